@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace axle {
+
+struct AccountState {
+    int64_t balance{0};
+    uint64_t nonce{0};
+};
+
+// Accounts on disk: an open-addressing hash table of fixed 64-byte slots in 4 KiB pages,
+// mmapped. Page 0 is the header; a key hashes to a slot and probes forward from it, so a lookup
+// touches one page unless its run crosses a page boundary. The table doubles (rewritten into a
+// new file, then renamed over) once it is 70% full. Lookups may run concurrently with each
+// other, not with put/erase/flush.
+class AccountStore {
+public:
+    static constexpr size_t PAGE = 4096, SLOT = 64, SLOTS_PER_PAGE = PAGE / SLOT;
+    static constexpr size_t MAX_KEY = 47; // longer keys are refused (addresses are ~34 chars)
+
+    ~AccountStore();
+    // Opens or creates the table at path; truncate starts it empty. Null (err set) on failure.
+    static std::unique_ptr<AccountStore> open(const std::string& path, bool truncate, std::string& err);
+
+    std::optional<AccountState> get(std::string_view key) const;
+    bool put(std::string_view key, const AccountState& a);
+    bool erase(std::string_view key);
+    // hints the kernel to read the pages these keys hash to
+    void will_need(const std::vector<std::string_view>& keys) const;
+    void for_each(const std::function<void(std::string_view, const AccountState&)>& f) const;
+    bool sync(); // msync
+    // The block the contents were last flushed at, kept in the header so a store left ahead of
+    // or behind tip.json is noticed on load. An empty hash in files from before it was recorded.
+    void set_tip(uint64_t height, const std::string& hash);
+    std::pair<uint64_t, std::string> tip() const;
+    // renames the file (a reindex builds its store aside and moves it into place at the end)
+    bool move_to(const std::string& path);
+    const std::string& path() const { return path_; }
+    uint64_t size() const;
+    uint64_t file_bytes() const { return bytes_; }
+
+private:
+    AccountStore() = default;
+    bool map(size_t bytes);
+    void unmap();
+    bool grow();
+    uint64_t slots() const;
+    uint64_t find_slot(std::string_view key, uint64_t h, bool for_insert) const;
+    uint8_t* slot(uint64_t i) const;
+
+    std::string path_;
+    int fd_{-1};
+    uint8_t* base_{nullptr};
+    size_t bytes_{0};
+};
+
+struct AccountCacheStats {
+    uint64_t hits{0}, misses{0};
+    double miss_seconds{0};    // summed store lookup time
+    uint64_t prefetched{0};    // misses served by prefetch() rather than during execution
+    uint64_t evictions{0}, flushed{0};
+    size_t entries{0}, capacity{0};
+    uint64_t stored{0};        // accounts in the store
+};
+
+// LedgerState's accounts. By default every account lives here in memory, as before. Once a
+// store is attached, this is a bounded cache over it: entries read from the store or written by
+// blocks are kept, writes stay dirty until flush(), and trim() drops the least recently used
+// clean ones once there are more than the capacity. Only Storage::save_state flushes, so the
+// store never runs ahead of state.json and tip.json. An absent account is cached too, so
+// repeated lookups of a new address do not go to disk.
+//
+// Lookups are const and may run on several threads at once (block execution does); a miss then
+// reads the store without caching, so callers prefetch() what a block touches first. Writers
+// need exclusive access. Copies share the store; only one of them should flush.
+class AccountTable {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 20;
+
+    std::optional<AccountState> get(const std::string& addr) const;
+    size_t count(const std::string& addr) const { return get(addr) ? 1 : 0; }
+    AccountState at(const std::string& addr) const; // throws std::out_of_range
+    // the account, created empty if absent, for in-place updates
+    AccountState& operator[](const std::string& addr);
+    void erase(const std::string& addr);
+    size_t size() const { return store_ ? size_ : cache_.size(); }
+    void clear();
+    // Every account, in address order when in memory and in store order when tiered.
+    void for_each(const std::function<void(const std::string&, const AccountState&)>& f) const;
+
+    // Moves the accounts onto `store` and from then on caches at most `capacity` of them.
+    void attach(std::shared_ptr<AccountStore> store, size_t capacity = DEFAULT_CAPACITY);
+    bool tiered() const { return store_ != nullptr; }
+    void set_capacity(size_t capacity) { capacity_ = capacity; }
+    // loads the accounts the store holds for these addresses into the cache, in one batch
+    void prefetch(const std::vector<std::string>& addrs);
+    // writes dirty entries to the store and, if every one of them was stored, the tip set below
+    // into its header; logically const, as the contents do not change
+    bool flush() const;
+    // the block the next flush is at (see AccountStore::tip)
+    void set_tip(uint64_t height, const std::string& hash) { tip_height_ = height; tip_hash_ = hash; }
+    std::shared_ptr<AccountStore> store() const { return store_; }
+    // Evicts clean entries down to the capacity if it is exceeded, or by half if the State
+    // memory budget is. Dirty ones stay until the next flush unless flush_first is set, which
+    // only a store nothing else reads yet (a reindex's) may use.
+    void trim(bool flush_first = false);
+    AccountCacheStats stats() const;
+
+private:
+    struct Entry {
+        AccountState a;
+        bool present{true};
+        mutable bool dirty{false};
+        uint64_t used{0}; // tick of the last write or prefetch, for eviction
+    };
+    Entry& load(const std::string& addr);
+
+    std::map<std::string, Entry> cache_;
+    std::shared_ptr<AccountStore> store_;
+    size_t capacity_{0};
+    size_t size_{0}; // accounts in total, tiered only
+    uint64_t tick_{0};
+    uint64_t tip_height_{0};
+    std::string tip_hash_;
+    struct Counters {
+        std::atomic<uint64_t> hits{0}, misses{0}, miss_ns{0}, prefetched{0}, evictions{0}, flushed{0};
+    };
+    std::shared_ptr<Counters> counters_ = std::make_shared<Counters>();
+};
+
+}
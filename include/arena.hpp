@@ -0,0 +1,71 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+
+namespace axle {
+
+struct ArenaStats {
+    uint64_t allocations{0};
+    uint64_t bytes{0};      // requested by callers
+    uint64_t peak_bytes{0}; // reserved from the heap by the arena
+};
+
+// Monotonic arena for everything allocated while decoding or executing one block.
+// Deallocation is a no-op; the memory goes back in one step on release() or destruction.
+class BlockArena : public std::pmr::memory_resource {
+public:
+    explicit BlockArena(size_t initial_bytes = 64 * 1024);
+    void release() { mono_.release(); }
+    ArenaStats stats() const { return {allocations_, bytes_, upstream_.reserved}; }
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& o) const noexcept override { return this == &o; }
+
+    struct Upstream : std::pmr::memory_resource {
+        uint64_t reserved{0};
+        void* do_allocate(size_t bytes, size_t align) override;
+        void do_deallocate(void* p, size_t bytes, size_t align) override;
+        bool do_is_equal(const std::pmr::memory_resource& o) const noexcept override { return this == &o; }
+    } upstream_;
+    std::pmr::monotonic_buffer_resource mono_;
+    uint64_t allocations_{0};
+    uint64_t bytes_{0};
+};
+
+// The arena ArenaAllocator draws from on this thread (the heap when none is active).
+inline std::pmr::memory_resource*& arena_slot() {
+    thread_local std::pmr::memory_resource* r = nullptr;
+    return r;
+}
+
+class ArenaScope {
+public:
+    explicit ArenaScope(std::pmr::memory_resource* r) : prev_(arena_slot()) { arena_slot() = r; }
+    ~ArenaScope() { arena_slot() = prev_; }
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+private:
+    std::pmr::memory_resource* prev_;
+};
+
+// Binds to the thread's active arena when constructed, so containers that default-construct
+// their allocators (like nlohmann::basic_json) can be pointed at an arena from the outside.
+template <class T>
+struct ArenaAllocator {
+    using value_type = T;
+    std::pmr::memory_resource* mr;
+    ArenaAllocator() noexcept : mr(arena_slot() ? arena_slot() : std::pmr::new_delete_resource()) {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U>& o) noexcept : mr(o.mr) {}
+    T* allocate(size_t n) { return static_cast<T*>(mr->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T* p, size_t n) noexcept { mr->deallocate(p, n * sizeof(T), alignof(T)); }
+    template <class U> bool operator==(const ArenaAllocator<U>& o) const noexcept { return mr == o.mr; }
+};
+
+using arena_string = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+using arena_json = nlohmann::basic_json<std::map, std::vector, arena_string, bool, std::int64_t, std::uint64_t,
+                                        double, ArenaAllocator>;
+
+}
@@ -7,5 +7,26 @@ namespace axle {
 std::string header_preimage(const BlockHeader& h);
 std::string block_hash(const BlockHeader& h);
 std::string merkle_root(const std::vector<SignedTx>& txs);
+// true if the hex hash has at least `bits` leading zero bits
+bool hash_meets_bits(const std::string& hexhash, uint32_t bits);
+
+// Fixed-size binary form of a header and its hash: one slot per height in headers.dat.
+struct HeaderRecord {
+    uint64_t height{0};
+    uint64_t timestamp{0};
+    uint64_t nonce{0};
+    uint32_t difficulty_bits{0};
+    uint32_t flags{0}; // EMPTY_* below: genesis has no parent, empty blocks no merkle root
+    uint8_t prev_hash[32]{};
+    uint8_t merkle_root[32]{};
+    uint8_t state_root[32]{};
+    uint8_t hash[32]{};
+
+    static constexpr uint32_t EMPTY_PREV = 1, EMPTY_MERKLE = 2, EMPTY_STATE = 4;
+    static HeaderRecord from(const BlockHeader& h, const std::string& hash);
+    BlockHeader header() const;
+    std::string hash_hex() const;
+};
+static_assert(sizeof(HeaderRecord) == 160);
 
 }
@@ -0,0 +1,21 @@
+#pragma once
+#include "types.hpp"
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace axle {
+
+// Compact binary block encoding for storage. Transaction fields are stored column by column:
+// strings (addresses, NFT metadata) go through a per-block dictionary and are referenced by
+// index, Base58 addresses and hex hashes are kept as raw bytes, nonces are varint deltas per
+// sender, amounts and token ids are zigzag varint deltas, and signatures/pubkeys are raw.
+// decode_block_columnar(encode_block_columnar(b)) reproduces b exactly, including strings that
+// are not canonical Base58/hex (those are kept verbatim).
+std::string encode_block_columnar(const Block& b);
+std::optional<Block> decode_block_columnar(std::string_view data);
+
+// true if data starts with the columnar magic
+bool is_columnar_block(std::string_view data);
+
+}
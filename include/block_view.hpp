@@ -0,0 +1,59 @@
+#pragma once
+#include "types.hpp"
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace axle {
+
+// Read-only views over a block as stored on disk (the to_json encoding). Nothing is copied:
+// construction only indexes where the header and each transaction sit in the buffer, and fields
+// are located and converted when accessed. Views must not outlive the bytes they point into.
+//
+// String accessors return the text as stored: hashes, addresses and base64 keys/signatures never
+// need escaping, NFT metadata may (use decode() when it matters).
+
+class TxView {
+public:
+    explicit TxView(std::string_view raw) : raw_(raw) {}
+    std::string_view raw() const { return raw_; }
+    TxType type() const;
+    std::string_view from() const;
+    std::string_view to() const;
+    int64_t amount() const;
+    uint64_t nonce() const;
+    uint64_t token_id() const;
+    std::string_view id() const;
+    std::string_view signature_b64() const;
+    std::string_view pubkey_b64() const;
+    SignedTx decode() const;
+private:
+    std::string_view raw_;
+};
+
+class BlockView {
+public:
+    // nullopt when the bytes are not a well-formed block object
+    static std::optional<BlockView> parse(std::string_view raw);
+
+    std::string_view raw() const { return raw_; }
+    uint64_t height() const;
+    std::string_view prev_hash() const;
+    std::string_view merkle_root() const;
+    std::string_view state_root() const;
+    uint64_t timestamp() const;
+    uint32_t difficulty_bits() const;
+    uint64_t nonce() const;
+    std::string_view hash() const;
+    std::string_view miner_address() const;
+    int64_t reward() const;
+
+    size_t tx_count() const { return txs_.size(); }
+    TxView tx(size_t i) const { return TxView(txs_.at(i)); }
+    Block decode() const;
+private:
+    std::string_view raw_, header_, hash_, miner_, reward_;
+    std::vector<std::string_view> txs_;
+};
+
+}
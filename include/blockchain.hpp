@@ -1,9 +1,52 @@
 #pragma once
 #include "types.hpp"
 #include "storage.hpp"
+#include "ledger.hpp"
+#include "state_tree.hpp"
+#include "header_index.hpp"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace axle {
 
+// mainnet, or regtest: fixed zero difficulty so blocks are produced instantly.
+ChainParams chain_params_for(const std::string& network);
+
+// Wall-clock split of the most recent accept_block call, in microseconds.
+struct AcceptTimings {
+    double validate_us{0};
+    double apply_us{0};
+    double store_us{0};
+};
+
+// Most recent switch to a heavier branch.
+struct ReorgInfo {
+    uint64_t depth{0};     // blocks disconnected from the old main chain
+    uint64_t connected{0}; // blocks connected from the new branch
+    double seconds{0};
+};
+
+// Non-archival mode: delete block bodies (and their undo records) below a retention horizon.
+// Headers are always kept. At least MIN_PRUNE_KEEP recent blocks survive so reorgs still work.
+struct PruneConfig {
+    uint64_t keep_blocks{0};  // keep this many recent bodies, or
+    uint64_t target_bytes{0}; // keep the recent bodies that fit in this many bytes
+    bool enabled() const { return keep_blocks || target_bytes; }
+};
+static constexpr uint64_t MIN_PRUNE_KEEP = 288;
+// "<N>" blocks or "<N>MB"; nullopt if malformed
+std::optional<PruneConfig> parse_prune(const std::string& s);
+
+// Blocks may claim at most this many bits so that cumulative work fits in 64 bits.
+static constexpr uint32_t MAX_DIFFICULTY_BITS = 48;
+inline uint64_t block_work(uint32_t bits) { return 1ULL << bits; }
+
+// Side branches are kept at most this many blocks below the tip, and at most this many in all.
+static constexpr uint64_t MAX_SIDE_DEPTH = MIN_PRUNE_KEEP;
+static constexpr size_t MAX_SIDE_BLOCKS = 1024;
+
 class Blockchain {
 public:
     Blockchain(Storage& s, ChainParams p);
@@ -13,20 +56,104 @@ public:
     const LedgerState& state() const { return state_; }
     uint64_t tip_height() const { return tip_height_; }
     std::string tip_hash() const { return tip_hash_; }
+    uint64_t tip_work() const { return tip_work_; }
+    // hex root of the state tree at the tip; rehashes whatever changed since the last call
+    std::string state_root() { return hex(tree_.root(exec_threads_)); }
 
+    // Extends the main chain, or stores a block on a side branch and reorganizes onto that
+    // branch once its cumulative work exceeds the tip's. False if the block is invalid, does
+    // not declare the difficulty its parent implies, is already known, its parent is unknown,
+    // or it would be a side block deeper than MAX_SIDE_DEPTH or beyond MAX_SIDE_BLOCKS.
     bool accept_block(const Block& b);
+    // Transactions of the blocks the last reorg disconnected, for the caller to return to its
+    // mempool (which refuses those the new branch confirmed). Empties the list.
+    std::vector<SignedTx> take_reorged_txs() { return std::move(reorged_txs_); }
     Block build_block(const std::string& miner_addr, const std::vector<SignedTx>& txs);
 
+    // Rebuilding state from the stored bodies (see reindex.hpp). begin_replay resets the ledger
+    // to genesis; replay_block connects a body already on disk whose hash, proof of work, merkle
+    // root and signatures the caller has checked, so it is not re-verified and its body is not
+    // rewritten (its header and undo record are);
+    // end_replay persists the state and moves the tip to the last replayed block. With a state
+    // cache the accounts and the state tree go to files of their own, which end_replay moves over
+    // accounts.dat and state_tree.dat and abort_replay (after a failed replay) deletes, so the
+    // old ones survive a failure.
+    bool begin_replay(const Block& genesis);
+    bool replay_block(const Block& b);
+    bool end_replay();
+    void abort_replay();
+
     // simple difficulty control
     uint32_t current_difficulty_bits() const { return difficulty_bits_; }
+    // Keep accounts in accounts.dat with at most this many cached in memory, and the state tree
+    // in state_tree.dat (0 = all in memory, in state.json). Set before load(); a datadir whose accounts are already on disk stays
+    // tiered either way.
+    void set_state_cache(size_t accounts) { state_cache_ = accounts; }
+    // worker threads used to execute block transactions (1 = serial)
+    void set_exec_threads(unsigned n) { exec_threads_ = n ? n : 1; }
+    const AcceptTimings& last_accept_timings() const { return last_timings_; }
+    const ExecStats& last_exec_stats() const { return last_exec_; }
+    const Storage& storage() const { return storage_; }
+    // Held by every thread that reads or extends the chain while a node is running (RPC, P2P,
+    // the work server). Blockchain itself does no locking.
+    std::mutex& mutex() const { return mu_; }
+    const ReorgInfo& last_reorg() const { return last_reorg_; }
+    size_t side_block_count() const { return side_.size(); }
+    // on the main chain or a kept side branch
+    bool knows_block(const std::string& hash) const { return side_.count(hash) || headers_.height_of(hash).has_value(); }
+    void set_prune(PruneConfig c) { prune_ = c; }
+    bool pruned() const { return prune_.enabled() || pruned_below_ > 0; }
+    // lowest height whose body is still stored
+    uint64_t pruned_below() const { return pruned_below_; }
+    // every main-chain header, including those whose bodies were pruned
+    const HeaderIndex& headers() const { return headers_; }
 private:
+    struct SideBlock {
+        uint64_t height;
+        std::string prev_hash;
+        uint64_t work; // cumulative, including this block
+        uint64_t time;
+        uint32_t next_bits; // difficulty its children must declare
+    };
+    bool connect_block(const Block& b, uint64_t work, bool save_state = true, bool replay = false);
+    void rebuild_state_tree(bool replay = false);
+    bool reuse_state_tree();
+    void reset_state(bool replay = false);
+    bool persist_state();
+    bool roll_back_to_tip(const ChainTip& at);
+    void prefetch_accounts(const Block& b);
+    bool disconnect_tip();
+    void remove_above_tip(uint64_t to);
+    bool reorganize(const std::string& new_tip);
+    void load_side_blocks();
+    void trim_side_blocks();
+    uint32_t main_child_bits(uint64_t height) const;
+    std::optional<UndoRecord> main_undo(uint64_t height) const;
+    uint32_t next_difficulty_bits(uint32_t bits, uint64_t prev_time, uint64_t time) const;
+    void write_tip() const;
+    void prune();
+
     Storage& storage_;
+    mutable std::mutex mu_;
     ChainParams params_;
     LedgerState state_;
+    StateTree tree_; // commitment to state_, updated with each connected or disconnected block
+    HeaderIndex headers_;
     uint64_t tip_height_{0};
     std::string tip_hash_{};
+    uint64_t tip_work_{0};
+    std::unordered_map<std::string, SideBlock> side_;
+    std::vector<SignedTx> reorged_txs_;
+    ReorgInfo last_reorg_{};
+    PruneConfig prune_{};
+    uint64_t pruned_below_{0};
+    uint64_t retained_bytes_{0}; // body bytes in [pruned_below_, tip], maintained only when pruning
     uint32_t difficulty_bits_{18};
     uint64_t last_block_time_{0};
+    AcceptTimings last_timings_{};
+    ExecStats last_exec_{};
+    size_t state_cache_{0};
+    unsigned exec_threads_{std::max(1u, std::thread::hardware_concurrency())};
 };
 
 }
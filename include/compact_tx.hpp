@@ -0,0 +1,51 @@
+#pragma once
+#include "types.hpp"
+#include <array>
+#include <memory>
+#include <optional>
+#include <variant>
+
+namespace axle {
+
+// A Base58Check address as its 25 decoded bytes (version, hash160, checksum).
+using AddressBytes = std::array<uint8_t, 25>;
+
+// In-memory form of a SignedTx for long-lived sets of transactions (the mempool). SignedTx has
+// every field any tx type could use, so a transfer still carries three NFT metadata strings
+// and a token id, and its signature, key, id and addresses all live on the heap. CompactTx
+// keeps them as fixed-size binary arrays and holds only the payload its type uses. The
+// variant index is the TxType.
+//
+// The conversion is lossless: to_signed() returns the original tx, with the same signature and
+// id. from_signed() refuses a tx it could not give back exactly, e.g. one that sets a field its
+// type does not use or has a non-canonical address.
+struct CompactTx {
+    struct Transfer { int64_t amount; };
+    struct MintNft { NftMetaRef meta; }; // shared, so copies stay cheap
+    struct TransferNft { uint64_t token_id; };
+    struct BurnNft { uint64_t token_id; };
+    using Payload = std::variant<Transfer, MintNft, TransferNft, BurnNft>;
+
+    uint64_t nonce{0};
+    AddressBytes from{};
+    std::optional<AddressBytes> to; // empty string in the SignedTx
+    std::array<uint8_t, 64> signature{};
+    std::array<uint8_t, 32> pubkey{};
+    std::array<uint8_t, 32> id{};
+    Payload payload;
+
+    TxType type() const { return (TxType)payload.index(); }
+    std::string from_address() const;
+    std::string to_address() const;
+    std::string txid() const; // hex, as in SignedTx::id
+
+    static std::optional<CompactTx> from_signed(const SignedTx& tx);
+    SignedTx to_signed() const;
+    // sizeof plus owned heap, to compare with memory_bytes(const SignedTx&)
+    size_t memory_bytes() const;
+};
+
+// sizeof plus the heap its strings and byte vectors hold
+size_t memory_bytes(const SignedTx& tx);
+
+}
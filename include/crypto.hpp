@@ -17,6 +17,7 @@ void sodium_init_or_throw();
 KeyPair keygen();
 bytes ed25519_sign(const bytes& msg, const bytes& priv);
 bool ed25519_verify(const bytes& msg, const bytes& sig, const bytes& pub);
+bool ed25519_verify(const uint8_t* msg, size_t len, const bytes& sig, const bytes& pub);
 
 bytes sha256(const bytes& data);
 bytes double_sha256(const bytes& data);
@@ -1,13 +1,14 @@
 #pragma once
 #include "types.hpp"
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace axle {
 
 std::string to_json(const SignedTx& tx);
-SignedTx tx_from_json(const std::string& js);
+SignedTx tx_from_json(std::string_view js);
 std::string to_json(const Block& b);
-Block block_from_json(const std::string& js);
+Block block_from_json(std::string_view js);
 
 }
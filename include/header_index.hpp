@@ -0,0 +1,49 @@
+#pragma once
+#include "block.hpp"
+#include "storage.hpp"
+#include <array>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace axle {
+
+// The main chain's headers in memory: HeaderRecords in one contiguous array indexed by height,
+// the cumulative work at every height and a hash -> height map. Loaded from headers.dat at
+// startup and kept in step with the tip. Not thread-safe; Blockchain's mutex covers it.
+class HeaderIndex {
+public:
+    void clear();
+    // Heights 0..tip from headers.dat. False (and left empty) if the file stops short of the
+    // tip or a record does not link to the one before it.
+    bool load(const Storage& s, uint64_t tip);
+    // appends the next height
+    void push(const HeaderRecord& h);
+    // drops every height >= height
+    void truncate(uint64_t height);
+
+    uint64_t size() const { return headers_.size(); }
+    const HeaderRecord* at(uint64_t height) const { return height < headers_.size() ? &headers_[height] : nullptr; }
+    // main-chain height of a hex block hash
+    std::optional<uint64_t> height_of(const std::string& hash) const;
+    // work of every block up to and including height (genesis counts 0)
+    uint64_t work_at(uint64_t height) const { return height < work_.size() ? work_[height] : 0; }
+    const std::vector<HeaderRecord>& records() const { return headers_; }
+    size_t memory_bytes() const;
+
+private:
+    using Key = std::array<uint8_t, 32>;
+    // the tail of the hash: its leading bytes are the proof of work's zero bits
+    struct KeyHash {
+        size_t operator()(const Key& k) const { size_t h; std::memcpy(&h, k.data() + k.size() - sizeof h, sizeof h); return h; }
+    };
+    static Key key_of(const HeaderRecord& h);
+
+    std::vector<HeaderRecord> headers_;
+    std::vector<uint64_t> work_;
+    std::unordered_map<Key, uint64_t, KeyHash> by_hash_;
+};
+
+}
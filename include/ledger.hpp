@@ -1,5 +1,7 @@
 #pragma once
 #include "types.hpp"
+#include "compact_tx.hpp"
+#include <unordered_map>
 
 namespace axle {
 
@@ -8,8 +10,56 @@ struct ValidationResult {
     std::string reason;
 };
 
+// Net effect of a block on a LedgerState: final values of every touched entry.
+struct StateDelta {
+    std::unordered_map<std::string, AccountState> accounts;
+    std::unordered_map<uint64_t, std::optional<NftEntry>> nfts; // nullopt = burned
+    std::optional<uint64_t> next_token_id;
+    int64_t pool_delta{0};
+};
+
+struct ExecStats {
+    size_t txs{0};
+    size_t reexecuted{0}; // speculative results discarded because of a read/write conflict
+    unsigned threads{1};
+    uint64_t arena_allocations{0}; // scratch allocations served by the per-worker block arenas
+    uint64_t arena_peak_bytes{0};  // heap those arenas reserved
+};
+
+// What a connected block overwrote, so it can be disconnected without replaying the chain:
+// the prior value (nullopt = absent) of every entry its delta touched, plus the chain control
+// state from before it.
+struct UndoRecord {
+    std::string hash;
+    std::string prev_hash;
+    uint64_t work{0};            // cumulative chain work up to and including this block
+    uint32_t difficulty_bits{0}; // difficulty/timing state before the block
+    uint64_t last_block_time{0};
+    std::map<std::string, std::optional<AccountState>> accounts;
+    std::map<uint64_t, std::optional<NftEntry>> nfts;
+    uint64_t next_token_id{1};
+    int64_t pool_delta{0};
+};
+
+// signature and address checks, which need no state
+ValidationResult check_tx_stateless(const SignedTx& tx);
 ValidationResult apply_tx(LedgerState& st, const ChainParams& params, const SignedTx& tx);
+// same rules; the payload's type picks the rule at compile time
+ValidationResult apply_tx(LedgerState& st, const ChainParams& params, const CompactTx& tx);
+
+// Executes b.txs (and the miner reward) against `prior` without modifying it. Transactions run
+// speculatively on up to `threads` threads; an in-order commit re-executes any whose reads were
+// written by an earlier tx, so `out` always equals what serial apply_block would produce.
+// check_sigs=false skips signature and address checks, for callers that only need the delta.
+ValidationResult execute_block(const LedgerState& prior, const ChainParams& params, const Block& b,
+                               StateDelta& out, unsigned threads = 1, ExecStats* stats = nullptr,
+                               bool check_sigs = true);
+void commit_delta(LedgerState& st, const StateDelta& d);
+// ledger part of the undo record for applying `d` on top of `prior` (call before commit_delta)
+UndoRecord make_undo(const LedgerState& prior, const StateDelta& d);
+void apply_undo(LedgerState& st, const UndoRecord& u);
+
 ValidationResult validate_block(const LedgerState& prior, const ChainParams& params, const Block& b);
-void apply_block(LedgerState& st, const ChainParams& params, const Block& b);
+void apply_block(LedgerState& st, const ChainParams& params, const Block& b); // serial reference path
 
 }
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Compile-time switch (CMake option AXLE_MEMORY_ACCOUNTING). When 0 the global allocation
+// functions are left alone, MemScope does nothing and every figure reads zero.
+#ifndef AXLE_MEMORY_ACCOUNTING
+#define AXLE_MEMORY_ACCOUNTING 1
+#endif
+
+namespace axle {
+
+enum class MemTag : uint8_t { Other, State, Storage, Mempool, P2P, RPC, Validation, COUNT };
+constexpr size_t MEM_TAGS = (size_t)MemTag::COUNT;
+
+const char* mem_tag_name(MemTag tag);
+bool parse_mem_tag(const std::string& name, MemTag& out);
+
+// Subsystem that allocations made on this thread are charged to. Memory is credited back to the
+// subsystem that allocated it, whichever thread frees it.
+inline MemTag& mem_tag_slot() { thread_local MemTag tag = MemTag::Other; return tag; }
+
+class MemScope {
+public:
+    explicit MemScope(MemTag tag) : prev_(mem_tag_slot()) { mem_tag_slot() = tag; }
+    ~MemScope() { mem_tag_slot() = prev_; }
+    MemScope(const MemScope&) = delete;
+    MemScope& operator=(const MemScope&) = delete;
+private:
+    MemTag prev_;
+};
+
+struct MemUsage {
+    MemTag tag{MemTag::Other};
+    int64_t bytes{0};          // live
+    int64_t allocations{0};    // live
+    uint64_t total_allocations{0};
+    int64_t peak_bytes{0};
+    int64_t budget_bytes{0};   // 0 = unlimited
+};
+
+bool memory_accounting_enabled();
+std::vector<MemUsage> memory_usage();
+int64_t memory_bytes(MemTag tag);
+
+// Budgets are enforced by the subsystems that can shed load: the mempool refuses transactions,
+// P2P refuses inbound connections and drops queued messages. Others are only reported.
+void set_memory_budget(MemTag tag, int64_t bytes);
+int64_t memory_budget(MemTag tag);
+bool over_memory_budget(MemTag tag);
+// "mempool=256MB,p2p=64MB" (KB/MB/GB or plain bytes); false on a bad name or size
+bool parse_memory_budgets(const std::string& spec, std::string& err);
+
+uint64_t process_rss_bytes();
+// Human-readable breakdown, one line per subsystem (for SIGUSR1)
+std::string memory_report();
+// Refreshes the axle_memory_* gauges
+void publish_memory_metrics();
+
+}
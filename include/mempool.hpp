@@ -0,0 +1,43 @@
+#pragma once
+#include "types.hpp"
+#include "ledger.hpp"
+#include "compact_tx.hpp"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace axle {
+
+// Signed transactions waiting for a block. Thread-safe. Admits only transactions that pass the
+// stateless checks and whose nonce the sender has not used yet, one per (sender, nonce). They
+// are held as CompactTx, so a pending transfer costs a fraction of a SignedTx.
+class Mempool {
+public:
+    explicit Mempool(size_t max_txs = 100000);
+
+    // fails with a reason if the tx is malformed, already pending, stale, or the pool is full
+    ValidationResult add(const SignedTx& tx, const LedgerState& st);
+    // Up to max txs that run in order against st: consecutive nonces per sender that the
+    // sender can pay for from its current balance, NFT ops only on tokens it owns now.
+    std::vector<SignedTx> select(const LedgerState& st, const ChainParams& params, size_t max) const;
+    // drops txs whose nonce the chain has used, after a block is connected or a reorg
+    void remove_confirmed(const LedgerState& st);
+    bool contains(const std::string& txid) const;
+    std::optional<SignedTx> get(const std::string& txid) const;
+    size_t size() const;
+    size_t tx_bytes() const; // memory held by the pending txs themselves
+    uint64_t version() const { return version_; } // changes whenever the contents do
+
+private:
+    mutable std::mutex mu_;
+    size_t max_txs_;
+    std::map<std::string, std::map<uint64_t, CompactTx>> by_sender_; // from -> nonce -> tx
+    std::unordered_map<std::string, std::pair<std::string, uint64_t>> ids_; // txid -> (from, nonce)
+    std::atomic<uint64_t> version_{0};
+    size_t tx_bytes_{0};
+};
+
+}
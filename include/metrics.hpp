@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+
+namespace axle {
+
+// Lock-free metric cells. Registration takes a lock once; updates are relaxed atomics.
+class Counter {
+public:
+    void inc(uint64_t n = 1) { v_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> v_{0};
+};
+
+class Gauge {
+public:
+    void set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+    void add(int64_t d) { v_.fetch_add(d, std::memory_order_relaxed); }
+    int64_t value() const { return v_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> v_{0};
+};
+
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+    void observe(double v);
+    const std::vector<double>& bounds() const { return bounds_; }
+    uint64_t bucket(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); } // i == bounds().size() is +Inf
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> count_{0};
+    std::atomic<double> sum_{0};
+};
+
+// Default latency buckets in seconds, 100us .. 10s.
+std::vector<double> latency_buckets();
+
+class MetricsRegistry {
+public:
+    // `labels` is the Prometheus label body, e.g. `method="get_tip"`. Returned references stay valid forever.
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "",
+                         std::vector<double> bounds = latency_buckets());
+    std::string render() const; // Prometheus text exposition format 0.0.4
+private:
+    struct Family {
+        std::string help, type;
+        std::map<std::string, std::unique_ptr<Counter>> counters;
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<Histogram>> histograms;
+    };
+    Family& family(const std::string& name, const std::string& help, const char* type);
+    mutable std::mutex mu_;
+    std::map<std::string, Family> families_;
+};
+
+MetricsRegistry& metrics();
+
+// Observes the elapsed wall time in seconds into `h` on destruction.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& h) : h_(h), t0_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { h_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0_).count()); }
+private:
+    Histogram& h_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+// Serves `GET /metrics` over plain HTTP/1.0.
+class MetricsServer {
+public:
+    MetricsServer() = default;
+    ~MetricsServer();
+
+    bool start(const std::string& host, uint16_t port);
+    void stop();
+private:
+    std::thread server_thread_;
+    std::atomic<bool> running_{false};
+    std::pair<std::string, uint16_t> listen_;
+};
+
+}
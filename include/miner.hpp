@@ -1,8 +1,81 @@
 #pragma once
 #include "types.hpp"
+#include "blockchain.hpp"
+#include "mempool.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace axle {
 
 bool mine_block(Block& b, uint32_t difficulty_bits, uint64_t& iters);
 
+// A block on the tip paying miner_address with up to max_txs of the mempool's transactions
+// (mempool may be null), or an empty one if they do not execute. Caller holds chain.mutex().
+Block build_template(Blockchain& chain, Mempool* mempool, const std::string& miner_address, size_t max_txs);
+
+struct NodeMinerStats {
+    uint64_t templates{0};
+    uint64_t hashes{0};
+    uint64_t found{0};           // headers meeting the target
+    uint64_t accepted{0};
+    uint64_t orphaned{0};        // found on a parent that was no longer the tip, or rejected
+    uint64_t orphaned_hashes{0}; // estimated hashes spent on a template after its parent was replaced
+    uint64_t switches{0};        // templates every worker moved to
+    double switch_ms_avg{0}, switch_ms_max{0}; // from noticing the change to the last worker moving
+};
+
+// Mines inside the node: one thread keeps a template on the tip, rebuilding it as soon as the
+// tip moves (polled every poll_ms, or at once after a block of ours) and at most every
+// tx_refresh_ms for new mempool transactions; `threads` workers hash disjoint nonces of the
+// current template and move to a new one within a hash of its publication. Solutions go
+// straight to accept_block, then to on_block.
+class NodeMiner {
+public:
+    // mempool may be null (empty blocks only)
+    NodeMiner(Blockchain& chain, Mempool* mempool, std::string miner_address);
+    ~NodeMiner();
+
+    void start(unsigned threads);
+    void stop();
+    // called after the chain accepted a block we solved (e.g. to broadcast it)
+    void on_block(std::function<void(const Block&)> f) { on_block_ = std::move(f); }
+    NodeMinerStats stats() const; // totals since construction
+
+    size_t max_block_txs{1000};
+    int poll_ms{2};
+    int tx_refresh_ms{100};
+    int template_max_age_ms{5000}; // rebuilt at least this often, for a fresh timestamp
+
+private:
+    struct Template;
+    void refresh_loop();
+    void work(unsigned t, unsigned threads);
+    void submit(const Template& tpl, uint64_t nonce);
+
+    Blockchain& chain_;
+    Mempool* mempool_;
+    std::string miner_address_;
+    std::function<void(const Block&)> on_block_;
+
+    std::mutex mu_; // guards current_ and wakes the refresh thread
+    std::condition_variable cv_;
+    std::shared_ptr<const Template> current_;
+    std::atomic<uint64_t> gen_{0};
+    std::atomic<uint64_t> solved_{0}; // gen a solution was found for
+    bool wake_{false};
+    bool rejected_{false}; // the tip refused our block: rebuild, without transactions until it moves
+    std::atomic<bool> running_{false};
+    std::thread refresher_;
+    std::vector<std::thread> workers_;
+
+    std::atomic<uint64_t> templates_{0}, hashes_{0}, found_{0}, accepted_{0}, orphaned_{0}, orphaned_hashes_{0},
+        switches_{0}, switch_us_{0}, switch_us_max_{0};
+};
+
 }
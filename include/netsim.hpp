@@ -0,0 +1,110 @@
+#pragma once
+#include "types.hpp"
+#include "blockchain.hpp"
+#include "crypto.hpp"
+#include "mempool.hpp"
+#include "p2p.hpp"
+#include "storage.hpp"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace axle {
+
+// Shaping of one direction of a simulated link.
+struct LinkShape {
+    double latency_ms{0}; // added to everything sent
+    double bandwidth{0};  // bytes per second, shared by the link's connections; 0 = unlimited
+};
+
+struct NetSimOptions {
+    size_t nodes{4};
+    // line, ring, star (around node 0), full, or random:K (each node links to K others)
+    std::string topology{"ring"};
+    LinkShape link;
+    uint32_t seed{1};
+    int announce_ms{100};
+    int sync_ms{200};
+    std::string dir; // parent of the node datadirs; a temp dir, removed on destruction, if empty
+};
+
+struct NodeTraffic {
+    uint64_t sent_bytes{0}, recv_bytes{0}; // P2P bytes on the wire, both directions of every link
+};
+
+struct PropagationStats {
+    size_t blocks{0};               // mined through mine()
+    std::vector<double> arrival_ms; // per (block, other node running then): from mining to that node accepting it
+    std::vector<double> full_ms;    // per block that reached every node: until the last one had it
+    size_t missed{0};               // (block, node) pairs where it never arrived
+};
+
+// A network of P2P nodes in one process, for reproducible propagation and sync measurements.
+// Every node has its own datadir (all sharing one regtest genesis), chain, mempool and P2PNode
+// listening on loopback. Each link between two nodes is a pair of local TCP proxies, one per
+// connecting side, that delay and rate-limit what passes through and count its bytes. Latency
+// should stay well under the P2P I/O timeout (2 s).
+class NetSim {
+public:
+    explicit NetSim(NetSimOptions o);
+    ~NetSim();
+
+    bool start(std::string& err);
+    // stops every node; chains, stats and traffic stay readable until destruction
+    void stop();
+
+    size_t size() const { return nodes_.size(); }
+    Blockchain& chain(size_t i) { return *nodes_.at(i)->chain; }
+    Mempool& mempool(size_t i) { return nodes_.at(i)->mempool; }
+    P2PNode& node(size_t i) { return *nodes_.at(i)->p2p; }
+    // node i's mining key, which mine() pays
+    const KeyPair& key(size_t i) const { return nodes_.at(i)->key; }
+
+    // links a and b, each an outbound peer of the other
+    void connect(size_t a, size_t b);
+    // Starts a node with only genesis, linked to `peers`; it catches up by syncing. Its index.
+    size_t add_node(const std::vector<size_t>& peers);
+
+    // Builds a block from node i's mempool, mines it, accepts it and broadcasts it.
+    std::optional<Block> mine(size_t i);
+    // Admits tx to node i's mempool and announces it to its peers.
+    bool submit_tx(size_t i, const SignedTx& tx);
+    // Until every node (or those listed) is at height >= h; false on timeout.
+    bool wait_for_height(uint64_t h, int timeout_ms, const std::vector<size_t>& nodes = {});
+    uint64_t max_height();
+
+    PropagationStats propagation() const;
+    NodeTraffic traffic(size_t i) const;
+
+private:
+    struct Node {
+        std::string dir;
+        uint16_t port{0};
+        KeyPair key;
+        std::unique_ptr<Storage> storage;
+        std::unique_ptr<Blockchain> chain;
+        Mempool mempool;
+        std::unique_ptr<P2PNode> p2p;
+    };
+    struct Impl; // the proxies and their io thread
+    bool start_node(Node& n, std::string& err);
+
+    NetSimOptions o_;
+    std::string genesis_dir_;
+    bool temp_{false}, running_{false};
+    std::vector<std::unique_ptr<Node>> nodes_;
+    std::unique_ptr<Impl> impl_;
+    std::vector<NodeTraffic> final_traffic_;
+
+    using Steady = std::chrono::steady_clock;
+    mutable std::mutex times_mu_; // guards the members below
+    std::vector<Steady::time_point> joined_;                                          // per node
+    std::vector<std::pair<std::string, Steady::time_point>> mined_;                  // hash, when
+    std::map<std::string, std::vector<std::pair<size_t, Steady::time_point>>> arrived_; // hash -> node, when
+};
+
+}
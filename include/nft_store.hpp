@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace axle {
+
+struct NFTMeta {
+    std::string name;
+    std::string symbol;
+    std::string uri; // IPFS/HTTPS
+};
+
+// One shared, immutable copy of each distinct string in use, released when the last reference
+// goes. A copy is a pointer copy plus a reference count; equal strings share one pointer.
+// Thread-safe.
+class InternedString {
+public:
+    InternedString() : InternedString(std::string_view()) {}
+    InternedString(std::string_view s);
+    InternedString(const std::string& s) : InternedString(std::string_view(s)) {}
+    InternedString(const char* s) : InternedString(std::string_view(s)) {}
+    InternedString(const InternedString& o);
+    InternedString(InternedString&& o) noexcept : n_(o.n_) { o.n_ = nullptr; }
+    InternedString& operator=(InternedString o) noexcept { std::swap(n_, o.n_); return *this; }
+    ~InternedString();
+
+    const std::string& str() const;
+    operator const std::string&() const { return str(); }
+    size_t size() const { return str().size(); }
+    bool operator==(const InternedString& o) const { return n_ == o.n_; }
+    friend bool operator==(const InternedString& a, const std::string& b) { return a.str() == b; }
+    friend bool operator==(const InternedString& a, std::string_view b) { return a.str() == b; }
+    friend bool operator==(const InternedString& a, const char* b) { return a.str() == b; }
+
+    struct Node;
+private:
+    Node* n_;
+};
+
+// NFT metadata held once per distinct (name, symbol, uri), content-addressed: minting a token
+// whose metadata is already in use just takes another reference. The symbol is interned, and
+// the uri is split after its last '/' so a collection's tokens share one interned prefix. What
+// is left (the name and the uri suffix, e.g. "Punk #12" and "12.json") is usually unique to the
+// token, so it is stored inline in the record's single allocation.
+class NftMetaRef {
+public:
+    NftMetaRef() : NftMetaRef(NFTMeta{}) {}
+    NftMetaRef(const NFTMeta& m);
+    NftMetaRef(const NftMetaRef& o);
+    NftMetaRef(NftMetaRef&& o) noexcept : r_(o.r_) { o.r_ = nullptr; }
+    NftMetaRef& operator=(NftMetaRef o) noexcept { std::swap(r_, o.r_); return *this; }
+    ~NftMetaRef();
+
+    std::string_view name() const;
+    const std::string& symbol() const;
+    const std::string& uri_prefix() const;
+    std::string_view uri_suffix() const;
+    std::string uri() const { return uri_prefix() + std::string(uri_suffix()); }
+    NFTMeta meta() const { return {std::string(name()), symbol(), uri()}; }
+    // same content <=> same record
+    bool operator==(const NftMetaRef& o) const { return r_ == o.r_; }
+    const void* identity() const { return r_; }
+
+    struct Record;
+private:
+    Record* r_;
+};
+
+struct NftStoreStats {
+    size_t strings{0}, string_bytes{0}; // distinct interned strings (owners, names, symbols, uri prefixes)
+    size_t records{0};                  // distinct metadata
+    size_t memory_bytes{0};             // both pools, including their index entries
+};
+NftStoreStats nft_store_stats();
+
+}
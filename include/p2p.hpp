@@ -1,28 +1,155 @@
 #pragma once
 #include "types.hpp"
 #include "blockchain.hpp"
+#include "mempool.hpp"
+#include "rolling_bloom.hpp"
+#include "peer_manager.hpp"
 #include <string>
+#include <string_view>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
+#include <optional>
+#include <nlohmann/json_fwd.hpp>
 
 namespace axle {
 
+struct TxRelayStats {
+    uint64_t announced{0};     // txids sent in inv messages
+    uint64_t inv_received{0};  // txids peers announced to us
+    uint64_t requested{0};     // of those, the ones we asked the bodies of
+    uint64_t received{0};      // tx bodies peers sent us
+    uint64_t accepted{0};      // of those, the ones the mempool admitted
+    uint64_t inv_bytes{0};     // sent as announcements and requests
+    uint64_t tx_bytes{0};      // sent as tx bodies
+    uint64_t timeouts{0};      // requested bodies that did not arrive in time
+};
+
+struct BlockRelayStats {
+    uint64_t pushed{0};   // blocks peers pushed to us
+    uint64_t accepted{0}; // of those, the ones that extended our chain (and were passed on)
+    uint64_t synced{0};   // blocks fetched with get_block to catch up
+};
+
 class P2PNode {
 public:
-    P2PNode(Blockchain& chain);
+    P2PNode(Blockchain& chain, PeerLimits limits = {});
     ~P2PNode();
 
     bool start_listen(const std::string& host, uint16_t port);
     void add_peer(const std::string& host, uint16_t port);
     void stop();
 
+    // Blocks and tx announcements go out through a bounded queue per peer, drained by that
+    // peer's own sender thread, so a slow peer delays nobody else and at worst loses messages.
     void broadcast_block(const Block& b);
+    // sends a block already in its stored encoding (Storage::read_block_bytes) as-is
+    void relay_block(std::string_view block_json);
+
+    // Block relay: a pushed block that extends a block we have is accepted and passed on to
+    // every peer but the sender (when the sender's host is that of just one peer); one that
+    // fails validation costs the sender points. One further ahead than our tip, if its header
+    // has valid proof of work, and every sync_ms regardless, has the node fetch the blocks
+    // after its tip from its outbound peers with get_block, so a node that starts behind or
+    // missed a push catches up. Syncing follows a peer's chain by height and stops at a block
+    // that does not extend ours.
+    // f is called with each block accepted from a peer, under the chain's mutex.
+    void on_block(std::function<void(const Block&)> f) { on_block_ = std::move(f); }
+    BlockRelayStats block_stats() const;
+    int sync_ms{1000};
+
+    // Transaction relay: txids are batched and announced every announce_ms ("inv"); a peer asks
+    // only for the ones it lacks ("get_txs") and gets their bodies on the same connection. Each
+    // peer has a rolling Bloom filter of the txids it is known to have, so nothing is announced
+    // back to where it came from. A body that does not arrive within a few seconds is asked
+    // for again from another peer that announced it. Needs a mempool, set before start_listen.
+    void set_mempool(Mempool* m) { mempool_ = m; }
+    void announce_tx(const std::string& txid);
+    TxRelayStats tx_stats() const;
+    int announce_ms{100};
+
+    PeerManager& peers() { return manager_; }
+    const PeerManager& peers() const { return manager_; }
+
 private:
+    using Clock = std::chrono::steady_clock;
+    using Inventory = std::vector<std::pair<std::string, Clock::time_point>>; // txid, when queued
+    struct Outgoing {
+        std::string type, line;
+        Inventory inv;
+    };
+    struct Peer {
+        std::string host, key;
+        uint16_t port;
+        RollingBloom known{50000, 1e-6}; // txids the peer has or has been told about; under relay_mu_
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<Outgoing> queue;
+        std::thread sender;
+    };
+    // one inbound connection's view of its exchange with handle_request
+    struct Exchange {
+        std::string host, type;
+        size_t wanted{0};  // tx bodies asked for, which the peer may send next
+        bool more{false};  // a follow-up is expected on the same connection
+    };
+    struct Connection; // an accepted socket with its own io_context
+    void serve(Connection& c);
+    std::string handle_request(const std::string& line, Exchange& ex);
+    void enqueue(Peer& p, Outgoing m);
+    void send_loop(Peer& p);
+    bool deliver(Peer& p, const Outgoing& m);
+    void relay_loop();
+    void retry_requests();
+    void receive_txs(const nlohmann::json& txs, const std::string& from);
+    void sync_loop();
+    bool sync_from(const std::string& host, uint16_t port);
+    void queue_block(std::string_view block_json, const std::string& except_host);
+    void block_accepted(const Block& b, bool pushed);
+
     Blockchain& chain_;
-    std::thread server_thread_;
+    Mempool* mempool_{nullptr};
+    PeerManager manager_;
+    std::thread server_thread_, relay_thread_, sync_thread_;
     std::atomic<bool> running_{false};
-    std::vector<std::pair<std::string,uint16_t>> peers_;
+    std::vector<std::unique_ptr<Peer>> peers_;
+    std::pair<std::string,uint16_t> listen_;
+
+    std::mutex serving_mu_;
+    std::condition_variable serving_cv_;
+    size_t serving_{0}; // inbound connections being served
+
+    std::mutex relay_mu_; // guards the members below and every Peer::known
+    std::condition_variable relay_cv_;
+    Inventory pending_inv_;
+    RollingBloom seen_{100000, 1e-6}; // txids this node has had, so it never fetches one twice
+    struct InFlight {
+        Clock::time_point expires;
+        std::string asked;          // peer the body was requested from
+        std::vector<Peer*> others;  // outbound peers that announced it too, to ask next
+    };
+    std::unordered_map<std::string, InFlight> inflight_; // txid -> requested body not yet received
+    std::atomic<uint64_t> announced_{0}, inv_received_{0}, requested_{0}, received_{0}, accepted_{0},
+                          inv_bytes_{0}, tx_bytes_{0}, timeouts_{0};
+
+    std::function<void(const Block&)> on_block_;
+    std::mutex sync_mu_; // guards sync_now_ and last_push_sync_
+    std::condition_variable sync_cv_;
+    bool sync_now_{false};
+    Clock::time_point last_push_sync_{}; // last sync a pushed block triggered
+    std::atomic<uint64_t> blocks_pushed_{0}, blocks_accepted_{0}, blocks_synced_{0};
 };
 
+// One exchange with a peer's P2P port: reads its hello, sends `request` (a JSON line) and returns
+// the reply line. nullopt on connection failure, timeout or an {"error":...} reply.
+std::optional<std::string> p2p_request(const std::string& host, uint16_t port, const std::string& request,
+                                       int timeout_ms = 10000);
+
 }
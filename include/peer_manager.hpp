@@ -0,0 +1,104 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace axle {
+
+struct PeerLimits {
+    size_t max_inbound = 32;               // inbound connections served at once
+    size_t max_inbound_per_host = 4;       // of those, from any one host
+    size_t max_outbound = 8;               // outbound peers
+    size_t max_queue_bytes = 8 << 20;      // queued for one outbound peer before messages drop
+    int ban_score = 100;
+    std::chrono::seconds ban_time{24 * 3600};
+    std::chrono::seconds backoff{5};       // after a failed send, before trying the peer again
+    size_t max_tracked = 1024;             // inbound hosts remembered; idle ones are evicted.
+                                           // Also caps the scores and bans kept for evicted hosts
+};
+
+// Per-peer bookkeeping for P2PNode: connection slots, send-queue budgets, per-message-type
+// traffic, misbehavior scores and bans. Thread-safe. Outbound peers are keyed "host:port";
+// inbound ones by host, since their source ports are ephemeral. Bans apply to the host.
+class PeerManager {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct TypeStats {
+        uint64_t sent_msgs{0}, sent_bytes{0}, recv_msgs{0}, recv_bytes{0};
+        uint64_t exchanges{0};
+        double exchange_seconds{0}; // total time of the exchanges, for averages
+    };
+
+    struct PeerStats {
+        std::string key;
+        bool outbound{false};
+        bool connected{false};     // outbound: the last exchange succeeded; inbound: a connection is open
+        unsigned open{0};          // inbound connections open now
+        int score{0};
+        bool banned{false};
+        int64_t banned_for_s{0};   // seconds left on the ban
+        size_t queued_msgs{0}, queued_bytes{0};
+        uint64_t dropped_msgs{0};  // refused by a full queue or during backoff
+        uint64_t failures{0};
+        std::map<std::string, TypeStats> types;
+    };
+
+    explicit PeerManager(PeerLimits limits = {});
+    const PeerLimits& limits() const { return limits_; }
+
+    // Inbound slot for a new connection; false if the host is banned, already holds
+    // max_inbound_per_host slots, or every slot is taken.
+    bool admit_inbound(const std::string& host);
+    void release_inbound(const std::string& host);
+    // A new outbound peer; false if the outbound slots are full or it is already known.
+    bool add_outbound(const std::string& key);
+
+    // Send-queue budget for an outbound peer: reserve before queueing a message, release when it
+    // has been sent or thrown away. false (and counted as a drop) if the queue would exceed its
+    // byte budget or the peer is backing off after a failure.
+    bool reserve_queue(const std::string& key, size_t bytes);
+    void release_queue(const std::string& key, size_t bytes);
+    // An outbound exchange failed (connect, timeout); the peer is backed off.
+    void failed(const std::string& key);
+    void succeeded(const std::string& key);
+
+    void record_sent(const std::string& key, const std::string& type, size_t bytes);
+    void record_received(const std::string& key, const std::string& type, size_t bytes);
+    void record_exchange(const std::string& key, const std::string& type, double seconds);
+
+    // Adds misbehavior points to the peer's host; true if that banned it.
+    bool misbehaving(const std::string& key, int points, const std::string& reason);
+    bool banned(const std::string& host) const;
+    void unban(const std::string& host);
+
+    std::vector<PeerStats> stats() const;
+
+private:
+    struct HostRecord {
+        int score{0};
+        Clock::time_point ban_until{};
+    };
+    struct Entry {
+        PeerStats s;
+        std::string host;
+        Clock::time_point last_seen{}, ban_until{}, backoff_until{};
+    };
+    Entry& entry(const std::string& key, bool outbound);
+    static std::string host_of(const std::string& key);
+    void evict_idle();
+    void prune_hosts();
+
+    PeerLimits limits_;
+    mutable std::mutex mu_;
+    std::map<std::string, Entry> peers_;
+    // bans, and the scores of inbound hosts evicted from peers_, so going idle does not clear them
+    std::map<std::string, HostRecord> hosts_;
+    size_t inbound_open_{0};
+    size_t outbound_{0};
+};
+
+}
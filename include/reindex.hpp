@@ -0,0 +1,47 @@
+#pragma once
+#include "types.hpp"
+#include "storage.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace axle {
+
+struct ReindexStage {
+    std::string name;
+    unsigned threads{1};
+    uint64_t blocks{0};
+    double busy_seconds{0};  // summed over the stage's threads, waiting on queues excluded
+    // what the stage could sustain if it were never starved or blocked
+    double capacity_blocks_per_s() const { return busy_seconds > 0 ? blocks * threads / busy_seconds : 0; }
+    double utilization(double wall) const { return wall > 0 ? busy_seconds / (threads * wall) : 0; }
+};
+
+struct ReindexResult {
+    bool ok{false};
+    std::string error;        // why the replay stopped early
+    uint64_t height{0};       // last block replayed
+    uint64_t target{0};       // stored tip it was replaying towards
+    uint64_t txs{0};
+    double seconds{0};
+    std::vector<ReindexStage> stages; // read, decode, verify, apply
+};
+
+struct ReindexOptions {
+    unsigned threads{0};       // decode and verify workers each; 0 = all cores
+    unsigned exec_threads{0};  // block execution in the apply stage; 0 = Blockchain's default
+    size_t queue_blocks{64};   // capacity of each queue between stages
+    size_t state_cache{0};     // Blockchain::set_state_cache; 0 = accounts in memory
+    // called from the apply stage about once a second
+    std::function<void(const ReindexResult&)> progress;
+};
+
+// Rebuilds state.json and the undo records by replaying every stored body from genesis to the
+// stored tip. Runs as a pipeline on bounded queues: read (one thread) -> decode (N) -> verify
+// header, merkle root, signatures and addresses (N) -> apply in height order (one thread).
+// tip.json and state.json are only rewritten once every block up to the stored tip replayed;
+// if one fails, the replay stops there and both are left as they were. Needs every body, so
+// it refuses pruned datadirs; the node must not be running.
+ReindexResult reindex(Storage& storage, const ChainParams& params, const ReindexOptions& opt = {});
+
+}
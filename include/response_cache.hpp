@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace axle {
+
+struct ResponseCacheStats {
+    uint64_t hits{0}, misses{0};
+    uint64_t served_bytes{0}; // response bytes written straight from the cache
+    uint64_t evictions{0};
+    size_t entries{0}, bytes{0};
+};
+
+// Fully serialized RPC responses for immutable objects, keyed by content (e.g. "block:<hash>")
+// so a reorg can never make an entry stale. Least recently used entries are evicted to stay
+// within max_bytes; 0 disables the cache. Thread-safe.
+class ResponseCache {
+public:
+    explicit ResponseCache(size_t max_bytes = 64 << 20) : max_bytes_(max_bytes) {}
+
+    std::shared_ptr<const std::string> get(const std::string& key);
+    void put(const std::string& key, std::string response);
+    void set_max_bytes(size_t n);
+    size_t max_bytes() const;
+    // evicts down to `bytes` now, leaving max_bytes as it is (to give memory back)
+    void shrink_to(size_t bytes);
+    ResponseCacheStats stats() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<const std::string> response;
+        std::list<std::string>::iterator lru;
+    };
+    void evict_to(size_t bytes);
+
+    mutable std::mutex mu_;
+    size_t max_bytes_;
+    std::list<std::string> lru_; // most recent first
+    std::unordered_map<std::string, Entry> entries_;
+    ResponseCacheStats stats_;
+};
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace axle {
+
+// Approximate set of recently inserted items with a fixed memory footprint. Remembers at
+// least the last `capacity` insertions (older ones are forgotten a generation at a time) and
+// answers false positives for unseen items at roughly `fp_rate`. Not thread-safe.
+class RollingBloom {
+public:
+    RollingBloom(size_t capacity, double fp_rate);
+
+    void insert(std::string_view item);
+    bool contains(std::string_view item) const;
+    void clear();
+    size_t memory_bytes() const;
+
+private:
+    static constexpr size_t GENERATIONS = 3;
+    std::pair<uint64_t, uint64_t> hash(std::string_view item) const;
+
+    size_t per_generation_; // insertions before the oldest generation is recycled
+    size_t bits_;           // per generation
+    unsigned hashes_;
+    uint64_t seed_;
+    size_t current_{0}, inserted_{0};
+    std::array<std::vector<uint64_t>, GENERATIONS> gens_;
+};
+
+}
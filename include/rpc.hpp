@@ -1,9 +1,14 @@
 #pragma once
 #include "types.hpp"
 #include "blockchain.hpp"
+#include "mempool.hpp"
+#include "peer_manager.hpp"
+#include "response_cache.hpp"
 #include <string>
 #include <thread>
 #include <atomic>
+#include <functional>
+#include <optional>
 
 namespace axle {
 
@@ -12,12 +17,32 @@ public:
     RpcServer(Blockchain& chain);
     ~RpcServer();
 
+    // Serves one connection at a time on its own thread. Each gets 5 s to send a request line of
+    // at most 16 MiB and read the reply, so a stalled client holds the others up no longer.
     bool start(const std::string& host, uint16_t port);
     void stop();
+    // enables send_tx; without a mempool it answers an error
+    void set_mempool(Mempool* m) { mempool_ = m; }
+    // called with each tx send_tx admitted to the mempool (e.g. to announce it to peers)
+    void on_tx(std::function<void(const SignedTx&)> f) { on_tx_ = std::move(f); }
+    // enables get_peers
+    void set_peer_manager(const PeerManager* p) { peers_ = p; }
+    // serialized get_block responses; 64 MiB unless resized
+    ResponseCache& cache() { return cache_; }
 private:
     Blockchain& chain_;
+    Mempool* mempool_{nullptr};
+    const PeerManager* peers_{nullptr};
+    std::function<void(const SignedTx&)> on_tx_;
+    ResponseCache cache_;
     std::thread server_thread_;
     std::atomic<bool> running_{false};
+    std::pair<std::string,uint16_t> listen_;
 };
 
+// One request to an RpcServer: sends `request` (a JSON object, no newline) and returns the
+// reply line. nullopt on connection failure or timeout.
+std::optional<std::string> rpc_request(const std::string& host, uint16_t port, const std::string& request,
+                                       int timeout_ms = 60000);
+
 }
@@ -0,0 +1,47 @@
+#pragma once
+#include "types.hpp"
+#include "crypto.hpp"
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace axle {
+
+struct Payment {
+    std::string to;
+    int64_t amount; // base units
+};
+
+// "12.5" -> 1250000000. nullopt if malformed, not positive, or finer than 1e-8.
+std::optional<int64_t> parse_amount(std::string_view s);
+
+// (to, amount) rows from a CSV file ("ADDR,AMOUNT" per line, an optional header) or, for
+// *.jsonl, one {"to":ADDR,"amount":"N.NNNNNNNN"} object per line. nullopt with `err` naming
+// the first bad line.
+std::optional<std::vector<Payment>> read_payments(const std::string& path, std::string& err);
+
+struct BatchResult {
+    size_t total{0}, signed_txs{0}, submitted{0}, accepted{0}, rejected{0};
+    double sign_seconds{0}, seconds{0};
+    bool rpc_failed{false};
+    std::vector<std::string> errors; // the first few rejections, "row N: reason"
+};
+
+struct BatchOptions {
+    std::string host{"127.0.0.1"};
+    uint16_t port{9736};
+    unsigned threads{1};
+    size_t batch_size{1000};
+    std::function<void(const BatchResult&)> progress; // after every submitted batch
+};
+
+// Signs a transfer for every payment with nonces first_nonce, first_nonce+1, ... on
+// opt.threads threads, and submits them to the node's send_txs RPC in batches. Each batch goes
+// out as soon as it is signed, so submission overlaps the signing of later batches. Stops at
+// the first batch the node does not answer.
+BatchResult send_batch(const std::vector<Payment>& payments, const bytes& priv, uint64_t first_nonce,
+                       const BatchOptions& opt);
+
+}
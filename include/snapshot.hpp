@@ -0,0 +1,62 @@
+#pragma once
+#include "types.hpp"
+#include "block.hpp"
+#include "storage.hpp"
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace axle {
+
+class Blockchain;
+
+// A state snapshot at some height: the ledger plus every header up to that height, split into
+// content-hashed chunks. The manifest lists the chunk hashes; its own hash is what a new node
+// is told to trust, so every chunk can be checked as soon as it arrives.
+struct SnapshotChunk {
+    std::string hash; // sha256 hex of the chunk bytes
+    uint64_t size{0};
+};
+
+struct SnapshotManifest {
+    uint32_t network_id{0};
+    uint64_t height{0};
+    std::string block_hash;
+    uint64_t work{0};
+    std::vector<SnapshotChunk> chunks;
+
+    std::string to_json() const;
+    static std::optional<SnapshotManifest> from_json(std::string_view js);
+    std::string hash() const; // sha256 hex of to_json()
+};
+
+// Serializes state and headers into chunks of roughly chunk_bytes each.
+std::vector<std::string> make_snapshot_chunks(const LedgerState& st, const std::vector<HeaderRecord>& headers,
+                                              size_t chunk_bytes);
+
+// Writes a snapshot of the chain's tip under DATADIR/snapshots/<height>/, keeping the newest two.
+std::optional<SnapshotManifest> write_snapshot(const Blockchain& chain, size_t chunk_bytes = 1 << 20);
+// Stored manifest whose hash is manifest_hash (any if empty), as its exact bytes.
+std::optional<std::string> read_snapshot_manifest(const Storage& st, const std::string& manifest_hash);
+std::optional<std::string> read_snapshot_chunk(const Storage& st, uint64_t height, size_t index);
+
+struct SnapshotSyncResult {
+    bool ok{false};
+    std::string error;
+    uint64_t height{0};       // snapshot height installed
+    uint64_t tip_height{0};   // after catching up on later blocks
+    size_t chunks{0};
+    uint64_t bytes{0};
+    double fetch_seconds{0};  // chunks downloaded and verified
+    double total_seconds{0};  // until the node is at the peers' tip
+};
+
+// Bootstraps an empty datadir: fetches the manifest with the trusted hash and its chunks from
+// `peers` in parallel (P2P get_snapshot_manifest/get_snapshot_chunk), verifies every chunk and
+// the header chain, installs the state, then syncs the remaining blocks with get_block.
+SnapshotSyncResult snapshot_sync(Storage& st, const ChainParams& params,
+                                 const std::vector<std::pair<std::string, uint16_t>>& peers,
+                                 const std::string& manifest_hash, unsigned threads = 4);
+
+}
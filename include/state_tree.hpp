@@ -0,0 +1,117 @@
+#pragma once
+#include "types.hpp"
+#include "ledger.hpp"
+#include <array>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace axle {
+
+using Hash256 = std::array<uint8_t, 32>;
+// key hash -> new value hash (nullopt = delete)
+using StateChanges = std::vector<std::pair<Hash256, std::optional<Hash256>>>;
+
+// Sparse Merkle tree over 256-bit key hashes, committing to accounts, NFTs and the pool.
+// A subtree holding a single entry is that entry's leaf, so paths are about log2(entries) deep
+// rather than 256. Internal nodes cache their hash; apply() only marks the paths of the keys it
+// touches, and root() rehashes just those nodes, splitting large batches across threads.
+//   leaf     = sha256(0x00 || key || value)
+//   internal = sha256(0x01 || left || right), an empty child counting as 32 zero bytes
+// The root depends only on the set of entries, not on the order they were written in.
+//
+// Nodes live on the heap, or after open() in an mmapped file of 64-byte slots (like
+// AccountStore), so only the pages in use take memory and the tree survives a restart.
+class StateTree {
+public:
+    StateTree() = default;
+    StateTree(StateTree&& o) noexcept { *this = std::move(o); }
+    StateTree& operator=(StateTree&& o) noexcept;
+    StateTree(const StateTree&) = delete;
+    StateTree& operator=(const StateTree&) = delete;
+    ~StateTree();
+
+    // Replaces the tree with the one in the file at path (an empty one if truncate or the file is
+    // new), and keeps it there from now on. False (err set) if the file is not a state tree.
+    bool open(const std::string& path, bool truncate, std::string& err);
+    bool file_backed() const { return fd_ >= 0; }
+    const std::string& path() const { return path_; }
+    bool sync(); // msync
+    bool move_to(const std::string& path);
+    // The block the tree was last stamped at, kept in the file's header; any change clears it,
+    // so a file left mid-block is rebuilt rather than trusted. Nullopt if unstamped.
+    void set_tip(uint64_t height, const std::string& hash);
+    std::optional<std::pair<uint64_t, std::string>> tip() const;
+
+    // Applies the changes and returns their inverse (each key's previous value).
+    StateChanges apply(StateChanges changes);
+    Hash256 root(unsigned threads = 1);
+    std::optional<Hash256> get(const Hash256& key) const;
+    size_t size() const { return header().entries; }
+    uint64_t last_hashes() const { return last_hashes_; } // node hashes computed by the last root()
+
+private:
+    struct Internal { Hash256 hash; uint32_t child[2]; uint8_t dirty; };
+    struct Leaf { Hash256 key; Hash256 value; };
+    // Internal nodes and leaves share one array of 64-byte slots; a free slot's child[0] links
+    // to the next free one.
+    union Node { Internal in; Leaf leaf; };
+    struct Header {
+        char magic[8];
+        uint64_t slots;   // allocated
+        uint64_t used;    // ever handed out; the free list covers the rest of [0, used)
+        uint32_t root;
+        uint32_t free_head; // slot + 1, 0 = none
+        uint64_t entries;
+        uint64_t height;  // see tip()
+        char tip[64];     // hex block hash, not terminated; all zero = unstamped
+    };
+    using Ref = uint32_t; // 0 = empty, LEAF bit set = leaf in slot (ref & ~LEAF) - 1, else internal in slot ref - 1
+    static constexpr Ref LEAF = 1u << 31;
+    using Iter = StateChanges::const_iterator;
+
+    Header& header() { return fd_ >= 0 ? *reinterpret_cast<Header*>(base_) : heap_header_; }
+    const Header& header() const { return fd_ >= 0 ? *reinterpret_cast<const Header*>(base_) : heap_header_; }
+    Internal& internal(Ref r) const { return nodes_[r - 1].in; }
+    Leaf& leaf(Ref r) const { return nodes_[(r & ~LEAF) - 1].leaf; }
+    Ref update(Ref r, unsigned depth, Iter b, Iter e, StateChanges& inverse);
+    Ref build(unsigned depth, Iter b, Iter e); // from set-only changes
+    uint32_t alloc_slot();
+    bool grow();
+    bool map(size_t bytes);
+    Ref new_leaf(const Hash256& key, const Hash256& value);
+    Ref new_internal(Ref left, Ref right);
+    void free(Ref r);
+    Hash256 rehash(Ref r, uint64_t& hashes);
+    void dirty_frontier(Ref r, unsigned depth, unsigned max_depth, std::vector<Ref>& out) const;
+    void unmap();
+
+    Header heap_header_{};
+    std::vector<Node> heap_;
+    Node* nodes_{nullptr}; // heap_ or the slots after the file's header page
+    std::string path_;
+    int fd_{-1};
+    uint8_t* base_{nullptr};
+    size_t bytes_{0};
+    size_t pending_{0}; // keys changed since the last root()
+    uint64_t last_hashes_{0};
+};
+
+// Tree keys and values for ledger entries.
+Hash256 account_key(const std::string& addr);
+Hash256 nft_key(uint64_t id);
+Hash256 pool_key(); // unclaimed pool and next token id
+Hash256 account_value(const AccountState& a);
+Hash256 nft_value(const NftEntry& e);
+Hash256 pool_value(int64_t unclaimed_pool, uint64_t next_token_id);
+
+// Every entry of st, for building a tree from scratch.
+StateChanges state_entries(const LedgerState& st);
+// What applying d on top of prior does to the tree.
+StateChanges state_changes(const LedgerState& prior, const StateDelta& d);
+// The entries an undo record restored, read back from st after apply_undo.
+StateChanges state_changes(const LedgerState& st, const UndoRecord& u);
+
+std::string hex(const Hash256& h);
+
+}
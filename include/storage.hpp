@@ -1,22 +1,78 @@
 #pragma once
 #include "types.hpp"
+#include "ledger.hpp"
+#include "block.hpp"
 #include <string>
+#include <string_view>
 #include <optional>
+#include <vector>
+#include <filesystem>
+#include <memory>
 
 namespace axle {
 
+// How block bodies are written: blocks/<h>.json or the columnar blocks/<h>.blk. Either is read.
+enum class BlockCodec { Json, Columnar };
+std::optional<BlockCodec> parse_block_codec(const std::string& s);
+
+struct ChainTip {
+    uint64_t height{0};
+    std::string hash;
+    uint64_t work{0}; // cumulative; 0 in datadirs written before fork choice tracked it
+    uint64_t pruned_below{0}; // block bodies and undo records below this height were deleted
+};
+
 class Storage {
+    struct JsonCache;
     std::string datadir_;
+    BlockCodec codec_{BlockCodec::Json};
+    std::shared_ptr<JsonCache> json_cache_; // columnar bodies already re-encoded for serving
+    std::filesystem::path block_path(uint64_t height, BlockCodec codec) const;
 public:
     explicit Storage(std::string datadir);
+    void set_block_codec(BlockCodec c) { codec_ = c; }
+    BlockCodec block_codec() const { return codec_; }
     bool ensure_layout(const ChainParams& params);
     std::optional<Block> read_block(uint64_t height) const;
+    // the block as JSON, for BlockView or relaying; stored JSON is returned without a decode/encode
+    // round trip, and columnar bodies are re-encoded once and kept for the next request
+    std::optional<std::string> read_block_bytes(uint64_t height) const;
+    // the stored body as is, in whichever codec it was written (see is_columnar_block)
+    std::optional<std::string> read_block_raw(uint64_t height) const;
     bool write_block(const Block& b) const;
-    bool write_tip(uint64_t height, const std::string& hash) const;
-    std::optional<std::pair<uint64_t,std::string>> read_tip() const;
-    bool load_state(LedgerState& st) const;
-    bool save_state(const LedgerState& st) const;
+    bool remove_block(uint64_t height) const;
+    uint64_t block_size(uint64_t height) const; // bytes on disk, 0 if absent
+    // tip.json, state.json, bodies and undo records are written aside and renamed into place
+    bool write_tip(const ChainTip& tip) const;
+    std::optional<ChainTip> read_tip() const;
+
+    // undo/<h>.json: what the main-chain block at height h changed
+    bool write_undo(uint64_t height, const UndoRecord& u) const;
+    std::optional<UndoRecord> read_undo(uint64_t height) const;
+    bool remove_undo(uint64_t height) const;
+
+    // blocks/side/<hash>.json: valid-PoW blocks on branches other than the main chain
+    bool write_side_block(const std::string& hash, std::string_view block_json) const;
+    std::optional<std::string> read_side_block_bytes(const std::string& hash) const;
+    bool remove_side_block(const std::string& hash) const;
+    std::vector<std::string> side_block_hashes() const;
+
+    // headers.dat: every main-chain header, kept when bodies are pruned
+    bool write_header(const HeaderRecord& h) const;
+    std::optional<HeaderRecord> read_header(uint64_t height) const;
+    std::vector<HeaderRecord> read_headers(uint64_t first, uint64_t count) const;
+    bool write_headers(const std::vector<HeaderRecord>& hs) const; // replaces the whole file
+    uint64_t header_count() const;
+    // With tiered accounts, state.json records that they live in accounts.dat instead of
+    // listing them, and save_state flushes the account cache first. `at` is the block the state
+    // is at; load_state leaves it alone in files written without one.
+    bool load_state(LedgerState& st, ChainTip* at = nullptr) const;
+    bool save_state(const LedgerState& st, const ChainTip* at = nullptr) const;
+    // accounts.dat, or another store file in the datadir; truncate starts it empty. Null if it
+    // cannot be opened.
+    std::shared_ptr<AccountStore> open_account_store(bool truncate, const std::string& name = "accounts.dat") const;
     std::string blocks_dir() const;
+    const std::string& datadir() const { return datadir_; }
 };
 
 }
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Compile-time switch (CMake option AXLE_TRACING). When 0, AXLE_TRACE_SCOPE expands to nothing.
+#ifndef AXLE_TRACING
+#define AXLE_TRACING 1
+#endif
+
+namespace axle {
+
+// Runtime switch; spans cost one relaxed load while it is off.
+inline std::atomic<bool>& tracing_flag() { static std::atomic<bool> on{false}; return on; }
+inline bool tracing_enabled() { return tracing_flag().load(std::memory_order_relaxed); }
+inline void set_tracing(bool on) { tracing_flag().store(on, std::memory_order_relaxed); }
+
+int64_t trace_now_ns();
+// Appends a complete event to the calling thread's ring buffer. `name` must outlive the process (a literal).
+void trace_record(const char* name, int64_t start_ns, int64_t dur_ns);
+
+// Chrome trace-event JSON ({"traceEvents":[...]}) of everything still held in the ring buffers,
+// including the last events of threads that have exited.
+std::string trace_json(size_t* events = nullptr);
+bool dump_trace(const std::string& path, size_t* events = nullptr);
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name_(tracing_enabled() ? name : nullptr) {
+        if (name_) t0_ = trace_now_ns();
+    }
+    ~TraceSpan() { if (name_) trace_record(name_, t0_, trace_now_ns() - t0_); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+    const char* name_;
+    int64_t t0_{0};
+};
+
+}
+
+#if AXLE_TRACING
+#define AXLE_TRACE_CONCAT2(a, b) a##b
+#define AXLE_TRACE_CONCAT(a, b) AXLE_TRACE_CONCAT2(a, b)
+#define AXLE_TRACE_SCOPE(name) ::axle::TraceSpan AXLE_TRACE_CONCAT(axle_trace_span_, __LINE__)(name)
+#else
+#define AXLE_TRACE_SCOPE(name) ((void)0)
+#endif
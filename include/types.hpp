@@ -5,6 +5,8 @@
 #include <optional>
 #include <chrono>
 #include <map>
+#include "account_store.hpp"
+#include "nft_store.hpp"
 
 namespace axle {
 
@@ -24,12 +26,6 @@ enum class TxType : uint8_t {
     BURN_NFT = 3
 };
 
-struct NFTMeta {
-    std::string name;
-    std::string symbol;
-    std::string uri; // IPFS/HTTPS
-};
-
 struct SignedTx {
     TxType type;
     std::string from;
@@ -48,6 +44,7 @@ struct BlockHeader {
     uint64_t height{0};
     std::string prev_hash;
     std::string merkle_root;
+    std::string state_root; // hex root of the StateTree after this block's txs and reward
     uint64_t timestamp{0}; // unix
     uint32_t difficulty_bits{18}; // number of leading zero bits required
     uint64_t nonce{0};
@@ -61,23 +58,22 @@ struct Block {
     int64_t reward{0}; // reward paid to miner from pool
 };
 
-struct AccountState {
-    int64_t balance{0};
-    uint64_t nonce{0};
-};
-
 struct ChainParams {
     std::string network{"mainnet"};
     uint32_t network_id{0xA117E};
-    int64_t supply_cap{100000000000LL * UNIT};
+    int64_t supply_cap{92000000000LL * UNIT}; // largest whole-AXLE cap that fits int64 units
     int64_t burn_fee{BURN_FEE_UNITS};
     int target_block_time_sec{30};
     int emission_years{8};
+    uint32_t initial_difficulty_bits{18};
+    bool fixed_difficulty{false}; // regtest: never retarget
 };
 
+using NftEntry = std::pair<InternedString, NftMetaRef>; // (owner, meta), both shared; see nft_store.hpp
+
 struct LedgerState {
-    std::map<std::string, AccountState> accounts;
-    std::map<uint64_t, std::pair<std::string, NFTMeta>> nfts; // tokenId -> (owner, meta)
+    AccountTable accounts; // in memory, or a cache over an AccountStore
+    std::map<uint64_t, NftEntry> nfts; // tokenId -> (owner, meta)
     uint64_t next_token_id{1};
     int64_t unclaimed_pool{0}; // starts at supply cap
 };
@@ -0,0 +1,73 @@
+#pragma once
+#include "types.hpp"
+#include "blockchain.hpp"
+#include "mempool.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace axle {
+
+struct WorkStats {
+    uint64_t jobs{0};      // templates built
+    uint64_t submitted{0};
+    uint64_t accepted{0};
+    uint64_t stale{0};     // solved a job whose parent is no longer the tip
+    uint64_t invalid{0};   // unknown job, hash misses the target, or the chain rejected the block
+    uint64_t workers{0};   // connected right now
+};
+
+// Serves mining work to miner processes over line-delimited JSON on a local TCP port:
+//   worker: {"type":"subscribe"}                   server: work
+//   worker: {"type":"get_work"}                    server: work (same job, next nonce range)
+//   worker: {"type":"submit","job":J,"nonce":N}    server: {"type":"result","job":J,"accepted":...}
+//   server: {"type":"work","job":J,"header":{...},"nonce_start":S,"nonce_end":E}
+// The header is everything block_hash covers except the nonce. Every worker gets its own nonce
+// range, so none repeat another's hashes. Work is pushed to all workers as soon as a block is
+// solved, and within refresh_ms when the tip or the mempool changes otherwise. A solution to
+// an older job on the current tip is still a valid block and is accepted.
+class WorkServer {
+public:
+    // mempool may be null (empty blocks only)
+    WorkServer(Blockchain& chain, Mempool* mempool, std::string miner_address);
+    ~WorkServer();
+
+    bool start(const std::string& host, uint16_t port);
+    void stop();
+    // called after the chain accepted a block a worker solved (e.g. to broadcast it)
+    void on_block(std::function<void(const Block&)> f) { on_block_ = std::move(f); }
+    WorkStats stats() const; // totals since the last start(), kept after stop()
+
+    uint64_t nonce_range{1ULL << 32};
+    size_t max_block_txs{1000};
+    int refresh_ms{100};
+
+private:
+    struct Impl;
+    struct Session;
+    Blockchain& chain_;
+    Mempool* mempool_;
+    std::string miner_address_;
+    std::function<void(const Block&)> on_block_;
+    std::unique_ptr<Impl> impl_;
+    WorkStats final_;
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+};
+
+struct MinerStats {
+    std::atomic<uint64_t> hashes{0};
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> submitted{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+// Mining worker: connects to a WorkServer and hashes its work on `threads` threads until
+// `stop` is set or the connection drops. False if it could not connect.
+bool run_mining_worker(const std::string& host, uint16_t port, unsigned threads,
+                       const std::atomic<bool>& stop, MinerStats& stats);
+
+}
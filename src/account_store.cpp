@@ -0,0 +1,414 @@
+#include "account_store.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace axle {
+
+static Counter& m_hits = metrics().counter("axle_state_cache_hits_total", "Account lookups served by the state cache");
+static Counter& m_misses = metrics().counter("axle_state_cache_misses_total", "Account lookups that went to the account store");
+static Histogram& m_miss = metrics().histogram("axle_state_cache_miss_seconds", "Account store lookup time on a cache miss", "",
+                                               {1e-6, 4e-6, 16e-6, 64e-6, 256e-6, 1e-3, 4e-3, 16e-3});
+static Counter& m_evicted = metrics().counter("axle_state_cache_evictions_total", "Accounts dropped from the state cache");
+static Gauge& m_entries = metrics().gauge("axle_state_cache_entries", "Accounts held by the state cache");
+static Gauge& m_stored = metrics().gauge("axle_state_store_accounts", "Accounts in the on-disk account store");
+static Gauge& m_store_bytes = metrics().gauge("axle_state_store_bytes", "Size of the account store file");
+
+namespace {
+
+using Steady = std::chrono::steady_clock;
+
+constexpr char MAGIC[8] = {'A', 'X', 'A', 'C', 'C', 'T', '0', '1'};
+constexpr uint8_t EMPTY = 0, TOMBSTONE = 0xFF;
+constexpr size_t INITIAL_PAGES = 16;
+
+struct Header {
+    char magic[8];
+    uint64_t pages;      // slot pages, excluding this one
+    uint64_t live;
+    uint64_t tombstones;
+    uint64_t height;     // see AccountStore::tip; zero in older files
+    char tip[64];        // hex block hash, not terminated
+};
+
+// FNV-1a: the slot a key lands in is part of the file format, so no std::hash
+uint64_t key_hash(std::string_view k) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : k) h = (h ^ c) * 1099511628211ull;
+    return h;
+}
+
+// slot: key length (0 empty, 0xFF deleted), key, balance, nonce
+std::string_view slot_key(const uint8_t* s) { return {reinterpret_cast<const char*>(s + 1), s[0]}; }
+AccountState slot_value(const uint8_t* s) {
+    AccountState a;
+    std::memcpy(&a.balance, s + 48, 8);
+    std::memcpy(&a.nonce, s + 56, 8);
+    return a;
+}
+void set_slot_value(uint8_t* s, const AccountState& a) {
+    std::memcpy(s + 48, &a.balance, 8);
+    std::memcpy(s + 56, &a.nonce, 8);
+}
+
+}
+
+AccountStore::~AccountStore() {
+    unmap();
+    if (fd_ >= 0) ::close(fd_);
+}
+
+std::unique_ptr<AccountStore> AccountStore::open(const std::string& path, bool truncate, std::string& err) {
+    std::unique_ptr<AccountStore> s(new AccountStore);
+    s->path_ = path;
+    s->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (s->fd_ < 0) { err = "cannot open " + path + ": " + std::strerror(errno); return nullptr; }
+    struct stat sb{};
+    ::fstat(s->fd_, &sb);
+    size_t bytes = (size_t)sb.st_size;
+    bool fresh = bytes == 0;
+    if (fresh) {
+        bytes = PAGE * (1 + INITIAL_PAGES);
+        if (::ftruncate(s->fd_, (off_t)bytes) != 0) { err = "cannot size " + path; return nullptr; }
+    }
+    if (bytes % PAGE || bytes < 2 * PAGE) { err = path + " is not an account store"; return nullptr; }
+    if (!s->map(bytes)) { err = "cannot map " + path; return nullptr; }
+    auto* h = reinterpret_cast<Header*>(s->base_);
+    if (fresh) {
+        std::memcpy(h->magic, MAGIC, 8);
+        h->pages = INITIAL_PAGES;
+    } else if (std::memcmp(h->magic, MAGIC, 8) != 0 || (h->pages + 1) * PAGE != bytes) {
+        err = path + " is not an account store";
+        return nullptr;
+    }
+    m_stored.set((int64_t)h->live);
+    m_store_bytes.set((int64_t)bytes);
+    return s;
+}
+
+bool AccountStore::map(size_t bytes) {
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) return false;
+    base_ = static_cast<uint8_t*>(p);
+    bytes_ = bytes;
+    return true;
+}
+
+void AccountStore::unmap() {
+    if (base_) ::munmap(base_, bytes_);
+    base_ = nullptr;
+    bytes_ = 0;
+}
+
+uint64_t AccountStore::slots() const { return reinterpret_cast<const Header*>(base_)->pages * SLOTS_PER_PAGE; }
+uint8_t* AccountStore::slot(uint64_t i) const { return base_ + PAGE + i * SLOT; }
+uint64_t AccountStore::size() const { return reinterpret_cast<const Header*>(base_)->live; }
+
+// The key's slot; with for_insert, where it would go (the first deleted slot on its probe run,
+// else the empty slot ending it). UINT64_MAX if neither.
+uint64_t AccountStore::find_slot(std::string_view key, uint64_t h, bool for_insert) const {
+    uint64_t n = slots(), i = h % n, tomb = UINT64_MAX;
+    for (uint64_t probes = 0; probes < n; probes++, i = (i + 1) % n) {
+        const uint8_t* s = slot(i);
+        if (s[0] == EMPTY) return for_insert && tomb != UINT64_MAX ? tomb : for_insert ? i : UINT64_MAX;
+        if (s[0] == TOMBSTONE) { if (tomb == UINT64_MAX) tomb = i; continue; }
+        if (slot_key(s) == key) return i;
+    }
+    return for_insert ? tomb : UINT64_MAX;
+}
+
+std::optional<AccountState> AccountStore::get(std::string_view key) const {
+    if (key.empty() || key.size() > MAX_KEY) return std::nullopt;
+    auto i = find_slot(key, key_hash(key), false);
+    if (i == UINT64_MAX) return std::nullopt;
+    return slot_value(slot(i));
+}
+
+bool AccountStore::put(std::string_view key, const AccountState& a) {
+    if (key.empty() || key.size() > MAX_KEY) return false;
+    auto* h = reinterpret_cast<Header*>(base_);
+    if ((h->live + h->tombstones + 1) * 10 > slots() * 7) {
+        if (!grow()) return false;
+        h = reinterpret_cast<Header*>(base_);
+    }
+    auto i = find_slot(key, key_hash(key), true);
+    if (i == UINT64_MAX) return false;
+    uint8_t* s = slot(i);
+    if (s[0] == EMPTY || s[0] == TOMBSTONE) {
+        if (s[0] == TOMBSTONE) h->tombstones--;
+        h->live++;
+        s[0] = (uint8_t)key.size();
+        std::memcpy(s + 1, key.data(), key.size());
+    }
+    set_slot_value(s, a);
+    return true;
+}
+
+bool AccountStore::erase(std::string_view key) {
+    if (key.empty() || key.size() > MAX_KEY) return true;
+    auto i = find_slot(key, key_hash(key), false);
+    if (i == UINT64_MAX) return true;
+    slot(i)[0] = TOMBSTONE;
+    auto* h = reinterpret_cast<Header*>(base_);
+    h->live--;
+    h->tombstones++;
+    return true;
+}
+
+// Rewrites the live slots into a table twice the size (the same size if most of the fill is
+// deletions), then renames it over this one.
+bool AccountStore::grow() {
+    AXLE_TRACE_SCOPE("account_store.grow");
+    auto* h = reinterpret_cast<Header*>(base_);
+    uint64_t pages = h->tombstones > h->live ? h->pages : h->pages * 2;
+    std::string tmp = path_ + ".grow", err;
+    auto fresh = open(tmp, true, err);
+    if (!fresh) { std::cerr << "[STATE] " << err << std::endl; return false; }
+    size_t bytes = PAGE * (1 + pages);
+    fresh->unmap();
+    if (::ftruncate(fresh->fd_, (off_t)bytes) != 0 || !fresh->map(bytes)) return false;
+    auto* fh = reinterpret_cast<Header*>(fresh->base_);
+    std::memcpy(fh->magic, MAGIC, 8);
+    fh->pages = pages;
+    fh->height = h->height;
+    std::memcpy(fh->tip, h->tip, sizeof fh->tip);
+    for (uint64_t i = 0, n = slots(); i < n; i++) {
+        const uint8_t* s = slot(i);
+        if (s[0] == EMPTY || s[0] == TOMBSTONE) continue;
+        uint8_t* d = fresh->slot(fresh->find_slot(slot_key(s), key_hash(slot_key(s)), true));
+        std::memcpy(d, s, SLOT);
+        fh->live++;
+    }
+    fresh->sync();
+    if (std::rename(tmp.c_str(), path_.c_str()) != 0) return false;
+    unmap();
+    ::close(fd_);
+    fd_ = std::exchange(fresh->fd_, -1);
+    base_ = std::exchange(fresh->base_, nullptr);
+    bytes_ = std::exchange(fresh->bytes_, 0);
+    m_stored.set((int64_t)size());
+    m_store_bytes.set((int64_t)bytes_);
+    return true;
+}
+
+void AccountStore::will_need(const std::vector<std::string_view>& keys) const {
+    std::vector<uint64_t> pages;
+    pages.reserve(keys.size());
+    for (auto k : keys) pages.push_back(1 + key_hash(k) % slots() / SLOTS_PER_PAGE);
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    for (auto p : pages) ::madvise(base_ + p * PAGE, PAGE, MADV_WILLNEED);
+}
+
+void AccountStore::for_each(const std::function<void(std::string_view, const AccountState&)>& f) const {
+    for (uint64_t i = 0, n = slots(); i < n; i++) {
+        const uint8_t* s = slot(i);
+        if (s[0] != EMPTY && s[0] != TOMBSTONE) f(slot_key(s), slot_value(s));
+    }
+}
+
+bool AccountStore::sync() { return ::msync(base_, bytes_, MS_SYNC) == 0; }
+
+void AccountStore::set_tip(uint64_t height, const std::string& hash) {
+    auto* h = reinterpret_cast<Header*>(base_);
+    h->height = height;
+    std::memset(h->tip, 0, sizeof h->tip);
+    std::memcpy(h->tip, hash.data(), std::min(hash.size(), sizeof h->tip));
+}
+
+std::pair<uint64_t, std::string> AccountStore::tip() const {
+    auto* h = reinterpret_cast<const Header*>(base_);
+    return {h->height, std::string(h->tip, strnlen(h->tip, sizeof h->tip))};
+}
+
+bool AccountStore::move_to(const std::string& path) {
+    if (std::rename(path_.c_str(), path.c_str()) != 0) return false;
+    path_ = path;
+    return true;
+}
+
+std::optional<AccountState> AccountTable::get(const std::string& addr) const {
+    auto it = cache_.find(addr);
+    if (it != cache_.end()) {
+        if (!it->second.present) return std::nullopt;
+        return it->second.a;
+    }
+    if (!store_) return std::nullopt;
+    auto t0 = Steady::now();
+    auto a = store_->get(addr);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Steady::now() - t0).count();
+    counters_->misses.fetch_add(1, std::memory_order_relaxed);
+    counters_->miss_ns.fetch_add(ns, std::memory_order_relaxed);
+    m_misses.inc();
+    m_miss.observe(ns / 1e9);
+    return a;
+}
+
+AccountState AccountTable::at(const std::string& addr) const {
+    auto a = get(addr);
+    if (!a) throw std::out_of_range("no account " + addr);
+    return *a;
+}
+
+AccountTable::Entry& AccountTable::load(const std::string& addr) {
+    auto it = cache_.find(addr);
+    if (it != cache_.end()) {
+        counters_->hits.fetch_add(1, std::memory_order_relaxed);
+        m_hits.inc();
+    } else {
+        auto a = get(addr);
+        it = cache_.emplace(addr, Entry{a.value_or(AccountState{}), a.has_value()}).first;
+    }
+    it->second.used = ++tick_;
+    return it->second;
+}
+
+AccountState& AccountTable::operator[](const std::string& addr) {
+    if (!store_) return cache_[addr].a;
+    auto& e = load(addr);
+    if (!e.present) {
+        e = Entry{AccountState{}, true, false, e.used};
+        size_++;
+    }
+    e.dirty = true;
+    return e.a;
+}
+
+void AccountTable::erase(const std::string& addr) {
+    if (!store_) { cache_.erase(addr); return; }
+    auto& e = load(addr);
+    if (!e.present) return;
+    e.present = false;
+    e.dirty = true;
+    size_--;
+}
+
+void AccountTable::clear() {
+    cache_.clear();
+    store_.reset();
+    size_ = 0;
+}
+
+void AccountTable::for_each(const std::function<void(const std::string&, const AccountState&)>& f) const {
+    if (!store_) {
+        for (auto& [addr, e] : cache_) f(addr, e.a);
+        return;
+    }
+    // the store, with what is cached but not yet flushed in place of its own entries
+    std::string key;
+    store_->for_each([&](std::string_view k, const AccountState& a) {
+        key.assign(k);
+        auto it = cache_.find(key);
+        if (it == cache_.end() || !it->second.dirty) f(key, a);
+    });
+    for (auto& [addr, e] : cache_)
+        if (e.dirty && e.present) f(addr, e.a);
+}
+
+void AccountTable::attach(std::shared_ptr<AccountStore> store, size_t capacity) {
+    store_ = std::move(store);
+    capacity_ = capacity;
+    size_ = store_->size();
+    for (auto& [addr, e] : cache_) {
+        if (!store_->get(addr)) size_++;
+        e.dirty = true;
+    }
+    m_entries.set((int64_t)cache_.size());
+}
+
+void AccountTable::prefetch(const std::vector<std::string>& addrs) {
+    if (!store_) return;
+    AXLE_TRACE_SCOPE("state.prefetch");
+    std::vector<const std::string*> missing;
+    for (auto& a : addrs) {
+        auto it = cache_.find(a);
+        if (it != cache_.end()) {
+            it->second.used = ++tick_;
+            counters_->hits.fetch_add(1, std::memory_order_relaxed);
+            m_hits.inc();
+        } else {
+            missing.push_back(&a);
+        }
+    }
+    if (missing.empty()) return;
+    std::vector<std::string_view> keys;
+    for (auto* a : missing) keys.push_back(*a);
+    store_->will_need(keys);
+    for (auto* a : missing) {
+        if (cache_.count(*a)) continue; // listed twice
+        auto v = get(*a);
+        cache_.emplace(*a, Entry{v.value_or(AccountState{}), v.has_value(), false, ++tick_});
+        counters_->prefetched.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_entries.set((int64_t)cache_.size());
+}
+
+bool AccountTable::flush() const {
+    if (!store_) return true;
+    bool ok = true;
+    uint64_t n = 0;
+    for (auto& [addr, e] : cache_) {
+        if (!e.dirty) continue;
+        bool written = e.present ? store_->put(addr, e.a) : store_->erase(addr);
+        if (!written) {
+            std::cerr << "[STATE] cannot store account " << addr << std::endl;
+            ok = false;
+            continue;
+        }
+        e.dirty = false;
+        n++;
+    }
+    // a store missing some of the block's writes must not claim to be at its tip
+    if (ok && !tip_hash_.empty()) store_->set_tip(tip_height_, tip_hash_);
+    counters_->flushed.fetch_add(n, std::memory_order_relaxed);
+    m_stored.set((int64_t)store_->size());
+    return ok;
+}
+
+void AccountTable::trim(bool flush_first) {
+    if (!store_) return;
+    bool over_budget = over_memory_budget(MemTag::State);
+    if (cache_.size() <= capacity_ && !over_budget) return;
+    AXLE_TRACE_SCOPE("state.trim");
+    if (flush_first) flush();
+    // evict to 90% of the capacity, oldest first, so this does not run again next block; over
+    // the State memory budget, halve the cache instead
+    size_t target = over_budget ? cache_.size() / 2 : capacity_ - capacity_ / 10;
+    std::vector<std::pair<uint64_t, std::map<std::string, Entry>::iterator>> clean;
+    for (auto it = cache_.begin(); it != cache_.end(); ++it)
+        if (!it->second.dirty) clean.push_back({it->second.used, it});
+    size_t drop = std::min(clean.size(), cache_.size() - target);
+    std::nth_element(clean.begin(), clean.begin() + drop, clean.end(),
+                     [](auto& a, auto& b) { return a.first < b.first; });
+    for (size_t i = 0; i < drop; i++) cache_.erase(clean[i].second);
+    counters_->evictions.fetch_add(drop, std::memory_order_relaxed);
+    m_evicted.inc(drop);
+    m_entries.set((int64_t)cache_.size());
+}
+
+AccountCacheStats AccountTable::stats() const {
+    AccountCacheStats s;
+    s.hits = counters_->hits.load();
+    s.misses = counters_->misses.load();
+    s.miss_seconds = counters_->miss_ns.load() / 1e9;
+    s.prefetched = counters_->prefetched.load();
+    s.evictions = counters_->evictions.load();
+    s.flushed = counters_->flushed.load();
+    s.entries = cache_.size();
+    s.capacity = capacity_;
+    s.stored = store_ ? store_->size() : 0;
+    return s;
+}
+
+}
@@ -0,0 +1,22 @@
+#include "arena.hpp"
+
+namespace axle {
+
+BlockArena::BlockArena(size_t initial_bytes) : mono_(initial_bytes, &upstream_) {}
+
+void* BlockArena::do_allocate(size_t bytes, size_t align) {
+    allocations_++;
+    bytes_ += bytes;
+    return mono_.allocate(bytes, align);
+}
+
+void* BlockArena::Upstream::do_allocate(size_t bytes, size_t align) {
+    reserved += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+}
+
+void BlockArena::Upstream::do_deallocate(void* p, size_t bytes, size_t align) {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+}
+
+}
@@ -2,6 +2,7 @@
 #include "encoding.hpp"
 #include "crypto.hpp"
 #include <nlohmann/json.hpp>
+#include <algorithm>
 
 using json = nlohmann::json;
 
@@ -14,6 +15,7 @@ std::string header_preimage(const BlockHeader& h) {
     j["height"] = h.height;
     j["prev_hash"] = h.prev_hash;
     j["merkle_root"] = h.merkle_root;
+    j["state_root"] = h.state_root;
     j["timestamp"] = h.timestamp;
     j["difficulty_bits"] = h.difficulty_bits;
     j["nonce"] = h.nonce;
@@ -31,6 +33,54 @@ static std::string hash_concat(const std::string& a, const std::string& b) {
     return hex(double_sha256(bytes{x.begin(), x.end()}));
 }
 
+bool hash_meets_bits(const std::string& hexhash, uint32_t bits) {
+    // Check leading zero bits
+    size_t bytes_zero = bits / 8;
+    uint8_t rem = bits % 8;
+    auto h = unhex(hexhash);
+    for (size_t i=0;i<bytes_zero;i++) if (h[i]!=0) return false;
+    if (rem) {
+        uint8_t mask = 0xFF << (8 - rem);
+        if ((h[bytes_zero] & mask) != 0) return false;
+    }
+    return true;
+}
+
+static void put_hash(uint8_t out[32], const std::string& hexhash) {
+    auto b = unhex(hexhash);
+    std::copy_n(b.begin(), std::min<size_t>(32, b.size()), out);
+}
+
+HeaderRecord HeaderRecord::from(const BlockHeader& h, const std::string& hash) {
+    HeaderRecord r;
+    r.height = h.height;
+    r.timestamp = h.timestamp;
+    r.nonce = h.nonce;
+    r.difficulty_bits = h.difficulty_bits;
+    if (h.prev_hash.empty()) r.flags |= EMPTY_PREV;
+    if (h.merkle_root.empty()) r.flags |= EMPTY_MERKLE;
+    if (h.state_root.empty()) r.flags |= EMPTY_STATE;
+    put_hash(r.prev_hash, h.prev_hash);
+    put_hash(r.merkle_root, h.merkle_root);
+    put_hash(r.state_root, h.state_root);
+    put_hash(r.hash, hash);
+    return r;
+}
+
+BlockHeader HeaderRecord::header() const {
+    BlockHeader h;
+    h.height = height;
+    h.timestamp = timestamp;
+    h.nonce = nonce;
+    h.difficulty_bits = difficulty_bits;
+    if (!(flags & EMPTY_PREV)) h.prev_hash = hex(bytes(prev_hash, prev_hash + 32));
+    if (!(flags & EMPTY_MERKLE)) h.merkle_root = hex(bytes(merkle_root, merkle_root + 32));
+    if (!(flags & EMPTY_STATE)) h.state_root = hex(bytes(state_root, state_root + 32));
+    return h;
+}
+
+std::string HeaderRecord::hash_hex() const { return hex(bytes(hash, hash + 32)); }
+
 std::string merkle_root(const std::vector<SignedTx>& txs) {
     if (txs.empty()) return "";
     std::vector<std::string> level;
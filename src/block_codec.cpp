@@ -0,0 +1,229 @@
+#include "block_codec.hpp"
+#include "base58.hpp"
+#include "crypto.hpp"
+#include "trace.hpp"
+#include <unordered_map>
+
+namespace axle {
+
+static constexpr std::string_view MAGIC = "AXB1";
+static constexpr uint8_t HAS_META = 0x80;
+
+namespace {
+
+struct Writer {
+    std::string out;
+    void byte(uint8_t b) { out.push_back((char)b); }
+    void varint(uint64_t v) {
+        while (v >= 0x80) { byte((uint8_t)(v | 0x80)); v >>= 7; }
+        byte((uint8_t)v);
+    }
+    void zigzag(int64_t v) { varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+    void raw(const void* p, size_t n) { out.append((const char*)p, n); }
+    void blob(std::string_view s) { varint(s.size()); raw(s.data(), s.size()); }
+    void blob(const bytes& b) { varint(b.size()); raw(b.data(), b.size()); }
+    // lowercase hex is stored as its bytes; anything else verbatim
+    void hexfield(const std::string& s) {
+        bool is_hex = s.size() % 2 == 0;
+        for (char c : s) is_hex = is_hex && ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'));
+        byte(is_hex ? 1 : 0);
+        if (is_hex) blob(unhex(s));
+        else blob(s);
+    }
+};
+
+struct Reader {
+    std::string_view in;
+    size_t i{0};
+    bool ok{true};
+    uint8_t byte() {
+        if (i >= in.size()) { ok = false; return 0; }
+        return (uint8_t)in[i++];
+    }
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            v |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+    int64_t zigzag() { uint64_t v = varint(); return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+    std::string_view blob() {
+        uint64_t n = varint();
+        if (!ok || n > in.size() - i) { ok = false; return {}; }
+        auto s = in.substr(i, n);
+        i += n;
+        return s;
+    }
+    bytes blob_bytes() { auto s = blob(); return bytes(s.begin(), s.end()); }
+    std::string hexfield() {
+        uint8_t tag = byte();
+        auto s = blob();
+        return tag ? hex(bytes(s.begin(), s.end())) : std::string(s);
+    }
+};
+
+// Per-block string table. Canonical Base58 strings (addresses) are stored decoded.
+struct Dictionary {
+    std::vector<const std::string*> entries;
+    std::unordered_map<std::string_view, uint64_t> index;
+    uint64_t add(const std::string& s) {
+        auto [it, fresh] = index.emplace(s, entries.size());
+        if (fresh) entries.push_back(&s);
+        return it->second;
+    }
+    void write(Writer& w) const {
+        w.varint(entries.size());
+        for (auto* s : entries) {
+            bool ok = !s->empty();
+            auto raw = ok ? base58_decode(*s, &ok) : bytes{};
+            ok = ok && base58_encode(raw) == *s;
+            w.byte(ok ? 1 : 0);
+            if (ok) w.blob(raw);
+            else w.blob(*s);
+        }
+    }
+};
+
+}
+
+bool is_columnar_block(std::string_view data) { return data.substr(0, MAGIC.size()) == MAGIC; }
+
+std::string encode_block_columnar(const Block& b) {
+    AXLE_TRACE_SCOPE("encode_block_columnar");
+    Dictionary dict;
+    dict.add(b.miner_address);
+    std::unordered_map<std::string_view, uint64_t> key_index; // pubkeys repeat per sender
+    std::vector<const bytes*> keys;
+    for (auto& tx : b.txs) {
+        dict.add(tx.from);
+        dict.add(tx.to);
+        if (!tx.meta.name.empty() || !tx.meta.symbol.empty() || !tx.meta.uri.empty()) {
+            dict.add(tx.meta.name);
+            dict.add(tx.meta.symbol);
+            dict.add(tx.meta.uri);
+        }
+        std::string_view k((const char*)tx.pubkey.data(), tx.pubkey.size());
+        if (key_index.emplace(k, keys.size()).second) keys.push_back(&tx.pubkey);
+    }
+
+    Writer w;
+    w.out.reserve(256 + b.txs.size() * 112);
+    w.raw(MAGIC.data(), MAGIC.size());
+    dict.write(w);
+    w.varint(keys.size());
+    for (auto* k : keys) w.blob(*k);
+
+    w.varint(b.header.height);
+    w.hexfield(b.header.prev_hash);
+    w.hexfield(b.header.merkle_root);
+    w.hexfield(b.header.state_root);
+    w.varint(b.header.timestamp);
+    w.varint(b.header.difficulty_bits);
+    w.varint(b.header.nonce);
+    w.hexfield(b.hash);
+    w.varint(dict.add(b.miner_address));
+    w.zigzag(b.reward);
+
+    size_t n = b.txs.size();
+    w.varint(n);
+    for (auto& tx : b.txs) {
+        bool meta = !tx.meta.name.empty() || !tx.meta.symbol.empty() || !tx.meta.uri.empty();
+        w.byte((uint8_t)tx.type | (meta ? HAS_META : 0));
+    }
+    for (auto& tx : b.txs) w.varint(dict.add(tx.from));
+    for (auto& tx : b.txs) w.varint(dict.add(tx.to));
+    std::unordered_map<uint64_t, uint64_t> last_nonce; // by sender index
+    for (auto& tx : b.txs) {
+        auto& prev = last_nonce[dict.add(tx.from)];
+        w.zigzag((int64_t)(tx.nonce - prev));
+        prev = tx.nonce;
+    }
+    uint64_t prev_amount = 0, prev_token = 0;
+    for (auto& tx : b.txs) { w.zigzag((int64_t)((uint64_t)tx.amount - prev_amount)); prev_amount = (uint64_t)tx.amount; }
+    for (auto& tx : b.txs) { w.zigzag((int64_t)(tx.tokenId - prev_token)); prev_token = tx.tokenId; }
+    for (auto& tx : b.txs) {
+        if (tx.meta.name.empty() && tx.meta.symbol.empty() && tx.meta.uri.empty()) continue;
+        w.varint(dict.add(tx.meta.name));
+        w.varint(dict.add(tx.meta.symbol));
+        w.varint(dict.add(tx.meta.uri));
+    }
+    for (auto& tx : b.txs) w.blob(tx.signature);
+    for (auto& tx : b.txs) w.varint(key_index[std::string_view((const char*)tx.pubkey.data(), tx.pubkey.size())]);
+    for (auto& tx : b.txs) w.hexfield(tx.id);
+    return std::move(w.out);
+}
+
+std::optional<Block> decode_block_columnar(std::string_view data) {
+    AXLE_TRACE_SCOPE("decode_block_columnar");
+    if (!is_columnar_block(data)) return std::nullopt;
+    Reader r{data, MAGIC.size()};
+    std::vector<std::string> dict(std::min<uint64_t>(r.varint(), data.size()));
+    for (auto& s : dict) {
+        uint8_t tag = r.byte();
+        auto v = r.blob();
+        s = tag ? base58_encode(bytes(v.begin(), v.end())) : std::string(v);
+    }
+    std::vector<bytes> keys(std::min<uint64_t>(r.varint(), data.size()));
+    for (auto& k : keys) k = r.blob_bytes();
+    auto str = [&](uint64_t i) -> const std::string& {
+        static const std::string empty;
+        if (i >= dict.size()) { r.ok = false; return empty; }
+        return dict[i];
+    };
+
+    Block b;
+    b.header.height = r.varint();
+    b.header.prev_hash = r.hexfield();
+    b.header.merkle_root = r.hexfield();
+    b.header.state_root = r.hexfield();
+    b.header.timestamp = r.varint();
+    b.header.difficulty_bits = (uint32_t)r.varint();
+    b.header.nonce = r.varint();
+    b.hash = r.hexfield();
+    b.miner_address = str(r.varint());
+    b.reward = r.zigzag();
+
+    uint64_t n = r.varint();
+    if (!r.ok || n > data.size()) return std::nullopt; // every tx takes at least a byte
+    b.txs.resize(n);
+    std::vector<uint8_t> has_meta(n);
+    for (size_t i=0;i<n;i++) {
+        uint8_t t = r.byte();
+        b.txs[i].type = (TxType)(t & ~HAS_META);
+        has_meta[i] = t & HAS_META;
+    }
+    std::vector<uint64_t> from(n);
+    for (size_t i=0;i<n;i++) { from[i] = r.varint(); b.txs[i].from = str(from[i]); }
+    for (auto& tx : b.txs) tx.to = str(r.varint());
+    std::unordered_map<uint64_t, uint64_t> last_nonce;
+    for (size_t i=0;i<n;i++) {
+        auto& prev = last_nonce[from[i]];
+        b.txs[i].nonce = prev + (uint64_t)r.zigzag();
+        prev = b.txs[i].nonce;
+    }
+    uint64_t prev_amount = 0, prev_token = 0;
+    for (auto& tx : b.txs) { prev_amount += (uint64_t)r.zigzag(); tx.amount = (int64_t)prev_amount; }
+    for (auto& tx : b.txs) { prev_token += (uint64_t)r.zigzag(); tx.tokenId = prev_token; }
+    for (size_t i=0;i<n;i++) {
+        if (!has_meta[i]) continue;
+        auto& m = b.txs[i].meta;
+        m.name = str(r.varint());
+        m.symbol = str(r.varint());
+        m.uri = str(r.varint());
+    }
+    for (auto& tx : b.txs) tx.signature = r.blob_bytes();
+    for (auto& tx : b.txs) {
+        uint64_t k = r.varint();
+        if (k >= keys.size()) return std::nullopt;
+        tx.pubkey = keys[k];
+    }
+    for (auto& tx : b.txs) tx.id = r.hexfield();
+    if (!r.ok || r.i != data.size()) return std::nullopt;
+    return b;
+}
+
+}
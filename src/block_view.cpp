@@ -0,0 +1,142 @@
+#include "block_view.hpp"
+#include "encoding.hpp"
+#include <cctype>
+#include <charconv>
+
+namespace axle {
+
+namespace {
+
+// Minimal structural JSON scanner: enough to find value boundaries without building a DOM.
+struct Scanner {
+    std::string_view s;
+    size_t i{0};
+
+    void ws() { while (i < s.size() && (s[i]==' ' || s[i]=='\n' || s[i]=='\r' || s[i]=='\t')) i++; }
+    bool eat(char c) {
+        ws();
+        if (i < s.size() && s[i] == c) { i++; return true; }
+        return false;
+    }
+    bool string(std::string_view& out) {
+        ws();
+        if (i >= s.size() || s[i] != '"') return false;
+        size_t b = ++i;
+        while (i < s.size() && s[i] != '"') i += (s[i] == '\\') ? 2 : 1;
+        if (i >= s.size()) return false;
+        out = s.substr(b, i - b);
+        i++;
+        return true;
+    }
+    bool value(std::string_view& out, int depth = 0) {
+        ws();
+        size_t b = i;
+        if (!skip(depth)) return false;
+        out = s.substr(b, i - b);
+        return true;
+    }
+    bool skip(int depth) {
+        if (i >= s.size() || depth > 32) return false;
+        char c = s[i];
+        std::string_view v;
+        if (c == '"') return string(v);
+        if (c == '{' || c == '[') {
+            char close = c == '{' ? '}' : ']';
+            i++;
+            if (eat(close)) return true;
+            do {
+                if (c == '{' && (!string(v) || !eat(':'))) return false;
+                ws();
+                if (!skip(depth + 1)) return false;
+            } while (eat(','));
+            return eat(close);
+        }
+        size_t b = i;
+        while (i < s.size() && (std::isalnum((unsigned char)s[i]) || s[i]=='-' || s[i]=='+' || s[i]=='.')) i++;
+        return i > b;
+    }
+};
+
+// Calls f(key, raw value) for each member of an object; false when malformed.
+template <class F>
+bool members(std::string_view obj, F&& f) {
+    Scanner sc{obj};
+    if (!sc.eat('{')) return false;
+    if (sc.eat('}')) return true;
+    do {
+        std::string_view k, v;
+        if (!sc.string(k) || !sc.eat(':') || !sc.value(v)) return false;
+        f(k, v);
+    } while (sc.eat(','));
+    return sc.eat('}');
+}
+
+std::string_view field(std::string_view obj, std::string_view key) {
+    std::string_view out;
+    members(obj, [&](std::string_view k, std::string_view v){ if (k == key && out.empty()) out = v; });
+    return out;
+}
+
+std::string_view text(std::string_view raw) {
+    if (raw.size() >= 2 && raw.front() == '"') return raw.substr(1, raw.size() - 2);
+    return {};
+}
+
+template <class T>
+T number(std::string_view raw) {
+    T v{};
+    std::from_chars(raw.data(), raw.data() + raw.size(), v);
+    return v;
+}
+
+}
+
+TxType TxView::type() const { return (TxType)number<int>(field(raw_, "type")); }
+std::string_view TxView::from() const { return text(field(raw_, "from")); }
+std::string_view TxView::to() const { return text(field(raw_, "to")); }
+int64_t TxView::amount() const { return number<int64_t>(field(raw_, "amount")); }
+uint64_t TxView::nonce() const { return number<uint64_t>(field(raw_, "nonce")); }
+uint64_t TxView::token_id() const { return number<uint64_t>(field(raw_, "tokenId")); }
+std::string_view TxView::id() const { return text(field(raw_, "id")); }
+std::string_view TxView::signature_b64() const { return text(field(raw_, "signature")); }
+std::string_view TxView::pubkey_b64() const { return text(field(raw_, "pubkey")); }
+SignedTx TxView::decode() const { return tx_from_json(raw_); }
+
+std::optional<BlockView> BlockView::parse(std::string_view raw) {
+    BlockView v;
+    v.raw_ = raw;
+    std::string_view txs;
+    bool ok = members(raw, [&](std::string_view k, std::string_view val){
+        if (k == "header") v.header_ = val;
+        else if (k == "hash") v.hash_ = val;
+        else if (k == "miner_address") v.miner_ = val;
+        else if (k == "reward") v.reward_ = val;
+        else if (k == "txs") txs = val;
+    });
+    if (!ok || v.header_.empty() || v.header_.front() != '{' || txs.empty()) return std::nullopt;
+    Scanner sc{txs};
+    if (!sc.eat('[')) return std::nullopt;
+    if (!sc.eat(']')) {
+        do {
+            std::string_view t;
+            if (!sc.value(t) || t.front() != '{') return std::nullopt;
+            v.txs_.push_back(t);
+        } while (sc.eat(','));
+        if (!sc.eat(']')) return std::nullopt;
+    }
+    return v;
+}
+
+uint64_t BlockView::height() const { return number<uint64_t>(field(header_, "height")); }
+std::string_view BlockView::prev_hash() const { return text(field(header_, "prev_hash")); }
+std::string_view BlockView::merkle_root() const { return text(field(header_, "merkle_root")); }
+std::string_view BlockView::state_root() const { return text(field(header_, "state_root")); }
+uint64_t BlockView::timestamp() const { return number<uint64_t>(field(header_, "timestamp")); }
+uint32_t BlockView::difficulty_bits() const { return number<uint32_t>(field(header_, "difficulty_bits")); }
+uint64_t BlockView::nonce() const { return number<uint64_t>(field(header_, "nonce")); }
+std::string_view BlockView::hash() const { return text(hash_); }
+std::string_view BlockView::miner_address() const { return text(miner_); }
+int64_t BlockView::reward() const { return number<int64_t>(reward_); }
+Block BlockView::decode() const { return block_from_json(raw_); }
+
+}
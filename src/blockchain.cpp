@@ -1,30 +1,120 @@
 #include "blockchain.hpp"
+#include "block_view.hpp"
 #include "encoding.hpp"
 #include "crypto.hpp"
 #include "block.hpp"
 #include "ledger.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <nlohmann/json.hpp>
 #include <fstream>
 #include <filesystem>
 #include <chrono>
 #include <cmath>
+#include <iostream>
 
 namespace fs = std::filesystem;
 
 namespace axle {
 
+static Counter& m_accepted = metrics().counter("axle_blocks_accepted_total", "Blocks appended to the main chain");
+static Counter& m_rejected = metrics().counter("axle_blocks_rejected_total", "Blocks that failed acceptance checks");
+static Counter& m_confirmed = metrics().counter("axle_txs_confirmed_total", "Transactions included in accepted blocks");
+static Histogram& m_accept = metrics().histogram("axle_accept_block_seconds", "Wall time of Blockchain::accept_block for accepted blocks");
+static Gauge& m_height = metrics().gauge("axle_tip_height", "Height of the current tip");
+static Gauge& m_bits = metrics().gauge("axle_difficulty_bits", "Leading zero bits required for the next block");
+static Counter& m_pruned = metrics().counter("axle_pruned_blocks_total", "Block bodies deleted by pruning");
+static Gauge& m_pruned_below = metrics().gauge("axle_pruned_below_height", "Lowest height whose block body is still stored");
+static Gauge& m_side = metrics().gauge("axle_side_blocks", "Known blocks not on the main chain");
+static Counter& m_reorgs = metrics().counter("axle_reorgs_total", "Switches to a branch with more cumulative work");
+static Histogram& m_reorg_depth = metrics().histogram("axle_reorg_depth_blocks", "Blocks disconnected per reorg", "",
+                                                      {1, 2, 3, 5, 10, 20, 50, 100});
+static Histogram& m_state_root = metrics().histogram("axle_state_root_seconds", "Wall time to update and rehash the state tree for one block");
+static Counter& m_state_hashes = metrics().counter("axle_state_root_hashes_total", "State tree node hashes computed");
+static Gauge& m_state_entries = metrics().gauge("axle_state_tree_entries", "Entries committed to by the state root");
+static Histogram& m_reorg_seconds = metrics().histogram("axle_reorg_seconds", "Wall time of a reorg");
+
+ChainParams chain_params_for(const std::string& network) {
+    ChainParams p;
+    p.network = network;
+    if (network == "regtest") {
+        p.network_id = 0xA117F;
+        p.initial_difficulty_bits = 0;
+        p.fixed_difficulty = true;
+    }
+    return p;
+}
+
 Blockchain::Blockchain(Storage& s, ChainParams p)
-: storage_(s), params_(p) {}
+: storage_(s), params_(p), difficulty_bits_(p.initial_difficulty_bits) {}
+
+std::optional<PruneConfig> parse_prune(const std::string& s) {
+    size_t used = 0;
+    uint64_t n = 0;
+    try { n = std::stoull(s, &used); } catch (...) { return std::nullopt; }
+    auto unit = s.substr(used);
+    if (unit.empty()) return PruneConfig{n, 0};
+    if (unit == "MB" || unit == "M") return PruneConfig{0, n * 1024 * 1024};
+    return std::nullopt;
+}
+
+// +/- 1 bit depending on how long the previous block took
+uint32_t Blockchain::next_difficulty_bits(uint32_t bits, uint64_t prev_time, uint64_t time) const {
+    if (params_.fixed_difficulty) return bits;
+    uint64_t dt = (prev_time==0) ? params_.target_block_time_sec : (time - prev_time);
+    if (dt < (uint64_t)params_.target_block_time_sec/2 && bits < 31) bits++;
+    else if (dt > (uint64_t)params_.target_block_time_sec*2 && bits > 8) bits--;
+    return bits;
+}
+
+// a reindex builds its account store here and moves it over accounts.dat once it succeeds
+static const char* REPLAY_ACCOUNT_STORE = "accounts.reindex.dat";
+static const char* STATE_TREE = "state_tree.dat";
+static const char* REPLAY_STATE_TREE = "state_tree.reindex.dat";
+// entries handed to the tree at a time when it is rebuilt from the account store
+constexpr size_t REBUILD_BATCH = 1 << 20;
+
+// fresh ledger: the whole supply starts in the unclaimed pool
+void Blockchain::reset_state(bool replay) {
+    state_ = LedgerState{};
+    state_.unclaimed_pool = params_.supply_cap;
+    if (state_cache_)
+        if (auto store = storage_.open_account_store(true, replay ? REPLAY_ACCOUNT_STORE : "accounts.dat"))
+            state_.accounts.attach(std::move(store), state_cache_);
+}
+
+// state.json, and the account store and state tree stamped with the tip they now match; false
+// if either file could not be written
+bool Blockchain::persist_state() {
+    state_.accounts.set_tip(tip_height_, tip_hash_);
+    ChainTip at{tip_height_, tip_hash_};
+    if (!storage_.save_state(state_, &at)) return false;
+    tree_.set_tip(tip_height_, tip_hash_);
+    return true;
+}
+
+// Reads every account the block's txs and reward touch into the cache in one batch, so
+// execution (several threads, read-only) does not go to the store.
+void Blockchain::prefetch_accounts(const Block& b) {
+    if (!state_.accounts.tiered()) return;
+    std::vector<std::string> addrs;
+    addrs.reserve(2 * b.txs.size() + 1);
+    for (auto& tx : b.txs) {
+        addrs.push_back(tx.from);
+        if (!tx.to.empty()) addrs.push_back(tx.to);
+    }
+    addrs.push_back(b.miner_address);
+    state_.accounts.prefetch(addrs);
+}
 
 bool Blockchain::init_genesis() {
+    MemScope mem(MemTag::State);
     storage_.ensure_layout(params_);
-    // genesis only if no blocks
-    if (storage_.read_block(0).has_value()) return true;
-    // ledger state already initialized with full pool
-    storage_.save_state(LedgerState{}); // reset file first
-    LedgerState st;
-    storage_.load_state(st);
-    state_ = st;
+    // genesis only if no chain yet (its body may have been pruned since)
+    if (storage_.read_tip().has_value()) return true;
+    reset_state();
+    rebuild_state_tree();
     Block genesis;
     genesis.header.height = 0;
     genesis.header.prev_hash = "";
@@ -32,48 +122,270 @@ bool Blockchain::init_genesis() {
     genesis.header.difficulty_bits = difficulty_bits_;
     genesis.header.nonce = 0;
     genesis.header.merkle_root = "";
+    genesis.header.state_root = state_root();
     genesis.reward = 0;
     genesis.miner_address = "";
     genesis.hash = block_hash(genesis.header);
     storage_.write_block(genesis);
+    headers_.clear();
+    headers_.push(HeaderRecord::from(genesis.header, genesis.hash));
+    storage_.write_header(*headers_.at(0));
+    UndoRecord undo;
+    undo.hash = genesis.hash;
+    undo.difficulty_bits = difficulty_bits_;
+    undo.next_token_id = state_.next_token_id;
+    storage_.write_undo(0, undo);
     tip_height_ = 0;
     tip_hash_ = genesis.hash;
-    storage_.write_tip(tip_height_, tip_hash_);
-    storage_.save_state(state_);
+    tip_work_ = 0;
+    pruned_below_ = 0;
+    if (!persist_state()) return false;
+    write_tip();
     last_block_time_ = genesis.header.timestamp;
     return true;
 }
 
 bool Blockchain::load() {
+    MemScope mem(MemTag::State);
     storage_.ensure_layout(params_);
-    storage_.load_state(state_);
+    ChainTip at; // the block state.json was written at
+    storage_.load_state(state_, &at);
     auto tip = storage_.read_tip();
+    if (tip && at.hash.empty()) at = *tip; // written before state.json recorded it
+    if (state_cache_ && !state_.accounts.tiered() && tip) {
+        // accounts so far listed in state.json: move them into accounts.dat
+        auto store = storage_.open_account_store(true);
+        if (!store) return false;
+        state_.accounts.attach(std::move(store), state_cache_);
+        state_.accounts.set_tip(at.height, at.hash);
+        if (!storage_.save_state(state_, &at)) return false;
+        state_.accounts.trim();
+        std::cerr << "[CHAIN] moved " << state_.accounts.size() << " accounts to accounts.dat" << std::endl;
+    } else if (state_cache_) {
+        state_.accounts.set_capacity(state_cache_);
+    }
     if (tip) {
-        tip_height_ = tip->first;
-        tip_hash_ = tip->second;
+        tip_height_ = tip->height;
+        tip_hash_ = tip->hash;
+        tip_work_ = tip->work;
+        pruned_below_ = tip->pruned_below;
     } else {
         return init_genesis();
     }
-    // naive: read latest block for timestamp
-    auto b = storage_.read_block(tip_height_);
-    if (b) last_block_time_ = b->header.timestamp;
+    if (!roll_back_to_tip(at)) return false;
+    // datadirs from before headers.dat: backfill it once from the stored bodies
+    for (uint64_t h = storage_.header_count(); h <= tip_height_; h++) {
+        auto raw = storage_.read_block_bytes(h);
+        auto v = raw ? BlockView::parse(*raw) : std::nullopt;
+        if (!v) break;
+        auto blk = v->decode();
+        storage_.write_header(HeaderRecord::from(blk.header, blk.hash));
+    }
+    if (!headers_.load(storage_, tip_height_) || headers_.at(tip_height_)->hash_hex() != tip_hash_) {
+        std::cerr << "[CHAIN] headers.dat does not lead to the stored tip " << tip_height_
+                  << "; run `axle reindex` to rebuild it" << std::endl;
+        return false;
+    }
+    if (!tip_work_) tip_work_ = headers_.work_at(tip_height_); // older datadirs did not store it
+    // The tip's undo record holds the difficulty state it was mined under; without one (pruned,
+    // or installed from a snapshot) the tip header's bits and its parent's timestamp give the
+    // same answer. No block body is read.
+    auto tip_header = headers_.at(tip_height_);
+    last_block_time_ = tip_header->timestamp;
+    if (auto u = main_undo(tip_height_); u && tip_height_ > 0) {
+        difficulty_bits_ = next_difficulty_bits(u->difficulty_bits, u->last_block_time, last_block_time_);
+    } else if (tip_height_ > 0) {
+        difficulty_bits_ = next_difficulty_bits(tip_header->difficulty_bits, headers_.at(tip_height_ - 1)->timestamp, tip_header->timestamp);
+    }
+    if (prune_.enabled()) {
+        retained_bytes_ = 0;
+        for (uint64_t h = pruned_below_; h <= tip_height_; h++) retained_bytes_ += storage_.block_size(h);
+    }
+    load_side_blocks();
+    if (!reuse_state_tree()) rebuild_state_tree();
+    if (tip_header->header().state_root != state_root()) {
+        std::cerr << "[CHAIN] the stored state does not match the state root of block " << tip_height_
+                  << "; run `axle reindex` to rebuild it" << std::endl;
+        return false;
+    }
+    m_pruned_below.set((int64_t)pruned_below_);
+    m_height.set((int64_t)tip_height_);
+    m_bits.set(difficulty_bits_);
     return true;
 }
 
-static bool hash_meets_bits(const std::string& hexhash, uint32_t bits) {
-    // Check leading zero bits
-    size_t bytes_zero = bits / 8;
-    uint8_t rem = bits % 8;
-    auto h = unhex(hexhash);
-    for (size_t i=0;i<bytes_zero;i++) if (h[i]!=0) return false;
-    if (rem) {
-        uint8_t mask = 0xFF << (8 - rem);
-        if ((h[bytes_zero] & mask) != 0) return false;
+// The state is written before tip.json moves forward and after it moves back, and accounts.dat
+// is flushed before state.json, so a node stopped between the writes finds its accounts and
+// state.json a few blocks ahead of tip.json (not behind). The undo records of those blocks are
+// only deleted once both caught up, so they take the state back to the tip here.
+bool Blockchain::roll_back_to_tip(const ChainTip& at) {
+    ChainTip accounts_at = at;
+    if (auto store = state_.accounts.store()) {
+        auto [height, hash] = store->tip();
+        if (!hash.empty()) accounts_at = {height, hash};
+    }
+    if (accounts_at.height == tip_height_ && accounts_at.hash == tip_hash_ && at.hash == tip_hash_) return true;
+    auto refuse = [&] {
+        std::cerr << "[CHAIN] the stored state (accounts at block " << accounts_at.height << ", state.json at block "
+                  << at.height << ") does not lead back to the tip " << tip_height_
+                  << "; run `axle reindex` to rebuild it" << std::endl;
+        return false;
+    };
+    if (accounts_at.height < at.height || at.height < tip_height_) return refuse();
+    std::string expect = accounts_at.hash;
+    for (uint64_t h = accounts_at.height; h > tip_height_; h--) {
+        if (h == at.height && expect != at.hash) return refuse();
+        auto u = storage_.read_undo(h);
+        if (!u || u->hash != expect) return refuse();
+        if (h > at.height) {
+            // only the accounts got this far
+            UndoRecord accounts;
+            accounts.accounts = std::move(u->accounts);
+            accounts.next_token_id = state_.next_token_id;
+            apply_undo(state_, accounts);
+        } else {
+            apply_undo(state_, *u);
+        }
+        expect = u->prev_hash;
     }
+    if (expect != tip_hash_ || (at.height == tip_height_ && at.hash != tip_hash_)) return refuse();
+    std::cerr << "[CHAIN] rolled the stored state back from block " << accounts_at.height << " to the tip "
+              << tip_height_ << std::endl;
+    return persist_state();
+}
+
+// Rebuilds the side-branch index from blocks/side (parents before children).
+void Blockchain::load_side_blocks() {
+    side_.clear();
+    std::vector<std::pair<uint64_t, SideBlock>> found;
+    std::map<std::string, size_t> by_hash;
+    for (auto& h : storage_.side_block_hashes()) {
+        auto raw = storage_.read_side_block_bytes(h);
+        auto v = raw ? BlockView::parse(*raw) : std::nullopt;
+        if (!v || v->hash() != h) continue;
+        found.push_back({v->difficulty_bits(), SideBlock{v->height(), std::string(v->prev_hash()), 0, v->timestamp(), 0}});
+        by_hash[h] = found.size() - 1;
+    }
+    std::vector<std::string> order;
+    for (auto& [h, i] : by_hash) order.push_back(h);
+    std::sort(order.begin(), order.end(), [&](auto& a, auto& b){ return found[by_hash[a]].second.height < found[by_hash[b]].second.height; });
+    for (auto& h : order) {
+        auto& [bits, sb] = found[by_hash[h]];
+        uint64_t parent_work = 0, parent_time = 0;
+        if (auto it = side_.find(sb.prev_hash); it != side_.end()) {
+            parent_work = it->second.work;
+            parent_time = it->second.time;
+        } else if (auto ph = headers_.height_of(sb.prev_hash); ph && *ph + 1 == sb.height) {
+            parent_work = headers_.work_at(*ph);
+            parent_time = headers_.at(*ph)->timestamp;
+        } else {
+            continue; // parent gone; unreachable branch
+        }
+        sb.work = parent_work + block_work(bits);
+        sb.next_bits = next_difficulty_bits(bits, parent_time, sb.time);
+        side_[h] = sb;
+    }
+    trim_side_blocks();
+}
+
+// Forgets side blocks too far below the tip to be reorganized onto, on disk as well.
+void Blockchain::trim_side_blocks() {
+    for (auto it = side_.begin(); it != side_.end();) {
+        if (it->second.height + MAX_SIDE_DEPTH >= tip_height_) { ++it; continue; }
+        storage_.remove_side_block(it->first);
+        it = side_.erase(it);
+    }
+    m_side.set((int64_t)side_.size());
+}
+
+// Bits a block on top of main-chain height h must declare. Below the tip each header's own
+// bits stand for the difficulty it was mined under, as in load().
+uint32_t Blockchain::main_child_bits(uint64_t h) const {
+    if (h == tip_height_) return difficulty_bits_;
+    auto hd = headers_.at(h);
+    if (h == 0) return hd->difficulty_bits;
+    return next_difficulty_bits(hd->difficulty_bits, headers_.at(h - 1)->timestamp, hd->timestamp);
+}
+
+std::optional<UndoRecord> Blockchain::main_undo(uint64_t height) const {
+    if (height > tip_height_ || height < pruned_below_) return std::nullopt;
+    return storage_.read_undo(height);
+}
+
+// Full build from state_; afterwards blocks only rehash the paths they touch. With tiered
+// accounts the tree goes to state_tree.dat (a scratch file while reindexing) and is fed from
+// the account store in batches, so neither the tree nor its entries have to fit in memory.
+void Blockchain::rebuild_state_tree(bool replay) {
+    AXLE_TRACE_SCOPE("rebuild_state_tree");
+    tree_ = StateTree{};
+    if (state_.accounts.tiered()) {
+        std::string err;
+        if (!tree_.open((fs::path(storage_.datadir()) / (replay ? REPLAY_STATE_TREE : STATE_TREE)).string(), true, err))
+            std::cerr << "[STATE] " << err << "; keeping the state tree in memory" << std::endl;
+    }
+    StateChanges batch;
+    auto add = [&](const Hash256& key, const Hash256& value) {
+        batch.push_back({key, value});
+        if (batch.size() >= REBUILD_BATCH) tree_.apply(std::exchange(batch, {}));
+    };
+    state_.accounts.for_each([&](const std::string& addr, const AccountState& a) { add(account_key(addr), account_value(a)); });
+    for (auto& [id, e] : state_.nfts) add(nft_key(id), nft_value(e));
+    add(pool_key(), pool_value(state_.unclaimed_pool, state_.next_token_id));
+    tree_.apply(std::move(batch));
+    tree_.root(exec_threads_);
+    m_state_hashes.inc(tree_.last_hashes());
+    m_state_entries.set((int64_t)tree_.size());
+}
+
+// Opens the state_tree.dat left by the last run if it was stamped at the tip, so a start only
+// rehashes what was left dirty instead of the whole tree. load() still checks the root against
+// the tip's header.
+bool Blockchain::reuse_state_tree() {
+    if (!state_.accounts.tiered()) return false;
+    auto path = fs::path(storage_.datadir()) / STATE_TREE;
+    std::error_code ec;
+    if (!fs::exists(path, ec)) return false;
+    StateTree stored;
+    std::string err;
+    if (!stored.open(path.string(), false, err)) {
+        std::cerr << "[STATE] " << err << "; rebuilding it" << std::endl;
+        return false;
+    }
+    auto at = stored.tip();
+    if (!at || at->first != tip_height_ || at->second != tip_hash_) return false;
+    if (hex(stored.root(exec_threads_)) != headers_.at(tip_height_)->header().state_root) return false;
+    tree_ = std::move(stored);
+    m_state_hashes.inc(tree_.last_hashes());
+    m_state_entries.set((int64_t)tree_.size());
     return true;
 }
 
+void Blockchain::write_tip() const {
+    storage_.write_tip({tip_height_, tip_hash_, tip_work_, pruned_below_});
+}
+
+// Drops the oldest bodies and undo records until the retention target is met. Blocks below
+// the horizon can no longer be served or reorganized away.
+void Blockchain::prune() {
+    if (!prune_.enabled()) return;
+    uint64_t keep = std::max(prune_.keep_blocks, MIN_PRUNE_KEEP);
+    uint64_t removed = 0;
+    while (pruned_below_ + keep <= tip_height_) {
+        if (!prune_.keep_blocks && retained_bytes_ <= prune_.target_bytes) break;
+        retained_bytes_ -= std::min(retained_bytes_, storage_.block_size(pruned_below_));
+        storage_.remove_block(pruned_below_);
+        storage_.remove_undo(pruned_below_);
+        pruned_below_++;
+        removed++;
+    }
+    if (!removed) return;
+    m_pruned.inc(removed);
+    m_pruned_below.set((int64_t)pruned_below_);
+    write_tip();
+}
+
 Block Blockchain::build_block(const std::string& miner_addr, const std::vector<SignedTx>& txs) {
+    AXLE_TRACE_SCOPE("build_block");
     Block b;
     b.header.height = tip_height_ + 1;
     b.header.prev_hash = tip_hash_;
@@ -90,33 +402,362 @@ Block Blockchain::build_block(const std::string& miner_addr, const std::vector<S
     int64_t reward = state_.unclaimed_pool / remaining_blocks;
     if (reward < 0) reward = 0;
     b.reward = reward;
+    // commit to the state the block produces; the tree is put back right after. Signatures
+    // are left to accept_block: a bad one makes the block invalid whatever its root.
+    StateDelta delta;
+    prefetch_accounts(b);
+    if (execute_block(state_, params_, b, delta, exec_threads_, nullptr, false).ok) {
+        auto stamp = tree_.tip();
+        auto inverse = tree_.apply(state_changes(state_, delta));
+        b.header.state_root = state_root();
+        tree_.apply(std::move(inverse));
+        if (stamp) tree_.set_tip(stamp->first, stamp->second); // back to the tree it was stamped with
+    }
     return b;
 }
 
 bool Blockchain::accept_block(const Block& b) {
-    // Basic checks
-    if (b.header.height != tip_height_ + 1) return false;
-    if (b.header.prev_hash != tip_hash_) return false;
-    if (!hash_meets_bits(b.hash, b.header.difficulty_bits)) return false;
-    // validate txs and reward
-    auto vr = validate_block(state_, params_, b);
+    AXLE_TRACE_SCOPE("accept_block");
+    MemScope mem(MemTag::State); // execution and storage charge their own scratch
+    // Basic checks: the hash commits to the header, which commits to the txs, and meets its bits
+    if (b.header.difficulty_bits > MAX_DIFFICULTY_BITS || b.hash != block_hash(b.header) ||
+        !hash_meets_bits(b.hash, b.header.difficulty_bits) || b.header.merkle_root != merkle_root(b.txs) ||
+        !verify_address(b.miner_address)) {
+        m_rejected.inc();
+        return false;
+    }
+    uint64_t work = block_work(b.header.difficulty_bits);
+    if (b.header.height == tip_height_ + 1 && b.header.prev_hash == tip_hash_) {
+        if (b.header.difficulty_bits != difficulty_bits_ || !connect_block(b, tip_work_ + work)) { m_rejected.inc(); return false; }
+        return true;
+    }
+
+    // Otherwise it must extend a known side block or a main-chain block below the tip, not too
+    // far down, with the difficulty that parent implies.
+    if (side_.count(b.hash) || b.hash == tip_hash_) return false;
+    uint64_t parent_work = 0, parent_time = 0;
+    uint32_t bits = 0;
+    if (auto it = side_.find(b.header.prev_hash); it != side_.end() && it->second.height + 1 == b.header.height) {
+        parent_work = it->second.work;
+        parent_time = it->second.time;
+        bits = it->second.next_bits;
+    } else if (auto ph = headers_.height_of(b.header.prev_hash); ph && *ph + 1 == b.header.height) {
+        if (headers_.height_of(b.hash)) return false; // already on the main chain
+        parent_work = headers_.work_at(*ph);
+        parent_time = headers_.at(*ph)->timestamp;
+        bits = main_child_bits(*ph);
+    } else {
+        m_rejected.inc();
+        return false;
+    }
+    if (b.header.difficulty_bits != bits || b.header.height + MAX_SIDE_DEPTH < tip_height_) {
+        m_rejected.inc();
+        return false;
+    }
+    if (side_.size() >= MAX_SIDE_BLOCKS) trim_side_blocks();
+    if (side_.size() >= MAX_SIDE_BLOCKS) {
+        std::cerr << "[CHAIN] side block " << b.hash << " dropped: " << MAX_SIDE_BLOCKS << " already kept" << std::endl;
+        m_rejected.inc();
+        return false;
+    }
+    // Side blocks are only checked for proof of work here; their transactions are executed if
+    // and when the branch becomes the main chain.
+    storage_.write_side_block(b.hash, to_json(b));
+    side_[b.hash] = {b.header.height, b.header.prev_hash, parent_work + work, b.header.timestamp,
+                     next_difficulty_bits(bits, parent_time, b.header.timestamp)};
+    m_side.set((int64_t)side_.size());
+    if (parent_work + work <= tip_work_) return true;
+    return reorganize(b.hash);
+}
+
+// Executes b on top of the tip and makes it the new tip, writing its undo record.
+bool Blockchain::connect_block(const Block& b, uint64_t work, bool save_state, bool replay) {
+    using us = std::chrono::duration<double, std::micro>;
+    auto t0 = std::chrono::steady_clock::now();
+    // validate txs and reward once; the resulting delta is what gets applied
+    StateDelta delta;
+    prefetch_accounts(b);
+    auto vr = execute_block(state_, params_, b, delta, exec_threads_, &last_exec_, !replay);
     if (!vr.ok) return false;
+    auto t1 = std::chrono::steady_clock::now();
+
+    // the header must commit to the resulting state
+    auto stamp = tree_.tip();
+    auto inverse = tree_.apply(state_changes(state_, delta));
+    auto root = state_root();
+    m_state_hashes.inc(tree_.last_hashes());
+    m_state_root.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count());
+    if (root != b.header.state_root) {
+        tree_.apply(std::move(inverse));
+        if (stamp) tree_.set_tip(stamp->first, stamp->second);
+        std::cerr << "[CHAIN] block " << b.header.height << " rejected: state root " << b.header.state_root
+                  << " != computed " << root << std::endl;
+        return false;
+    }
+    m_state_entries.set((int64_t)tree_.size());
 
     // apply
-    apply_block(state_, params_, b);
+    UndoRecord undo = make_undo(state_, delta);
+    undo.hash = b.hash;
+    undo.prev_hash = b.header.prev_hash;
+    undo.work = work;
+    undo.difficulty_bits = difficulty_bits_;
+    undo.last_block_time = last_block_time_;
+    commit_delta(state_, delta);
+    uint64_t parent_work = tip_work_;
     tip_height_ = b.header.height;
     tip_hash_ = b.hash;
-    storage_.write_block(b);
-    storage_.write_tip(tip_height_, tip_hash_);
-    storage_.save_state(state_);
+    tip_work_ = work;
+    auto t2 = std::chrono::steady_clock::now();
+    auto record = HeaderRecord::from(b.header, b.hash);
+    headers_.push(record);
+    if (!replay) storage_.write_block(b);
+    storage_.write_header(record);
+    storage_.write_undo(tip_height_, undo);
+    // state.json first: tip.json only moves once the state it implies is on disk
+    if (save_state && !persist_state()) {
+        std::cerr << "[CHAIN] block " << tip_height_ << " not connected: cannot write its state" << std::endl;
+        apply_undo(state_, undo);
+        tree_.apply(std::move(inverse));
+        if (stamp) tree_.set_tip(stamp->first, stamp->second);
+        headers_.truncate(tip_height_);
+        if (!replay) storage_.remove_block(tip_height_);
+        storage_.remove_undo(tip_height_);
+        tip_height_ = b.header.height - 1;
+        tip_hash_ = undo.prev_hash;
+        tip_work_ = parent_work;
+        return false;
+    }
+    if (save_state) write_tip(); // a reorg or replay moves tip.json once it is done
+    if (prune_.enabled()) retained_bytes_ += storage_.block_size(tip_height_);
+    if (save_state) prune();
+    state_.accounts.trim(replay);
+    auto t3 = std::chrono::steady_clock::now();
+    last_timings_ = {us(t1 - t0).count(), us(t2 - t1).count(), us(t3 - t2).count()};
+    m_accepted.inc();
+    m_confirmed.inc(b.txs.size());
+    m_accept.observe(std::chrono::duration<double>(t3 - t0).count());
+    m_height.set((int64_t)tip_height_);
 
-    // adjust difficulty +/- 1 bit based on timing
-    uint64_t now = b.header.timestamp;
-    uint64_t dt = (last_block_time_==0) ? params_.target_block_time_sec : (now - last_block_time_);
-    last_block_time_ = now;
-    if (dt < (uint64_t)params_.target_block_time_sec/2 && difficulty_bits_ < 31) difficulty_bits_++;
-    else if (dt > (uint64_t)params_.target_block_time_sec*2 && difficulty_bits_ > 8) difficulty_bits_--;
+    difficulty_bits_ = next_difficulty_bits(difficulty_bits_, last_block_time_, b.header.timestamp);
+    last_block_time_ = b.header.timestamp;
+    m_bits.set(difficulty_bits_);
+    return true;
+}
+
+bool Blockchain::begin_replay(const Block& genesis) {
+    MemScope mem(MemTag::State);
+    if (genesis.header.height != 0 || genesis.hash != block_hash(genesis.header)) return false;
+    reset_state(true);
+    rebuild_state_tree(true);
+    if (state_root() != genesis.header.state_root) return false;
+    side_.clear();
+    tip_height_ = 0;
+    tip_hash_ = genesis.hash;
+    tip_work_ = 0;
+    pruned_below_ = 0;
+    retained_bytes_ = 0;
+    difficulty_bits_ = genesis.header.difficulty_bits;
+    last_block_time_ = genesis.header.timestamp;
+    headers_.clear();
+    headers_.push(HeaderRecord::from(genesis.header, genesis.hash));
+    storage_.write_header(*headers_.at(0));
+    UndoRecord undo;
+    undo.hash = genesis.hash;
+    undo.difficulty_bits = difficulty_bits_;
+    undo.next_token_id = state_.next_token_id;
+    storage_.write_undo(0, undo);
+    return true;
+}
+
+bool Blockchain::replay_block(const Block& b) {
+    MemScope mem(MemTag::State);
+    if (b.header.height != tip_height_ + 1 || b.header.prev_hash != tip_hash_ ||
+        b.header.difficulty_bits != difficulty_bits_) return false;
+    return connect_block(b, tip_work_ + block_work(b.header.difficulty_bits), false, true);
+}
 
+bool Blockchain::end_replay() {
+    if (auto store = state_.accounts.store()) {
+        state_.accounts.set_tip(tip_height_, tip_hash_);
+        if (!state_.accounts.flush() || !store->sync() ||
+            !store->move_to((fs::path(storage_.datadir()) / "accounts.dat").string())) {
+            std::cerr << "[CHAIN] cannot move " << store->path() << " over accounts.dat" << std::endl;
+            return false;
+        }
+    }
+    if (tree_.file_backed() && (!tree_.sync() || !tree_.move_to((fs::path(storage_.datadir()) / STATE_TREE).string()))) {
+        std::cerr << "[CHAIN] cannot move " << tree_.path() << " over " << STATE_TREE << std::endl;
+        return false;
+    }
+    if (!persist_state()) return false;
+    write_tip();
+    m_height.set((int64_t)tip_height_);
+    m_bits.set(difficulty_bits_);
+    return true;
+}
+
+void Blockchain::abort_replay() {
+    if (auto store = state_.accounts.store(); store && fs::path(store->path()).filename() == REPLAY_ACCOUNT_STORE) {
+        std::error_code ec;
+        fs::remove(store->path(), ec);
+    }
+    state_.accounts.clear();
+    if (tree_.file_backed() && fs::path(tree_.path()).filename() == REPLAY_STATE_TREE) {
+        std::error_code ec;
+        fs::remove(tree_.path(), ec);
+    }
+    tree_ = StateTree{};
+}
+
+// Rolls the tip back in memory with its undo record and copies the block to the side store.
+// Its body and undo record stay on disk until reorganize has written the state below it.
+bool Blockchain::disconnect_tip() {
+    if (tip_height_ == 0) return false;
+    auto u = main_undo(tip_height_);
+    if (!u || u->hash != tip_hash_) return false;
+    auto raw = storage_.read_block_bytes(tip_height_);
+    auto v = raw ? BlockView::parse(*raw) : std::nullopt;
+    if (v) {
+        storage_.write_side_block(tip_hash_, *raw);
+        side_[tip_hash_] = {tip_height_, u->prev_hash, u->work, headers_.at(tip_height_)->timestamp, difficulty_bits_};
+        if (prune_.enabled()) retained_bytes_ -= std::min(retained_bytes_, (uint64_t)raw->size());
+    }
+    apply_undo(state_, *u);
+    tree_.apply(state_changes(state_, *u));
+    tip_work_ = u->work - (v ? block_work(v->difficulty_bits()) : 0);
+    tip_height_--;
+    headers_.truncate(tip_height_ + 1);
+    tip_hash_ = u->prev_hash;
+    difficulty_bits_ = u->difficulty_bits;
+    last_block_time_ = u->last_block_time;
+    if (!v) { // body gone: recover the parent's work from its own record
+        auto pu = main_undo(tip_height_);
+        if (pu) tip_work_ = pu->work;
+    }
+    return true;
+}
+
+// Deletes the bodies and undo records of main-chain heights in (tip, to], once the state and
+// tip.json no longer need them.
+void Blockchain::remove_above_tip(uint64_t to) {
+    for (uint64_t h = tip_height_ + 1; h <= to; h++) {
+        storage_.remove_block(h);
+        storage_.remove_undo(h);
+    }
+}
+
+// Switches the main chain to the branch ending at new_tip (a side block). Only the blocks
+// between the fork point and the two tips are touched. If a block on the new branch turns
+// out to be invalid, it and its descendants are dropped and the old branch is restored.
+bool Blockchain::reorganize(const std::string& new_tip) {
+    AXLE_TRACE_SCOPE("reorganize");
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> branch; // new tip first
+    std::string h = new_tip;
+    for (auto it = side_.find(h); it != side_.end(); it = side_.find(h)) {
+        branch.push_back(h);
+        h = it->second.prev_hash;
+    }
+    uint64_t fork = side_.at(branch.back()).height - 1;
+    auto fu = main_undo(fork);
+    if (!fu || fu->hash != h) return false;
+
+    // a side block that cannot be read or parsed is as good as invalid
+    auto side_block = [&](const std::string& hash) -> std::optional<Block> {
+        auto raw = storage_.read_side_block_bytes(hash);
+        if (!raw) return std::nullopt;
+        try { return block_from_json(*raw); } catch (std::exception&) { return std::nullopt; }
+    };
+    auto connect_from_side = [&](const std::string& hash) {
+        auto it = side_.find(hash);
+        auto blk = it == side_.end() ? std::nullopt : side_block(hash);
+        if (!blk || !connect_block(*blk, it->second.work, false)) return false;
+        side_.erase(hash);
+        storage_.remove_side_block(hash);
+        return true;
+    };
+    std::vector<std::string> old; // old main-chain blocks, tip first
+    // Puts the first n of them back on top of the tip, lowest first. False if one cannot be,
+    // which leaves the chain on a shorter prefix of the old branch.
+    auto restore_old = [&](size_t n) {
+        for (size_t i = n; i-- > 0;) {
+            if (connect_from_side(old[i])) continue;
+            std::cerr << "[CHAIN] reorg: cannot restore block " << old[i] << " of the old branch; staying at height "
+                      << tip_height_ << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    // Nothing on disk moves until the old branch is off: then tip.json goes back to the fork
+    // before the state does, so a stop in between leaves the state ahead of the tip with the
+    // undo records load() needs to roll it back. The new branch is written the other way round.
+    uint64_t old_height = tip_height_;
+    while (tip_height_ > fork) {
+        std::string hash = tip_hash_;
+        if (!disconnect_tip()) {
+            std::cerr << "[CHAIN] reorg: cannot disconnect block " << tip_height_ << " (undo record missing)" << std::endl;
+            if (!restore_old(old.size())) {
+                // the disk is still at the old tip; bring it down to where the chain is
+                write_tip();
+                persist_state();
+                remove_above_tip(old_height);
+            }
+            return false;
+        }
+        old.push_back(hash);
+    }
+    write_tip();
+    if (!persist_state()) {
+        std::cerr << "[CHAIN] reorg: cannot write the state at the fork " << fork << "; keeping the old branch" << std::endl;
+        restore_old(old.size());
+        write_tip();
+        return false;
+    }
+    remove_above_tip(old_height);
+
+    uint64_t connected = 0;
+    for (auto it = branch.rbegin(); it != branch.rend(); ++it) {
+        if (connect_from_side(*it)) { connected++; continue; }
+        std::cerr << "[CHAIN] reorg: block " << *it << " is invalid, keeping the old branch" << std::endl;
+        for (auto bad = it; bad != branch.rend(); ++bad) {
+            side_.erase(*bad);
+            storage_.remove_side_block(*bad);
+        }
+        // back to the fork and onto the old branch, as far as that goes; the disk is at the fork
+        uint64_t high = tip_height_;
+        bool restored = true;
+        while (restored && tip_height_ > fork) {
+            restored = disconnect_tip();
+            if (!restored) std::cerr << "[CHAIN] reorg: cannot disconnect block " << tip_height_ << "; staying there" << std::endl;
+        }
+        if (restored) restored = restore_old(old.size());
+        if (persist_state()) write_tip();
+        remove_above_tip(high);
+        m_rejected.inc();
+        m_side.set((int64_t)side_.size());
+        return false;
+    }
+    if (!persist_state()) {
+        // tip.json stays at the fork; the next block that persists writes all of this
+        std::cerr << "[CHAIN] reorg: cannot write the state at " << tip_height_ << std::endl;
+        return false;
+    }
+    write_tip();
+    prune();
+    reorged_txs_.clear();
+    for (auto it = old.rbegin(); it != old.rend(); ++it)
+        if (auto blk = side_block(*it)) reorged_txs_.insert(reorged_txs_.end(), blk->txs.begin(), blk->txs.end());
+    trim_side_blocks();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    last_reorg_ = {old.size(), connected, secs};
+    m_reorgs.inc();
+    m_reorg_depth.observe((double)old.size());
+    m_reorg_seconds.observe(secs);
+    m_side.set((int64_t)side_.size());
+    std::cerr << "[CHAIN] reorg to " << tip_hash_ << " at height " << tip_height_ << ": depth " << old.size()
+              << ", connected " << connected << " in " << secs * 1000 << " ms" << std::endl;
     return true;
 }
 
@@ -7,11 +7,22 @@
 #include "tx.hpp"
 #include "p2p.hpp"
 #include "rpc.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "snapshot.hpp"
+#include "mempool.hpp"
+#include "work_server.hpp"
+#include "send_batch.hpp"
+#include "reindex.hpp"
 #include <nlohmann/json.hpp>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <sstream>
+#include <csignal>
+#include <ctime>
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
@@ -20,15 +31,32 @@ namespace axle {
 
 static void usage() {
     std::cout << "Axle Chain CLI\n"
-              << "  init --datadir DIR [--network mainnet]\n"
-              << "  start --datadir DIR [--p2p HOST:PORT] [--rpc HOST:PORT] [--bootstrap HOST:PORT]\n"
+              << "  init --datadir DIR [--network mainnet|regtest]\n"
+              << "  start --datadir DIR [--p2p HOST:PORT] [--rpc HOST:PORT] [--bootstrap HOST:PORT] [--metrics HOST:PORT|off] [--trace] [--exec-threads N]\n"
+              << "        [--prune BLOCKS|<N>MB] [--snapshot-interval N] [--work HOST:PORT]\n"
+              << "        [--rpc-cache-mb N]  (get_block response cache, default 64; 0 disables)\n"
+              << "        [--mem-budget SUBSYSTEM=SIZE[,...]]  (e.g. mempool=256MB,p2p=64MB; SIGUSR1 prints memory use)\n"
+              << "        [--state-cache N]  (keep accounts in accounts.dat, caching up to N in memory)\n"
+              << "        [--mine [--threads N]]  (mine on N threads inside the node, paying the default key)\n"
+              << "  mine-worker --connect HOST:PORT [--threads N]  (hash work served by a node's --work port)\n"
+              << "  (any command) [--block-codec json|columnar]  (format for newly written block bodies)\n"
+              << "  snapshot --datadir DIR                  (export a state snapshot at the tip)\n"
+              << "  reindex --datadir DIR [--threads N] [--exec-threads N] [--state-cache N]  (rebuild state from stored blocks; node stopped)\n"
+              << "  sync-snapshot --datadir DIR --peers HOST:PORT[,HOST:PORT...] --manifest-hash HEX [--threads N]\n"
               << "  create-address --datadir DIR --name NAME\n"
               << "  send --datadir DIR --from NAME --to ADDR --amount N.NNNNNNNN\n"
+              << "  send-batch --datadir DIR --from NAME --file PAYMENTS.csv|.jsonl [--rpc HOST:PORT] [--threads N] [--batch N]\n"
+              << "        (signs one transfer per row and submits them to a running node)\n"
               << "  mine --datadir DIR\n"
               << "  mint-nft --datadir DIR --from NAME --name NAME --symbol SYM --uri URI\n"
               << std::endl;
 }
 
+static std::atomic<bool> g_dump_trace{false};
+static void on_dump_trace_signal(int) { g_dump_trace = true; }
+static std::atomic<bool> g_dump_memory{false};
+static void on_dump_memory_signal(int) { g_dump_memory = true; }
+
 static std::string join(const std::string& a, const std::string& b) {
     return (fs::path(a)/b).string();
 }
@@ -65,6 +93,18 @@ int run_cli(int argc, char** argv) {
     std::string p2p = "0.0.0.0:9735";
     std::string rpc = "127.0.0.1:9736";
     std::string bootstrap = "";
+    std::string metrics_listen = "127.0.0.1:9737";
+    unsigned exec_threads = 0;
+    std::string prune;
+    std::string mem_budget;
+    int64_t rpc_cache_mb = -1;
+    size_t state_cache = 0;
+    std::string block_codec = "json";
+    uint64_t snapshot_interval = 0;
+    std::string peers, manifest_hash;
+    std::string work_listen, connect;
+    unsigned threads = 4;
+    bool mine = false;
 
     // simple arg parse
     for (int i=2;i<argc;i++) {
@@ -75,16 +115,35 @@ int run_cli(int argc, char** argv) {
         else if (a=="--p2p") p2p = val();
         else if (a=="--rpc") rpc = val();
         else if (a=="--bootstrap") bootstrap = val();
+        else if (a=="--metrics") metrics_listen = val();
+        else if (a=="--trace") set_tracing(true);
+        else if (a=="--exec-threads") exec_threads = (unsigned)std::stoul(val());
+        else if (a=="--prune") prune = val();
+        else if (a=="--mem-budget") mem_budget = val();
+        else if (a=="--rpc-cache-mb") rpc_cache_mb = std::stoll(val());
+        else if (a=="--state-cache") state_cache = std::stoull(val());
+        else if (a.rfind("--prune=", 0) == 0) prune = a.substr(8);
+        else if (a=="--block-codec") block_codec = val();
+        else if (a=="--snapshot-interval") snapshot_interval = std::stoull(val());
+        else if (a=="--work") work_listen = val();
+        else if (a=="--connect") connect = val();
+        else if (a=="--peers") peers = val();
+        else if (a=="--manifest-hash") manifest_hash = val();
+        else if (a=="--threads") threads = (unsigned)std::stoul(val());
+        else if (a=="--mine") mine = true;
         else if (a=="--help") { usage(); return 0; }
     }
 
-    ChainParams params; params.network = network;
+    ChainParams params = chain_params_for(network);
+    auto codec = parse_block_codec(block_codec);
+    if (!codec) { std::cerr << "--block-codec expects json or columnar\n"; return 1; }
 
     if (cmd=="init") {
         Storage st(datadir);
+        st.set_block_codec(*codec);
         st.ensure_layout(params);
         Blockchain chain(st, params);
-        chain.init_genesis();
+        if (!chain.init_genesis()) { std::cerr << "cannot write the genesis state in " << datadir << "\n"; return 1; }
         fs::create_directories(fs::path(datadir)/"keys");
         auto kp = keygen();
         save_keys(datadir, "default", kp.priv, kp.pub);
@@ -98,10 +157,22 @@ int run_cli(int argc, char** argv) {
         save_keys(datadir, name, kp.priv, kp.pub);
         return 0;
     } else if (cmd=="start") {
+        std::string err;
+        if (!parse_memory_budgets(mem_budget, err)) { std::cerr << "--mem-budget: " << err << "\n"; return 1; }
         Storage st(datadir);
+        st.set_block_codec(*codec);
         Blockchain chain(st, params);
-        chain.load();
+        if (exec_threads) chain.set_exec_threads(exec_threads);
+        chain.set_state_cache(state_cache);
+        if (!prune.empty()) {
+            auto pc = parse_prune(prune);
+            if (!pc) { std::cerr << "--prune expects a block count or a size like 550MB\n"; return 1; }
+            chain.set_prune(*pc);
+        }
+        if (!chain.load()) { std::cerr << "cannot load the chain in " << datadir << "\n"; return 1; }
+        Mempool mempool;
         P2PNode p2pnode(chain);
+        p2pnode.set_mempool(&mempool);
         // parse host:port
         auto split = [](const std::string& hp){ auto pos=hp.find(':'); return std::make_pair(hp.substr(0,pos), (uint16_t)std::stoi(hp.substr(pos+1))); };
         auto [host,port] = split(p2p);
@@ -111,11 +182,141 @@ int run_cli(int argc, char** argv) {
             p2pnode.add_peer(bh,bp);
         }
         RpcServer rpcserver(chain);
+        rpcserver.set_mempool(&mempool);
+        rpcserver.set_peer_manager(&p2pnode.peers());
+        size_t rpc_cache = rpc_cache_mb >= 0 ? (size_t)rpc_cache_mb << 20 : rpcserver.cache().max_bytes();
+        // the cache is charged to the RPC budget, so it gets at most half of it
+        if (int64_t budget = memory_budget(MemTag::RPC); budget > 0) rpc_cache = std::min(rpc_cache, (size_t)budget / 2);
+        rpcserver.cache().set_max_bytes(rpc_cache);
+        rpcserver.on_tx([&](const SignedTx& tx){ p2pnode.announce_tx(tx.id); });
         auto [rh,rp] = split(rpc);
         rpcserver.start(rh,rp);
+        std::unique_ptr<WorkServer> work;
+        if (!work_listen.empty()) {
+            bytes priv,pub; std::string addr;
+            if (!load_keys(datadir, "default", priv, pub, addr)) { std::cerr << "--work needs a default key to pay\n"; return 1; }
+            work = std::make_unique<WorkServer>(chain, &mempool, addr);
+            work->on_block([&](const Block& b){ p2pnode.broadcast_block(b); });
+            auto [wh,wp] = split(work_listen);
+            if (!work->start(wh,wp)) return 1;
+        }
+        std::unique_ptr<NodeMiner> miner;
+        if (mine) {
+            bytes priv,pub; std::string addr;
+            if (!load_keys(datadir, "default", priv, pub, addr)) { std::cerr << "--mine needs a default key to pay\n"; return 1; }
+            miner = std::make_unique<NodeMiner>(chain, &mempool, addr);
+            miner->on_block([&](const Block& b){ p2pnode.broadcast_block(b); });
+            miner->start(threads);
+        }
+        MetricsServer metrics_server;
+        if (metrics_listen != "off") {
+            auto [mh,mp] = split(metrics_listen);
+            metrics_server.start(mh,mp);
+        }
         std::cout << "Node started. Press Ctrl+C to exit.\n";
-        while (true) std::this_thread::sleep_for(std::chrono::seconds(10));
+#ifdef SIGUSR2
+        std::signal(SIGUSR2, on_dump_trace_signal);
+#endif
+#ifdef SIGUSR1
+        std::signal(SIGUSR1, on_dump_memory_signal);
+#endif
+        uint64_t last_snapshot; // snapshots are taken from the next multiple of the interval on
+        {
+            std::lock_guard<std::mutex> lk(chain.mutex());
+            last_snapshot = chain.tip_height();
+        }
+        auto last_report = std::chrono::steady_clock::now();
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            if (miner && std::chrono::steady_clock::now() - last_report >= std::chrono::seconds(60)) {
+                last_report = std::chrono::steady_clock::now();
+                auto s = miner->stats();
+                std::cout << "Mining: " << s.accepted << " blocks, " << s.orphaned << " orphaned, " << s.templates
+                          << " templates, switch " << std::fixed << std::setprecision(2) << s.switch_ms_avg << " ms avg / "
+                          << s.switch_ms_max << " ms max, " << s.orphaned_hashes << " of " << s.hashes << " hashes orphaned"
+                          << std::defaultfloat << std::endl;
+            }
+            if (snapshot_interval) {
+                // the tip can pass a multiple of the interval between polls (sync, reorg), so
+                // snapshot whenever it has crossed into a later one
+                std::lock_guard<std::mutex> lk(chain.mutex());
+                uint64_t tip = chain.tip_height();
+                if (tip / snapshot_interval > last_snapshot / snapshot_interval) {
+                    last_snapshot = tip;
+                    if (auto m = write_snapshot(chain))
+                        std::cout << "Snapshot at height " << m->height << ": manifest " << m->hash() << std::endl;
+                }
+            }
+            if (g_dump_trace.exchange(false)) {
+                auto path = join(datadir, "trace-" + std::to_string(std::time(nullptr)) + ".json");
+                size_t n = 0;
+                if (dump_trace(path, &n)) std::cout << "Wrote " << n << " trace events to " << path << std::endl;
+            }
+            publish_memory_metrics();
+            if (g_dump_memory.exchange(false)) std::cout << memory_report() << std::flush;
+        }
+        return 0;
+    } else if (cmd=="snapshot") {
+        Storage st(datadir);
+        st.set_block_codec(*codec);
+        Blockchain chain(st, params);
+        if (!chain.load()) { std::cerr << "cannot load the chain in " << datadir << "\n"; return 1; }
+        auto m = write_snapshot(chain);
+        if (!m) { std::cerr << "cannot snapshot: headers.dat does not reach the tip\n"; return 1; }
+        std::cout << "Snapshot at height " << m->height << " (" << m->chunks.size() << " chunks)\n"
+                  << "manifest hash: " << m->hash() << std::endl;
         return 0;
+    } else if (cmd=="reindex") {
+        Storage st(datadir);
+        ReindexOptions opt;
+        opt.threads = threads;
+        opt.exec_threads = exec_threads;
+        opt.state_cache = state_cache;
+        opt.progress = [](const ReindexResult& r) {
+            std::cout << "  " << r.height << "/" << r.target << " blocks, " << r.txs << " txs" << std::endl;
+        };
+        auto r = reindex(st, params, opt);
+        std::cout << std::fixed << std::setprecision(1)
+                  << "Replayed " << r.height << " blocks (" << r.txs << " txs) in " << r.seconds << "s: "
+                  << (r.seconds > 0 ? r.height / r.seconds : 0) << " blocks/s\n";
+        for (auto& s : r.stages)
+            std::cout << "  " << std::left << std::setw(7) << s.name << std::right << std::setw(3) << s.threads << " thr "
+                      << std::setw(10) << s.capacity_blocks_per_s() << " blocks/s capacity "
+                      << std::setw(5) << 100 * s.utilization(r.seconds) << "% busy\n";
+        if (!r.ok) { std::cerr << "reindex stopped: " << r.error << "\n"; return 1; }
+        return 0;
+    } else if (cmd=="sync-snapshot") {
+        if (peers.empty() || manifest_hash.empty()) { std::cerr << "--peers and --manifest-hash required\n"; return 1; }
+        auto split = [](const std::string& hp){ auto pos=hp.find(':'); return std::make_pair(hp.substr(0,pos), (uint16_t)std::stoi(hp.substr(pos+1))); };
+        std::vector<std::pair<std::string,uint16_t>> list;
+        std::stringstream ss(peers);
+        for (std::string p; std::getline(ss, p, ','); ) if (!p.empty()) list.push_back(split(p));
+        Storage st(datadir);
+        st.set_block_codec(*codec);
+        auto r = snapshot_sync(st, params, list, manifest_hash, threads);
+        if (!r.ok) { std::cerr << "snapshot sync failed: " << r.error << "\n"; return 1; }
+        std::cout << "Installed snapshot at height " << r.height << " (" << r.chunks << " chunks, " << r.bytes
+                  << " bytes in " << r.fetch_seconds << "s), synced to " << r.tip_height << " in "
+                  << r.total_seconds << "s" << std::endl;
+        return 0;
+    } else if (cmd=="mine-worker") {
+        if (connect.empty()) { std::cerr << "--connect HOST:PORT required\n"; return 1; }
+        auto pos = connect.find(':');
+        std::atomic<bool> stop{false};
+        MinerStats stats;
+        std::thread report([&](){
+            auto t0 = std::chrono::steady_clock::now();
+            while (!stop) {
+                std::this_thread::sleep_for(std::chrono::seconds(10));
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                std::cout << "hashes/s " << (uint64_t)(stats.hashes / secs) << ", jobs " << stats.jobs << ", submitted "
+                          << stats.submitted << ", accepted " << stats.accepted << ", rejected " << stats.rejected << std::endl;
+            }
+        });
+        bool ok = run_mining_worker(connect.substr(0, pos), (uint16_t)std::stoi(connect.substr(pos + 1)), threads, stop, stats);
+        stop = true;
+        report.join();
+        return ok ? 0 : 1;
     } else if (cmd=="send") {
         std::string from, to; double amount=0.0;
         for (int i=2;i<argc;i++) {
@@ -128,8 +329,9 @@ int run_cli(int argc, char** argv) {
         bytes priv,pub; std::string addr;
         if (!load_keys(datadir, from, priv, pub, addr)) { std::cerr << "no keys for "<<from<<"\n"; return 1; }
         Storage st(datadir);
+        st.set_block_codec(*codec);
         Blockchain chain(st, params);
-        chain.load();
+        if (!chain.load()) { std::cerr << "cannot load the chain in " << datadir << "\n"; return 1; }
         // determine nonce
         LedgerState stt; st.load_state(stt);
         uint64_t nonce = stt.accounts[addr].nonce;
@@ -149,12 +351,53 @@ int run_cli(int argc, char** argv) {
             }
         }
         return 0;
+    } else if (cmd=="send-batch") {
+        std::string from, file;
+        size_t batch = 1000;
+        for (int i=2;i<argc-1;i++) {
+            std::string a = argv[i];
+            if (a=="--from") from = argv[++i];
+            else if (a=="--file") file = argv[++i];
+            else if (a=="--batch") batch = std::stoul(argv[++i]);
+        }
+        if (from.empty()||file.empty()) { std::cerr << "--from,--file required\n"; return 1; }
+        bytes priv,pub; std::string addr;
+        if (!load_keys(datadir, from, priv, pub, addr)) { std::cerr << "no keys for "<<from<<"\n"; return 1; }
+        std::string err;
+        auto payments = read_payments(file, err);
+        if (!payments) { std::cerr << file << ": " << err << "\n"; return 1; }
+        // nonces continue from the sender's state on disk; every row gets the next one
+        Storage st(datadir);
+        LedgerState stt; st.load_state(stt);
+        uint64_t nonce = stt.accounts[addr].nonce;
+        auto pos = rpc.find(':');
+        BatchOptions opt;
+        opt.host = rpc.substr(0, pos);
+        opt.port = (uint16_t)std::stoi(rpc.substr(pos + 1));
+        opt.threads = threads;
+        opt.batch_size = batch;
+        auto last = std::chrono::steady_clock::now();
+        opt.progress = [&](const BatchResult& r) {
+            if (std::chrono::steady_clock::now() - last < std::chrono::seconds(1) && r.submitted < r.total) return;
+            last = std::chrono::steady_clock::now();
+            std::cout << "  signed " << r.signed_txs << "/" << r.total << ", submitted " << r.submitted
+                      << " (" << r.rejected << " rejected)" << std::endl;
+        };
+        std::cout << "Sending " << payments->size() << " transfers from " << addr << " starting at nonce " << nonce << std::endl;
+        auto r = send_batch(*payments, priv, nonce, opt);
+        for (auto& e : r.errors) std::cerr << "  " << e << std::endl;
+        std::cout << "Signed " << r.signed_txs << " in " << r.sign_seconds << "s ("
+                  << (r.sign_seconds > 0 ? r.signed_txs / r.sign_seconds : 0) << " tx/s); submitted " << r.submitted
+                  << " in " << r.seconds << "s (" << (r.seconds > 0 ? r.submitted / r.seconds : 0) << " tx/s); "
+                  << r.accepted << " accepted, " << r.rejected << " rejected" << std::endl;
+        return r.rpc_failed || r.rejected ? 1 : 0;
     } else if (cmd=="mine") {
         bytes priv,pub; std::string addr;
         if (!load_keys(datadir, "default", priv, pub, addr)) { std::cerr << "no default key\n"; return 1; }
         Storage st(datadir);
+        st.set_block_codec(*codec);
         Blockchain chain(st, params);
-        chain.load();
+        if (!chain.load()) { std::cerr << "cannot load the chain in " << datadir << "\n"; return 1; }
         auto blk = chain.build_block(addr, {});
         uint64_t iters=0;
         while (true) {
@@ -179,8 +422,9 @@ int run_cli(int argc, char** argv) {
         bytes priv,pub; std::string addr;
         if (!load_keys(datadir, from, priv, pub, addr)) { std::cerr << "no keys for "<<from<<"\n"; return 1; }
         Storage st(datadir);
+        st.set_block_codec(*codec);
         Blockchain chain(st, params);
-        chain.load();
+        if (!chain.load()) { std::cerr << "cannot load the chain in " << datadir << "\n"; return 1; }
         LedgerState stt; st.load_state(stt);
         uint64_t nonce = stt.accounts[addr].nonce;
         SignedTx utx;
@@ -0,0 +1,104 @@
+#include "compact_tx.hpp"
+#include "base58.hpp"
+#include "crypto.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace axle {
+
+namespace {
+
+std::optional<AddressBytes> decode_address(const std::string& s) {
+    bool ok = false;
+    auto raw = base58_decode(s, &ok);
+    if (!ok || raw.size() != 25) return std::nullopt;
+    AddressBytes a;
+    std::copy(raw.begin(), raw.end(), a.begin());
+    if (base58_encode(raw) != s) return std::nullopt; // would not round-trip
+    return a;
+}
+
+std::string encode_address(const AddressBytes& a) { return base58_encode(bytes(a.begin(), a.end())); }
+
+template <size_t N>
+bool copy_exact(const bytes& v, std::array<uint8_t, N>& out) {
+    if (v.size() != N) return false;
+    std::copy(v.begin(), v.end(), out.begin());
+    return true;
+}
+
+// heap held by a string beyond its inline (small-string) buffer
+size_t heap(const std::string& s) { return s.capacity() > 15 ? s.capacity() + 1 : 0; }
+
+}
+
+std::string CompactTx::from_address() const { return encode_address(from); }
+std::string CompactTx::to_address() const { return to ? encode_address(*to) : std::string(); }
+std::string CompactTx::txid() const { return hex(bytes(id.begin(), id.end())); }
+
+std::optional<CompactTx> CompactTx::from_signed(const SignedTx& tx) {
+    CompactTx c;
+    c.nonce = tx.nonce;
+    auto from = decode_address(tx.from);
+    if (!from) return std::nullopt;
+    c.from = *from;
+    if (!tx.to.empty()) {
+        c.to = decode_address(tx.to);
+        if (!c.to) return std::nullopt;
+    }
+    if (!copy_exact(tx.signature, c.signature) || !copy_exact(tx.pubkey, c.pubkey)) return std::nullopt;
+    if (!copy_exact(unhex(tx.id), c.id) || c.txid() != tx.id) return std::nullopt;
+    bool no_meta = tx.meta.name.empty() && tx.meta.symbol.empty() && tx.meta.uri.empty();
+    switch (tx.type) {
+    case TxType::TRANSFER:
+        if (tx.tokenId || !no_meta) return std::nullopt;
+        c.payload = Transfer{tx.amount};
+        break;
+    case TxType::MINT_NFT:
+        if (tx.amount || tx.tokenId) return std::nullopt;
+        c.payload = MintNft{NftMetaRef(tx.meta)};
+        break;
+    case TxType::TRANSFER_NFT:
+        if (tx.amount || !no_meta) return std::nullopt;
+        c.payload = TransferNft{tx.tokenId};
+        break;
+    case TxType::BURN_NFT:
+        if (tx.amount || !no_meta) return std::nullopt;
+        c.payload = BurnNft{tx.tokenId};
+        break;
+    default:
+        return std::nullopt;
+    }
+    return c;
+}
+
+SignedTx CompactTx::to_signed() const {
+    SignedTx tx;
+    tx.type = type();
+    tx.from = from_address();
+    tx.to = to_address();
+    tx.nonce = nonce;
+    std::visit([&](auto& p) {
+        using P = std::decay_t<decltype(p)>;
+        if constexpr (std::is_same_v<P, Transfer>) tx.amount = p.amount;
+        else if constexpr (std::is_same_v<P, MintNft>) tx.meta = p.meta.meta();
+        else tx.tokenId = p.token_id;
+    }, payload);
+    tx.signature.assign(signature.begin(), signature.end());
+    tx.pubkey.assign(pubkey.begin(), pubkey.end());
+    tx.id = txid();
+    return tx;
+}
+
+size_t CompactTx::memory_bytes() const {
+    size_t n = sizeof(CompactTx);
+    // MintNft metadata lives in the shared NFT store (nft_store_stats), not per tx
+    return n;
+}
+
+size_t memory_bytes(const SignedTx& tx) {
+    return sizeof(SignedTx) + heap(tx.from) + heap(tx.to) + heap(tx.meta.name) + heap(tx.meta.symbol)
+         + heap(tx.meta.uri) + tx.signature.capacity() + tx.pubkey.capacity() + heap(tx.id);
+}
+
+}
@@ -28,7 +28,12 @@ bytes ed25519_sign(const bytes& msg, const bytes& priv) {
 }
 
 bool ed25519_verify(const bytes& msg, const bytes& sig, const bytes& pub) {
-    return crypto_sign_verify_detached(sig.data(), msg.data(), msg.size(), pub.data()) == 0;
+    return ed25519_verify(msg.data(), msg.size(), sig, pub);
+}
+
+bool ed25519_verify(const uint8_t* msg, size_t len, const bytes& sig, const bytes& pub) {
+    if (sig.size() != crypto_sign_BYTES || pub.size() != crypto_sign_PUBLICKEYBYTES) return false;
+    return crypto_sign_verify_detached(sig.data(), msg, len, pub.data()) == 0;
 }
 
 bytes sha256(const bytes& data) {
@@ -1,15 +1,16 @@
 #include "encoding.hpp"
 #include "crypto.hpp"
 #include "tx.hpp"
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
+#include "trace.hpp"
+#include "arena.hpp"
+#include "metrics.hpp"
 
 namespace axle {
 
-static std::string b64(const bytes& v) {
+static arena_string b64(const bytes& v) {
     static const char* tbl="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string out;
+    arena_string out;
+    out.reserve((v.size() + 2) / 3 * 4);
     int val=0, valb=-6;
     for (uint8_t c: v) {
         val = (val<<8) + c;
@@ -23,7 +24,7 @@ static std::string b64(const bytes& v) {
     while (out.size()%4) out.push_back('=');
     return out;
 }
-static bytes b64d(const std::string& s) {
+static bytes b64d(std::string_view s) {
     static const int T[256] = {
         -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
         -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
@@ -49,8 +50,17 @@ static bytes b64d(const std::string& s) {
     return out;
 }
 
-std::string to_json(const SignedTx& tx) {
-    json j;
+static Counter& m_decode_allocs = metrics().counter("axle_block_arena_allocations_total", "Allocations served by per-block arenas", "stage=\"decode\"");
+static Histogram& m_decode_peak = metrics().histogram("axle_block_arena_peak_bytes", "Bytes reserved by a per-block arena", "stage=\"decode\"",
+                                                      {1<<14, 1<<16, 1<<18, 1<<20, 1<<22, 1<<24, 1<<26});
+
+static std::string str(const arena_json& j) {
+    auto& s = j.get_ref<const arena_string&>();
+    return std::string(s.data(), s.size());
+}
+
+static arena_json tx_node(const SignedTx& tx) {
+    arena_json j;
     j["type"] = (int)tx.type;
     j["from"] = tx.from;
     j["to"] = tx.to;
@@ -61,32 +71,45 @@ std::string to_json(const SignedTx& tx) {
     j["signature"] = b64(tx.signature);
     j["pubkey"] = b64(tx.pubkey);
     j["id"] = tx.id;
-    return j.dump();
+    return j;
 }
 
-SignedTx tx_from_json(const std::string& js) {
-    auto j = json::parse(js);
+static SignedTx tx_from_node(const arena_json& j) {
     SignedTx tx;
     tx.type = (TxType)((int)j.at("type"));
-    tx.from = j.at("from");
-    tx.to = j.at("to");
+    tx.from = str(j.at("from"));
+    tx.to = str(j.at("to"));
     tx.amount = j.at("amount");
     tx.nonce = j.at("nonce");
-    tx.tokenId = j.value("tokenId", 0);
-    auto m = j.at("meta");
-    tx.meta = {m.value("name",""), m.value("symbol",""), m.value("uri","")};
-    tx.signature = b64d(j.value("signature",""));
-    tx.pubkey = b64d(j.value("pubkey",""));
-    tx.id = j.value("id","");
+    tx.tokenId = j.value("tokenId", (uint64_t)0);
+    auto& m = j.at("meta");
+    auto field = [&](const char* k){ return m.contains(k) ? str(m[k]) : std::string(); };
+    tx.meta = {field("name"), field("symbol"), field("uri")};
+    tx.signature = j.contains("signature") ? b64d(j["signature"].get_ref<const arena_string&>()) : bytes{};
+    tx.pubkey = j.contains("pubkey") ? b64d(j["pubkey"].get_ref<const arena_string&>()) : bytes{};
+    tx.id = j.contains("id") ? str(j["id"]) : std::string();
     return tx;
 }
 
+std::string to_json(const SignedTx& tx) {
+    auto s = tx_node(tx).dump();
+    return std::string(s.data(), s.size());
+}
+
+SignedTx tx_from_json(std::string_view js) {
+    return tx_from_node(arena_json::parse(js));
+}
+
 std::string to_json(const Block& b) {
-    json j;
+    AXLE_TRACE_SCOPE("encode_block");
+    BlockArena arena(2 * 1024 + b.txs.size() * 2 * 1024);
+    ArenaScope scope(&arena);
+    arena_json j;
     j["header"] = {
         {"height", b.header.height},
         {"prev_hash", b.header.prev_hash},
         {"merkle_root", b.header.merkle_root},
+        {"state_root", b.header.state_root},
         {"timestamp", b.header.timestamp},
         {"difficulty_bits", b.header.difficulty_bits},
         {"nonce", b.header.nonce}
@@ -94,28 +117,38 @@ std::string to_json(const Block& b) {
     j["miner_address"] = b.miner_address;
     j["reward"] = b.reward;
     j["hash"] = b.hash;
-    j["txs"] = json::array();
-    for (auto& tx : b.txs) j["txs"].push_back(json::parse(to_json(tx)));
-    return j.dump();
+    auto& txs = j["txs"] = arena_json::array();
+    for (auto& tx : b.txs) txs.push_back(tx_node(tx));
+    auto s = j.dump();
+    return std::string(s.data(), s.size());
 }
 
-Block block_from_json(const std::string& js) {
-    auto j = json::parse(js);
+Block block_from_json(std::string_view js) {
+    AXLE_TRACE_SCOPE("decode_block");
+    // the parsed DOM lives in a per-block arena that is dropped wholesale on return
+    BlockArena arena(2 * js.size() + 4096);
     Block b;
-    auto h = j.at("header");
-    b.header.height = h.at("height");
-    b.header.prev_hash = h.at("prev_hash");
-    b.header.merkle_root = h.at("merkle_root");
-    b.header.timestamp = h.at("timestamp");
-    b.header.difficulty_bits = h.at("difficulty_bits");
-    b.header.nonce = h.at("nonce");
-    b.miner_address = j.at("miner_address");
-    b.reward = j.at("reward");
-    b.hash = j.at("hash");
-    b.txs.clear();
-    for (auto& t : j.at("txs")) {
-        b.txs.push_back(tx_from_json(t.dump()));
+    {
+        ArenaScope scope(&arena);
+        auto j = arena_json::parse(js);
+        auto& h = j.at("header");
+        b.header.height = h.at("height");
+        b.header.prev_hash = str(h.at("prev_hash"));
+        b.header.merkle_root = str(h.at("merkle_root"));
+        if (auto it = h.find("state_root"); it != h.end()) b.header.state_root = str(*it);
+        b.header.timestamp = h.at("timestamp");
+        b.header.difficulty_bits = h.at("difficulty_bits");
+        b.header.nonce = h.at("nonce");
+        b.miner_address = str(j.at("miner_address"));
+        b.reward = j.at("reward");
+        b.hash = str(j.at("hash"));
+        auto& txs = j.at("txs");
+        b.txs.reserve(txs.size());
+        for (auto& t : txs) b.txs.push_back(tx_from_node(t));
     }
+    auto st = arena.stats();
+    m_decode_allocs.inc(st.allocations);
+    m_decode_peak.observe((double)st.peak_bytes);
     return b;
 }
 
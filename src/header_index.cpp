@@ -0,0 +1,72 @@
+#include "header_index.hpp"
+#include "blockchain.hpp"
+#include "crypto.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace axle {
+
+HeaderIndex::Key HeaderIndex::key_of(const HeaderRecord& h) {
+    Key k;
+    std::copy_n(h.hash, 32, k.begin());
+    return k;
+}
+
+void HeaderIndex::clear() {
+    headers_.clear();
+    work_.clear();
+    by_hash_.clear();
+}
+
+bool HeaderIndex::load(const Storage& s, uint64_t tip) {
+    AXLE_TRACE_SCOPE("header_index.load");
+    clear();
+    auto records = s.read_headers(0, tip + 1);
+    if (records.size() != tip + 1) return false;
+    headers_.reserve(records.size());
+    work_.reserve(records.size());
+    by_hash_.reserve(records.size());
+    for (auto& h : records) {
+        bool links = h.height == headers_.size() &&
+                     (headers_.empty() ? (h.flags & HeaderRecord::EMPTY_PREV) != 0
+                                       : std::memcmp(h.prev_hash, headers_.back().hash, 32) == 0);
+        if (!links) { clear(); return false; }
+        push(h);
+    }
+    return true;
+}
+
+void HeaderIndex::push(const HeaderRecord& h) {
+    uint64_t work = headers_.empty() ? 0 : work_.back() + block_work(h.difficulty_bits);
+    headers_.push_back(h);
+    work_.push_back(work);
+    by_hash_[key_of(h)] = h.height;
+}
+
+void HeaderIndex::truncate(uint64_t height) {
+    while (headers_.size() > height) {
+        by_hash_.erase(key_of(headers_.back()));
+        headers_.pop_back();
+        work_.pop_back();
+    }
+}
+
+std::optional<uint64_t> HeaderIndex::height_of(const std::string& hash) const {
+    if (hash.size() != 64) return std::nullopt;
+    auto b = unhex(hash);
+    Key k;
+    std::copy_n(b.begin(), 32, k.begin());
+    auto it = by_hash_.find(k);
+    if (it == by_hash_.end()) return std::nullopt;
+    return it->second;
+}
+
+size_t HeaderIndex::memory_bytes() const {
+    // unordered_map nodes: key, value, next pointer and cached hash, plus one bucket slot each
+    size_t node = sizeof(Key) + sizeof(uint64_t) + 2 * sizeof(void*);
+    return headers_.capacity() * sizeof(HeaderRecord) + work_.capacity() * sizeof(uint64_t) +
+           by_hash_.size() * node + by_hash_.bucket_count() * sizeof(void*);
+}
+
+}
@@ -2,97 +2,392 @@
 #include "tx.hpp"
 #include "crypto.hpp"
 #include "base58.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "arena.hpp"
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
+#include <thread>
 
 namespace axle {
 
-static bool has_balance(const LedgerState& st, const std::string& addr, int64_t amt) {
-    auto it = st.accounts.find(addr);
-    return it != st.accounts.end() && it->second.balance >= amt;
+static Histogram& m_validate = metrics().histogram("axle_validate_block_seconds", "Wall time of block validation (execute_block)");
+static Counter& m_exec_txs = metrics().counter("axle_exec_txs_total", "Transactions run by execute_block");
+static Counter& m_exec_reexec = metrics().counter("axle_exec_reexecuted_total", "Speculative results discarded on a read/write conflict and re-executed");
+static Counter& m_arena_allocs = metrics().counter("axle_block_arena_allocations_total", "Allocations served by per-block arenas", "stage=\"execute\"");
+static Histogram& m_arena_peak = metrics().histogram("axle_block_arena_peak_bytes", "Heap reserved by the per-block arenas of one block", "stage=\"execute\"",
+                                                     {4096, 16384, 65536, 262144, 1048576, 4194304, 16777216});
+
+namespace {
+
+// Tx rules are written against a small view interface so the same code runs directly on a
+// LedgerState (serial path), on a read-tracking speculative overlay, or on a block delta.
+struct LedgerView {
+    LedgerState& st;
+    AccountState account(const std::string& a) {
+        return st.accounts.get(a).value_or(AccountState{});
+    }
+    void put_account(const std::string& a, const AccountState& v) { st.accounts[a] = v; }
+    std::optional<NftEntry> nft(uint64_t id) {
+        auto it = st.nfts.find(id);
+        if (it == st.nfts.end()) return std::nullopt;
+        return it->second;
+    }
+    void put_nft(uint64_t id, NftEntry v) { st.nfts[id] = std::move(v); }
+    void erase_nft(uint64_t id) { st.nfts.erase(id); }
+    uint64_t take_token_id() { return st.next_token_id++; }
+    void add_pool(int64_t d) { st.unclaimed_pool += d; }
+};
+
+// prior state overlaid with the writes of the transactions committed so far
+struct DeltaView {
+    const LedgerState& base;
+    StateDelta& d;
+    AccountState account(const std::string& a) {
+        auto it = d.accounts.find(a);
+        if (it != d.accounts.end()) return it->second;
+        return base.accounts.get(a).value_or(AccountState{});
+    }
+    void put_account(const std::string& a, const AccountState& v) { d.accounts[a] = v; }
+    std::optional<NftEntry> nft(uint64_t id) {
+        auto it = d.nfts.find(id);
+        if (it != d.nfts.end()) return it->second;
+        auto bt = base.nfts.find(id);
+        if (bt == base.nfts.end()) return std::nullopt;
+        return bt->second;
+    }
+    void put_nft(uint64_t id, NftEntry v) { d.nfts[id] = std::move(v); }
+    void erase_nft(uint64_t id) { d.nfts[id] = std::nullopt; }
+    uint64_t take_token_id() {
+        uint64_t id = d.next_token_id.value_or(base.next_token_id);
+        d.next_token_id = id + 1;
+        return id;
+    }
+    void add_pool(int64_t v) { d.pool_delta += v; }
+};
+
+template <class T> using scratch_vector = std::vector<T, ArenaAllocator<T>>;
+
+// Runs one tx against the prior state only, recording what it read and buffering what it wrote.
+// Its buffers come from the worker's block arena, so construct it on the thread that fills it.
+struct SpecView {
+    const LedgerState* base{nullptr};
+    scratch_vector<const std::string*> account_reads;
+    scratch_vector<uint64_t> nft_reads;
+    bool read_token_id{false};
+    scratch_vector<std::pair<const std::string*, AccountState>> accounts;
+    scratch_vector<std::pair<uint64_t, std::optional<NftEntry>>> nfts;
+    uint64_t tokens_taken{0};
+    int64_t pool_delta{0};
+
+    AccountState account(const std::string& a) {
+        for (auto& [k, v] : accounts) if (*k == a) return v;
+        account_reads.push_back(&a);
+        return base->accounts.get(a).value_or(AccountState{});
+    }
+    void put_account(const std::string& a, const AccountState& v) {
+        for (auto& [k, old] : accounts) if (*k == a) { old = v; return; }
+        accounts.push_back({&a, v});
+    }
+    std::optional<NftEntry> nft(uint64_t id) {
+        for (auto& [k, v] : nfts) if (k == id) return v;
+        nft_reads.push_back(id);
+        auto it = base->nfts.find(id);
+        if (it == base->nfts.end()) return std::nullopt;
+        return it->second;
+    }
+    void put_nft(uint64_t id, std::optional<NftEntry> v) {
+        for (auto& [k, old] : nfts) if (k == id) { old = std::move(v); return; }
+        nfts.push_back({id, std::move(v)});
+    }
+    void erase_nft(uint64_t id) { put_nft(id, std::nullopt); }
+    uint64_t take_token_id() { read_token_id = true; return base->next_token_id + tokens_taken++; }
+    void add_pool(int64_t d) { pool_delta += d; }
+
+    // valid iff nothing it read has been written by an earlier tx in the block
+    bool conflicts_with(const StateDelta& d) const {
+        for (auto* a : account_reads) if (d.accounts.count(*a)) return true;
+        for (auto id : nft_reads) if (d.nfts.count(id)) return true;
+        return read_token_id && d.next_token_id.has_value();
+    }
+    void merge_into(StateDelta& d) const {
+        for (auto& [k, v] : accounts) d.accounts[*k] = v;
+        for (auto& [k, v] : nfts) d.nfts[k] = v;
+        if (tokens_taken) d.next_token_id = base->next_token_id + tokens_taken;
+        d.pool_delta += pool_delta;
+    }
+};
+
+ValidationResult fail(const char* reason) { return {false, reason}; }
+
+// The rules of each tx type, as an overload per operation so callers holding a concrete type
+// (CompactTx's payload) get the right one at compile time. Each runs after the nonce check,
+// with the sender's account loaded into `sender`, and charges the burn to it.
+struct TransferOp { int64_t amount; };
+struct MintNftOp { NftMetaRef meta; };
+struct TransferNftOp { uint64_t token_id; };
+struct BurnNftOp { uint64_t token_id; };
+
+template <class View>
+ValidationResult exec_op(View& v, const ChainParams& params, AccountState& sender, const std::string& from,
+                         const std::string& to, const TransferOp& op) {
+    if (op.amount <= 0) return fail("amount<=0");
+    int64_t total = op.amount + params.burn_fee;
+    if (sender.balance < total) return fail("insufficient");
+    sender.balance -= total;
+    if (to == from) {
+        sender.balance += op.amount;
+    } else {
+        auto recipient = v.account(to);
+        recipient.balance += op.amount;
+        v.put_account(to, recipient);
+    }
+    v.add_pool(params.burn_fee);
+    return {};
 }
 
-static void add_balance(LedgerState& st, const std::string& addr, int64_t delta) {
-    auto& a = st.accounts[addr];
-    a.balance += delta;
+template <class View>
+ValidationResult exec_op(View& v, const ChainParams& params, AccountState& sender, const std::string& from,
+                         const std::string&, const MintNftOp& op) {
+    if (sender.balance < params.burn_fee) return fail("insufficient");
+    sender.balance -= params.burn_fee;
+    v.add_pool(params.burn_fee);
+    uint64_t id = v.take_token_id();
+    v.put_nft(id, NftEntry{from, op.meta});
+    return {};
 }
 
-ValidationResult apply_tx(LedgerState& st, const ChainParams& params, const SignedTx& tx) {
-    ValidationResult vr;
-    if (!verify_tx_sig(tx)) { vr.ok=false; vr.reason="bad signature"; return vr; }
-    if (!verify_address(tx.from) || (!tx.to.empty() && !verify_address(tx.to))) { vr.ok=false; vr.reason="bad address"; return vr; }
-
-    auto& sender = st.accounts[tx.from];
-    if (sender.nonce != tx.nonce) { vr.ok=false; vr.reason="bad nonce"; return vr; }
-
-    // universal burn
-    int64_t required_burn = params.burn_fee;
-    if (tx.type == TxType::TRANSFER) {
-        if (tx.amount <= 0) { vr.ok=false; vr.reason="amount<=0"; return vr; }
-        int64_t total = tx.amount + required_burn;
-        if (!has_balance(st, tx.from, total)) { vr.ok=false; vr.reason="insufficient"; return vr; }
-        add_balance(st, tx.from, -total);
-        add_balance(st, tx.to, tx.amount);
-        st.unclaimed_pool += required_burn;
-    } else if (tx.type == TxType::MINT_NFT) {
-        int64_t total = required_burn;
-        if (!has_balance(st, tx.from, total)) { vr.ok=false; vr.reason="insufficient"; return vr; }
-        add_balance(st, tx.from, -total);
-        st.unclaimed_pool += required_burn;
-        uint64_t id = st.next_token_id++;
-        st.nfts[id] = {tx.from, tx.meta};
-    } else if (tx.type == TxType::TRANSFER_NFT) {
-        int64_t total = required_burn;
-        if (!has_balance(st, tx.from, total)) { vr.ok=false; vr.reason="insufficient"; return vr; }
-        auto it = st.nfts.find(tx.tokenId);
-        if (it==st.nfts.end() || it->second.first != tx.from) { vr.ok=false; vr.reason="not owner"; return vr; }
-        add_balance(st, tx.from, -total);
-        st.unclaimed_pool += required_burn;
-        it->second.first = tx.to;
-    } else if (tx.type == TxType::BURN_NFT) {
-        int64_t total = required_burn;
-        if (!has_balance(st, tx.from, total)) { vr.ok=false; vr.reason="insufficient"; return vr; }
-        auto it = st.nfts.find(tx.tokenId);
-        if (it==st.nfts.end() || it->second.first != tx.from) { vr.ok=false; vr.reason="not owner"; return vr; }
-        add_balance(st, tx.from, -total);
-        st.unclaimed_pool += required_burn;
-        st.nfts.erase(it);
+template <class View, class Op>
+ValidationResult exec_nft_op(View& v, const ChainParams& params, AccountState& sender, const std::string& from,
+                             const std::string& to, const Op& op) {
+    if (sender.balance < params.burn_fee) return fail("insufficient");
+    auto nft = v.nft(op.token_id);
+    if (!nft || nft->first != from) return fail("not owner");
+    sender.balance -= params.burn_fee;
+    v.add_pool(params.burn_fee);
+    if constexpr (std::is_same_v<Op, TransferNftOp>) {
+        nft->first = to;
+        v.put_nft(op.token_id, std::move(*nft));
     } else {
-        vr.ok=false; vr.reason="unknown tx type"; return vr;
+        v.erase_nft(op.token_id);
     }
+    return {};
+}
+
+template <class View>
+ValidationResult exec_op(View& v, const ChainParams& params, AccountState& sender, const std::string& from,
+                         const std::string& to, const TransferNftOp& op) {
+    return exec_nft_op(v, params, sender, from, to, op);
+}
+
+template <class View>
+ValidationResult exec_op(View& v, const ChainParams& params, AccountState& sender, const std::string& from,
+                         const std::string& to, const BurnNftOp& op) {
+    return exec_nft_op(v, params, sender, from, to, op);
+}
+
+template <class View, class Op>
+ValidationResult exec_tx(View& v, const ChainParams& params, const std::string& from, const std::string& to,
+                         uint64_t nonce, const Op& op) {
+    auto sender = v.account(from);
+    if (sender.nonce != nonce) return fail("bad nonce");
+    auto vr = exec_op(v, params, sender, from, to, op);
+    if (!vr.ok) return vr;
     sender.nonce += 1;
-    vr.ok = true;
-    return vr;
+    v.put_account(from, sender);
+    return {};
 }
 
-ValidationResult validate_block(const LedgerState& prior, const ChainParams& params, const Block& b) {
+template <class View>
+ValidationResult exec_tx(View& v, const ChainParams& params, const SignedTx& tx) {
+    switch (tx.type) {
+    case TxType::TRANSFER: return exec_tx(v, params, tx.from, tx.to, tx.nonce, TransferOp{tx.amount});
+    case TxType::MINT_NFT: return exec_tx(v, params, tx.from, tx.to, tx.nonce, MintNftOp{NftMetaRef(tx.meta)});
+    case TxType::TRANSFER_NFT: return exec_tx(v, params, tx.from, tx.to, tx.nonce, TransferNftOp{tx.tokenId});
+    case TxType::BURN_NFT: return exec_tx(v, params, tx.from, tx.to, tx.nonce, BurnNftOp{tx.tokenId});
+    }
+    // keep the nonce check ahead of the type check, as before
+    if (v.account(tx.from).nonce != tx.nonce) return fail("bad nonce");
+    return fail("unknown tx type");
+}
+
+// Work-stealing loop over [0, n) on up to `threads` threads (the caller is worker 0).
+template <class F>
+void parallel_for(size_t n, unsigned threads, F&& f) {
+    constexpr size_t CHUNK = 16;
+    std::atomic<size_t> next{0};
+    auto work = [&](unsigned worker){
+        for (size_t i; (i = next.fetch_add(CHUNK)) < n; )
+            for (size_t j=i; j<std::min(n, i+CHUNK); j++) f(worker, j);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t=1; t<threads; t++) pool.emplace_back(work, t);
+    work(0);
+    for (auto& th : pool) th.join();
+}
+
+}
+
+ValidationResult check_tx_stateless(const SignedTx& tx) {
+    if (!verify_tx_sig(tx)) return fail("bad signature");
+    if (!verify_address(tx.from) || (!tx.to.empty() && !verify_address(tx.to))) return fail("bad address");
+    return {};
+}
+
+ValidationResult apply_tx(LedgerState& st, const ChainParams& params, const SignedTx& tx) {
+    auto vr = check_tx_stateless(tx);
+    if (!vr.ok) return vr;
+    LedgerView v{st};
+    return exec_tx(v, params, tx);
+}
+
+ValidationResult apply_tx(LedgerState& st, const ChainParams& params, const CompactTx& tx) {
+    // signatures are over the SignedTx preimage, so that check goes through the full form
+    auto vr = check_tx_stateless(tx.to_signed());
+    if (!vr.ok) return vr;
+    LedgerView v{st};
+    auto from = tx.from_address(), to = tx.to_address();
+    return std::visit([&](const auto& p) -> ValidationResult {
+        using P = std::decay_t<decltype(p)>;
+        if constexpr (std::is_same_v<P, CompactTx::Transfer>) return exec_tx(v, params, from, to, tx.nonce, TransferOp{p.amount});
+        else if constexpr (std::is_same_v<P, CompactTx::MintNft>) return exec_tx(v, params, from, to, tx.nonce, MintNftOp{p.meta});
+        else if constexpr (std::is_same_v<P, CompactTx::TransferNft>) return exec_tx(v, params, from, to, tx.nonce, TransferNftOp{p.token_id});
+        else return exec_tx(v, params, from, to, tx.nonce, BurnNftOp{p.token_id});
+    }, tx.payload);
+}
+
+ValidationResult execute_block(const LedgerState& prior, const ChainParams& params, const Block& b,
+                               StateDelta& out, unsigned threads, ExecStats* stats, bool check_sigs) {
+    ScopedTimer timer(m_validate);
+    AXLE_TRACE_SCOPE("execute_block");
+    MemScope mem(MemTag::Validation);
+    out = StateDelta{};
+    size_t n = b.txs.size();
+    // below a few chunks per worker the thread start-up costs more than it saves
+    threads = (unsigned)std::max<size_t>(1, std::min<size_t>(threads, n / 32));
+
+    // One arena per worker (BlockArena is not thread-safe). Scratch that dies with the block
+    // (speculative views, signing preimages) is carved from them and freed in one step on return.
+    size_t scratch = std::max<size_t>(4096, n / threads * 512);
+    std::vector<std::unique_ptr<BlockArena>> arenas;
+    for (unsigned t=0; t<threads; t++) arenas.push_back(std::make_unique<BlockArena>(scratch));
+    ArenaScope caller_scope(arenas[0].get());
+
+    struct Spec { ValidationResult stateless; ValidationResult vr; SpecView view; };
+    std::vector<std::optional<Spec>> spec(n);
+    {
+        AXLE_TRACE_SCOPE("execute_block.speculate");
+        parallel_for(n, threads, [&](unsigned worker, size_t i){
+            ArenaScope scope(arenas[worker].get());
+            MemScope mem(MemTag::Validation);
+            auto& s = spec[i].emplace();
+            if (check_sigs) s.stateless = check_tx_stateless(b.txs[i]);
+            if (!s.stateless.ok) return;
+            s.view.base = &prior;
+            s.vr = exec_tx(s.view, params, b.txs[i]);
+        });
+    }
+
     ValidationResult vr;
-    // minimal checks; PoW checking to be done at accept time
-    // Check txs nonces monotonic per account
-    std::map<std::string,uint64_t> nonces;
-    for (auto& [addr, acc] : prior.accounts) nonces[addr] = acc.nonce;
-    LedgerState tmp = prior;
-    int64_t pool0 = tmp.unclaimed_pool;
-    for (auto& tx : b.txs) {
-        auto r = apply_tx(tmp, params, tx);
-        if (!r.ok) { vr.ok=false; vr.reason="tx invalid: "+r.reason; return vr; }
+    size_t reexec = 0;
+    {
+        AXLE_TRACE_SCOPE("execute_block.commit");
+        DeltaView dv{prior, out};
+        for (size_t i=0; i<n && vr.ok; i++) {
+            auto& s = *spec[i];
+            if (!s.stateless.ok) { vr = s.stateless; break; }
+            if (s.view.conflicts_with(out)) {
+                reexec++;
+                vr = exec_tx(dv, params, b.txs[i]);
+            } else if (s.vr.ok) {
+                s.view.merge_into(out);
+            } else {
+                vr = s.vr;
+            }
+        }
     }
-    // reward should not exceed pool
-    if (b.reward < 0 || b.reward > pool0 + (tmp.unclaimed_pool - pool0)) {
-        // pool can only increase by burns
+    m_exec_txs.inc(n);
+    m_exec_reexec.inc(reexec);
+    ArenaStats arena;
+    for (auto& a : arenas) {
+        auto st = a->stats();
+        arena.allocations += st.allocations;
+        arena.bytes += st.bytes;
+        arena.peak_bytes += st.peak_bytes;
     }
-    vr.ok = true;
+    m_arena_allocs.inc(arena.allocations);
+    m_arena_peak.observe((double)arena.peak_bytes);
+    if (stats) *stats = {n, reexec, threads, arena.allocations, arena.peak_bytes};
+    if (!vr.ok) { vr.reason = "tx invalid: " + vr.reason; return vr; }
+
+    // pay miner from unclaimed pool
+    if (b.reward < 0 || b.reward > prior.unclaimed_pool + out.pool_delta) return fail("reward exceeds pool");
+    if (!verify_address(b.miner_address)) return fail("bad miner address");
+    DeltaView dv{prior, out};
+    auto miner = dv.account(b.miner_address);
+    miner.balance += b.reward;
+    dv.put_account(b.miner_address, miner);
+    out.pool_delta -= b.reward;
     return vr;
 }
 
+void commit_delta(LedgerState& st, const StateDelta& d) {
+    AXLE_TRACE_SCOPE("commit_delta");
+    for (auto& [addr, acc] : d.accounts) st.accounts[addr] = acc;
+    for (auto& [id, entry] : d.nfts) {
+        if (entry) st.nfts[id] = *entry;
+        else st.nfts.erase(id);
+    }
+    if (d.next_token_id) st.next_token_id = *d.next_token_id;
+    st.unclaimed_pool += d.pool_delta;
+}
+
+UndoRecord make_undo(const LedgerState& prior, const StateDelta& d) {
+    UndoRecord u;
+    for (auto& [addr, acc] : d.accounts) u.accounts[addr] = prior.accounts.get(addr);
+    for (auto& [id, entry] : d.nfts) {
+        auto it = prior.nfts.find(id);
+        u.nfts[id] = it == prior.nfts.end() ? std::nullopt : std::optional<NftEntry>(it->second);
+    }
+    u.next_token_id = prior.next_token_id;
+    u.pool_delta = d.pool_delta;
+    return u;
+}
+
+void apply_undo(LedgerState& st, const UndoRecord& u) {
+    AXLE_TRACE_SCOPE("apply_undo");
+    for (auto& [addr, acc] : u.accounts) {
+        if (acc) st.accounts[addr] = *acc;
+        else st.accounts.erase(addr);
+    }
+    for (auto& [id, entry] : u.nfts) {
+        if (entry) st.nfts[id] = *entry;
+        else st.nfts.erase(id);
+    }
+    st.next_token_id = u.next_token_id;
+    st.unclaimed_pool -= u.pool_delta;
+}
+
+ValidationResult validate_block(const LedgerState& prior, const ChainParams& params, const Block& b) {
+    AXLE_TRACE_SCOPE("validate_block");
+    // runs against an overlay, so the prior state is never copied
+    StateDelta delta;
+    return execute_block(prior, params, b, delta);
+}
+
 void apply_block(LedgerState& st, const ChainParams& params, const Block& b) {
+    AXLE_TRACE_SCOPE("apply_block");
     for (auto& tx : b.txs) {
         auto r = apply_tx(st, params, tx);
         if (!r.ok) throw std::runtime_error("apply_block: tx invalid after validation");
     }
     // pay miner from unclaimed pool
     if (b.reward > st.unclaimed_pool) throw std::runtime_error("reward exceeds pool");
+    if (!verify_address(b.miner_address)) throw std::runtime_error("bad miner address");
     st.unclaimed_pool -= b.reward;
-    add_balance(st, b.miner_address, b.reward);
+    st.accounts[b.miner_address].balance += b.reward;
 }
 
 }
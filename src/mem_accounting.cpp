@@ -0,0 +1,226 @@
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+namespace axle {
+
+// Plain zero-initialised atomics: operator new runs before any dynamic initialiser does.
+namespace {
+struct TagCounters {
+    std::atomic<int64_t> bytes, allocations, peak, budget;
+    std::atomic<uint64_t> total;
+};
+TagCounters g_tags[MEM_TAGS];
+}
+
+static const char* const TAG_NAMES[MEM_TAGS] = {"other", "state", "storage", "mempool", "p2p", "rpc", "validation"};
+
+const char* mem_tag_name(MemTag tag) {
+    return (size_t)tag < MEM_TAGS ? TAG_NAMES[(size_t)tag] : "other";
+}
+
+bool parse_mem_tag(const std::string& name, MemTag& out) {
+    for (size_t i = 0; i < MEM_TAGS; ++i)
+        if (name == TAG_NAMES[i]) { out = (MemTag)i; return true; }
+    return false;
+}
+
+bool memory_accounting_enabled() { return AXLE_MEMORY_ACCOUNTING != 0; }
+
+std::vector<MemUsage> memory_usage() {
+    std::vector<MemUsage> out;
+    for (size_t i = 0; i < MEM_TAGS; ++i) {
+        auto& t = g_tags[i];
+        MemUsage u;
+        u.tag = (MemTag)i;
+        u.bytes = t.bytes.load(std::memory_order_relaxed);
+        u.allocations = t.allocations.load(std::memory_order_relaxed);
+        u.total_allocations = t.total.load(std::memory_order_relaxed);
+        u.peak_bytes = t.peak.load(std::memory_order_relaxed);
+        u.budget_bytes = t.budget.load(std::memory_order_relaxed);
+        out.push_back(u);
+    }
+    return out;
+}
+
+int64_t memory_bytes(MemTag tag) { return g_tags[(size_t)tag].bytes.load(std::memory_order_relaxed); }
+
+void set_memory_budget(MemTag tag, int64_t bytes) { g_tags[(size_t)tag].budget.store(bytes < 0 ? 0 : bytes); }
+int64_t memory_budget(MemTag tag) { return g_tags[(size_t)tag].budget.load(std::memory_order_relaxed); }
+
+bool over_memory_budget(MemTag tag) {
+    auto& t = g_tags[(size_t)tag];
+    int64_t budget = t.budget.load(std::memory_order_relaxed);
+    return budget > 0 && t.bytes.load(std::memory_order_relaxed) > budget;
+}
+
+static bool parse_size(const std::string& s, int64_t& out) {
+    size_t used = 0;
+    uint64_t n = 0;
+    try { n = std::stoull(s, &used); } catch (...) { return false; }
+    auto unit = s.substr(used);
+    uint64_t mult = 1;
+    if (unit == "KB" || unit == "K") mult = 1ULL << 10;
+    else if (unit == "MB" || unit == "M") mult = 1ULL << 20;
+    else if (unit == "GB" || unit == "G") mult = 1ULL << 30;
+    else if (!unit.empty() && unit != "B") return false;
+    out = (int64_t)(n * mult);
+    return true;
+}
+
+bool parse_memory_budgets(const std::string& spec, std::string& err) {
+    std::vector<std::pair<MemTag, int64_t>> budgets;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        auto eq = item.find('=');
+        MemTag tag;
+        int64_t bytes = 0;
+        if (eq == std::string::npos || !parse_mem_tag(item.substr(0, eq), tag)) { err = "unknown subsystem in '" + item + "'"; return false; }
+        if (!parse_size(item.substr(eq + 1), bytes)) { err = "bad size in '" + item + "'"; return false; }
+        budgets.emplace_back(tag, bytes);
+    }
+    for (auto& [tag, bytes] : budgets) set_memory_budget(tag, bytes);
+    return true;
+}
+
+uint64_t process_rss_bytes() {
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) return std::stoull(line.substr(6)) * 1024;
+    }
+    return 0;
+}
+
+std::string memory_report() {
+    std::ostringstream os;
+    auto mb = [](int64_t b) { return (double)b / (1 << 20); };
+    os << std::fixed << std::setprecision(1);
+    os << "memory by subsystem (MiB live / peak / budget, live allocations)"
+       << (memory_accounting_enabled() ? "" : " -- accounting compiled out") << "\n";
+    int64_t total = 0;
+    for (auto& u : memory_usage()) {
+        total += u.bytes;
+        os << "  " << std::left << std::setw(11) << mem_tag_name(u.tag) << std::right
+           << std::setw(9) << mb(u.bytes) << std::setw(9) << mb(u.peak_bytes);
+        if (u.budget_bytes > 0) os << std::setw(9) << mb(u.budget_bytes);
+        else os << std::setw(9) << "-";
+        os << std::setw(11) << u.allocations << (u.budget_bytes > 0 && u.bytes > u.budget_bytes ? "  OVER" : "") << "\n";
+    }
+    os << "  total      " << std::setw(9) << mb(total) << "   rss " << mb((int64_t)process_rss_bytes()) << "\n";
+    return os.str();
+}
+
+void publish_memory_metrics() {
+    struct Cells { Gauge* bytes[MEM_TAGS]; Gauge* allocs[MEM_TAGS]; Gauge* budget[MEM_TAGS]; };
+    static const Cells cells = [] {
+        Cells c;
+        for (size_t i = 0; i < MEM_TAGS; ++i) {
+            std::string l = std::string("subsystem=\"") + TAG_NAMES[i] + "\"";
+            c.bytes[i] = &metrics().gauge("axle_memory_bytes", "Live heap bytes by subsystem", l);
+            c.allocs[i] = &metrics().gauge("axle_memory_allocations", "Live heap allocations by subsystem", l);
+            c.budget[i] = &metrics().gauge("axle_memory_budget_bytes", "Configured memory budget by subsystem (0 = none)", l);
+        }
+        return c;
+    }();
+    for (auto& u : memory_usage()) {
+        size_t i = (size_t)u.tag;
+        cells.bytes[i]->set(u.bytes);
+        cells.allocs[i]->set(u.allocations);
+        cells.budget[i]->set(u.budget_bytes);
+    }
+}
+
+}
+
+#if AXLE_MEMORY_ACCOUNTING
+
+// Every allocation carries a 16-byte header just below the pointer handed out: the offset back
+// to the start of the underlying malloc block (larger than the header for over-aligned types),
+// the tag it was charged to and its size.
+namespace {
+
+struct alignas(16) AllocHeader {
+    uint64_t size;
+    uint32_t offset;
+    uint8_t tag;
+};
+static_assert(sizeof(AllocHeader) == 16);
+
+void charge(uint8_t tag, int64_t size, int64_t sign) {
+    auto& t = axle::g_tags[tag];
+    int64_t now = t.bytes.fetch_add(sign * size, std::memory_order_relaxed) + sign * size;
+    t.allocations.fetch_add(sign, std::memory_order_relaxed);
+    if (sign > 0) {
+        t.total.fetch_add(1, std::memory_order_relaxed);
+        if (now > t.peak.load(std::memory_order_relaxed)) t.peak.store(now, std::memory_order_relaxed);
+    }
+}
+
+void* tracked_alloc(size_t size, size_t align) noexcept {
+    size_t offset = align > sizeof(AllocHeader) ? align : sizeof(AllocHeader);
+    void* raw;
+    if (align > sizeof(AllocHeader)) {
+        size_t total = (size + offset + align - 1) / align * align;
+        raw = std::aligned_alloc(align, total);
+    } else {
+        raw = std::malloc(size + offset);
+    }
+    if (!raw) return nullptr;
+    auto* p = static_cast<char*>(raw) + offset;
+    auto* h = reinterpret_cast<AllocHeader*>(p) - 1;
+    h->size = size;
+    h->offset = (uint32_t)offset;
+    h->tag = (uint8_t)axle::mem_tag_slot();
+    charge(h->tag, (int64_t)size, 1);
+    return p;
+}
+
+void tracked_free(void* p) noexcept {
+    if (!p) return;
+    auto* h = static_cast<AllocHeader*>(p) - 1;
+    charge(h->tag, (int64_t)h->size, -1);
+    std::free(static_cast<char*>(p) - h->offset);
+}
+
+void* throwing_alloc(size_t size, size_t align) {
+    for (;;) {
+        if (void* p = tracked_alloc(size ? size : 1, align)) return p;
+        auto handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+}
+
+void* operator new(size_t n) { return throwing_alloc(n, 0); }
+void* operator new[](size_t n) { return throwing_alloc(n, 0); }
+void* operator new(size_t n, std::align_val_t a) { return throwing_alloc(n, (size_t)a); }
+void* operator new[](size_t n, std::align_val_t a) { return throwing_alloc(n, (size_t)a); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return tracked_alloc(n ? n : 1, 0); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return tracked_alloc(n ? n : 1, 0); }
+void* operator new(size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return tracked_alloc(n ? n : 1, (size_t)a); }
+void* operator new[](size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return tracked_alloc(n ? n : 1, (size_t)a); }
+
+void operator delete(void* p) noexcept { tracked_free(p); }
+void operator delete[](void* p) noexcept { tracked_free(p); }
+void operator delete(void* p, size_t) noexcept { tracked_free(p); }
+void operator delete[](void* p, size_t) noexcept { tracked_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_free(p); }
+
+#endif
@@ -0,0 +1,109 @@
+#include "mempool.hpp"
+#include "tx.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include <set>
+
+namespace axle {
+
+static Gauge& m_size = metrics().gauge("axle_mempool_txs", "Transactions waiting for a block");
+static Counter& m_added = metrics().counter("axle_mempool_added_total", "Transactions admitted to the mempool");
+static Gauge& m_bytes = metrics().gauge("axle_mempool_tx_bytes", "Memory held by pending transactions");
+static Counter& m_refused = metrics().counter("axle_mempool_refused_total", "Transactions the mempool turned away");
+
+Mempool::Mempool(size_t max_txs) : max_txs_(max_txs) {}
+
+ValidationResult Mempool::add(const SignedTx& tx, const LedgerState& st) {
+    MemScope mem(MemTag::Mempool);
+    auto refuse = [](const char* reason) { m_refused.inc(); return ValidationResult{false, reason}; };
+    if (tx.id != tx_id(tx)) return refuse("bad txid");
+    auto vr = check_tx_stateless(tx);
+    if (!vr.ok) { m_refused.inc(); return vr; }
+    if (tx.nonce < st.accounts.get(tx.from).value_or(AccountState{}).nonce) return refuse("nonce already used");
+    if (tx.type == TxType::TRANSFER && tx.amount <= 0) return refuse("amount<=0");
+    auto compact = CompactTx::from_signed(tx);
+    if (!compact) return refuse("non-standard tx"); // sets fields its type does not use
+    std::lock_guard<std::mutex> lk(mu_);
+    if (ids_.count(tx.id)) return refuse("already pending");
+    if (ids_.size() >= max_txs_) return refuse("mempool full");
+    if (over_memory_budget(MemTag::Mempool)) return refuse("mempool over memory budget");
+    auto& pending = by_sender_[tx.from];
+    if (pending.count(tx.nonce)) return refuse("nonce already pending");
+    tx_bytes_ += compact->memory_bytes();
+    pending.emplace(tx.nonce, std::move(*compact));
+    ids_.emplace(tx.id, std::make_pair(tx.from, tx.nonce));
+    version_++;
+    m_added.inc();
+    m_size.set((int64_t)ids_.size());
+    m_bytes.set((int64_t)tx_bytes_);
+    return {};
+}
+
+std::vector<SignedTx> Mempool::select(const LedgerState& st, const ChainParams& params, size_t max) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<SignedTx> out;
+    std::set<uint64_t> tokens_used;
+    for (auto& [from, pending] : by_sender_) {
+        if (out.size() >= max) break;
+        AccountState a = st.accounts.get(from).value_or(AccountState{});
+        // incoming transfers in the same block are ignored, so this never overestimates
+        for (auto it = pending.find(a.nonce); it != pending.end() && out.size() < max; ++it) {
+            auto& tx = it->second;
+            if (tx.nonce != a.nonce) break;
+            auto* transfer = std::get_if<CompactTx::Transfer>(&tx.payload);
+            int64_t cost = params.burn_fee + (transfer ? transfer->amount : 0);
+            if (a.balance < cost) break;
+            if (tx.type() == TxType::TRANSFER_NFT || tx.type() == TxType::BURN_NFT) {
+                uint64_t token = tx.type() == TxType::TRANSFER_NFT ? std::get<CompactTx::TransferNft>(tx.payload).token_id
+                                                                   : std::get<CompactTx::BurnNft>(tx.payload).token_id;
+                auto nft = st.nfts.find(token);
+                if (nft == st.nfts.end() || nft->second.first != from || !tokens_used.insert(token).second) break;
+            }
+            a.balance -= cost;
+            a.nonce++;
+            out.push_back(tx.to_signed());
+        }
+    }
+    return out;
+}
+
+void Mempool::remove_confirmed(const LedgerState& st) {
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t before = ids_.size();
+    for (auto it = by_sender_.begin(); it != by_sender_.end(); ) {
+        uint64_t used = st.accounts.get(it->first).value_or(AccountState{}).nonce;
+        auto& pending = it->second;
+        for (auto p = pending.begin(); p != pending.end() && p->first < used; p = pending.erase(p)) {
+            ids_.erase(p->second.txid());
+            tx_bytes_ -= p->second.memory_bytes();
+        }
+        it = pending.empty() ? by_sender_.erase(it) : std::next(it);
+    }
+    if (ids_.size() != before) version_++;
+    m_size.set((int64_t)ids_.size());
+    m_bytes.set((int64_t)tx_bytes_);
+}
+
+bool Mempool::contains(const std::string& txid) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return ids_.count(txid) > 0;
+}
+
+std::optional<SignedTx> Mempool::get(const std::string& txid) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = ids_.find(txid);
+    if (it == ids_.end()) return std::nullopt;
+    return by_sender_.at(it->second.first).at(it->second.second).to_signed();
+}
+
+size_t Mempool::size() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return ids_.size();
+}
+
+size_t Mempool::tx_bytes() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return tx_bytes_;
+}
+
+}
@@ -0,0 +1,157 @@
+#include "metrics.hpp"
+#include <asio.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+namespace axle {
+
+Histogram::Histogram(std::vector<double> bounds)
+: bounds_(std::move(bounds)), buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    std::sort(bounds_.begin(), bounds_.end());
+    for (size_t i=0;i<=bounds_.size();i++) buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::observe(double v) {
+    size_t i = std::lower_bound(bounds_.begin(), bounds_.end(), v) - bounds_.begin();
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+}
+
+std::vector<double> latency_buckets() {
+    return {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+}
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string& name, const std::string& help, const char* type) {
+    auto& f = families_[name];
+    if (f.type.empty()) { f.help = help; f.type = type; }
+    return f;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& slot = family(name, help, "counter").counters[labels];
+    if (!slot) slot = std::make_unique<Counter>();
+    return *slot;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& slot = family(name, help, "gauge").gauges[labels];
+    if (!slot) slot = std::make_unique<Gauge>();
+    return *slot;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help, const std::string& labels,
+                                      std::vector<double> bounds) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& slot = family(name, help, "histogram").histograms[labels];
+    if (!slot) slot = std::make_unique<Histogram>(std::move(bounds));
+    return *slot;
+}
+
+static std::string braces(const std::string& labels, const std::string& extra = "") {
+    if (labels.empty() && extra.empty()) return "";
+    if (labels.empty()) return "{" + extra + "}";
+    if (extra.empty()) return "{" + labels + "}";
+    return "{" + labels + "," + extra + "}";
+}
+
+std::string MetricsRegistry::render() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::ostringstream o;
+    for (auto& [name, f] : families_) {
+        o << "# HELP " << name << " " << f.help << "\n# TYPE " << name << " " << f.type << "\n";
+        for (auto& [l, c] : f.counters) o << name << braces(l) << " " << c->value() << "\n";
+        for (auto& [l, g] : f.gauges) o << name << braces(l) << " " << g->value() << "\n";
+        for (auto& [l, h] : f.histograms) {
+            uint64_t cum = 0;
+            for (size_t i=0;i<h->bounds().size();i++) {
+                cum += h->bucket(i);
+                std::ostringstream le; le << "le=\"" << h->bounds()[i] << "\"";
+                o << name << "_bucket" << braces(l, le.str()) << " " << cum << "\n";
+            }
+            cum += h->bucket(h->bounds().size());
+            o << name << "_bucket" << braces(l, "le=\"+Inf\"") << " " << cum << "\n";
+            o << name << "_sum" << braces(l) << " " << h->sum() << "\n";
+            o << name << "_count" << braces(l) << " " << cum << "\n";
+        }
+    }
+    return o.str();
+}
+
+MetricsRegistry& metrics() {
+    static MetricsRegistry reg;
+    return reg;
+}
+
+// Scrapes are served one at a time, so a client gets this long to send its request and take the reply.
+static constexpr int IO_TIMEOUT_MS = 2000;
+static constexpr size_t MAX_REQUEST = 8192;
+
+MetricsServer::~MetricsServer() { stop(); }
+
+bool MetricsServer::start(const std::string& host, uint16_t port) {
+    if (running_) return false;
+    running_ = true;
+    listen_ = {host, port};
+    server_thread_ = std::thread([this, host, port](){
+        try {
+            asio::io_context io;
+            asio::ip::tcp::acceptor acc(io, asio::ip::tcp::endpoint(asio::ip::make_address(host), port));
+            // runs the pending operation on sock for at most IO_TIMEOUT_MS; false if it failed or
+            // ran out of time, in which case it is cancelled and its handler has run
+            auto finish = [&](asio::ip::tcp::socket& sock, const bool& ok) {
+                io.restart();
+                io.run_for(std::chrono::milliseconds(IO_TIMEOUT_MS));
+                if (ok) return true;
+                sock.close();
+                io.restart();
+                io.run();
+                return false;
+            };
+            while (running_) {
+                asio::ip::tcp::socket sock(io);
+                acc.accept(sock);
+                if (!running_) break;
+                try {
+                    asio::streambuf buf(MAX_REQUEST);
+                    bool ok = false;
+                    asio::async_read_until(sock, buf, "\r\n\r\n", [&](const auto& ec, size_t) { ok = !ec; });
+                    if (!finish(sock, ok)) continue;
+                    std::istream is(&buf);
+                    std::string verb, path;
+                    is >> verb >> path;
+                    std::string body, status = "200 OK";
+                    if (verb == "GET" && (path == "/metrics" || path.rfind("/metrics?", 0) == 0)) body = metrics().render();
+                    else { status = "404 Not Found"; body = "not found\n"; }
+                    std::string s = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                                  + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                    ok = false;
+                    asio::async_write(sock, asio::buffer(s), [&](const auto& ec, size_t) { ok = !ec; });
+                    finish(sock, ok);
+                } catch (std::exception&) {}
+            }
+        } catch (std::exception& e) {
+            std::cerr << "[METRICS] error: " << e.what() << std::endl;
+        }
+    });
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (!running_) return;
+    running_ = false;
+    // wake the blocking accept so the loop sees running_ == false
+    try {
+        asio::io_context io;
+        asio::ip::tcp::socket s(io);
+        auto addr = asio::ip::make_address(listen_.first);
+        if (addr.is_unspecified()) addr = asio::ip::make_address("127.0.0.1");
+        s.connect({addr, listen_.second});
+    } catch (std::exception&) {}
+    if (server_thread_.joinable()) server_thread_.join();
+}
+
+}
@@ -1,12 +1,42 @@
 #include "miner.hpp"
 #include "block.hpp"
 #include "crypto.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iostream>
+#include <utility>
 
 namespace axle {
 
+using Steady = std::chrono::steady_clock;
+
+static Counter& m_hashes = metrics().counter("axle_miner_hashes_total", "Header hashes computed by the miner");
+static Counter& m_found = metrics().counter("axle_miner_blocks_found_total", "Headers found meeting the difficulty target");
+static Gauge& m_hashrate = metrics().gauge("axle_miner_hashrate", "Hashes per second over the last mine_block call or second of in-node mining");
+static Counter& m_templates = metrics().counter("axle_miner_templates_total", "Block templates built by the in-node miner");
+static Histogram& m_switch = metrics().histogram("axle_miner_template_switch_seconds",
+    "Time from noticing a new tip or transactions until every in-node mining thread hashes the new template", "",
+    {1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2, 5e-2, 0.1, 1});
+static Counter& m_orphaned_hashes = metrics().counter("axle_miner_orphaned_hashes_total",
+    "Estimated in-node hashes spent on a template after its parent stopped being the tip");
+static Counter& mined(const char* result) {
+    return metrics().counter("axle_miner_blocks_total", "Blocks solved by the in-node miner", std::string("result=\"") + result + "\"");
+}
+static Counter& m_accepted = mined("accepted");
+static Counter& m_orphaned = mined("orphaned");
+
 bool mine_block(Block& b, uint32_t difficulty_bits, uint64_t& iters) {
+    AXLE_TRACE_SCOPE("mine_block");
     iters = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    auto report = [&](){
+        m_hashes.inc(iters);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (secs > 0) m_hashrate.set((int64_t)(iters / secs));
+    };
     for (;;) {
         b.header.nonce++;
         b.hash = block_hash(b.header);
@@ -15,9 +45,208 @@ bool mine_block(Block& b, uint32_t difficulty_bits, uint64_t& iters) {
         auto h = unhex(b.hash);
         size_t zeros = 0;
         for (auto c: h) { if (c==0) zeros+=8; else { uint8_t v=c; while ((v&0x80)==0) { zeros++; v<<=1; } break; } }
-        if (zeros >= difficulty_bits) return true;
-        if (iters % 100000 == 0) return false; // yield to caller periodically
+        if (zeros >= difficulty_bits) { report(); m_found.inc(); return true; }
+        if (iters % 100000 == 0) { report(); return false; } // yield to caller periodically
+    }
+}
+
+Block build_template(Blockchain& chain, Mempool* mempool, const std::string& miner_address, size_t max_txs) {
+    std::vector<SignedTx> txs;
+    if (mempool) txs = mempool->select(chain.state(), chain.params(), max_txs);
+    Block b = chain.build_block(miner_address, txs);
+    if (b.header.state_root.empty() && !txs.empty()) {
+        std::cerr << "[MINER] pending transactions do not execute on the tip; mining an empty block" << std::endl;
+        b = chain.build_block(miner_address, {});
+    }
+    return b;
+}
+
+struct NodeMiner::Template {
+    uint64_t gen{0};
+    Block block;
+    Steady::time_point noticed;            // when the change it answers was seen
+    mutable std::atomic<unsigned> picked{0}; // workers that moved to it
+};
+
+NodeMiner::NodeMiner(Blockchain& chain, Mempool* mempool, std::string miner_address)
+: chain_(chain), mempool_(mempool), miner_address_(std::move(miner_address)) {}
+NodeMiner::~NodeMiner() { stop(); }
+
+void NodeMiner::start(unsigned threads) {
+    if (running_.exchange(true)) return;
+    threads = std::max(1u, threads);
+    refresher_ = std::thread([this]() { refresh_loop(); });
+    for (unsigned t=0; t<threads; t++) workers_.emplace_back([this, t, threads]() { work(t, threads); });
+}
+
+void NodeMiner::stop() {
+    if (!running_.exchange(false)) return;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        wake_ = true;
     }
+    cv_.notify_all();
+    refresher_.join();
+    for (auto& w : workers_) w.join();
+    workers_.clear();
+}
+
+// Polls the tip and the mempool and publishes a new template when either moved, when the chain
+// refused the last one, or when it is template_max_age_ms old. After a refusal the templates stay
+// empty until the tip moves, in case one of the transactions caused it.
+void NodeMiner::refresh_loop() {
+    std::string tip;
+    uint64_t version = 0;
+    bool empty = false;
+    Steady::time_point built, rate_t0 = Steady::now();
+    uint64_t rate_hashes = 0;
+    while (running_) {
+        bool rejected;
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait_for(lk, std::chrono::milliseconds(poll_ms), [&]{ return wake_; });
+            wake_ = false;
+            rejected = std::exchange(rejected_, false);
+        }
+        if (!running_) break;
+        auto noticed = Steady::now();
+        if (noticed - rate_t0 >= std::chrono::seconds(1)) {
+            uint64_t h = hashes_;
+            m_hashrate.set((int64_t)((h - rate_hashes) / std::chrono::duration<double>(noticed - rate_t0).count()));
+            rate_hashes = h;
+            rate_t0 = noticed;
+        }
+        auto tpl = std::make_shared<Template>();
+        {
+            std::lock_guard<std::mutex> lk(chain_.mutex());
+            bool new_tip = chain_.tip_hash() != tip;
+            bool txs_due = mempool_ && mempool_->version() != version && !empty &&
+                           noticed - built >= std::chrono::milliseconds(tx_refresh_ms);
+            bool stale = noticed - built >= std::chrono::milliseconds(template_max_age_ms);
+            if (!new_tip && !txs_due && !rejected && !stale) continue;
+            AXLE_TRACE_SCOPE("miner.template");
+            if (new_tip && mempool_) mempool_->remove_confirmed(chain_.state());
+            empty = !new_tip && (empty || rejected);
+            if (rejected && !new_tip) std::cerr << "[MINER] the chain refused our block; mining an empty one" << std::endl;
+            version = mempool_ ? mempool_->version() : 0;
+            tpl->block = build_template(chain_, empty ? nullptr : mempool_, miner_address_, max_block_txs);
+            tip = chain_.tip_hash();
+        }
+        tpl->gen = gen_ + 1;
+        tpl->noticed = noticed;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            current_ = tpl;
+            gen_.store(tpl->gen, std::memory_order_release);
+        }
+        built = Steady::now();
+        templates_++;
+        m_templates.inc();
+    }
+}
+
+// Worker t hashes nonces t, t+threads, ... of the current template, checking for a newer one
+// before every hash, until it or another worker solves it.
+void NodeMiner::work(unsigned t, unsigned threads) {
+    std::shared_ptr<const Template> tpl;
+    BlockHeader h;
+    uint64_t seen = 0, nonce = 0, n = 0; // n: hashes on tpl
+    Steady::time_point started;
+    while (running_) {
+        if (gen_.load(std::memory_order_acquire) != seen) {
+            std::shared_ptr<const Template> next;
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                next = current_;
+            }
+            auto now = Steady::now();
+            // work on the old parent after the new tip was noticed is orphaned; estimate it from
+            // this worker's rate on the old template
+            if (tpl && n && solved_ != seen && next->block.header.prev_hash != tpl->block.header.prev_hash) {
+                double on = std::chrono::duration<double>(now - started).count();
+                double late = std::chrono::duration<double>(now - next->noticed).count();
+                uint64_t lost = on > 0 ? std::min(n, (uint64_t)(n * late / on)) : 0;
+                orphaned_hashes_ += lost;
+                m_orphaned_hashes.inc(lost);
+            }
+            if (next->picked.fetch_add(1) + 1 == threads) {
+                auto us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - next->noticed).count();
+                switches_++;
+                switch_us_ += us;
+                for (uint64_t m = switch_us_max_; us > m && !switch_us_max_.compare_exchange_weak(m, us);) {}
+                m_switch.observe(us / 1e6);
+            }
+            tpl = std::move(next);
+            seen = tpl->gen;
+            h = tpl->block.header;
+            nonce = t;
+            n = 0;
+            started = now;
+        }
+        if (!tpl || solved_ == seen) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        uint64_t batch = 0;
+        for (; batch < 256 && gen_.load(std::memory_order_relaxed) == seen && running_; batch++) {
+            h.nonce = nonce;
+            nonce += threads;
+            if (hash_meets_bits(block_hash(h), h.difficulty_bits)) {
+                batch++;
+                if (solved_.exchange(seen) != seen) submit(*tpl, h.nonce);
+                break;
+            }
+        }
+        n += batch;
+        hashes_ += batch;
+        m_hashes.inc(batch);
+    }
+}
+
+void NodeMiner::submit(const Template& tpl, uint64_t nonce) {
+    AXLE_TRACE_SCOPE("miner.submit");
+    Block b = tpl.block;
+    b.header.nonce = nonce;
+    b.hash = block_hash(b.header);
+    found_++;
+    m_found.inc();
+    bool ok = false, refused = false;
+    {
+        std::lock_guard<std::mutex> lk(chain_.mutex());
+        if (chain_.tip_hash() == b.header.prev_hash) refused = !(ok = chain_.accept_block(b));
+        if (ok && mempool_) mempool_->remove_confirmed(chain_.state());
+    }
+    // rebuild right away rather than at the next poll, before broadcasting; a refused block
+    // leaves the tip where it was, so without the flag every worker would wait on its template
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        wake_ = true;
+        rejected_ = rejected_ || refused;
+    }
+    cv_.notify_all();
+    if (!ok) {
+        orphaned_++;
+        m_orphaned.inc();
+        return;
+    }
+    accepted_++;
+    m_accepted.inc();
+    std::cerr << "[MINER] mined block " << b.header.height << " hash=" << b.hash << std::endl;
+    if (on_block_) on_block_(b);
+}
+
+NodeMinerStats NodeMiner::stats() const {
+    NodeMinerStats s;
+    s.templates = templates_;
+    s.hashes = hashes_;
+    s.found = found_;
+    s.accepted = accepted_;
+    s.orphaned = orphaned_;
+    s.orphaned_hashes = orphaned_hashes_;
+    s.switches = switches_;
+    s.switch_ms_avg = s.switches ? switch_us_ / 1e3 / s.switches : 0;
+    s.switch_ms_max = switch_us_max_ / 1e3;
+    return s;
 }
 
 }
@@ -0,0 +1,357 @@
+#include "netsim.hpp"
+#include "block.hpp"
+#include "miner.hpp"
+#include <asio.hpp>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <set>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace axle {
+
+using Steady = std::chrono::steady_clock;
+
+// One side of a link: `from` reaches `to`'s port `target` by connecting to `acc`. Direction 0 is
+// what `from` sends, direction 1 what `to` answers.
+struct ProxyLink {
+    size_t from, to;
+    uint16_t target;
+    asio::ip::tcp::acceptor acc;
+    Steady::time_point busy[2]{}; // when each direction has finished sending what it has queued
+    std::atomic<uint64_t> bytes[2]{};
+    ProxyLink(asio::io_context& io, size_t f, size_t t, uint16_t tgt) : from(f), to(t), target(tgt), acc(io) {}
+};
+
+// One proxied connection. Everything runs on the proxies' io thread.
+struct Pipe : std::enable_shared_from_this<Pipe> {
+    struct Dir {
+        asio::ip::tcp::socket* src;
+        asio::ip::tcp::socket* dst;
+        std::array<char, 16384> buf;
+        std::deque<std::pair<Steady::time_point, std::string>> queue; // chunks, when they arrive
+        asio::steady_timer timer;
+        bool writing{false}, eof{false};
+        explicit Dir(asio::io_context& io) : timer(io) {}
+    };
+    ProxyLink& link;
+    LinkShape shape;
+    asio::ip::tcp::socket client, server;
+    Dir dirs[2];
+
+    Pipe(asio::io_context& io, ProxyLink& l, LinkShape s, asio::ip::tcp::socket c)
+    : link(l), shape(s), client(std::move(c)), server(io), dirs{Dir(io), Dir(io)} {
+        dirs[0].src = &client; dirs[0].dst = &server;
+        dirs[1].src = &server; dirs[1].dst = &client;
+    }
+
+    void start() {
+        auto self = shared_from_this();
+        server.async_connect({asio::ip::make_address("127.0.0.1"), link.target}, [self](const auto& ec) {
+            if (ec) { self->close(); return; }
+            self->read(0);
+            self->read(1);
+        });
+    }
+    void close() {
+        asio::error_code ec;
+        client.close(ec);
+        server.close(ec);
+    }
+    void read(int d) {
+        auto self = shared_from_this();
+        auto& dir = dirs[d];
+        dir.src->async_read_some(asio::buffer(dir.buf), [self, d](const auto& ec, size_t n) {
+            auto& dir = self->dirs[d];
+            if (ec) {
+                dir.eof = true;
+                if (!dir.writing) self->pump(d);
+                return;
+            }
+            self->queue(d, std::string(dir.buf.data(), n));
+            self->read(d);
+        });
+    }
+    // A chunk leaves once the link has sent everything queued before it at the link's
+    // bandwidth, and arrives latency_ms after that.
+    void queue(int d, std::string data) {
+        auto now = Steady::now();
+        auto start = std::max(now, link.busy[d]);
+        auto send = shape.bandwidth > 0 ? std::chrono::duration<double>(data.size() / shape.bandwidth) : std::chrono::duration<double>(0);
+        link.busy[d] = start + std::chrono::duration_cast<Steady::duration>(send);
+        link.bytes[d] += data.size();
+        auto at = link.busy[d] + std::chrono::duration_cast<Steady::duration>(std::chrono::duration<double, std::milli>(shape.latency_ms));
+        dirs[d].queue.push_back({at, std::move(data)});
+        if (!dirs[d].writing) pump(d);
+    }
+    void pump(int d) {
+        auto& dir = dirs[d];
+        if (dir.queue.empty()) {
+            dir.writing = false;
+            if (dir.eof) {
+                asio::error_code ec;
+                dir.dst->shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+            }
+            return;
+        }
+        dir.writing = true;
+        auto self = shared_from_this();
+        dir.timer.expires_at(dir.queue.front().first);
+        dir.timer.async_wait([self, d](const auto& ec) {
+            if (ec) return;
+            auto& dir = self->dirs[d];
+            asio::async_write(*dir.dst, asio::buffer(dir.queue.front().second), [self, d](const auto& ec, size_t) {
+                if (ec) { self->close(); return; }
+                self->dirs[d].queue.pop_front();
+                self->pump(d);
+            });
+        });
+    }
+};
+
+struct NetSim::Impl {
+    asio::io_context io;
+    asio::executor_work_guard<asio::io_context::executor_type> work{io.get_executor()};
+    std::vector<std::unique_ptr<ProxyLink>> links;
+    std::thread thread;
+    LinkShape shape;
+
+    // listens for `from` on a fresh loopback port; returns it
+    uint16_t add(size_t from, size_t to, uint16_t target) {
+        auto link = std::make_unique<ProxyLink>(io, from, to, target);
+        asio::ip::tcp::endpoint ep(asio::ip::make_address("127.0.0.1"), 0);
+        link->acc.open(ep.protocol());
+        link->acc.bind(ep);
+        link->acc.listen();
+        uint16_t port = link->acc.local_endpoint().port();
+        auto* l = link.get();
+        asio::post(io, [this, l]() { accept(*l); });
+        links.push_back(std::move(link));
+        return port;
+    }
+    void accept(ProxyLink& l) {
+        l.acc.async_accept([this, &l](const auto& ec, asio::ip::tcp::socket sock) {
+            if (ec) return;
+            std::make_shared<Pipe>(io, l, shape, std::move(sock))->start();
+            accept(l);
+        });
+    }
+};
+
+static uint16_t free_port() {
+    asio::io_context io;
+    asio::ip::tcp::acceptor acc(io, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), 0));
+    return acc.local_endpoint().port();
+}
+
+NetSim::NetSim(NetSimOptions o) : o_(std::move(o)) {}
+NetSim::~NetSim() {
+    stop();
+    nodes_.clear();
+    if (temp_) {
+        std::error_code ec;
+        fs::remove_all(o_.dir, ec);
+    }
+}
+
+bool NetSim::start_node(Node& n, std::string& err) {
+    std::error_code ec;
+    fs::copy(genesis_dir_, n.dir, fs::copy_options::recursive, ec);
+    if (ec) { err = "cannot create " + n.dir + ": " + ec.message(); return false; }
+    n.key = keygen();
+    n.storage = std::make_unique<Storage>(n.dir);
+    n.chain = std::make_unique<Blockchain>(*n.storage, chain_params_for("regtest"));
+    if (!n.chain->load()) { err = "cannot load " + n.dir; return false; }
+    PeerLimits limits;
+    limits.max_inbound = 64;
+    limits.max_inbound_per_host = 64; // every proxy connects from loopback
+    limits.max_outbound = 64;
+    n.p2p = std::make_unique<P2PNode>(*n.chain, limits);
+    n.p2p->set_mempool(&n.mempool);
+    n.p2p->announce_ms = o_.announce_ms;
+    n.p2p->sync_ms = o_.sync_ms;
+    size_t index = nodes_.size();
+    {
+        std::lock_guard<std::mutex> lk(times_mu_);
+        joined_.push_back(Steady::now());
+    }
+    n.p2p->on_block([this, index](const Block& b) {
+        std::lock_guard<std::mutex> lk(times_mu_);
+        arrived_[b.hash].push_back({index, Steady::now()});
+    });
+    n.port = free_port();
+    if (!n.p2p->start_listen("127.0.0.1", n.port)) { err = "cannot listen"; return false; }
+    return true;
+}
+
+bool NetSim::start(std::string& err) {
+    if (running_) return false;
+    temp_ = o_.dir.empty();
+    if (temp_) o_.dir = (fs::temp_directory_path() / ("axle-netsim-" + hex(random_bytes(4)))).string();
+    fs::create_directories(o_.dir);
+    // one genesis for everyone: created once, then copied into each datadir
+    genesis_dir_ = (fs::path(o_.dir) / "genesis").string();
+    {
+        Storage st(genesis_dir_);
+        Blockchain chain(st, chain_params_for("regtest"));
+        if (!chain.load()) { err = "cannot create genesis"; return false; }
+    }
+    impl_ = std::make_unique<Impl>();
+    impl_->shape = o_.link;
+    impl_->thread = std::thread([this]() { impl_->io.run(); });
+    running_ = true;
+    for (size_t i=0; i<o_.nodes; i++) {
+        auto n = std::make_unique<Node>();
+        n->dir = (fs::path(o_.dir) / ("node-" + std::to_string(i))).string();
+        if (!start_node(*n, err)) return false;
+        nodes_.push_back(std::move(n));
+    }
+
+    size_t n = nodes_.size();
+    std::set<std::pair<size_t, size_t>> edges;
+    auto edge = [&](size_t a, size_t b) { if (a != b) edges.insert({std::min(a, b), std::max(a, b)}); };
+    const std::string& t = o_.topology;
+    if (t == "line" || t == "ring") {
+        for (size_t i=0; i+1<n; i++) edge(i, i + 1);
+        if (t == "ring" && n > 2) edge(n - 1, 0);
+    } else if (t == "star") {
+        for (size_t i=1; i<n; i++) edge(0, i);
+    } else if (t == "full") {
+        for (size_t i=0; i<n; i++) for (size_t j=i+1; j<n; j++) edge(i, j);
+    } else if (t.rfind("random:", 0) == 0) {
+        size_t k = std::stoul(t.substr(7));
+        std::mt19937 rng(o_.seed);
+        for (size_t i=0; i<n && n > 1; i++)
+            for (size_t j=0; j<std::min(k, n - 1); j++) edge(i, (i + 1 + rng() % (n - 1)) % n);
+        for (size_t i=0; i+1<n; i++) edge(i, i + 1); // keeps it connected
+    } else {
+        err = "unknown topology " + t;
+        return false;
+    }
+    for (auto [a, b] : edges) connect(a, b);
+    return true;
+}
+
+void NetSim::connect(size_t a, size_t b) {
+    nodes_.at(a)->p2p->add_peer("127.0.0.1", impl_->add(a, b, nodes_.at(b)->port));
+    nodes_.at(b)->p2p->add_peer("127.0.0.1", impl_->add(b, a, nodes_.at(a)->port));
+}
+
+size_t NetSim::add_node(const std::vector<size_t>& peers) {
+    auto n = std::make_unique<Node>();
+    n->dir = (fs::path(o_.dir) / ("node-" + std::to_string(nodes_.size()))).string();
+    std::string err;
+    if (!start_node(*n, err)) throw std::runtime_error(err);
+    nodes_.push_back(std::move(n));
+    size_t i = nodes_.size() - 1;
+    for (auto p : peers) connect(i, p);
+    return i;
+}
+
+void NetSim::stop() {
+    if (!running_) return;
+    running_ = false;
+    for (size_t i=0; i<nodes_.size(); i++) final_traffic_.push_back(traffic(i));
+    // proxies first, so exchanges in flight fail at once instead of running into timeouts
+    impl_->work.reset();
+    impl_->io.stop();
+    impl_->thread.join();
+    impl_.reset();
+    for (auto& n : nodes_) n->p2p->stop();
+}
+
+std::optional<Block> NetSim::mine(size_t i) {
+    auto& n = *nodes_.at(i);
+    Block b;
+    {
+        std::lock_guard<std::mutex> lk(n.chain->mutex());
+        n.mempool.remove_confirmed(n.chain->state());
+        b = build_template(*n.chain, &n.mempool, address_from_pubkey(n.key.pub), 1000);
+        uint64_t iters = 0;
+        while (!mine_block(b, b.header.difficulty_bits, iters)) {}
+        if (!n.chain->accept_block(b)) return std::nullopt;
+        n.mempool.remove_confirmed(n.chain->state());
+        std::lock_guard<std::mutex> tl(times_mu_);
+        mined_.push_back({b.hash, Steady::now()});
+    }
+    n.p2p->broadcast_block(b);
+    return b;
+}
+
+bool NetSim::submit_tx(size_t i, const SignedTx& tx) {
+    auto& n = *nodes_.at(i);
+    {
+        std::lock_guard<std::mutex> lk(n.chain->mutex());
+        if (!n.mempool.add(tx, n.chain->state()).ok) return false;
+    }
+    n.p2p->announce_tx(tx.id);
+    return true;
+}
+
+uint64_t NetSim::max_height() {
+    uint64_t h = 0;
+    for (auto& n : nodes_) {
+        std::lock_guard<std::mutex> lk(n->chain->mutex());
+        h = std::max(h, n->chain->tip_height());
+    }
+    return h;
+}
+
+bool NetSim::wait_for_height(uint64_t h, int timeout_ms, const std::vector<size_t>& which) {
+    auto deadline = Steady::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        bool all = true;
+        for (size_t i=0; i<nodes_.size() && all; i++) {
+            if (!which.empty() && std::find(which.begin(), which.end(), i) == which.end()) continue;
+            std::lock_guard<std::mutex> lk(nodes_[i]->chain->mutex());
+            all = nodes_[i]->chain->tip_height() >= h;
+        }
+        if (all) return true;
+        if (Steady::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+PropagationStats NetSim::propagation() const {
+    std::lock_guard<std::mutex> lk(times_mu_);
+    PropagationStats s;
+    s.blocks = mined_.size();
+    for (auto& [hash, t0] : mined_) {
+        // only nodes already running when the block was mined; later ones catch up by syncing
+        size_t others = 0;
+        for (auto& j : joined_) if (j <= t0) others++;
+        others = others ? others - 1 : 0;
+        auto it = arrived_.find(hash);
+        size_t got = 0;
+        double last = 0;
+        if (it != arrived_.end()) {
+            for (auto& [node, t] : it->second) {
+                if (joined_[node] > t0) continue;
+                double ms = std::chrono::duration<double, std::milli>(t - t0).count();
+                s.arrival_ms.push_back(ms);
+                last = std::max(last, ms);
+                got++;
+            }
+        }
+        if (got >= others) s.full_ms.push_back(last);
+        else s.missed += others - got;
+    }
+    return s;
+}
+
+NodeTraffic NetSim::traffic(size_t i) const {
+    NodeTraffic t;
+    if (!impl_) return i < final_traffic_.size() ? final_traffic_[i] : t;
+    for (auto& l : impl_->links) {
+        if (l->from == i) { t.sent_bytes += l->bytes[0]; t.recv_bytes += l->bytes[1]; }
+        if (l->to == i) { t.recv_bytes += l->bytes[0]; t.sent_bytes += l->bytes[1]; }
+    }
+    return t;
+}
+
+}
@@ -0,0 +1,199 @@
+#include "nft_store.hpp"
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+
+namespace axle {
+
+// A null pointer stands for the empty string / empty metadata, so default-constructed and
+// moved-from values never touch the pools.
+
+struct InternedString::Node {
+    std::atomic<uint32_t> refs{1};
+    std::string s;
+};
+
+// name, then uri suffix, follow the struct in the same allocation
+struct NftMetaRef::Record {
+    std::atomic<uint32_t> refs{1};
+    uint32_t name_len{0}, suffix_len{0};
+    InternedString symbol, uri_prefix;
+
+    const char* chars() const { return reinterpret_cast<const char*>(this + 1); }
+    std::string_view name() const { return {chars(), name_len}; }
+    std::string_view suffix() const { return {chars() + name_len, suffix_len}; }
+};
+
+namespace {
+
+using Node = InternedString::Node;
+using Record = NftMetaRef::Record;
+
+// The pools are sets of the entries themselves, looked up by content, so each entry costs one
+// hash node. They are never destroyed, so values held by other statics stay valid through exit.
+struct NodeHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    size_t operator()(const Node* n) const { return (*this)(n->s); }
+};
+struct NodeEq {
+    using is_transparent = void;
+    static std::string_view view(std::string_view s) { return s; }
+    static std::string_view view(const Node* n) { return n->s; }
+    template <class A, class B> bool operator()(const A& a, const B& b) const { return view(a) == view(b); }
+};
+
+struct MetaKey {
+    std::string_view name, symbol, prefix, suffix;
+};
+struct RecordHash {
+    using is_transparent = void;
+    size_t operator()(const MetaKey& k) const {
+        std::hash<std::string_view> h;
+        size_t v = h(k.name);
+        for (auto s : {k.symbol, k.prefix, k.suffix}) v = v * 1099511628211ull ^ h(s);
+        return v;
+    }
+    size_t operator()(const Record* r) const { return (*this)(key_of(r)); }
+    static MetaKey key_of(const Record* r) { return {r->name(), r->symbol.str(), r->uri_prefix.str(), r->suffix()}; }
+};
+struct RecordEq {
+    using is_transparent = void;
+    static MetaKey view(const MetaKey& k) { return k; }
+    static MetaKey view(const Record* r) { return RecordHash::key_of(r); }
+    template <class A, class B> bool operator()(const A& a, const B& b) const {
+        auto x = view(a), y = view(b);
+        return x.name == y.name && x.symbol == y.symbol && x.prefix == y.prefix && x.suffix == y.suffix;
+    }
+};
+
+template <class T, class Hash, class Eq>
+struct Pool {
+    std::mutex mu;
+    std::unordered_set<T*, Hash, Eq> set;
+    size_t bytes{0};
+};
+using StringPool = Pool<Node, NodeHash, NodeEq>;
+using MetaPool = Pool<Record, RecordHash, RecordEq>;
+StringPool& strings() { static auto* p = new StringPool; return *p; }
+MetaPool& metas() { static auto* p = new MetaPool; return *p; }
+
+size_t entry_bytes(const Node* n) { return sizeof(Node) + (n->s.capacity() > 15 ? n->s.capacity() + 1 : 0); }
+size_t entry_bytes(const Record* r) { return sizeof(Record) + r->name_len + r->suffix_len; }
+
+void destroy(Node* n) { delete n; }
+void destroy(Record* r) {
+    r->~Record();
+    ::operator delete(r);
+}
+
+// Drops one reference; the last one removes the entry under the pool lock. Only holders can
+// take refs from 1 to 0, and interning takes the lock, so nobody revives an entry being freed.
+template <class P, class T>
+void release(P& pool, T* p) {
+    if (!p) return;
+    uint32_t r = p->refs.load(std::memory_order_relaxed);
+    while (r > 1)
+        if (p->refs.compare_exchange_weak(r, r - 1, std::memory_order_acq_rel)) return;
+    std::lock_guard<std::mutex> lk(pool.mu);
+    if (p->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    pool.set.erase(p);
+    pool.bytes -= entry_bytes(p);
+    destroy(p);
+}
+
+// takes a reference to the entry matching `key`, if there is one; caller holds the lock
+template <class T, class H, class E, class K>
+T* find_ref(Pool<T, H, E>& pool, const K& key) {
+    auto it = pool.set.find(key);
+    if (it == pool.set.end()) return nullptr;
+    (*it)->refs.fetch_add(1, std::memory_order_relaxed);
+    return *it;
+}
+
+template <class P>
+size_t pool_memory(const P& pool) {
+    // unordered_set node: value, next pointer and cached hash, plus a bucket slot
+    return pool.bytes + pool.set.size() * 3 * sizeof(void*) + pool.set.bucket_count() * sizeof(void*);
+}
+
+const std::string& empty_string() { static const std::string e; return e; }
+
+}
+
+InternedString::InternedString(std::string_view s) : n_(nullptr) {
+    if (s.empty()) return;
+    auto& pool = strings();
+    std::lock_guard<std::mutex> lk(pool.mu);
+    if ((n_ = find_ref(pool, s))) return;
+    n_ = new Node;
+    n_->s.assign(s);
+    pool.set.insert(n_);
+    pool.bytes += entry_bytes(n_);
+}
+
+InternedString::InternedString(const InternedString& o) : n_(o.n_) {
+    if (n_) n_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+InternedString::~InternedString() { release(strings(), n_); }
+
+const std::string& InternedString::str() const { return n_ ? n_->s : empty_string(); }
+
+NftMetaRef::NftMetaRef(const NFTMeta& m) : r_(nullptr) {
+    if (m.name.empty() && m.symbol.empty() && m.uri.empty()) return;
+    std::string_view uri(m.uri);
+    auto cut = uri.rfind('/');
+    cut = cut == std::string_view::npos ? 0 : cut + 1;
+    MetaKey key{m.name, m.symbol, uri.substr(0, cut), uri.substr(cut)};
+    auto& pool = metas();
+    {
+        std::lock_guard<std::mutex> lk(pool.mu);
+        if ((r_ = find_ref(pool, key))) return;
+    }
+    // Build it outside the lock (interning takes the string pool's); another thread may insert
+    // the same content meanwhile, in which case its record wins.
+    auto* r = new (::operator new(sizeof(Record) + key.name.size() + key.suffix.size())) Record;
+    r->name_len = (uint32_t)key.name.size();
+    r->suffix_len = (uint32_t)key.suffix.size();
+    std::memcpy(reinterpret_cast<char*>(r + 1), key.name.data(), key.name.size());
+    std::memcpy(reinterpret_cast<char*>(r + 1) + key.name.size(), key.suffix.data(), key.suffix.size());
+    r->symbol = InternedString(key.symbol);
+    r->uri_prefix = InternedString(key.prefix);
+    std::lock_guard<std::mutex> lk(pool.mu);
+    if ((r_ = find_ref(pool, key))) { destroy(r); return; }
+    pool.set.insert(r);
+    pool.bytes += entry_bytes(r);
+    r_ = r;
+}
+
+NftMetaRef::NftMetaRef(const NftMetaRef& o) : r_(o.r_) {
+    if (r_) r_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+NftMetaRef::~NftMetaRef() { release(metas(), r_); }
+
+std::string_view NftMetaRef::name() const { return r_ ? r_->name() : std::string_view(); }
+const std::string& NftMetaRef::symbol() const { return r_ ? r_->symbol.str() : empty_string(); }
+const std::string& NftMetaRef::uri_prefix() const { return r_ ? r_->uri_prefix.str() : empty_string(); }
+std::string_view NftMetaRef::uri_suffix() const { return r_ ? r_->suffix() : std::string_view(); }
+
+NftStoreStats nft_store_stats() {
+    NftStoreStats st;
+    {
+        auto& pool = strings();
+        std::lock_guard<std::mutex> lk(pool.mu);
+        st.strings = pool.set.size();
+        for (auto* n : pool.set) st.string_bytes += n->s.size();
+        st.memory_bytes += pool_memory(pool);
+    }
+    auto& pool = metas();
+    std::lock_guard<std::mutex> lk(pool.mu);
+    st.records = pool.set.size();
+    st.memory_bytes += pool_memory(pool);
+    return st;
+}
+
+}
@@ -1,62 +1,715 @@
 #include "p2p.hpp"
+#include "block.hpp"
 #include "encoding.hpp"
 #include "crypto.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "snapshot.hpp"
+#include "tx.hpp"
 #include <asio.hpp>
 #include <nlohmann/json.hpp>
+#include <algorithm>
 #include <iostream>
+#include <map>
 
 using json = nlohmann::json;
 
 namespace axle {
 
-P2PNode::P2PNode(Blockchain& chain) : chain_(chain) {}
+static Gauge& m_peers = metrics().gauge("axle_p2p_peers", "Configured outbound peers");
+static Counter& m_inbound = metrics().counter("axle_p2p_inbound_connections_total", "Accepted inbound P2P connections");
+static Counter& m_broadcasts = metrics().counter("axle_p2p_blocks_broadcast_total", "Blocks sent to peers");
+static Counter& m_send_errors = metrics().counter("axle_p2p_send_errors_total", "Failed sends to peers");
+static Counter& m_sent = metrics().counter("axle_p2p_sent_bytes_total", "Bytes sent to peers");
+static Counter& m_tx_announced = metrics().counter("axle_p2p_tx_announced_total", "Txids announced to peers");
+static Counter& m_tx_inv_received = metrics().counter("axle_p2p_tx_inv_received_total", "Txids announced by peers");
+static Counter& m_tx_requested = metrics().counter("axle_p2p_tx_requested_total", "Tx bodies requested from peers");
+static Counter& m_tx_received = metrics().counter("axle_p2p_tx_received_total", "Tx bodies received from peers");
+static Counter& m_tx_accepted = metrics().counter("axle_p2p_tx_accepted_total", "Relayed txs admitted to the mempool");
+static Counter& m_tx_timeouts = metrics().counter("axle_p2p_tx_request_timeouts_total", "Requested tx bodies that did not arrive in time");
+static Counter& m_tx_inv_bytes = metrics().counter("axle_p2p_tx_relay_bytes_total", "Bytes sent to relay txs", "kind=\"inv\"");
+static Counter& m_tx_body_bytes = metrics().counter("axle_p2p_tx_relay_bytes_total", "Bytes sent to relay txs", "kind=\"tx\"");
+static Counter& blocks_received(const char* source) {
+    return metrics().counter("axle_p2p_blocks_received_total", "Blocks from peers that extended the chain", std::string("source=\"") + source + "\"");
+}
+static Counter& m_blocks_pushed = blocks_received("push");
+static Counter& m_blocks_synced = blocks_received("sync");
+static Histogram& m_tx_relay = metrics().histogram("axle_p2p_tx_relay_seconds",
+    "From queueing a txid for announcement to handing its body to a peer", "",
+    {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5});
+
+// Bounds on what one peer can make the node buffer or do per message.
+constexpr size_t MAX_LINE_BYTES = 16 << 20;  // a block, or a snapshot chunk, as JSON
+constexpr size_t MAX_INV_TXIDS = 5000;
+constexpr int IO_TIMEOUT_MS = 2000;
+constexpr int TX_REQUEST_TIMEOUT_MS = 2 * IO_TIMEOUT_MS; // the bodies follow on the inv's connection
+constexpr size_t MAX_IN_FLIGHT = 100000;
+constexpr size_t MAX_ANNOUNCERS = 8; // kept per requested txid, to ask on timeout
+
+// Misbehavior points; PeerLimits::ban_score of them gets the host banned.
+constexpr int SCORE_MALFORMED = 10;
+constexpr int SCORE_UNKNOWN_TYPE = 5;
+constexpr int SCORE_OVERSIZED = 50;
+constexpr int SCORE_UNREQUESTED = 20;
+constexpr int SCORE_TIMEOUT = 5; // an inbound read or write ran out of time, holding a slot meanwhile
+constexpr int SCORE_INVALID_BLOCK = 20; // fails validation on top of a block we have
+constexpr int PUSH_SYNC_INTERVAL_MS = 250; // pushed blocks from ahead trigger a sync at most this often
+
+struct P2PNode::Connection {
+    asio::io_context io;
+    asio::ip::tcp::socket sock{io};
+    std::string host;
+};
+
+P2PNode::P2PNode(Blockchain& chain, PeerLimits limits) : chain_(chain), manager_(limits) {}
 P2PNode::~P2PNode() { stop(); }
 
+// Runs io until `done` or timeout_ms pass; on timeout the socket is closed. False on timeout.
+static bool run_until(asio::io_context& io, asio::ip::tcp::socket& sock, const bool& done, int timeout_ms) {
+    io.restart();
+    io.run_for(std::chrono::milliseconds(timeout_ms));
+    if (done) return true;
+    sock.close();
+    io.restart();
+    io.run();
+    return false;
+}
+
+// Reads one '\n'-terminated line of at most MAX_LINE_BYTES, giving up after timeout_ms (and
+// setting *timed_out, if given).
+static std::optional<std::string> read_line(asio::io_context& io, asio::ip::tcp::socket& sock, int timeout_ms,
+                                            bool* timed_out = nullptr) {
+    asio::streambuf buf(MAX_LINE_BYTES);
+    bool done = false, failed = false;
+    asio::async_read_until(sock, buf, '\n', [&](const auto& ec, size_t){ failed = (bool)ec; done = true; });
+    if (!run_until(io, sock, done, timeout_ms)) {
+        if (timed_out) *timed_out = true;
+        return std::nullopt;
+    }
+    if (failed) return std::nullopt;
+    std::istream is(&buf);
+    std::string line;
+    std::getline(is, line);
+    return line;
+}
+
+// Writes all of s, giving up after timeout_ms so a peer that stops reading cannot stall us.
+static bool write_all(asio::io_context& io, asio::ip::tcp::socket& sock, const std::string& s, int timeout_ms,
+                      bool* timed_out = nullptr) {
+    bool done = false, failed = false;
+    asio::async_write(sock, asio::buffer(s), [&](const auto& ec, size_t){ failed = (bool)ec; done = true; });
+    if (!run_until(io, sock, done, timeout_ms)) {
+        if (timed_out) *timed_out = true;
+        return false;
+    }
+    return !failed;
+}
+
+static bool connect(asio::io_context& io, asio::ip::tcp::socket& sock, const std::string& host, uint16_t port, int timeout_ms) {
+    bool done = false, failed = false;
+    asio::ip::tcp::endpoint ep(asio::ip::make_address(host), port);
+    sock.async_connect(ep, [&](const auto& ec){ failed = (bool)ec; done = true; });
+    return run_until(io, sock, done, timeout_ms) && !failed;
+}
+
+// Answers a peer's request line. Blocks and snapshot pieces go out as the bytes on disk. Sets
+// ex.more when the peer will send a follow-up on the same connection (tx bodies after get_txs).
+std::string P2PNode::handle_request(const std::string& line, Exchange& ex) {
+    json req = json::parse(line, nullptr, false);
+    bool object = !req.is_discarded() && req.is_object();
+    std::string type = object && req.contains("type") && req["type"].is_string() ? req["type"].get<std::string>() : "";
+    ex.type = type;
+    manager_.record_received(ex.host, type, line.size());
+    if (!object || type.empty()) {
+        manager_.misbehaving(ex.host, SCORE_MALFORMED, "malformed message");
+        return "";
+    }
+    // blocks and snapshot pieces are read from disk without holding the chain; block files are
+    // replaced whole, so a concurrent write is seen before or after, never half done
+    if (type == "get_block") {
+        uint64_t h = req.value("height", (uint64_t)0), pruned_below, tip;
+        {
+            std::lock_guard<std::mutex> lk(chain_.mutex());
+            pruned_below = chain_.pruned_below();
+            tip = chain_.tip_height();
+        }
+        if (h < pruned_below) return json{{"error","block pruned"}, {"pruned_below", pruned_below}}.dump();
+        auto blk = h <= tip ? chain_.storage().read_block_bytes(h) : std::nullopt;
+        if (blk) return "{\"block\":" + *blk + "}";
+        return json{{"error","not found"}}.dump();
+    } else if (type == "get_snapshot_manifest") {
+        if (auto m = read_snapshot_manifest(chain_.storage(), req.value("hash", ""))) return *m;
+        return json{{"error","not found"}}.dump();
+    } else if (type == "get_snapshot_chunk") {
+        if (auto c = read_snapshot_chunk(chain_.storage(), req.value("height", (uint64_t)0), req.value("index", (size_t)0))) return *c;
+        return json{{"error","not found"}}.dump();
+    }
+    std::lock_guard<std::mutex> lk(chain_.mutex());
+    if (type == "inv") {
+        if (!mempool_ || !req.contains("txids") || !req["txids"].is_array()) return "";
+        if (req["txids"].size() > MAX_INV_TXIDS) {
+            manager_.misbehaving(ex.host, SCORE_OVERSIZED, "inv too large");
+            return "";
+        }
+        uint16_t port = req.value("port", (uint16_t)0);
+        json want = json::array();
+        std::lock_guard<std::mutex> rl(relay_mu_);
+        Peer* from = nullptr;
+        for (auto& p : peers_) if (p->host == ex.host && p->port == port) from = p.get();
+        for (auto& id : req["txids"]) {
+            if (!id.is_string()) continue;
+            const std::string& txid = id.get_ref<const std::string&>();
+            inv_received_++;
+            m_tx_inv_received.inc();
+            if (from) from->known.insert(txid);
+            if (seen_.contains(txid) || mempool_->contains(txid)) continue;
+            // asked for once; another announcer is only remembered, and asked if that request times out
+            auto now = Clock::now();
+            if (auto it = inflight_.find(txid); it != inflight_.end() && it->second.expires > now) {
+                auto& others = it->second.others;
+                if (from && others.size() < MAX_ANNOUNCERS && std::find(others.begin(), others.end(), from) == others.end())
+                    others.push_back(from);
+                continue;
+            }
+            if (inflight_.size() >= MAX_IN_FLIGHT) continue;
+            inflight_[txid] = {now + std::chrono::milliseconds(TX_REQUEST_TIMEOUT_MS), ex.host, {}};
+            want.push_back(txid);
+        }
+        requested_ += want.size();
+        m_tx_requested.inc(want.size());
+        ex.wanted = want.size();
+        ex.more = !want.empty();
+        return json{{"type","get_txs"},{"txids",want}}.dump();
+    } else if (type == "txs") {
+        if (!mempool_ || !req.contains("txs") || !req["txs"].is_array()) return "";
+        if (req["txs"].size() > ex.wanted) {
+            manager_.misbehaving(ex.host, SCORE_UNREQUESTED, "unrequested txs");
+            return "";
+        }
+        receive_txs(req["txs"], ex.host);
+        return "";
+    } else if (type == "get_txs") {
+        // a peer whose request elsewhere timed out asks us directly
+        if (!mempool_ || !req.contains("txids") || !req["txids"].is_array()) return "";
+        if (req["txids"].size() > MAX_INV_TXIDS) {
+            manager_.misbehaving(ex.host, SCORE_OVERSIZED, "get_txs too large");
+            return "";
+        }
+        std::string body = "{\"txs\":[";
+        bool first = true;
+        for (auto& id : req["txids"]) {
+            if (!id.is_string()) continue;
+            auto tx = mempool_->get(id.get<std::string>());
+            if (!tx) continue;
+            if (!first) body += ",";
+            body += to_json(*tx);
+            first = false;
+        }
+        body += "],\"type\":\"txs\"}";
+        tx_bytes_ += body.size();
+        m_tx_body_bytes.inc(body.size());
+        return body;
+    } else if (type == "block") {
+        if (!req.contains("data") || !req["data"].is_object()) {
+            manager_.misbehaving(ex.host, SCORE_MALFORMED, "malformed block");
+            return "";
+        }
+        blocks_pushed_++;
+        std::string raw = req["data"].dump();
+        Block b;
+        try {
+            b = block_from_json(raw);
+        } catch (std::exception&) {
+            manager_.misbehaving(ex.host, SCORE_MALFORMED, "malformed block");
+            return "";
+        }
+        if (b.header.height > chain_.tip_height() + 1) {
+            // we are missing its ancestors; fetch them from our peers now, if the header shows
+            // real work (difficulty moves at most a bit per block, so it is at most the gap
+            // below ours) and no other push did so just now
+            uint64_t gap = b.header.height - chain_.tip_height();
+            uint32_t bits = chain_.current_difficulty_bits(), least = gap < bits ? bits - (uint32_t)gap : 0;
+            if (b.hash != block_hash(b.header) || b.header.difficulty_bits > MAX_DIFFICULTY_BITS ||
+                b.header.difficulty_bits < least || !hash_meets_bits(b.hash, b.header.difficulty_bits)) {
+                manager_.misbehaving(ex.host, SCORE_MALFORMED, "block without proof of work");
+                return "";
+            }
+            std::lock_guard<std::mutex> sl(sync_mu_);
+            auto now = Clock::now();
+            if (now - last_push_sync_ < std::chrono::milliseconds(PUSH_SYNC_INTERVAL_MS)) return "";
+            last_push_sync_ = now;
+            sync_now_ = true;
+            sync_cv_.notify_one();
+            return "";
+        }
+        // a known block is not passed on again, so relay ends
+        if (chain_.knows_block(b.hash)) return "";
+        if (!chain_.accept_block(b)) {
+            // on a parent we lack it is a fork we have not seen, not necessarily a bad block
+            if (chain_.knows_block(b.header.prev_hash)) manager_.misbehaving(ex.host, SCORE_INVALID_BLOCK, "invalid block");
+            return "";
+        }
+        block_accepted(b, true);
+        queue_block(raw, ex.host);
+        return "";
+    }
+    manager_.misbehaving(ex.host, SCORE_UNKNOWN_TYPE, "unknown message type " + type.substr(0, 32));
+    return "";
+}
+
+// One inbound connection: hello, then at most one request (and its follow-up, if any).
+void P2PNode::serve(Connection& c) {
+    MemScope mem(MemTag::P2P);
+    auto& io = c.io;
+    auto& sock = c.sock;
+    bool timed_out = false;
+    try {
+        std::string hello;
+        {
+            AXLE_TRACE_SCOPE("p2p.hello");
+            // on connect, send tip height
+            std::lock_guard<std::mutex> lk(chain_.mutex());
+            json j = {{"type","hello"},{"height",chain_.tip_height()}};
+            // pruned nodes can't serve old bodies; peers should fetch those elsewhere
+            if (chain_.pruned()) { j["pruned"] = true; j["pruned_below"] = chain_.pruned_below(); }
+            hello = j.dump()+"\n";
+        }
+        if (!write_all(io, sock, hello, IO_TIMEOUT_MS, &timed_out)) {
+            if (timed_out) manager_.misbehaving(c.host, SCORE_TIMEOUT, "timed out");
+            return;
+        }
+        manager_.record_sent(c.host, "hello", hello.size());
+        Exchange ex;
+        ex.host = c.host;
+        ex.more = true;
+        for (int i=0; i<2 && ex.more && running_; i++) {
+            ex.more = false;
+            auto line = read_line(io, sock, IO_TIMEOUT_MS, &timed_out);
+            if (!line) break;
+            AXLE_TRACE_SCOPE("p2p.request");
+            auto t0 = std::chrono::steady_clock::now();
+            auto reply = handle_request(*line, ex);
+            if (!reply.empty()) {
+                reply += "\n";
+                if (!write_all(io, sock, reply, IO_TIMEOUT_MS, &timed_out)) break;
+                m_sent.inc(reply.size());
+                manager_.record_sent(c.host, ex.type, reply.size());
+            }
+            manager_.record_exchange(c.host, ex.type, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            if (manager_.banned(c.host)) break;
+        }
+    } catch (std::exception&) {
+        // the peer went away mid-exchange
+    }
+    // a peer that closes is fine; one that sits on the connection until it times out costs points
+    if (timed_out) manager_.misbehaving(c.host, SCORE_TIMEOUT, "timed out");
+}
+
 bool P2PNode::start_listen(const std::string& host, uint16_t port) {
     if (running_) return false;
     running_ = true;
+    listen_ = {host, port};
     server_thread_ = std::thread([this, host, port](){
+        MemScope mem(MemTag::P2P);
         try {
             asio::io_context io;
             asio::ip::tcp::acceptor acc(io, asio::ip::tcp::endpoint(asio::ip::make_address(host), port));
             while (running_) {
-                asio::ip::tcp::socket sock(io);
-                acc.accept(sock);
-                // Very simple: on connect, send tip height
-                auto tip = chain_.tip_height();
-                json j = {{"type","hello"},{"height",tip}};
-                std::string s = j.dump()+"\n";
-                asio::write(sock, asio::buffer(s));
+                // each connection gets its own io_context and thread, so a slow peer only
+                // holds up its own slot; PeerManager caps how many slots there are
+                auto c = std::make_unique<Connection>();
+                acc.accept(c->sock);
+                if (!running_) break;
+                m_inbound.inc();
+                asio::error_code ec;
+                auto remote = c->sock.remote_endpoint(ec);
+                if (ec) continue;
+                c->host = remote.address().to_string();
+                if (!manager_.admit_inbound(c->host)) continue; // banned or full: just close
+                {
+                    std::lock_guard<std::mutex> lk(serving_mu_);
+                    serving_++;
+                }
+                std::thread([this, c = std::move(c)]() {
+                    serve(*c);
+                    manager_.release_inbound(c->host);
+                    std::lock_guard<std::mutex> lk(serving_mu_);
+                    serving_--;
+                    serving_cv_.notify_all();
+                }).detach();
             }
         } catch (std::exception& e) {
             std::cerr << "[P2P] listen error: " << e.what() << std::endl;
         }
     });
+    {
+        std::lock_guard<std::mutex> lk(relay_mu_);
+        for (auto& p : peers_) p->sender = std::thread([this, peer = p.get()](){ send_loop(*peer); });
+    }
+    if (mempool_) relay_thread_ = std::thread([this](){ relay_loop(); });
+    sync_thread_ = std::thread([this](){ sync_loop(); });
     return true;
 }
 
 void P2PNode::add_peer(const std::string& host, uint16_t port) {
-    peers_.push_back({host, port});
+    std::string key = host + ":" + std::to_string(port);
+    if (!manager_.add_outbound(key)) {
+        std::cerr << "[P2P] not adding peer " << key << ": already known or outbound slots full" << std::endl;
+        return;
+    }
+    std::lock_guard<std::mutex> lk(relay_mu_);
+    auto p = std::make_unique<Peer>();
+    p->host = host;
+    p->port = port;
+    p->key = key;
+    if (running_) p->sender = std::thread([this, peer = p.get()](){ send_loop(*peer); });
+    peers_.push_back(std::move(p));
+    m_peers.set((int64_t)peers_.size());
+}
+
+void P2PNode::enqueue(Peer& p, Outgoing m) {
+    if (manager_.banned(p.host)) return; // nothing is relayed or requested from a banned host
+    if (!manager_.reserve_queue(p.key, m.line.size())) return; // full, or backing off
+    std::lock_guard<std::mutex> lk(p.mu);
+    p.queue.push_back(std::move(m));
+    p.cv.notify_one();
+}
+
+void P2PNode::send_loop(Peer& p) {
+    MemScope mem(MemTag::P2P);
+    while (true) {
+        Outgoing m;
+        {
+            std::unique_lock<std::mutex> lk(p.mu);
+            p.cv.wait(lk, [&]{ return !running_ || !p.queue.empty(); });
+            if (!running_) break;
+            m = std::move(p.queue.front());
+            p.queue.pop_front();
+        }
+        bool ok = deliver(p, m);
+        manager_.release_queue(p.key, m.line.size());
+        if (ok) { manager_.succeeded(p.key); continue; }
+        // a peer that cannot keep up loses what is queued for it rather than growing the queue
+        m_send_errors.inc();
+        manager_.failed(p.key);
+        std::deque<Outgoing> dropped;
+        {
+            std::lock_guard<std::mutex> lk(p.mu);
+            dropped.swap(p.queue);
+        }
+        for (auto& d : dropped) manager_.release_queue(p.key, d.line.size());
+    }
+    std::lock_guard<std::mutex> lk(p.mu);
+    for (auto& d : p.queue) manager_.release_queue(p.key, d.line.size());
+    p.queue.clear();
+}
+
+// One exchange with an outbound peer: hello, the message, and for an inv the bodies it asks for.
+bool P2PNode::deliver(Peer& p, const Outgoing& m) {
+    AXLE_TRACE_SCOPE("p2p.deliver");
+    auto t0 = Clock::now();
+    asio::io_context io;
+    asio::ip::tcp::socket sock(io);
+    try {
+        if (!connect(io, sock, p.host, p.port, IO_TIMEOUT_MS)) return false;
+        auto hello = read_line(io, sock, IO_TIMEOUT_MS);
+        if (!hello) return false;
+        manager_.record_received(p.key, "hello", hello->size());
+        if (!write_all(io, sock, m.line, IO_TIMEOUT_MS)) return false;
+        manager_.record_sent(p.key, m.type, m.line.size());
+        m_sent.inc(m.line.size());
+        if (m.type == "block") m_broadcasts.inc();
+        if (m.type == "inv") {
+            announced_ += m.inv.size();
+            inv_bytes_ += m.line.size();
+            m_tx_announced.inc(m.inv.size());
+            m_tx_inv_bytes.inc(m.line.size());
+            auto reply = read_line(io, sock, IO_TIMEOUT_MS);
+            if (!reply) return false;
+            manager_.record_received(p.key, "get_txs", reply->size());
+            json want = json::parse(*reply, nullptr, false);
+            if (!want.is_discarded() && want.is_object() && want.contains("txids") && want["txids"].is_array() && !want["txids"].empty()) {
+                // bodies are spliced in as already-encoded JSON
+                std::string body = "{\"txs\":[";
+                std::vector<Clock::time_point> queued;
+                for (auto& id : want["txids"]) {
+                    if (!id.is_string()) continue;
+                    auto tx = mempool_->get(id.get<std::string>());
+                    if (!tx) continue; // mined or evicted since it was announced
+                    if (!queued.empty()) body += ",";
+                    body += to_json(*tx);
+                    for (auto& e : m.inv) if (e.first == tx->id) { queued.push_back(e.second); break; }
+                }
+                body += "],\"type\":\"txs\"}\n";
+                if (!write_all(io, sock, body, IO_TIMEOUT_MS)) return false;
+                tx_bytes_ += body.size();
+                m_tx_body_bytes.inc(body.size());
+                m_sent.inc(body.size());
+                manager_.record_sent(p.key, "txs", body.size());
+                auto now = Clock::now();
+                for (auto t : queued) m_tx_relay.observe(std::chrono::duration<double>(now - t).count());
+            }
+        } else if (m.type == "get_txs") {
+            auto reply = read_line(io, sock, IO_TIMEOUT_MS);
+            if (!reply) return false;
+            manager_.record_received(p.key, "txs", reply->size());
+            json got = json::parse(*reply, nullptr, false);
+            if (!got.is_discarded() && got.is_object() && got.contains("txs") && got["txs"].is_array()) {
+                if (got["txs"].size() > m.inv.size()) {
+                    manager_.misbehaving(p.key, SCORE_UNREQUESTED, "unrequested txs");
+                } else {
+                    std::lock_guard<std::mutex> lk(chain_.mutex());
+                    receive_txs(got["txs"], p.key);
+                }
+            }
+        }
+    } catch (std::exception&) {
+        return false;
+    }
+    manager_.record_exchange(p.key, m.type, std::chrono::duration<double>(Clock::now() - t0).count());
+    return true;
+}
+
+// Tx bodies a peer sent for our get_txs. Each is marked seen once it is here, whether or not the
+// mempool takes it. Caller holds the chain's mutex.
+void P2PNode::receive_txs(const json& txs, const std::string& from) {
+    for (auto& t : txs) {
+        received_++;
+        m_tx_received.inc();
+        SignedTx tx;
+        try {
+            tx = tx_from_json(t.dump());
+        } catch (std::exception&) {
+            manager_.misbehaving(from, SCORE_MALFORMED, "malformed tx");
+            continue;
+        }
+        if (tx.id != tx_id(tx)) { // would otherwise mark someone else's txid as had
+            manager_.misbehaving(from, SCORE_MALFORMED, "tx with a wrong id");
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> rl(relay_mu_);
+            inflight_.erase(tx.id);
+            seen_.insert(tx.id);
+        }
+        if (!mempool_->add(tx, chain_.state()).ok) continue;
+        accepted_++;
+        m_tx_accepted.inc();
+        announce_tx(tx.id);
+    }
+}
+
+void P2PNode::announce_tx(const std::string& txid) {
+    std::lock_guard<std::mutex> lk(relay_mu_);
+    seen_.insert(txid);
+    inflight_.erase(txid);
+    pending_inv_.push_back({txid, Clock::now()});
+}
+
+// Every announce_ms, queues for each peer an inv of the new txids it is not known to have.
+void P2PNode::relay_loop() {
+    MemScope mem(MemTag::P2P);
+    while (running_) {
+        std::unique_lock<std::mutex> lk(relay_mu_);
+        relay_cv_.wait_for(lk, std::chrono::milliseconds(announce_ms), [&]{ return !running_; });
+        if (!running_) continue;
+        retry_requests();
+        if (pending_inv_.empty()) continue;
+        Inventory batch;
+        batch.swap(pending_inv_);
+        for (auto& p : peers_) {
+            Inventory inv;
+            for (auto& e : batch) if (!p->known.contains(e.first)) { p->known.insert(e.first); inv.push_back(e); }
+            for (size_t i=0; i<inv.size(); i+=MAX_INV_TXIDS) {
+                Outgoing m;
+                m.type = "inv";
+                m.inv.assign(inv.begin() + i, inv.begin() + std::min(inv.size(), i + MAX_INV_TXIDS));
+                json ids = json::array();
+                for (auto& e : m.inv) ids.push_back(e.first);
+                m.line = json{{"type","inv"},{"port",listen_.second},{"txids",ids}}.dump() + "\n";
+                enqueue(*p, std::move(m));
+            }
+        }
+    }
+}
+
+// Requests whose bodies are overdue go to the next peer that announced the tx; with none left
+// the entry is dropped, so the next announcement fetches it again. Caller holds relay_mu_.
+void P2PNode::retry_requests() {
+    auto now = Clock::now();
+    std::map<Peer*, std::vector<std::string>> retry;
+    for (auto it = inflight_.begin(); it != inflight_.end(); ) {
+        auto& f = it->second;
+        if (f.expires > now) { ++it; continue; }
+        timeouts_++;
+        m_tx_timeouts.inc();
+        if (f.others.empty()) { it = inflight_.erase(it); continue; }
+        Peer* next = f.others.back();
+        f.others.pop_back();
+        f.asked = next->key;
+        f.expires = now + std::chrono::milliseconds(TX_REQUEST_TIMEOUT_MS);
+        retry[next].push_back(it->first);
+        ++it;
+    }
+    for (auto& [p, ids] : retry) {
+        for (size_t i=0; i<ids.size(); i+=MAX_INV_TXIDS) {
+            Outgoing m;
+            m.type = "get_txs";
+            std::vector<std::string> part(ids.begin() + i, ids.begin() + std::min(ids.size(), i + MAX_INV_TXIDS));
+            for (auto& id : part) m.inv.push_back({id, now});
+            m.line = json{{"type","get_txs"},{"txids",part}}.dump() + "\n";
+            requested_ += part.size();
+            m_tx_requested.inc(part.size());
+            enqueue(*p, std::move(m));
+        }
+    }
+}
+
+// Caller holds the chain's mutex.
+void P2PNode::block_accepted(const Block& b, bool pushed) {
+    (pushed ? blocks_accepted_ : blocks_synced_)++;
+    (pushed ? m_blocks_pushed : m_blocks_synced).inc();
+    if (mempool_) {
+        // a reorg hands back what the old branch had confirmed; the new one's txs are refused as stale
+        for (auto& tx : chain_.take_reorged_txs())
+            if (mempool_->add(tx, chain_.state()).ok) announce_tx(tx.id);
+        mempool_->remove_confirmed(chain_.state());
+    }
+    if (on_block_) on_block_(b);
+}
+
+// Fetches the blocks after our tip from one peer until it has no more or one does not extend
+// our chain. False if the peer sent a block that failed validation.
+bool P2PNode::sync_from(const std::string& host, uint16_t port) {
+    AXLE_TRACE_SCOPE("p2p.sync");
+    while (running_) {
+        uint64_t next;
+        {
+            std::lock_guard<std::mutex> lk(chain_.mutex());
+            next = chain_.tip_height() + 1;
+        }
+        auto resp = p2p_request(host, port, json{{"type","get_block"}, {"height", next}}.dump(), IO_TIMEOUT_MS);
+        // {"block":<stored bytes>} -- decode the inner block straight from the reply
+        constexpr std::string_view prefix = "{\"block\":";
+        if (!resp || resp->compare(0, prefix.size(), prefix) != 0 || resp->back() != '}') return true;
+        Block b;
+        try {
+            b = block_from_json(std::string_view(*resp).substr(prefix.size(), resp->size() - prefix.size() - 1));
+        } catch (std::exception&) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lk(chain_.mutex());
+        if (chain_.tip_height() + 1 != next) continue; // a push got there first
+        if (b.header.prev_hash != chain_.tip_hash()) return true; // the peer is on another branch
+        if (!chain_.accept_block(b)) return false;
+        block_accepted(b, false);
+    }
+    return true;
+}
+
+// Every sync_ms, or as soon as a pushed block shows we are behind, catches up from each
+// outbound peer in turn.
+void P2PNode::sync_loop() {
+    MemScope mem(MemTag::P2P);
+    while (running_) {
+        std::vector<std::pair<std::string, uint16_t>> sources;
+        {
+            std::unique_lock<std::mutex> lk(sync_mu_);
+            sync_cv_.wait_for(lk, std::chrono::milliseconds(sync_ms), [&]{ return !running_ || sync_now_; });
+            sync_now_ = false;
+        }
+        if (!running_) break;
+        {
+            std::lock_guard<std::mutex> lk(relay_mu_);
+            for (auto& p : peers_)
+                if (!manager_.banned(p->host)) sources.push_back({p->host, p->port});
+        }
+        for (auto& [host, port] : sources) {
+            if (!running_) break;
+            if (!sync_from(host, port)) manager_.misbehaving(host + ":" + std::to_string(port), SCORE_MALFORMED, "invalid block in sync");
+        }
+    }
+}
+
+BlockRelayStats P2PNode::block_stats() const {
+    return {blocks_pushed_, blocks_accepted_, blocks_synced_};
+}
+
+TxRelayStats P2PNode::tx_stats() const {
+    return {announced_, inv_received_, requested_, received_, accepted_, inv_bytes_, tx_bytes_, timeouts_};
 }
 
 void P2PNode::stop() {
     if (!running_) return;
     running_ = false;
+    {
+        std::lock_guard<std::mutex> lk(relay_mu_);
+        relay_cv_.notify_all();
+    }
+    if (relay_thread_.joinable()) relay_thread_.join();
+    {
+        std::lock_guard<std::mutex> lk(sync_mu_);
+        sync_cv_.notify_all();
+    }
+    if (sync_thread_.joinable()) sync_thread_.join();
+    for (auto& p : peers_) {
+        {
+            std::lock_guard<std::mutex> lk(p->mu);
+            p->cv.notify_all();
+        }
+        if (p->sender.joinable()) p->sender.join();
+    }
+    // wake the blocking accept so the loop sees running_ == false
+    try {
+        asio::io_context io;
+        asio::ip::tcp::socket s(io);
+        auto addr = asio::ip::make_address(listen_.first);
+        if (addr.is_unspecified()) addr = asio::ip::make_address("127.0.0.1");
+        s.connect({addr, listen_.second});
+    } catch (std::exception&) {}
     if (server_thread_.joinable()) server_thread_.join();
+    // connections in flight finish within their I/O timeouts
+    std::unique_lock<std::mutex> lk(serving_mu_);
+    serving_cv_.wait(lk, [&]{ return serving_ == 0; });
 }
 
-void P2PNode::broadcast_block(const Block& b) {
-    // naive: connect and send serialized block to each peer
-    for (auto& [h,p] : peers_) {
-        try {
-            asio::io_context io;
-            asio::ip::tcp::socket sock(io);
-            sock.connect({asio::ip::make_address(h), p});
-            json j = {{"type","block"}, {"data", json::parse(to_json(b))}};
-            std::string s = j.dump()+"\n";
-            asio::write(sock, asio::buffer(s));
-        } catch (...) {}
+std::optional<std::string> p2p_request(const std::string& host, uint16_t port, const std::string& request, int timeout_ms) {
+    try {
+        asio::io_context io;
+        asio::ip::tcp::socket sock(io);
+        if (!connect(io, sock, host, port, timeout_ms)) return std::nullopt;
+        if (!read_line(io, sock, timeout_ms)) return std::nullopt; // hello
+        if (!write_all(io, sock, request + "\n", timeout_ms)) return std::nullopt;
+        auto reply = read_line(io, sock, timeout_ms);
+        if (!reply || reply->empty()) return std::nullopt;
+        if (reply->rfind("{\"error\"", 0) == 0) return std::nullopt;
+        return reply;
+    } catch (std::exception&) {
+        return std::nullopt;
     }
 }
 
+void P2PNode::broadcast_block(const Block& b) {
+    relay_block(to_json(b));
+}
+
+void P2PNode::relay_block(std::string_view block_json) {
+    queue_block(block_json, "");
+}
+
+void P2PNode::queue_block(std::string_view block_json, const std::string& except_host) {
+    AXLE_TRACE_SCOPE("p2p.broadcast_block");
+    // the block is already JSON, so it is spliced into the envelope rather than re-parsed
+    std::string s;
+    s.reserve(block_json.size() + 32);
+    s.append("{\"data\":").append(block_json).append(",\"type\":\"block\"}\n");
+    std::lock_guard<std::mutex> lk(relay_mu_);
+    // the sender is left out only when it is the one peer at its host; an inbound connection
+    // does not say which of several it is
+    auto at_host = std::count_if(peers_.begin(), peers_.end(), [&](auto& p) { return p->host == except_host; });
+    for (auto& p : peers_)
+        if (at_host != 1 || p->host != except_host) enqueue(*p, {"block", s, {}});
+}
+
 }
@@ -0,0 +1,238 @@
+#include "peer_manager.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <iostream>
+#include <set>
+
+namespace axle {
+
+static Gauge& m_inbound_open = metrics().gauge("axle_p2p_inbound_open", "Inbound P2P connections being served");
+static Counter& m_inbound_refused = metrics().counter("axle_p2p_inbound_refused_total", "Inbound connections refused (banned host, host or node out of slots)");
+static Counter& m_dropped = metrics().counter("axle_p2p_queue_dropped_total", "Outbound messages dropped by a full or backed-off peer queue");
+static Counter& m_bans = metrics().counter("axle_p2p_bans_total", "Hosts banned for misbehavior");
+static Gauge& m_queued = metrics().gauge("axle_p2p_queued_bytes", "Bytes waiting in outbound peer queues");
+
+// Unknown message types are folded into "other", so a peer cannot grow the per-type maps.
+static const std::string& type_label(const std::string& type) {
+    static const std::set<std::string> known = {"hello", "block", "inv", "get_txs", "txs", "get_block",
+                                                "get_snapshot_manifest", "get_snapshot_chunk"};
+    static const std::string other = "other";
+    auto it = known.find(type);
+    return it == known.end() ? other : *it;
+}
+
+static Counter& message_bytes(const char* dir, const std::string& type) {
+    return metrics().counter("axle_p2p_message_bytes_total", "P2P bytes by direction and message type",
+                             std::string("dir=\"") + dir + "\",type=\"" + type + "\"");
+}
+
+PeerManager::PeerManager(PeerLimits limits) : limits_(limits) {}
+
+// "host:port" -> host; IPv6 hosts keep their colons
+std::string PeerManager::host_of(const std::string& key) {
+    auto pos = key.rfind(':');
+    return pos == std::string::npos ? key : key.substr(0, pos);
+}
+
+PeerManager::Entry& PeerManager::entry(const std::string& key, bool outbound) {
+    auto it = peers_.find(key);
+    if (it == peers_.end()) {
+        if (!outbound) evict_idle();
+        it = peers_.emplace(key, Entry{}).first;
+        it->second.s.key = key;
+        it->second.s.outbound = outbound;
+        it->second.host = outbound ? host_of(key) : key;
+        if (auto rec = hosts_.find(it->second.host); rec != hosts_.end()) {
+            it->second.ban_until = rec->second.ban_until;
+            if (!outbound) it->second.s.score = rec->second.score;
+        }
+    }
+    it->second.last_seen = Clock::now();
+    return it->second;
+}
+
+// Forgets the least recently seen inbound hosts with nothing open, so a stream of new source
+// addresses costs at most max_tracked entries. Their scores and bans live on in hosts_.
+void PeerManager::evict_idle() {
+    prune_hosts();
+    size_t inbound = 0;
+    for (auto& [k, e] : peers_) inbound += !e.s.outbound;
+    while (inbound >= limits_.max_tracked) {
+        auto victim = peers_.end();
+        for (auto it = peers_.begin(); it != peers_.end(); ++it)
+            if (!it->second.s.outbound && !it->second.s.open && (victim == peers_.end() || it->second.last_seen < victim->second.last_seen))
+                victim = it;
+        if (victim == peers_.end()) return;
+        if (auto& e = victim->second; e.s.score > 0) {
+            auto& rec = hosts_[e.host];
+            rec.score = e.s.score;
+            rec.ban_until = std::max(rec.ban_until, e.ban_until);
+        }
+        peers_.erase(victim);
+        inbound--;
+    }
+}
+
+// Drops records whose ban has run out, then, past max_tracked, the lowest scores and soonest
+// ending bans. Caller holds mu_.
+void PeerManager::prune_hosts() {
+    auto now = Clock::now();
+    std::erase_if(hosts_, [&](auto& kv) { return kv.second.ban_until != Clock::time_point{} && kv.second.ban_until <= now; });
+    while (hosts_.size() > limits_.max_tracked) {
+        auto victim = std::min_element(hosts_.begin(), hosts_.end(), [](auto& a, auto& b) {
+            return std::pair(a.second.ban_until, a.second.score) < std::pair(b.second.ban_until, b.second.score);
+        });
+        hosts_.erase(victim);
+    }
+}
+
+bool PeerManager::admit_inbound(const std::string& host) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto ban = hosts_.find(host);
+    if (ban != hosts_.end() && ban->second.ban_until > Clock::now()) { m_inbound_refused.inc(); return false; }
+    if (inbound_open_ >= limits_.max_inbound || over_memory_budget(MemTag::P2P)) { m_inbound_refused.inc(); return false; }
+    // one host cannot take every slot with slow connections
+    if (auto it = peers_.find(host); it != peers_.end() && it->second.s.open >= limits_.max_inbound_per_host) {
+        m_inbound_refused.inc();
+        return false;
+    }
+    auto& e = entry(host, false);
+    e.s.open++;
+    e.s.connected = true;
+    inbound_open_++;
+    m_inbound_open.set((int64_t)inbound_open_);
+    return true;
+}
+
+void PeerManager::release_inbound(const std::string& host) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = peers_.find(host);
+    if (it != peers_.end() && it->second.s.open) {
+        it->second.s.connected = --it->second.s.open > 0;
+    }
+    if (inbound_open_) inbound_open_--;
+    m_inbound_open.set((int64_t)inbound_open_);
+}
+
+bool PeerManager::add_outbound(const std::string& key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (outbound_ >= limits_.max_outbound || peers_.count(key)) return false;
+    entry(key, true);
+    outbound_++;
+    return true;
+}
+
+bool PeerManager::reserve_queue(const std::string& key, size_t bytes) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& e = entry(key, true);
+    if (e.backoff_until > Clock::now() || e.s.queued_bytes + bytes > limits_.max_queue_bytes ||
+        over_memory_budget(MemTag::P2P)) {
+        e.s.dropped_msgs++;
+        m_dropped.inc();
+        return false;
+    }
+    e.s.queued_bytes += bytes;
+    e.s.queued_msgs++;
+    m_queued.add((int64_t)bytes);
+    return true;
+}
+
+void PeerManager::release_queue(const std::string& key, size_t bytes) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& e = entry(key, true);
+    e.s.queued_bytes -= std::min(bytes, e.s.queued_bytes);
+    if (e.s.queued_msgs) e.s.queued_msgs--;
+    m_queued.add(-(int64_t)bytes);
+}
+
+void PeerManager::failed(const std::string& key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& e = entry(key, true);
+    e.s.failures++;
+    e.s.connected = false;
+    e.backoff_until = Clock::now() + limits_.backoff;
+}
+
+void PeerManager::succeeded(const std::string& key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    entry(key, true).s.connected = true;
+}
+
+void PeerManager::record_sent(const std::string& key, const std::string& type, size_t bytes) {
+    auto& label = type_label(type);
+    message_bytes("out", label).inc(bytes);
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = peers_.find(key);
+    if (it == peers_.end()) return;
+    auto& t = it->second.s.types[label];
+    t.sent_msgs++;
+    t.sent_bytes += bytes;
+}
+
+void PeerManager::record_received(const std::string& key, const std::string& type, size_t bytes) {
+    auto& label = type_label(type);
+    message_bytes("in", label).inc(bytes);
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = peers_.find(key);
+    if (it == peers_.end()) return;
+    auto& t = it->second.s.types[label];
+    t.recv_msgs++;
+    t.recv_bytes += bytes;
+}
+
+void PeerManager::record_exchange(const std::string& key, const std::string& type, double seconds) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = peers_.find(key);
+    if (it == peers_.end()) return;
+    auto& t = it->second.s.types[type_label(type)];
+    t.exchanges++;
+    t.exchange_seconds += seconds;
+}
+
+bool PeerManager::misbehaving(const std::string& key, int points, const std::string& reason) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = peers_.find(key);
+    if (it == peers_.end()) return false;
+    auto& e = it->second;
+    bool was_banned = e.ban_until > Clock::now();
+    e.s.score += points;
+    if (was_banned || e.s.score < limits_.ban_score) return false;
+    auto& host = e.host;
+    prune_hosts();
+    e.ban_until = Clock::now() + limits_.ban_time;
+    hosts_[host] = {e.s.score, e.ban_until};
+    m_bans.inc();
+    std::cerr << "[P2P] banned " << host << " (score " << e.s.score << ", last: " << reason << ")" << std::endl;
+    return true;
+}
+
+bool PeerManager::banned(const std::string& host) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = hosts_.find(host);
+    return it != hosts_.end() && it->second.ban_until > Clock::now();
+}
+
+void PeerManager::unban(const std::string& host) {
+    std::lock_guard<std::mutex> lk(mu_);
+    hosts_.erase(host);
+    for (auto& [k, e] : peers_)
+        if (e.host == host) { e.ban_until = {}; e.s.score = 0; }
+}
+
+std::vector<PeerManager::PeerStats> PeerManager::stats() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<PeerStats> out;
+    auto now = Clock::now();
+    for (auto& [k, e] : peers_) {
+        out.push_back(e.s);
+        auto ban = hosts_.find(e.host);
+        if (ban != hosts_.end() && ban->second.ban_until > now) {
+            out.back().banned = true;
+            out.back().banned_for_s = std::chrono::duration_cast<std::chrono::seconds>(ban->second.ban_until - now).count();
+        }
+    }
+    return out;
+}
+
+}
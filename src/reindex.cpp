@@ -0,0 +1,244 @@
+#include "reindex.hpp"
+#include "blockchain.hpp"
+#include "block.hpp"
+#include "block_codec.hpp"
+#include "crypto.hpp"
+#include "encoding.hpp"
+#include "ledger.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace axle {
+
+namespace {
+
+using Steady = std::chrono::steady_clock;
+
+double since(Steady::time_point t0) { return std::chrono::duration<double>(Steady::now() - t0).count(); }
+
+// Fixed-capacity FIFO between two stages. push blocks while full; pop blocks while empty and
+// returns nullopt once the queue is closed and drained. Closing also fails pending pushes.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t cap) : cap_(cap ? cap : 1) {}
+    bool push(T v) {
+        std::unique_lock<std::mutex> lk(mu_);
+        not_full_.wait(lk, [&]{ return closed_ || q_.size() < cap_; });
+        if (closed_) return false;
+        q_.push_back(std::move(v));
+        not_empty_.notify_one();
+        return true;
+    }
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lk(mu_);
+        not_empty_.wait(lk, [&]{ return closed_ || !q_.empty(); });
+        if (q_.empty()) return std::nullopt;
+        T v = std::move(q_.front());
+        q_.pop_front();
+        not_full_.notify_one();
+        return v;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lk(mu_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+private:
+    size_t cap_;
+    std::mutex mu_;
+    std::condition_variable not_full_, not_empty_;
+    std::deque<T> q_;
+    bool closed_{false};
+};
+
+struct Item {
+    uint64_t height{0};
+    std::string raw;
+    std::optional<Block> block;
+    std::string error; // set by the stage that rejected it; later stages pass it through
+};
+
+struct StageCounters {
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<int64_t> busy_ns{0};
+    void add(Steady::time_point t0) {
+        blocks.fetch_add(1, std::memory_order_relaxed);
+        busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Steady::now() - t0).count(), std::memory_order_relaxed);
+    }
+};
+
+std::optional<Block> decode_body(const std::string& raw) {
+    if (is_columnar_block(raw)) return decode_block_columnar(raw);
+    try { return block_from_json(raw); } catch (std::exception&) { return std::nullopt; }
+}
+
+// everything accept_block checks before touching state, plus the stateless tx checks
+std::string verify_body(const Block& b, uint64_t height) {
+    if (b.header.height != height) return "body at height " + std::to_string(height) + " claims " + std::to_string(b.header.height);
+    if (b.header.difficulty_bits > MAX_DIFFICULTY_BITS || b.hash != block_hash(b.header) ||
+        !hash_meets_bits(b.hash, b.header.difficulty_bits)) return "bad block hash or proof of work";
+    if (b.header.merkle_root != merkle_root(b.txs)) return "merkle root mismatch";
+    if (!verify_address(b.miner_address)) return "bad miner address";
+    for (size_t i = 0; i < b.txs.size(); ++i) {
+        auto vr = check_tx_stateless(b.txs[i]);
+        if (!vr.ok) return "tx " + std::to_string(i) + ": " + vr.reason;
+    }
+    return "";
+}
+
+}
+
+ReindexResult reindex(Storage& storage, const ChainParams& params, const ReindexOptions& opt) {
+    AXLE_TRACE_SCOPE("reindex");
+    ReindexResult res;
+    auto t0 = Steady::now();
+    auto tip = storage.read_tip();
+    if (!tip) { res.error = "no chain in this datadir"; return res; }
+    if (tip->pruned_below > 0) {
+        res.error = "pruned datadir: bodies below " + std::to_string(tip->pruned_below) + " are gone";
+        return res;
+    }
+    res.target = tip->height;
+    auto genesis_raw = storage.read_block_raw(0);
+    auto genesis = genesis_raw ? decode_body(*genesis_raw) : std::nullopt;
+    Blockchain chain(storage, params);
+    if (opt.exec_threads) chain.set_exec_threads(opt.exec_threads);
+    chain.set_state_cache(opt.state_cache);
+    if (!genesis || !chain.begin_replay(*genesis)) { res.error = "genesis block missing or does not match the chain parameters"; return res; }
+
+    unsigned workers = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    BoundedQueue<Item> read_q(opt.queue_blocks), decode_q(opt.queue_blocks), verify_q(opt.queue_blocks);
+    StageCounters c_read, c_decode, c_verify, c_apply;
+    std::atomic<bool> stop{false};
+
+    // Decode and verify finish blocks out of order, so the reader stays within a window of the
+    // next height to apply; that bounds the reorder buffer in the apply stage.
+    const uint64_t window = 3 * opt.queue_blocks + 2 * workers;
+    std::mutex window_mu;
+    std::condition_variable window_cv;
+    uint64_t next_apply = 1;
+
+    std::thread reader([&]{
+        for (uint64_t h = 1; h <= res.target && !stop; ++h) {
+            {
+                std::unique_lock<std::mutex> lk(window_mu);
+                window_cv.wait(lk, [&]{ return stop || h < next_apply + window; });
+            }
+            AXLE_TRACE_SCOPE("reindex.read");
+            auto start = Steady::now();
+            Item it;
+            it.height = h;
+            if (auto raw = storage.read_block_raw(h)) it.raw = std::move(*raw);
+            else it.error = "body missing";
+            bool missing = !it.error.empty();
+            c_read.add(start);
+            if (!read_q.push(std::move(it)) || missing) break;
+        }
+        read_q.close();
+    });
+
+    // runs `f` on `n` threads over `in`, closing `out` when the last of them is done
+    auto run_stage = [&](unsigned n, BoundedQueue<Item>& in, BoundedQueue<Item>& out, StageCounters& c, const char* name, auto f) {
+        auto live = std::make_shared<std::atomic<unsigned>>(n);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < n; ++t) threads.emplace_back([&, live, name, f]{
+            while (auto it = in.pop()) {
+                TraceSpan span(name);
+                auto start = Steady::now();
+                if (it->error.empty()) f(*it);
+                c.add(start);
+                if (!out.push(std::move(*it))) break;
+            }
+            if (--*live == 0) out.close();
+        });
+        return threads;
+    };
+    auto decoders = run_stage(workers, read_q, decode_q, c_decode, "reindex.decode", [](Item& it) {
+        it.block = decode_body(it.raw);
+        it.raw.clear();
+        it.raw.shrink_to_fit();
+        if (!it.block) it.error = "undecodable body";
+    });
+    auto verifiers = run_stage(workers, decode_q, verify_q, c_verify, "reindex.verify", [](Item& it) {
+        it.error = verify_body(*it.block, it.height);
+    });
+
+    auto snapshot_stages = [&]{
+        auto stage = [](const char* name, unsigned threads, const StageCounters& c) {
+            return ReindexStage{name, threads, c.blocks.load(), c.busy_ns.load() / 1e9};
+        };
+        res.stages = {stage("read", 1, c_read), stage("decode", workers, c_decode),
+                      stage("verify", workers, c_verify), stage("apply", 1, c_apply)};
+        res.seconds = since(t0);
+    };
+
+    // apply, strictly in height order
+    std::map<uint64_t, Item> pending;
+    auto last_progress = Steady::now();
+    while (!stop) {
+        auto it = verify_q.pop();
+        if (!it) break;
+        uint64_t h = it->height;
+        pending.emplace(h, std::move(*it));
+        for (auto p = pending.find(next_apply); p != pending.end() && !stop; p = pending.find(next_apply)) {
+            AXLE_TRACE_SCOPE("reindex.apply");
+            auto start = Steady::now();
+            auto& item = p->second;
+            if (!item.error.empty()) {
+                res.error = "block " + std::to_string(item.height) + ": " + item.error;
+                stop = true;
+            } else if (!chain.replay_block(*item.block)) {
+                res.error = "block " + std::to_string(item.height) + ": does not connect (bad parent, tx or state root)";
+                stop = true;
+            } else {
+                res.txs += item.block->txs.size();
+                c_apply.add(start);
+            }
+            pending.erase(p);
+            std::lock_guard<std::mutex> lk(window_mu);
+            if (!stop) next_apply++;
+            window_cv.notify_all();
+        }
+        if (opt.progress && since(last_progress) >= 1.0) {
+            last_progress = Steady::now();
+            res.height = chain.tip_height();
+            snapshot_stages();
+            opt.progress(res);
+        }
+    }
+    if (stop) {
+        std::lock_guard<std::mutex> lk(window_mu);
+        window_cv.notify_all();
+    }
+    read_q.close();
+    decode_q.close();
+    verify_q.close();
+    reader.join();
+    for (auto& t : decoders) t.join();
+    for (auto& t : verifiers) t.join();
+
+    res.height = chain.tip_height();
+    if (res.error.empty() && res.height != res.target) res.error = "stopped at " + std::to_string(res.height);
+    if (res.error.empty() && chain.tip_hash() != tip->hash) res.error = "replayed chain ends at a different block than tip.json";
+    res.ok = res.error.empty();
+    // only a complete replay moves the tip and writes the state; a failed one leaves tip.json
+    // and state.json as they were, so it can be retried once the bad body is replaced
+    if (res.ok && !chain.end_replay()) {
+        res.ok = false;
+        res.error = "cannot move the rebuilt account store into place";
+    }
+    if (!res.ok) chain.abort_replay();
+    snapshot_stages();
+    return res;
+}
+
+}
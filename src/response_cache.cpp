@@ -0,0 +1,72 @@
+#include "response_cache.hpp"
+#include "metrics.hpp"
+
+namespace axle {
+
+static Counter& m_hits = metrics().counter("axle_rpc_cache_hits_total", "RPC responses served from the response cache");
+static Counter& m_misses = metrics().counter("axle_rpc_cache_misses_total", "Cacheable RPC responses that had to be built");
+static Counter& m_served = metrics().counter("axle_rpc_cache_served_bytes_total", "Response bytes written from the RPC response cache");
+static Gauge& m_bytes = metrics().gauge("axle_rpc_cache_bytes", "Bytes held by the RPC response cache");
+
+std::shared_ptr<const std::string> ResponseCache::get(const std::string& key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        stats_.misses++;
+        m_misses.inc();
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    stats_.hits++;
+    stats_.served_bytes += it->second.response->size();
+    m_hits.inc();
+    m_served.inc(it->second.response->size());
+    return it->second.response;
+}
+
+void ResponseCache::put(const std::string& key, std::string response) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (response.size() > max_bytes_ || entries_.count(key)) return;
+    evict_to(max_bytes_ - response.size());
+    stats_.bytes += response.size();
+    lru_.push_front(key);
+    entries_[key] = {std::make_shared<const std::string>(std::move(response)), lru_.begin()};
+    stats_.entries = entries_.size();
+    m_bytes.set((int64_t)stats_.bytes);
+}
+
+void ResponseCache::set_max_bytes(size_t n) {
+    std::lock_guard<std::mutex> lk(mu_);
+    max_bytes_ = n;
+    evict_to(n);
+    m_bytes.set((int64_t)stats_.bytes);
+}
+
+size_t ResponseCache::max_bytes() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return max_bytes_;
+}
+
+void ResponseCache::shrink_to(size_t bytes) {
+    std::lock_guard<std::mutex> lk(mu_);
+    evict_to(bytes);
+    m_bytes.set((int64_t)stats_.bytes);
+}
+
+ResponseCacheStats ResponseCache::stats() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+}
+
+void ResponseCache::evict_to(size_t bytes) {
+    while (stats_.bytes > bytes && !lru_.empty()) {
+        auto it = entries_.find(lru_.back());
+        stats_.bytes -= it->second.response->size();
+        entries_.erase(it);
+        lru_.pop_back();
+        stats_.evictions++;
+    }
+    stats_.entries = entries_.size();
+}
+
+}
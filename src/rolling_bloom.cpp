@@ -0,0 +1,77 @@
+#include "rolling_bloom.hpp"
+#include "crypto.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace axle {
+
+namespace {
+
+uint64_t mix(uint64_t x) { // splitmix64 finalizer
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+}
+
+RollingBloom::RollingBloom(size_t capacity, double fp_rate) {
+    // Three generations of capacity/2 each: the current one plus the two before it always
+    // cover the last `capacity` items. A lookup checks all three, so each gets a third of the
+    // false-positive budget.
+    per_generation_ = std::max<size_t>(1, (capacity + 1) / 2);
+    double p = std::clamp(fp_rate, 1e-12, 0.5) / GENERATIONS;
+    double ln2 = std::log(2.0);
+    bits_ = std::max<size_t>(64, (size_t)std::ceil(-(double)per_generation_ * std::log(p) / (ln2 * ln2)));
+    bits_ = (bits_ + 63) / 64 * 64;
+    hashes_ = std::max(1u, (unsigned)std::lround((double)bits_ / per_generation_ * ln2));
+    // a per-filter seed, so a peer cannot pick txids that collide in every node's filter
+    auto r = random_bytes(8);
+    std::memcpy(&seed_, r.data(), 8);
+    for (auto& g : gens_) g.assign(bits_ / 64, 0);
+}
+
+std::pair<uint64_t, uint64_t> RollingBloom::hash(std::string_view item) const {
+    uint64_t h = seed_ ^ 0xcbf29ce484222325ULL; // FNV-1a, then mixed
+    for (unsigned char c : item) { h ^= c; h *= 0x100000001b3ULL; }
+    uint64_t h1 = mix(h), h2 = mix(h1 ^ seed_) | 1;
+    return {h1, h2};
+}
+
+void RollingBloom::insert(std::string_view item) {
+    if (inserted_ == per_generation_) {
+        current_ = (current_ + 1) % GENERATIONS;
+        std::fill(gens_[current_].begin(), gens_[current_].end(), 0);
+        inserted_ = 0;
+    }
+    auto [h1, h2] = hash(item);
+    auto& g = gens_[current_];
+    for (unsigned i=0;i<hashes_;i++) {
+        size_t b = (h1 + i * h2) % bits_;
+        g[b / 64] |= 1ULL << (b % 64);
+    }
+    inserted_++;
+}
+
+bool RollingBloom::contains(std::string_view item) const {
+    auto [h1, h2] = hash(item);
+    for (auto& g : gens_) {
+        bool all = true;
+        for (unsigned i=0;i<hashes_ && all;i++) {
+            size_t b = (h1 + i * h2) % bits_;
+            all = (g[b / 64] >> (b % 64)) & 1;
+        }
+        if (all) return true;
+    }
+    return false;
+}
+
+void RollingBloom::clear() {
+    for (auto& g : gens_) std::fill(g.begin(), g.end(), 0);
+    current_ = inserted_ = 0;
+}
+
+size_t RollingBloom::memory_bytes() const { return GENERATIONS * bits_ / 8; }
+
+}
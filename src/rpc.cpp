@@ -1,43 +1,268 @@
 #include "rpc.hpp"
 #include "encoding.hpp"
 #include "crypto.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <asio.hpp>
 #include <nlohmann/json.hpp>
+#include <filesystem>
 #include <iostream>
+#include <set>
 
 using json = nlohmann::json;
 
 namespace axle {
 
+static Histogram& m_rpc_latency = metrics().histogram("axle_rpc_request_seconds", "RPC request handling time");
+static Counter& m_rpc_errors = metrics().counter("axle_rpc_errors_total", "RPC requests answered with an error");
+
+// Unknown method names are folded into "other" to keep label cardinality bounded.
+static Counter& rpc_requests(const std::string& method) {
+    static const std::set<std::string> known = {"get_tip", "get_account", "get_block", "get_header", "send_tx", "send_txs", "get_peers", "get_memory", "dump_trace", "set_tracing"};
+    std::string label = known.count(method) ? method : "other";
+    return metrics().counter("axle_rpc_requests_total", "RPC requests by method", "method=\"" + label + "\"");
+}
+
+constexpr size_t MAX_BATCH_TXS = 10000;
+
+// The "height" a request names, or the tip if it names none; nullopt if it is not a
+// non-negative integer.
+static std::optional<uint64_t> height_param(const json& req, uint64_t tip) {
+    if (!req.contains("height")) return tip;
+    if (!req["height"].is_number_unsigned()) return std::nullopt;
+    return req["height"].get<uint64_t>();
+}
+// Connections are served one at a time, so a client gets this long to send its request line and
+// read the reply before the next one is let in. The line may be as long as a full send_txs batch.
+constexpr int IO_TIMEOUT_MS = 5000;
+constexpr size_t MAX_REQUEST = 16 << 20;
+
 RpcServer::RpcServer(Blockchain& chain) : chain_(chain) {}
 RpcServer::~RpcServer() { stop(); }
 
 bool RpcServer::start(const std::string& host, uint16_t port) {
     if (running_) return false;
     running_ = true;
+    listen_ = {host, port};
     server_thread_ = std::thread([this, host, port](){
+        MemScope mem(MemTag::RPC);
         try {
             asio::io_context io;
             asio::ip::tcp::acceptor acc(io, asio::ip::tcp::endpoint(asio::ip::make_address(host), port));
+            // as in MetricsServer: runs the pending operation on sock for at most IO_TIMEOUT_MS;
+            // false if it failed or ran out of time, in which case it is cancelled
+            auto finish = [&](asio::ip::tcp::socket& sock, const bool& ok) {
+                io.restart();
+                io.run_for(std::chrono::milliseconds(IO_TIMEOUT_MS));
+                if (ok) return true;
+                sock.close();
+                io.restart();
+                io.run();
+                return false;
+            };
             while (running_) {
                 asio::ip::tcp::socket sock(io);
                 acc.accept(sock);
-                // extremely simple: read first line and respond
-                asio::streambuf buf;
-                asio::read_until(sock, buf, "\n");
-                std::istream is(&buf);
-                std::string line; std::getline(is, line);
-                json req = json::parse(line, nullptr, false);
-                json resp;
-                if (req.is_discarded()) {
-                    resp = {{"error","bad json"}};
-                } else if (req["method"]=="get_tip") {
-                    resp = {{"height", chain_.tip_height()}, {"hash", chain_.tip_hash()}};
-                } else {
-                    resp = {{"error","unknown method"}};
+                if (!running_) break;
+                // a client that hangs up mid-request, stalls or sends an overlong line costs only
+                // its own connection, not the server
+                try {
+                    // extremely simple: read first line and respond
+                    asio::streambuf buf(MAX_REQUEST);
+                    bool ok = false;
+                    asio::async_read_until(sock, buf, "\n", [&](const auto& ec, size_t) { ok = !ec; });
+                    if (!finish(sock, ok)) continue;
+                    std::istream is(&buf);
+                    std::string line; std::getline(is, line);
+                    ScopedTimer timer(m_rpc_latency);
+                    AXLE_TRACE_SCOPE("rpc.request");
+                    json req = json::parse(line, nullptr, false);
+                    json resp;
+                    std::string raw; // preformatted response, sent instead of resp when set
+                    std::shared_ptr<const std::string> cached; // or one straight from the response cache
+                    std::string method = (!req.is_discarded() && req.contains("method") && req["method"].is_string()) ? req["method"].get<std::string>() : "";
+                    rpc_requests(method).inc();
+                    // held while the reply is built, not while it is written: a client that does not
+                    // read would otherwise stall everything else that needs the chain
+                    // cached responses are charged to RPC too: halve the cache until the subsystem is
+                    // back under its budget before refusing anything
+                    for (size_t b = cache_.stats().bytes; b && over_memory_budget(MemTag::RPC); b /= 2) cache_.shrink_to(b / 2);
+                    std::unique_lock<std::mutex> lk(chain_.mutex());
+                    if (req.is_discarded()) {
+                        resp = {{"error","bad json"}};
+                    } else if (method!="get_memory" && over_memory_budget(MemTag::RPC)) {
+                        resp = {{"error","over memory budget"}};
+                    } else if (method=="get_tip") {
+                        resp = {{"height", chain_.tip_height()}, {"hash", chain_.tip_hash()}, {"state_root", chain_.state_root()}};
+                        if (chain_.pruned()) resp["pruned_below"] = chain_.pruned_below();
+                    } else if (method=="get_account") {
+                        // {"address":A}; an address the chain has not seen has zero balance and nonce
+                        if (!req.contains("address") || !req["address"].is_string()) {
+                            resp = {{"error","address required"}};
+                        } else {
+                            auto addr = req["address"].get<std::string>();
+                            auto a = chain_.state().accounts.get(addr).value_or(AccountState{});
+                            resp = {{"address", addr}, {"balance", a.balance}, {"nonce", a.nonce}};
+                        }
+                    } else if (method=="get_block") {
+                        // {"height":H} or {"hash":HEX}. Relayed byte-for-byte from storage: the block is
+                        // never decoded or re-encoded, and the whole response is cached under its hash,
+                        // which is also its etag. "if_none_match" with that etag answers not_modified.
+                        auto& idx = chain_.headers();
+                        bool by_hash = req.contains("hash") && req["hash"].is_string();
+                        auto h = by_hash ? idx.height_of(req["hash"].get<std::string>()) : height_param(req, chain_.tip_height());
+                        if (!by_hash && !h) {
+                            resp = {{"error","height must be a non-negative integer"}};
+                        } else if (!h || *h > chain_.tip_height() || !idx.at(*h)) {
+                            resp = {{"error","block not found"}};
+                        } else if (*h < chain_.pruned_below()) {
+                            resp = {{"error","block pruned"}, {"pruned_below", chain_.pruned_below()}};
+                        } else {
+                            auto etag = idx.at(*h)->hash_hex();
+                            if (req.contains("if_none_match") && req["if_none_match"] == etag) {
+                                resp = {{"not_modified", true}, {"etag", etag}};
+                            } else if (!(cached = cache_.get("block:" + etag))) {
+                                auto blk = chain_.storage().read_block_bytes(*h);
+                                if (blk) {
+                                    raw = "{\"block\":" + *blk + ",\"etag\":\"" + etag + "\"}\n";
+                                    cache_.put("block:" + etag, raw);
+                                } else {
+                                    resp = {{"error","block not found"}};
+                                }
+                            }
+                        }
+                    } else if (method=="get_header") {
+                        // from the in-memory header index: {"height":H} or {"hash":HEX}, pruned heights included
+                        auto& idx = chain_.headers();
+                        bool by_hash = req.contains("hash") && req["hash"].is_string();
+                        auto h = by_hash ? idx.height_of(req["hash"].get<std::string>()) : height_param(req, chain_.tip_height());
+                        if (!by_hash && !h) {
+                            resp = {{"error","height must be a non-negative integer"}};
+                        } else if (auto rec = h ? idx.at(*h) : nullptr) {
+                            auto hd = rec->header();
+                            resp = {{"height", hd.height}, {"hash", rec->hash_hex()}, {"prev_hash", hd.prev_hash},
+                                    {"merkle_root", hd.merkle_root}, {"state_root", hd.state_root}, {"timestamp", hd.timestamp},
+                                    {"difficulty_bits", hd.difficulty_bits}, {"nonce", hd.nonce}, {"chain_work", idx.work_at(*h)}};
+                        } else {
+                            resp = {{"error","header not found"}};
+                        }
+                    } else if (method=="send_tx") {
+                        // queues a signed tx for the next block template; {"tx":{...}} as in blocks
+                        if (!mempool_) resp = {{"error","no mempool"}};
+                        else if (!req.contains("tx") || !req["tx"].is_object()) resp = {{"error","tx required"}};
+                        else {
+                            try {
+                                auto tx = tx_from_json(req["tx"].dump());
+                                auto vr = mempool_->add(tx, chain_.state());
+                                if (vr.ok) {
+                                    resp = {{"txid", tx.id}};
+                                    if (on_tx_) on_tx_(tx);
+                                } else {
+                                    resp = {{"error", vr.reason}};
+                                }
+                            } catch (std::exception&) {
+                                resp = {{"error","malformed tx"}};
+                            }
+                        }
+                    } else if (method=="send_txs") {
+                        // {"txs":[...]}: many send_tx in one round trip; rejections come back by index
+                        if (!mempool_) resp = {{"error","no mempool"}};
+                        else if (!req.contains("txs") || !req["txs"].is_array()) resp = {{"error","txs required"}};
+                        else if (req["txs"].size() > MAX_BATCH_TXS) resp = {{"error","at most " + std::to_string(MAX_BATCH_TXS) + " txs"}};
+                        else {
+                            size_t accepted = 0;
+                            json errors = json::array();
+                            auto& txs = req["txs"];
+                            for (size_t i=0;i<txs.size();i++) {
+                                ValidationResult vr;
+                                try {
+                                    auto tx = tx_from_json(txs[i].dump());
+                                    vr = mempool_->add(tx, chain_.state());
+                                    if (vr.ok && on_tx_) on_tx_(tx);
+                                } catch (std::exception&) {
+                                    vr = {false, "malformed tx"};
+                                }
+                                if (vr.ok) accepted++;
+                                else errors.push_back({{"index", i}, {"error", vr.reason}});
+                            }
+                            resp = {{"accepted", accepted}, {"errors", errors}};
+                        }
+                    } else if (method=="get_peers") {
+                        // per-peer connection state, queue use, scores and traffic by message type
+                        if (!peers_) resp = {{"error","no p2p"}};
+                        else {
+                            json list = json::array();
+                            for (auto& p : peers_->stats()) {
+                                json types = json::object();
+                                for (auto& [t, s] : p.types)
+                                    types[t] = {{"sent_msgs", s.sent_msgs}, {"sent_bytes", s.sent_bytes},
+                                                {"recv_msgs", s.recv_msgs}, {"recv_bytes", s.recv_bytes},
+                                                {"avg_ms", s.exchanges ? 1000 * s.exchange_seconds / s.exchanges : 0.0}};
+                                list.push_back({{"peer", p.key}, {"outbound", p.outbound}, {"connected", p.connected},
+                                                {"open", p.open}, {"score", p.score}, {"banned", p.banned},
+                                                {"banned_for_s", p.banned_for_s}, {"queued_msgs", p.queued_msgs},
+                                                {"queued_bytes", p.queued_bytes}, {"dropped_msgs", p.dropped_msgs},
+                                                {"failures", p.failures}, {"types", types}});
+                            }
+                            resp = {{"peers", list}};
+                        }
+                    } else if (method=="get_memory") {
+                        // live heap bytes and allocations by subsystem, with their budgets
+                        json subs = json::object();
+                        for (auto& u : memory_usage())
+                            subs[mem_tag_name(u.tag)] = {{"bytes", u.bytes}, {"allocations", u.allocations},
+                                                         {"total_allocations", u.total_allocations},
+                                                         {"peak_bytes", u.peak_bytes}, {"budget_bytes", u.budget_bytes}};
+                        resp = {{"accounting", memory_accounting_enabled()}, {"rss_bytes", process_rss_bytes()}, {"subsystems", subs}};
+                        auto& accounts = chain_.state().accounts;
+                        if (accounts.tiered()) {
+                            auto c = accounts.stats();
+                            uint64_t lookups = c.hits + c.misses;
+                            resp["state_cache"] = {{"entries", c.entries}, {"capacity", c.capacity}, {"stored", c.stored},
+                                                   {"hits", c.hits}, {"misses", c.misses}, {"prefetched", c.prefetched},
+                                                   {"hit_rate", lookups ? (double)c.hits / lookups : 0.0},
+                                                   {"mean_miss_us", c.misses ? c.miss_seconds * 1e6 / c.misses : 0.0},
+                                                   {"evictions", c.evictions}};
+                        }
+                    } else if (method=="set_tracing") {
+                        set_tracing(req.value("enabled", true));
+                        resp = {{"tracing", tracing_enabled()}};
+                    } else if (method=="dump_trace") {
+                        // with "path" (a bare file name) the trace is written to DATADIR/traces/, otherwise returned inline
+                        size_t n = 0;
+                        if (req.contains("path") && !req["path"].is_string()) {
+                            resp = {{"error","path required"}};
+                        } else if (req.contains("path")) {
+                            std::string name = req["path"];
+                            if (name.empty() || name == "." || name == ".." || name.find_first_of("/\\") != std::string::npos) {
+                                resp = {{"error","path must be a file name"}};
+                            } else {
+                                auto dir = std::filesystem::path(chain_.storage().datadir()) / "traces";
+                                std::error_code ec;
+                                std::filesystem::create_directories(dir, ec);
+                                std::string path = (dir / name).string();
+                                if (!ec && dump_trace(path, &n)) resp = {{"path", path}, {"events", n}};
+                                else resp = {{"error","cannot write trace file"}};
+                            }
+                        } else {
+                            resp = json::parse(trace_json(&n));
+                        }
+                    } else {
+                        resp = {{"error","unknown method"}};
+                    }
+                    lk.unlock();
+                    std::string s;
+                    if (!cached) {
+                        if (resp.contains("error")) m_rpc_errors.inc();
+                        s = raw.empty() ? resp.dump()+"\n" : std::move(raw);
+                    }
+                    ok = false;
+                    asio::async_write(sock, asio::buffer(cached ? *cached : s), [&](const auto& ec, size_t) { ok = !ec; });
+                    finish(sock, ok);
+                } catch (std::exception& e) {
+                    std::cerr << "[RPC] client error: " << e.what() << std::endl;
                 }
-                std::string s = resp.dump()+"\n";
-                asio::write(sock, asio::buffer(s));
             }
         } catch (std::exception& e) {
             std::cerr << "[RPC] error: " << e.what() << std::endl;
@@ -49,7 +274,40 @@ bool RpcServer::start(const std::string& host, uint16_t port) {
 void RpcServer::stop() {
     if (!running_) return;
     running_ = false;
+    // wake the blocking accept so the loop sees running_ == false
+    try {
+        asio::io_context io;
+        asio::ip::tcp::socket s(io);
+        auto addr = asio::ip::make_address(listen_.first);
+        if (addr.is_unspecified()) addr = asio::ip::make_address("127.0.0.1");
+        s.connect({addr, listen_.second});
+    } catch (std::exception&) {}
     if (server_thread_.joinable()) server_thread_.join();
 }
 
+std::optional<std::string> rpc_request(const std::string& host, uint16_t port, const std::string& request, int timeout_ms) {
+    try {
+        asio::io_context io;
+        asio::ip::tcp::socket sock(io);
+        std::string s = request + "\n";
+        asio::streambuf buf;
+        bool done = false, failed = false;
+        sock.async_connect({asio::ip::make_address(host), port}, [&](const auto& ec) {
+            if (ec) { failed = done = true; return; }
+            asio::async_write(sock, asio::buffer(s), [&](const auto& ec, size_t) {
+                if (ec) { failed = done = true; return; }
+                asio::async_read_until(sock, buf, '\n', [&](const auto& ec, size_t){ failed = (bool)ec; done = true; });
+            });
+        });
+        io.run_for(std::chrono::milliseconds(timeout_ms));
+        if (!done || failed) return std::nullopt;
+        std::istream is(&buf);
+        std::string line;
+        std::getline(is, line);
+        return line;
+    } catch (std::exception&) {
+        return std::nullopt;
+    }
+}
+
 }
@@ -0,0 +1,176 @@
+#include "send_batch.hpp"
+#include "encoding.hpp"
+#include "rpc.hpp"
+#include "tx.hpp"
+#include "trace.hpp"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+using json = nlohmann::json;
+
+namespace axle {
+
+namespace {
+
+constexpr size_t MAX_REPORTED_ERRORS = 10;
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.remove_suffix(1);
+    return s;
+}
+
+double since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+}
+
+std::optional<int64_t> parse_amount(std::string_view s) {
+    s = trim(s);
+    if (s.empty()) return std::nullopt;
+    int64_t whole = 0, frac = 0;
+    size_t i = 0, frac_digits = 0;
+    for (; i < s.size() && s[i] != '.'; i++) {
+        if (s[i] < '0' || s[i] > '9' || whole > (INT64_MAX / UNIT - 9) / 10) return std::nullopt;
+        whole = whole * 10 + (s[i] - '0');
+    }
+    if (i < s.size()) {
+        if (++i == s.size() && i == 1) return std::nullopt; // just "."
+        for (; i < s.size(); i++, frac_digits++) {
+            if (s[i] < '0' || s[i] > '9' || frac_digits == 8) return std::nullopt;
+            frac = frac * 10 + (s[i] - '0');
+        }
+    }
+    for (; frac_digits < 8; frac_digits++) frac *= 10;
+    int64_t units = whole * UNIT + frac;
+    if (units <= 0) return std::nullopt;
+    return units;
+}
+
+std::optional<std::vector<Payment>> read_payments(const std::string& path, std::string& err) {
+    std::ifstream f(path);
+    if (!f) { err = "cannot open " + path; return std::nullopt; }
+    bool jsonl = path.size() >= 6 && path.compare(path.size() - 6, 6, ".jsonl") == 0;
+    std::vector<Payment> out;
+    std::string line;
+    for (size_t n = 1; std::getline(f, line); n++) {
+        auto l = trim(line);
+        if (l.empty() || l[0] == '#') continue;
+        std::string to, amount;
+        if (jsonl) {
+            json j = json::parse(l, nullptr, false);
+            if (j.is_discarded() || !j.is_object() || !j.contains("to") || !j["to"].is_string() || !j.contains("amount")) {
+                err = "line " + std::to_string(n) + ": expected {\"to\":...,\"amount\":...}";
+                return std::nullopt;
+            }
+            to = j["to"];
+            amount = j["amount"].is_string() ? j["amount"].get<std::string>() : j["amount"].dump();
+        } else {
+            auto comma = l.find(',');
+            if (comma == std::string_view::npos) { err = "line " + std::to_string(n) + ": expected ADDR,AMOUNT"; return std::nullopt; }
+            to = std::string(trim(l.substr(0, comma)));
+            amount = std::string(trim(l.substr(comma + 1)));
+            if (out.empty() && to == "to") continue; // header
+        }
+        auto units = parse_amount(amount);
+        if (!units || !verify_address(to)) {
+            err = "line " + std::to_string(n) + ": bad " + (units ? "address" : "amount");
+            return std::nullopt;
+        }
+        out.push_back({std::move(to), *units});
+    }
+    return out;
+}
+
+BatchResult send_batch(const std::vector<Payment>& payments, const bytes& priv, uint64_t first_nonce,
+                       const BatchOptions& opt) {
+    AXLE_TRACE_SCOPE("send_batch");
+    auto t0 = std::chrono::steady_clock::now();
+    BatchResult r;
+    r.total = payments.size();
+    std::string from = address_from_pubkey(bytes(priv.begin() + 32, priv.end()));
+    size_t batch = std::max<size_t>(1, opt.batch_size);
+    size_t nbatches = (payments.size() + batch - 1) / batch;
+
+    // Signed send_txs request lines, filled in by the signers in roughly batch order.
+    std::vector<std::string> requests(nbatches);
+    std::vector<char> ready(nbatches, 0);
+    std::mutex mu;
+    std::condition_variable cv;
+    std::atomic<size_t> next{0}, signed_txs{0};
+    std::atomic<bool> abort{false};
+    auto sign = [&]() {
+        for (size_t b; !abort && (b = next.fetch_add(1)) < nbatches; ) {
+            std::string req = "{\"method\":\"send_txs\",\"txs\":[";
+            size_t end = std::min(payments.size(), (b + 1) * batch);
+            for (size_t i = b * batch; i < end; i++) {
+                SignedTx tx;
+                tx.type = TxType::TRANSFER;
+                tx.from = from;
+                tx.to = payments[i].to;
+                tx.amount = payments[i].amount;
+                tx.nonce = first_nonce + i;
+                if (i != b * batch) req += ",";
+                req += to_json(sign_tx(tx, priv));
+            }
+            req += "]}";
+            std::lock_guard<std::mutex> lk(mu);
+            if ((signed_txs += end - b * batch) == payments.size()) r.sign_seconds = since(t0);
+            requests[b] = std::move(req);
+            ready[b] = 1;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> signers;
+    for (unsigned t = 0; t < std::max(1u, opt.threads); t++) signers.emplace_back(sign);
+
+    for (size_t b = 0; b < nbatches; b++) {
+        std::string req;
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            cv.wait(lk, [&]{ return ready[b] != 0; });
+            req.swap(requests[b]);
+        }
+        auto reply = rpc_request(opt.host, opt.port, req);
+        json j = reply ? json::parse(*reply, nullptr, false) : json();
+        if (!reply || j.is_discarded() || !j.contains("accepted")) {
+            r.rpc_failed = true;
+            r.errors.push_back("batch " + std::to_string(b) + ": " + (!reply ? std::string("no reply from node")
+                               : j.is_object() && j.contains("error") ? j["error"].dump() : *reply));
+            abort = true;
+            break;
+        }
+        size_t n = std::min(payments.size(), (b + 1) * batch) - b * batch;
+        size_t accepted = j["accepted"].get<size_t>();
+        r.submitted += n;
+        r.accepted += accepted;
+        r.rejected += n - std::min(n, accepted);
+        if (j.contains("errors"))
+            for (auto& e : j["errors"]) {
+                if (r.errors.size() >= MAX_REPORTED_ERRORS) break;
+                r.errors.push_back("row " + std::to_string(b * batch + e.value("index", (size_t)0) + 1) + ": " + e.value("error", ""));
+            }
+        r.signed_txs = signed_txs;
+        r.seconds = since(t0);
+        if (opt.progress) {
+            BatchResult snap;
+            {
+                std::lock_guard<std::mutex> lk(mu); // sign_seconds is written under it
+                snap = r;
+            }
+            opt.progress(snap);
+        }
+    }
+    for (auto& t : signers) t.join();
+    r.signed_txs = signed_txs;
+    r.seconds = since(t0);
+    return r;
+}
+
+}
@@ -0,0 +1,322 @@
+#include "snapshot.hpp"
+#include "blockchain.hpp"
+#include "crypto.hpp"
+#include "encoding.hpp"
+#include "metrics.hpp"
+#include "p2p.hpp"
+#include "trace.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <thread>
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+namespace axle {
+
+static Counter& m_chunks_served = metrics().counter("axle_snapshot_chunks_served_total", "Snapshot chunks sent to peers");
+static Counter& m_chunks_fetched = metrics().counter("axle_snapshot_chunks_fetched_total", "Snapshot chunks downloaded and verified");
+static Counter& m_chunks_bad = metrics().counter("axle_snapshot_chunks_rejected_total", "Snapshot chunks that failed their hash check");
+
+static std::string sha256_hex(std::string_view s) { return hex(sha256(bytes(s.begin(), s.end()))); }
+
+std::string SnapshotManifest::to_json() const {
+    json j;
+    j["network_id"] = network_id;
+    j["height"] = height;
+    j["block_hash"] = block_hash;
+    j["work"] = work;
+    j["chunks"] = json::array();
+    for (auto& c : chunks) j["chunks"].push_back({{"hash", c.hash}, {"size", c.size}});
+    return j.dump();
+}
+
+std::optional<SnapshotManifest> SnapshotManifest::from_json(std::string_view js) {
+    json j = json::parse(js, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) return std::nullopt;
+    try {
+        SnapshotManifest m;
+        m.network_id = j.at("network_id");
+        m.height = j.at("height");
+        m.block_hash = j.at("block_hash");
+        m.work = j.at("work");
+        for (auto& c : j.at("chunks")) m.chunks.push_back({c.at("hash"), c.at("size")});
+        return m;
+    } catch (const json::exception&) {
+        return std::nullopt;
+    }
+}
+
+std::string SnapshotManifest::hash() const { return sha256_hex(to_json()); }
+
+// Chunk kinds, one JSON object per chunk:
+//   meta     {next_token_id, unclaimed_pool}                (always chunk 0)
+//   accounts {entries: [[addr, balance, nonce], ...]}
+//   nfts     {entries: [[id, owner, name, symbol, uri], ...]}
+//   headers  {first, records: hex of HeaderRecords}
+std::vector<std::string> make_snapshot_chunks(const LedgerState& st, const std::vector<HeaderRecord>& headers,
+                                              size_t chunk_bytes) {
+    std::vector<std::string> out;
+    out.push_back(json{{"kind","meta"}, {"next_token_id", st.next_token_id}, {"unclaimed_pool", st.unclaimed_pool}}.dump());
+
+    json cur;
+    size_t cur_bytes = 0;
+    auto flush = [&](){
+        if (cur_bytes) out.push_back(cur.dump());
+        cur = json(); cur_bytes = 0;
+    };
+    // in address order, so every peer serving this snapshot cuts the same chunks
+    std::vector<std::pair<std::string, AccountState>> accounts;
+    accounts.reserve(st.accounts.size());
+    st.accounts.for_each([&](const std::string& addr, const AccountState& a) { accounts.emplace_back(addr, a); });
+    if (st.accounts.tiered()) std::sort(accounts.begin(), accounts.end(), [](auto& x, auto& y) { return x.first < y.first; });
+    for (auto& [addr, a] : accounts) {
+        if (!cur_bytes) cur = {{"kind","accounts"}, {"entries", json::array()}};
+        cur["entries"].push_back({addr, a.balance, a.nonce});
+        cur_bytes += addr.size() + 48;
+        if (cur_bytes >= chunk_bytes) flush();
+    }
+    flush();
+    for (auto& [id, e] : st.nfts) {
+        if (!cur_bytes) cur = {{"kind","nfts"}, {"entries", json::array()}};
+        auto uri = e.second.uri();
+        cur["entries"].push_back({id, e.first.str(), e.second.name(), e.second.symbol(), uri});
+        cur_bytes += e.first.size() + e.second.name().size() + e.second.symbol().size() + uri.size() + 32;
+        if (cur_bytes >= chunk_bytes) flush();
+    }
+    flush();
+    size_t per_chunk = std::max<size_t>(1, chunk_bytes / (2 * sizeof(HeaderRecord)));
+    for (size_t i=0; i<headers.size(); i+=per_chunk) {
+        size_t n = std::min(per_chunk, headers.size() - i);
+        auto p = reinterpret_cast<const uint8_t*>(&headers[i]);
+        out.push_back(json{{"kind","headers"}, {"first", i}, {"records", hex(bytes(p, p + n * sizeof(HeaderRecord)))}}.dump());
+    }
+    return out;
+}
+
+static fs::path snapshots_dir(const Storage& st) { return fs::path(st.datadir()) / "snapshots"; }
+
+static std::optional<std::string> slurp(const fs::path& p) {
+    std::ifstream f(p, std::ios::binary);
+    if (!f) return std::nullopt;
+    return std::string((std::istreambuf_iterator<char>(f)), {});
+}
+
+std::optional<SnapshotManifest> write_snapshot(const Blockchain& chain, size_t chunk_bytes) {
+    AXLE_TRACE_SCOPE("write_snapshot");
+    auto& st = chain.storage();
+    auto& headers = chain.headers().records();
+    if (headers.size() != chain.tip_height() + 1 || headers.back().hash_hex() != chain.tip_hash()) return std::nullopt;
+    auto chunks = make_snapshot_chunks(chain.state(), headers, chunk_bytes);
+
+    SnapshotManifest m;
+    m.network_id = chain.params().network_id;
+    m.height = chain.tip_height();
+    m.block_hash = chain.tip_hash();
+    m.work = chain.tip_work();
+    auto dir = snapshots_dir(st) / std::to_string(m.height);
+    fs::create_directories(dir);
+    for (size_t i=0;i<chunks.size();i++) {
+        std::ofstream(dir / (std::to_string(i) + ".chunk"), std::ios::binary) << chunks[i];
+        m.chunks.push_back({sha256_hex(chunks[i]), chunks[i].size()});
+    }
+    std::ofstream(dir / "manifest.json", std::ios::binary) << m.to_json();
+
+    // keep the newest two
+    std::vector<uint64_t> heights;
+    for (auto& e : fs::directory_iterator(snapshots_dir(st))) {
+        try { heights.push_back(std::stoull(e.path().filename().string())); } catch (...) {}
+    }
+    std::sort(heights.rbegin(), heights.rend());
+    for (size_t i=2;i<heights.size();i++) fs::remove_all(snapshots_dir(st) / std::to_string(heights[i]));
+    return m;
+}
+
+std::optional<std::string> read_snapshot_manifest(const Storage& st, const std::string& manifest_hash) {
+    std::error_code ec;
+    std::optional<std::pair<uint64_t, std::string>> best;
+    for (auto& e : fs::directory_iterator(snapshots_dir(st), ec)) {
+        auto s = slurp(e.path() / "manifest.json");
+        if (!s || (!manifest_hash.empty() && sha256_hex(*s) != manifest_hash)) continue;
+        uint64_t h = 0;
+        try { h = std::stoull(e.path().filename().string()); } catch (...) { continue; }
+        if (!best || h > best->first) best = {h, *s};
+    }
+    if (!best) return std::nullopt;
+    return best->second;
+}
+
+std::optional<std::string> read_snapshot_chunk(const Storage& st, uint64_t height, size_t index) {
+    auto s = slurp(snapshots_dir(st) / std::to_string(height) / (std::to_string(index) + ".chunk"));
+    if (s) m_chunks_served.inc();
+    return s;
+}
+
+namespace {
+
+// Folds one verified chunk into the state/headers being assembled.
+bool apply_chunk(std::string_view chunk, LedgerState& st, std::vector<HeaderRecord>& headers) {
+    json j = json::parse(chunk, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) return false;
+    try {
+        std::string kind = j.at("kind");
+        if (kind == "meta") {
+            st.next_token_id = j.at("next_token_id");
+            st.unclaimed_pool = j.at("unclaimed_pool");
+        } else if (kind == "accounts") {
+            for (auto& e : j.at("entries")) st.accounts[e.at(0)] = {e.at(1), e.at(2)};
+        } else if (kind == "nfts") {
+            for (auto& e : j.at("entries")) st.nfts[e.at(0)] = {e.at(1).get<std::string>(), NFTMeta{e.at(2), e.at(3), e.at(4)}};
+        } else if (kind == "headers") {
+            uint64_t first = j.at("first");
+            auto raw = unhex(j.at("records").get<std::string>());
+            if (raw.size() % sizeof(HeaderRecord)) return false;
+            size_t n = raw.size() / sizeof(HeaderRecord);
+            if (headers.size() < first + n) headers.resize(first + n);
+            std::memcpy(&headers[first], raw.data(), raw.size());
+        } else {
+            return false;
+        }
+    } catch (const json::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// Header chain from genesis to the manifest's block: linked, hashed, proof-of-work valid.
+std::string check_headers(const std::vector<HeaderRecord>& hs, const SnapshotManifest& m) {
+    if (hs.size() != m.height + 1) return "header count does not match snapshot height";
+    uint64_t work = 0;
+    std::string prev;
+    for (uint64_t h=0; h<hs.size(); h++) {
+        auto header = hs[h].header();
+        auto hash = hs[h].hash_hex();
+        if (hs[h].height != h || header.prev_hash != prev || block_hash(header) != hash) return "broken header chain at " + std::to_string(h);
+        if (h > 0) {
+            if (hs[h].difficulty_bits > MAX_DIFFICULTY_BITS || !hash_meets_bits(hash, hs[h].difficulty_bits)) return "header without proof of work at " + std::to_string(h);
+            work += block_work(hs[h].difficulty_bits);
+        }
+        prev = hash;
+    }
+    if (prev != m.block_hash) return "headers end at a different block";
+    if (work != m.work) return "header work does not match manifest";
+    return "";
+}
+
+}
+
+SnapshotSyncResult snapshot_sync(Storage& st, const ChainParams& params,
+                                 const std::vector<std::pair<std::string, uint16_t>>& peers,
+                                 const std::string& manifest_hash, unsigned threads) {
+    AXLE_TRACE_SCOPE("snapshot_sync");
+    SnapshotSyncResult r;
+    auto start = std::chrono::steady_clock::now();
+    auto fail = [&](std::string e) { r.error = std::move(e); return r; };
+    if (st.read_tip()) return fail("datadir already has a chain");
+    if (peers.empty()) return fail("no peers");
+
+    std::optional<SnapshotManifest> m;
+    for (auto& [h, p] : peers) {
+        auto resp = p2p_request(h, p, json{{"type","get_snapshot_manifest"}, {"hash", manifest_hash}}.dump());
+        if (resp && sha256_hex(*resp) == manifest_hash) { m = SnapshotManifest::from_json(*resp); break; }
+    }
+    if (!m) return fail("no peer has a snapshot with manifest hash " + manifest_hash);
+    if (m->network_id != params.network_id) return fail("snapshot is for another network");
+
+    // each chunk goes to peers round-robin, moving on to the next peer when one fails or lies
+    std::vector<std::string> chunks(m->chunks.size());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&](){
+        for (size_t i; !failed && (i = next.fetch_add(1)) < chunks.size(); ) {
+            bool got = false;
+            for (size_t attempt=0; attempt < 2 * peers.size() && !got; attempt++) {
+                auto& [h, p] = peers[(i + attempt) % peers.size()];
+                auto resp = p2p_request(h, p, json{{"type","get_snapshot_chunk"}, {"height", m->height}, {"index", i}}.dump());
+                if (!resp) continue;
+                if (resp->size() != m->chunks[i].size || sha256_hex(*resp) != m->chunks[i].hash) { m_chunks_bad.inc(); continue; }
+                chunks[i] = std::move(*resp);
+                m_chunks_fetched.inc();
+                got = true;
+            }
+            if (!got) failed = true;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t=0; t<std::max(1u, threads); t++) pool.emplace_back(worker);
+    for (auto& t : pool) t.join();
+    if (failed) return fail("could not fetch every chunk");
+    r.fetch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    LedgerState state;
+    std::vector<HeaderRecord> headers;
+    for (auto& c : chunks) {
+        r.bytes += c.size();
+        if (!apply_chunk(c, state, headers)) return fail("malformed chunk");
+    }
+    r.chunks = chunks.size();
+    if (auto e = check_headers(headers, *m); !e.empty()) return fail(e);
+    // summed with overflow checks: a crafted ledger could otherwise wrap around to the cap
+    int64_t total = state.unclaimed_pool;
+    bool conserved = total >= 0;
+    state.accounts.for_each([&](const std::string&, const AccountState& a) {
+        if (a.balance < 0 || a.balance > std::numeric_limits<int64_t>::max() - total) conserved = false;
+        else total += a.balance;
+    });
+    if (!conserved || total != params.supply_cap) return fail("snapshot does not conserve the supply");
+    // the last header commits to the state, so a peer cannot hand over a doctored ledger
+    StateTree tree;
+    tree.apply(state_entries(state));
+    if (hex(tree.root(threads)) != headers.back().header().state_root) return fail("snapshot state does not match the header's state root");
+
+    // install: state and headers, with every body at or below the snapshot marked as pruned
+    st.ensure_layout(params);
+    st.write_headers(headers);
+    ChainTip tip{m->height, m->block_hash, m->work, m->height + 1};
+    if (!st.save_state(state, &tip)) return fail("cannot write state.json");
+    st.write_tip(tip);
+    r.height = m->height;
+
+    // catch up past the snapshot; a peer that sends a malformed or invalid block is dropped and
+    // the next one asked, since the snapshot itself is already installed and verified
+    Blockchain chain(st, params);
+    if (!chain.load()) return fail("installed snapshot does not load");
+    auto live = peers;
+    for (bool progress = true; progress; ) {
+        progress = false;
+        for (auto it = live.begin(); it != live.end(); ) {
+            auto& [h, p] = *it;
+            auto resp = p2p_request(h, p, json{{"type","get_block"}, {"height", chain.tip_height() + 1}}.dump());
+            // {"block":<stored bytes>} -- decode the inner block straight from the reply
+            constexpr std::string_view prefix = "{\"block\":";
+            if (!resp || resp->compare(0, prefix.size(), prefix) != 0 || resp->back() != '}') { ++it; continue; }
+            auto raw = std::string_view(*resp).substr(prefix.size(), resp->size() - prefix.size() - 1);
+            bool ok = false;
+            try {
+                ok = chain.accept_block(block_from_json(raw));
+            } catch (std::exception&) {
+            }
+            if (!ok) {
+                std::cerr << "[SNAPSHOT] " << h << ":" << p << " sent an invalid block at height " << chain.tip_height() + 1
+                          << "; dropping it" << std::endl;
+                it = live.erase(it);
+                continue;
+            }
+            progress = true;
+            break;
+        }
+    }
+    r.tip_height = chain.tip_height();
+    r.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.ok = true;
+    return r;
+}
+
+}
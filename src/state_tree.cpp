@@ -0,0 +1,368 @@
+#include "state_tree.hpp"
+#include "crypto.hpp"
+#include "trace.hpp"
+#include <sodium.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace axle {
+
+namespace {
+
+// below this many changed keys, thread start-up costs more than the hashing it spreads
+constexpr size_t PARALLEL_MIN_CHANGES = 1024;
+
+constexpr char MAGIC[8] = {'A', 'X', 'T', 'R', 'E', 'E', '0', '1'};
+constexpr size_t PAGE = 4096, SLOT = 64, INITIAL_SLOTS = 1024;
+
+struct Sha256 {
+    crypto_hash_sha256_state st;
+    Sha256() { crypto_hash_sha256_init(&st); }
+    Sha256& add(const void* p, size_t n) { crypto_hash_sha256_update(&st, (const uint8_t*)p, n); return *this; }
+    Sha256& add(uint8_t b) { return add(&b, 1); }
+    Sha256& add_u64(uint64_t v) {
+        uint8_t le[8];
+        for (int i=0;i<8;i++) le[i] = (uint8_t)(v >> (8 * i));
+        return add(le, 8);
+    }
+    Sha256& add_str(std::string_view s) { add_u64(s.size()); return add(s.data(), s.size()); }
+    Hash256 done() { Hash256 h; crypto_hash_sha256_final(&st, h.data()); return h; }
+};
+
+bool bit(const Hash256& k, unsigned depth) { return (k[depth / 8] >> (7 - depth % 8)) & 1; }
+
+StateChanges::const_iterator split(StateChanges::const_iterator b, StateChanges::const_iterator e, unsigned depth) {
+    return std::partition_point(b, e, [&](auto& c){ return !bit(c.first, depth); });
+}
+
+}
+
+StateTree& StateTree::operator=(StateTree&& o) noexcept {
+    if (this == &o) return *this;
+    unmap();
+    if (fd_ >= 0) ::close(fd_);
+    heap_header_ = o.heap_header_;
+    heap_ = std::move(o.heap_);
+    nodes_ = std::exchange(o.nodes_, nullptr);
+    path_ = std::move(o.path_);
+    fd_ = std::exchange(o.fd_, -1);
+    base_ = std::exchange(o.base_, nullptr);
+    bytes_ = std::exchange(o.bytes_, 0);
+    pending_ = std::exchange(o.pending_, 0);
+    last_hashes_ = o.last_hashes_;
+    o.heap_header_ = Header{};
+    return *this;
+}
+
+StateTree::~StateTree() {
+    unmap();
+    if (fd_ >= 0) ::close(fd_);
+}
+
+bool StateTree::open(const std::string& path, bool truncate, std::string& err) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) { err = "cannot open " + path + ": " + std::strerror(errno); return false; }
+    struct stat sb{};
+    ::fstat(fd, &sb);
+    size_t bytes = (size_t)sb.st_size;
+    bool fresh = bytes == 0;
+    if (fresh) {
+        bytes = PAGE + INITIAL_SLOTS * SLOT;
+        if (::ftruncate(fd, (off_t)bytes) != 0) { err = "cannot size " + path; ::close(fd); return false; }
+    }
+    *this = StateTree{};
+    fd_ = fd;
+    path_ = path;
+    if (bytes < PAGE || !map(bytes)) { err = "cannot map " + path; *this = StateTree{}; return false; }
+    auto& h = header();
+    if (fresh) {
+        std::memcpy(h.magic, MAGIC, 8);
+        h.slots = INITIAL_SLOTS;
+    } else if (std::memcmp(h.magic, MAGIC, 8) != 0 || PAGE + h.slots * SLOT != bytes || h.used > h.slots ||
+               h.free_head > h.used || (h.root & ~LEAF) > h.used) {
+        err = path + " is not a state tree";
+        *this = StateTree{};
+        return false;
+    }
+    return true;
+}
+
+bool StateTree::map(size_t bytes) {
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) return false;
+    base_ = static_cast<uint8_t*>(p);
+    bytes_ = bytes;
+    nodes_ = reinterpret_cast<Node*>(base_ + PAGE);
+    return true;
+}
+
+void StateTree::unmap() {
+    if (base_) ::munmap(base_, bytes_);
+    base_ = nullptr;
+    bytes_ = 0;
+}
+
+bool StateTree::sync() { return !file_backed() || ::msync(base_, bytes_, MS_SYNC) == 0; }
+
+bool StateTree::move_to(const std::string& path) {
+    if (std::rename(path_.c_str(), path.c_str()) != 0) return false;
+    path_ = path;
+    return true;
+}
+
+void StateTree::set_tip(uint64_t height, const std::string& hash) {
+    auto& h = header();
+    h.height = height;
+    std::memset(h.tip, 0, sizeof h.tip);
+    std::memcpy(h.tip, hash.data(), std::min(hash.size(), sizeof h.tip));
+}
+
+std::optional<std::pair<uint64_t, std::string>> StateTree::tip() const {
+    auto& h = header();
+    if (!h.tip[0]) return std::nullopt;
+    return std::pair{h.height, std::string(h.tip, strnlen(h.tip, sizeof h.tip))};
+}
+
+StateChanges StateTree::apply(StateChanges changes) {
+    AXLE_TRACE_SCOPE("state_tree.apply");
+    std::sort(changes.begin(), changes.end(), [](auto& a, auto& b){ return a.first < b.first; });
+    pending_ += changes.size();
+    auto& h = header();
+    std::memset(h.tip, 0, sizeof h.tip); // no longer the tree of the block it was stamped at
+    StateChanges inverse;
+    inverse.reserve(changes.size());
+    Ref root = update(h.root, 0, changes.begin(), changes.end(), inverse);
+    auto& after = header(); // the update may have remapped the file
+    after.root = root;
+    for (auto& c : changes) after.entries += c.second.has_value();
+    for (auto& c : inverse) after.entries -= c.second.has_value();
+    return inverse;
+}
+
+StateTree::Ref StateTree::update(Ref r, unsigned depth, Iter b, Iter e, StateChanges& inverse) {
+    if (b == e) return r;
+    if (!r || (r & LEAF)) {
+        // Empty or single-entry subtree: rebuild it from the surviving entries.
+        std::optional<Leaf> old;
+        if (r) old = leaf(r);
+        bool replaced = false;
+        StateChanges sets;
+        for (auto it = b; it != e; ++it) {
+            bool same = old && it->first == old->key;
+            replaced |= same;
+            inverse.push_back({it->first, same ? std::optional<Hash256>(old->value) : std::nullopt});
+            if (it->second) sets.push_back(*it);
+        }
+        if (old && !replaced) {
+            auto at = std::lower_bound(sets.begin(), sets.end(), old->key, [](auto& c, auto& k){ return c.first < k; });
+            sets.insert(at, {old->key, old->value});
+        }
+        if (r && sets.size() == 1 && sets[0].first == old->key) { // value update in place
+            leaf(r).value = *sets[0].second;
+            return r;
+        }
+        if (r) free(r);
+        return build(depth, sets.begin(), sets.end());
+    }
+    auto mid = split(b, e, depth);
+    // no references into the nodes across the recursion: growing the file remaps them
+    Ref left = update(internal(r).child[0], depth + 1, b, mid, inverse);
+    Ref right = update(internal(r).child[1], depth + 1, mid, e, inverse);
+    // keep the tree canonical: a subtree with one entry is just that entry's leaf
+    if ((!left && !right) || (!left && (right & LEAF)) || (!right && (left & LEAF))) {
+        free(r);
+        return left ? left : right;
+    }
+    auto& n = internal(r);
+    n.child[0] = left;
+    n.child[1] = right;
+    n.dirty = 1;
+    return r;
+}
+
+StateTree::Ref StateTree::build(unsigned depth, Iter b, Iter e) {
+    if (b == e) return 0;
+    if (e - b == 1) return new_leaf(b->first, *b->second);
+    auto mid = split(b, e, depth);
+    Ref left = build(depth + 1, b, mid);
+    Ref right = build(depth + 1, mid, e);
+    return new_internal(left, right);
+}
+
+// A free slot, from the free list or past the ones handed out so far.
+uint32_t StateTree::alloc_slot() {
+    auto& h = header();
+    if (h.free_head) {
+        uint32_t i = h.free_head - 1;
+        h.free_head = nodes_[i].in.child[0];
+        return i;
+    }
+    if (h.used == h.slots && !grow()) throw std::runtime_error("cannot grow the state tree" + (path_.empty() ? "" : " in " + path_));
+    return (uint32_t)header().used++;
+}
+
+// Doubles the slots: the heap array is reallocated, the file extended and mapped again.
+bool StateTree::grow() {
+    AXLE_TRACE_SCOPE("state_tree.grow");
+    uint64_t slots = std::max<uint64_t>(INITIAL_SLOTS, header().slots * 2);
+    if (slots >= LEAF) return false;
+    if (!file_backed()) {
+        heap_.resize(slots);
+        nodes_ = heap_.data();
+        heap_header_.slots = slots;
+        return true;
+    }
+    size_t bytes = PAGE + slots * SLOT;
+    if (::ftruncate(fd_, (off_t)bytes) != 0) return false;
+    unmap();
+    if (!map(bytes)) return false;
+    header().slots = slots;
+    return true;
+}
+
+StateTree::Ref StateTree::new_leaf(const Hash256& key, const Hash256& value) {
+    uint32_t i = alloc_slot();
+    nodes_[i].leaf = {key, value};
+    return (i + 1) | LEAF;
+}
+
+StateTree::Ref StateTree::new_internal(Ref left, Ref right) {
+    uint32_t i = alloc_slot();
+    auto& n = nodes_[i].in;
+    n.hash = Hash256{};
+    n.child[0] = left;
+    n.child[1] = right;
+    n.dirty = 1;
+    return i + 1;
+}
+
+void StateTree::free(Ref r) {
+    if (!r) return;
+    uint32_t i = (r & ~LEAF) - 1;
+    auto& h = header();
+    nodes_[i].in.child[0] = h.free_head;
+    h.free_head = i + 1;
+}
+
+std::optional<Hash256> StateTree::get(const Hash256& key) const {
+    Ref r = header().root;
+    for (unsigned depth = 0; r && !(r & LEAF); depth++) r = internal(r).child[bit(key, depth)];
+    if (!r) return std::nullopt;
+    auto& l = leaf(r);
+    if (l.key != key) return std::nullopt;
+    return l.value;
+}
+
+Hash256 StateTree::rehash(Ref r, uint64_t& hashes) {
+    if (!r) return Hash256{};
+    if (r & LEAF) {
+        auto& l = leaf(r);
+        hashes++;
+        return Sha256().add((uint8_t)0).add(l.key.data(), 32).add(l.value.data(), 32).done();
+    }
+    auto& n = internal(r);
+    if (!n.dirty) return n.hash;
+    auto left = rehash(n.child[0], hashes);
+    auto right = rehash(n.child[1], hashes);
+    n.hash = Sha256().add((uint8_t)1).add(left.data(), 32).add(right.data(), 32).done();
+    n.dirty = 0;
+    hashes++;
+    return n.hash;
+}
+
+// dirty internal nodes exactly max_depth below r; anything shallower is left to the serial pass
+void StateTree::dirty_frontier(Ref r, unsigned depth, unsigned max_depth, std::vector<Ref>& out) const {
+    if (!r || (r & LEAF) || !internal(r).dirty) return;
+    if (depth == max_depth) { out.push_back(r); return; }
+    for (Ref c : internal(r).child) dirty_frontier(c, depth + 1, max_depth, out);
+}
+
+Hash256 StateTree::root(unsigned threads) {
+    AXLE_TRACE_SCOPE("state_tree.root");
+    uint64_t hashes = 0;
+    Ref top = header().root;
+    if (threads > 1 && pending_ >= PARALLEL_MIN_CHANGES && top && !(top & LEAF)) {
+        // Dirty subtrees below the top few levels are disjoint, so they can be hashed in
+        // parallel; the serial pass afterwards only has the levels above them left.
+        std::vector<Ref> frontier;
+        unsigned depth = 3;
+        while ((1u << depth) < threads * 8) depth++;
+        dirty_frontier(top, 0, depth, frontier);
+        if (frontier.size() > 1) {
+            std::atomic<size_t> next{0};
+            std::atomic<uint64_t> total{0};
+            auto work = [&](){
+                uint64_t local = 0;
+                for (size_t i; (i = next.fetch_add(1)) < frontier.size(); ) rehash(frontier[i], local);
+                total += local;
+            };
+            std::vector<std::thread> pool;
+            for (unsigned t=1; t<std::min<size_t>(threads, frontier.size()); t++) pool.emplace_back(work);
+            work();
+            for (auto& th : pool) th.join();
+            hashes += total;
+        }
+    }
+    auto h = rehash(top, hashes);
+    last_hashes_ = hashes;
+    pending_ = 0;
+    return h;
+}
+
+Hash256 account_key(const std::string& addr) { return Sha256().add('a').add(addr.data(), addr.size()).done(); }
+Hash256 nft_key(uint64_t id) { return Sha256().add('n').add_u64(id).done(); }
+Hash256 pool_key() { return Sha256().add('p').done(); }
+
+Hash256 account_value(const AccountState& a) { return Sha256().add_u64((uint64_t)a.balance).add_u64(a.nonce).done(); }
+Hash256 nft_value(const NftEntry& e) {
+    return Sha256().add_str(e.first.str()).add_str(e.second.name()).add_str(e.second.symbol()).add_str(e.second.uri()).done();
+}
+Hash256 pool_value(int64_t unclaimed_pool, uint64_t next_token_id) {
+    return Sha256().add_u64((uint64_t)unclaimed_pool).add_u64(next_token_id).done();
+}
+
+StateChanges state_entries(const LedgerState& st) {
+    StateChanges out;
+    out.reserve(st.accounts.size() + st.nfts.size() + 1);
+    st.accounts.for_each([&](const std::string& addr, const AccountState& a) { out.push_back({account_key(addr), account_value(a)}); });
+    for (auto& [id, e] : st.nfts) out.push_back({nft_key(id), nft_value(e)});
+    out.push_back({pool_key(), pool_value(st.unclaimed_pool, st.next_token_id)});
+    return out;
+}
+
+StateChanges state_changes(const LedgerState& prior, const StateDelta& d) {
+    StateChanges out;
+    out.reserve(d.accounts.size() + d.nfts.size() + 1);
+    for (auto& [addr, a] : d.accounts) out.push_back({account_key(addr), account_value(a)});
+    for (auto& [id, e] : d.nfts) out.push_back({nft_key(id), e ? std::optional<Hash256>(nft_value(*e)) : std::nullopt});
+    if (d.pool_delta || d.next_token_id)
+        out.push_back({pool_key(), pool_value(prior.unclaimed_pool + d.pool_delta, d.next_token_id.value_or(prior.next_token_id))});
+    return out;
+}
+
+StateChanges state_changes(const LedgerState& st, const UndoRecord& u) {
+    StateChanges out;
+    for (auto& [addr, _] : u.accounts) {
+        auto a = st.accounts.get(addr);
+        out.push_back({account_key(addr), a ? std::optional<Hash256>(account_value(*a)) : std::nullopt});
+    }
+    for (auto& [id, _] : u.nfts) {
+        auto it = st.nfts.find(id);
+        out.push_back({nft_key(id), it == st.nfts.end() ? std::nullopt : std::optional<Hash256>(nft_value(it->second))});
+    }
+    out.push_back({pool_key(), pool_value(st.unclaimed_pool, st.next_token_id)});
+    return out;
+}
+
+std::string hex(const Hash256& h) { return hex(bytes(h.begin(), h.end())); }
+
+}
@@ -1,22 +1,68 @@
 #include "storage.hpp"
 #include "encoding.hpp"
+#include "block_codec.hpp"
 #include "crypto.hpp"
+#include "mem_accounting.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <fstream>
+#include <iostream>
 #include <filesystem>
 #include <nlohmann/json.hpp>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
 namespace axle {
 
-Storage::Storage(std::string datadir): datadir_(std::move(datadir)) {}
+static Histogram& m_write_block = metrics().histogram("axle_storage_write_seconds", "Storage write latency", "op=\"block\"");
+static Histogram& m_write_tip = metrics().histogram("axle_storage_write_seconds", "Storage write latency", "op=\"tip\"");
+static Histogram& m_write_undo = metrics().histogram("axle_storage_write_seconds", "Storage write latency", "op=\"undo\"");
+static Histogram& m_write_state = metrics().histogram("axle_storage_write_seconds", "Storage write latency", "op=\"state\"");
+static Counter& m_written = metrics().counter("axle_storage_written_bytes_total", "Bytes written by Storage");
+static Counter& m_json_hits = metrics().counter("axle_storage_block_json_hits_total", "Columnar blocks served from their cached JSON encoding");
+static Counter& m_json_encoded = metrics().counter("axle_storage_block_json_encoded_total", "Columnar blocks re-encoded as JSON to be served");
+
+constexpr size_t JSON_CACHE_BYTES = 16 << 20;
+
+// JSON encodings of columnar bodies by height. Storage writes every body, so it drops an entry
+// when its height is rewritten or removed; `version` keeps a read that raced such a write from
+// caching what it decoded. Past JSON_CACHE_BYTES the lowest heights go first: peers ask for
+// the recent blocks, and a syncing one walks upwards.
+struct Storage::JsonCache {
+    std::mutex mu;
+    std::map<uint64_t, std::shared_ptr<const std::string>> blocks;
+    size_t bytes{0};
+    uint64_t version{0};
+
+    void drop(uint64_t height) {
+        std::lock_guard<std::mutex> lk(mu);
+        version++;
+        if (auto it = blocks.find(height); it != blocks.end()) {
+            bytes -= it->second->size();
+            blocks.erase(it);
+        }
+    }
+};
+
+std::optional<BlockCodec> parse_block_codec(const std::string& s) {
+    if (s == "json") return BlockCodec::Json;
+    if (s == "columnar") return BlockCodec::Columnar;
+    return std::nullopt;
+}
+
+Storage::Storage(std::string datadir): datadir_(std::move(datadir)), json_cache_(std::make_shared<JsonCache>()) {}
 
 std::string Storage::blocks_dir() const { return (fs::path(datadir_) / "blocks").string(); }
 
 bool Storage::ensure_layout(const ChainParams& params) {
     fs::create_directories(datadir_);
     fs::create_directories(blocks_dir());
+    fs::create_directories(fs::path(blocks_dir()) / "side");
+    fs::create_directories(fs::path(datadir_) / "undo");
     // Initialize state if not present
     fs::path state_path = fs::path(datadir_) / "state.json";
     if (!fs::exists(state_path)) {
@@ -32,78 +78,344 @@ bool Storage::ensure_layout(const ChainParams& params) {
     return true;
 }
 
+static std::optional<std::string> read_file(const fs::path& p) {
+    std::ifstream f(p, std::ios::binary);
+    if (!f) return std::nullopt;
+    std::string s;
+    f.seekg(0, std::ios::end);
+    s.resize((size_t)f.tellg());
+    f.seekg(0);
+    f.read(s.data(), (std::streamsize)s.size());
+    return s;
+}
+
+// Written aside and renamed into place, so a crash or a reader without the chain lock never
+// sees half a file.
+static bool write_file_atomic(const fs::path& path, std::string_view s) {
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(s.data(), (std::streamsize)s.size());
+        if (!f) return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) return false;
+    m_written.inc(s.size());
+    return true;
+}
+
+fs::path Storage::block_path(uint64_t height, BlockCodec codec) const {
+    return fs::path(blocks_dir()) / (std::to_string(height) + (codec == BlockCodec::Columnar ? ".blk" : ".json"));
+}
+
 std::optional<Block> Storage::read_block(uint64_t height) const {
-    fs::path p = fs::path(blocks_dir()) / (std::to_string(height) + ".json");
-    if (!fs::exists(p)) return std::nullopt;
-    std::ifstream f(p);
-    std::string s((std::istreambuf_iterator<char>(f)), {});
-    return block_from_json(s);
+    MemScope mem(MemTag::Storage);
+    AXLE_TRACE_SCOPE("storage.read_block");
+    if (auto c = read_file(block_path(height, BlockCodec::Columnar))) return decode_block_columnar(*c);
+    auto s = read_file(block_path(height, BlockCodec::Json));
+    if (!s) return std::nullopt;
+    return block_from_json(*s);
+}
+
+std::optional<std::string> Storage::read_block_bytes(uint64_t height) const {
+    MemScope mem(MemTag::Storage);
+    AXLE_TRACE_SCOPE("storage.read_block");
+    if (auto s = read_file(block_path(height, BlockCodec::Json))) return s;
+    auto& cache = *json_cache_;
+    uint64_t version;
+    {
+        std::lock_guard<std::mutex> lk(cache.mu);
+        if (auto it = cache.blocks.find(height); it != cache.blocks.end()) {
+            m_json_hits.inc();
+            return *it->second;
+        }
+        version = cache.version;
+    }
+    auto c = read_file(block_path(height, BlockCodec::Columnar));
+    if (!c) return std::nullopt;
+    auto b = decode_block_columnar(*c);
+    if (!b) return std::nullopt;
+    auto s = std::make_shared<const std::string>(to_json(*b));
+    m_json_encoded.inc();
+    std::lock_guard<std::mutex> lk(cache.mu);
+    if (cache.version == version && s->size() <= JSON_CACHE_BYTES && !cache.blocks.count(height)) {
+        while (cache.bytes + s->size() > JSON_CACHE_BYTES) {
+            cache.bytes -= cache.blocks.begin()->second->size();
+            cache.blocks.erase(cache.blocks.begin());
+        }
+        cache.blocks[height] = s;
+        cache.bytes += s->size();
+    }
+    return *s;
+}
+
+std::optional<std::string> Storage::read_block_raw(uint64_t height) const {
+    MemScope mem(MemTag::Storage);
+    AXLE_TRACE_SCOPE("storage.read_block");
+    if (auto s = read_file(block_path(height, BlockCodec::Json))) return s;
+    return read_file(block_path(height, BlockCodec::Columnar));
+}
+
+bool Storage::remove_block(uint64_t height) const {
+    json_cache_->drop(height);
+    std::error_code ec;
+    bool json = fs::remove(block_path(height, BlockCodec::Json), ec);
+    bool blk = fs::remove(block_path(height, BlockCodec::Columnar), ec);
+    return json || blk;
+}
+
+uint64_t Storage::block_size(uint64_t height) const {
+    for (auto codec : {BlockCodec::Json, BlockCodec::Columnar}) {
+        std::error_code ec;
+        auto n = fs::file_size(block_path(height, codec), ec);
+        if (!ec) return n;
+    }
+    return 0;
 }
 
 bool Storage::write_block(const Block& b) const {
-    fs::path p = fs::path(blocks_dir()) / (std::to_string(b.header.height) + ".json");
-    std::ofstream f(p);
-    f << to_json(b);
+    MemScope mem(MemTag::Storage);
+    ScopedTimer timer(m_write_block);
+    AXLE_TRACE_SCOPE("storage.write_block");
+    auto other = codec_ == BlockCodec::Json ? BlockCodec::Columnar : BlockCodec::Json;
+    auto s = codec_ == BlockCodec::Columnar ? encode_block_columnar(b) : to_json(b);
+    if (!write_file_atomic(block_path(b.header.height, codec_), s)) return false;
+    std::error_code ec;
+    fs::remove(block_path(b.header.height, other), ec); // a height has one body, whichever codec wrote it last
+    json_cache_->drop(b.header.height);
     return true;
 }
 
-bool Storage::write_tip(uint64_t height, const std::string& hash) const {
+bool Storage::write_tip(const ChainTip& tip) const {
+    ScopedTimer timer(m_write_tip);
+    AXLE_TRACE_SCOPE("storage.write_tip");
     fs::path p = fs::path(datadir_) / "tip.json";
-    json j; j["height"] = height; j["hash"] = hash;
-    std::ofstream(p) << j.dump(2);
-    return true;
+    json j; j["height"] = tip.height; j["hash"] = tip.hash; j["work"] = tip.work;
+    if (tip.pruned_below) j["pruned_below"] = tip.pruned_below;
+    return write_file_atomic(p, j.dump(2));
 }
 
-std::optional<std::pair<uint64_t,std::string>> Storage::read_tip() const {
+std::optional<ChainTip> Storage::read_tip() const {
     fs::path p = fs::path(datadir_) / "tip.json";
     if (!fs::exists(p)) return std::nullopt;
     std::ifstream f(p);
     json j; f >> j;
-    return std::make_pair((uint64_t)j["height"], (std::string)j["hash"]);
+    return ChainTip{j["height"], j["hash"], j.value("work", (uint64_t)0), j.value("pruned_below", (uint64_t)0)};
+}
+
+static json account_json(const AccountState& a) { return {{"balance", a.balance}, {"nonce", a.nonce}}; }
+static json nft_json(const NftEntry& e) {
+    return {{"owner", e.first.str()}, {"meta", {{"name", e.second.name()}, {"symbol", e.second.symbol()}, {"uri", e.second.uri()}}}};
+}
+static NftEntry nft_from_json(const json& j) {
+    return {j["owner"].get<std::string>(), NFTMeta{j["meta"]["name"], j["meta"]["symbol"], j["meta"]["uri"]}};
 }
 
-bool Storage::load_state(LedgerState& st) const {
+bool Storage::write_undo(uint64_t height, const UndoRecord& u) const {
+    MemScope mem(MemTag::Storage);
+    ScopedTimer timer(m_write_undo);
+    AXLE_TRACE_SCOPE("storage.write_undo");
+    json j;
+    j["hash"] = u.hash;
+    j["prev_hash"] = u.prev_hash;
+    j["work"] = u.work;
+    j["difficulty_bits"] = u.difficulty_bits;
+    j["last_block_time"] = u.last_block_time;
+    j["next_token_id"] = u.next_token_id;
+    j["pool_delta"] = u.pool_delta;
+    j["accounts"] = json::object();
+    for (auto& [addr, a] : u.accounts) j["accounts"][addr] = a ? account_json(*a) : json();
+    j["nfts"] = json::object();
+    for (auto& [id, e] : u.nfts) j["nfts"][std::to_string(id)] = e ? nft_json(*e) : json();
+    return write_file_atomic(fs::path(datadir_) / "undo" / (std::to_string(height) + ".json"), j.dump());
+}
+
+std::optional<UndoRecord> Storage::read_undo(uint64_t height) const {
+    MemScope mem(MemTag::Storage);
+    auto s = read_file(fs::path(datadir_) / "undo" / (std::to_string(height) + ".json"));
+    if (!s) return std::nullopt;
+    json j = json::parse(*s, nullptr, false);
+    if (j.is_discarded()) return std::nullopt;
+    UndoRecord u;
+    u.hash = j["hash"];
+    u.prev_hash = j["prev_hash"];
+    u.work = j["work"];
+    u.difficulty_bits = j["difficulty_bits"];
+    u.last_block_time = j["last_block_time"];
+    u.next_token_id = j["next_token_id"];
+    u.pool_delta = j["pool_delta"];
+    for (auto& [addr, a] : j["accounts"].items()) {
+        if (a.is_null()) u.accounts[addr] = std::nullopt;
+        else u.accounts[addr] = AccountState{a["balance"], a["nonce"]};
+    }
+    for (auto& [id, e] : j["nfts"].items()) {
+        if (e.is_null()) u.nfts[std::stoull(id)] = std::nullopt;
+        else u.nfts[std::stoull(id)] = nft_from_json(e);
+    }
+    return u;
+}
+
+bool Storage::remove_undo(uint64_t height) const {
+    std::error_code ec;
+    return fs::remove(fs::path(datadir_) / "undo" / (std::to_string(height) + ".json"), ec);
+}
+
+bool Storage::write_side_block(const std::string& hash, std::string_view block_json) const {
+    MemScope mem(MemTag::Storage);
+    std::ofstream f(fs::path(blocks_dir()) / "side" / (hash + ".json"), std::ios::binary);
+    f.write(block_json.data(), (std::streamsize)block_json.size());
+    m_written.inc(block_json.size());
+    return (bool)f;
+}
+
+std::optional<std::string> Storage::read_side_block_bytes(const std::string& hash) const {
+    MemScope mem(MemTag::Storage);
+    return read_file(fs::path(blocks_dir()) / "side" / (hash + ".json"));
+}
+
+bool Storage::remove_side_block(const std::string& hash) const {
+    std::error_code ec;
+    return fs::remove(fs::path(blocks_dir()) / "side" / (hash + ".json"), ec);
+}
+
+std::vector<std::string> Storage::side_block_hashes() const {
+    std::vector<std::string> out;
+    std::error_code ec;
+    for (auto& e : fs::directory_iterator(fs::path(blocks_dir()) / "side", ec)) {
+        if (e.path().extension() == ".json") out.push_back(e.path().stem().string());
+    }
+    return out;
+}
+
+bool Storage::load_state(LedgerState& st, ChainTip* at) const {
+    AXLE_TRACE_SCOPE("storage.load_state");
     fs::path p = fs::path(datadir_) / "state.json";
     if (!fs::exists(p)) return false;
     std::ifstream f(p);
     json j; f >> j;
     st.accounts.clear();
+    if (j.value("account_store", false)) {
+        auto store = open_account_store(false);
+        if (!store) return false;
+        st.accounts.attach(std::move(store));
+    }
     for (auto it = j["accounts"].begin(); it != j["accounts"].end(); ++it) {
         AccountState a; a.balance = it.value()["balance"]; a.nonce = it.value()["nonce"];
         st.accounts[it.key()] = a;
     }
     st.nfts.clear();
-    if (j.contains("nfts")) {
-        for (auto it = j["nfts"].begin(); it != j["nfts"].end(); ++it) {
-            uint64_t id = std::stoull(it.key());
-            std::string owner = it.value()["owner"];
-            NFTMeta meta{it.value()["meta"]["name"], it.value()["meta"]["symbol"], it.value()["meta"]["uri"]};
-            st.nfts[id] = {owner, meta};
-        }
+    if (j.contains("nft_meta")) {
+        // compact form, see save_state
+        std::vector<InternedString> strings;
+        for (auto& s : j["nft_strings"]) strings.emplace_back(s.get<std::string>());
+        auto str = [&](const json& i) -> const std::string& { return strings.at(i.get<size_t>()).str(); };
+        std::vector<NftMetaRef> metas;
+        for (auto& m : j["nft_meta"])
+            metas.emplace_back(NFTMeta{m.at(0), str(m.at(1)), str(m.at(2)) + m.at(3).get<std::string>()});
+        for (auto it = j["nfts"].begin(); it != j["nfts"].end(); ++it)
+            st.nfts.emplace(std::stoull(it.key()), NftEntry{strings.at(it.value().at(0).get<size_t>()), metas.at(it.value().at(1).get<size_t>())});
+    } else if (j.contains("nfts")) {
+        for (auto it = j["nfts"].begin(); it != j["nfts"].end(); ++it)
+            st.nfts.emplace(std::stoull(it.key()), nft_from_json(it.value()));
     }
-    st.next_token_id = j.value("next_token_id", 1);
-    st.unclaimed_pool = j.value("unclaimed_pool", 0);
+    st.next_token_id = j.value("next_token_id", (uint64_t)1);
+    st.unclaimed_pool = j.value("unclaimed_pool", (int64_t)0);
+    if (at && j.contains("tip")) *at = ChainTip{j["tip"]["height"], j["tip"]["hash"]};
     return true;
 }
 
-bool Storage::save_state(const LedgerState& st) const {
+bool Storage::save_state(const LedgerState& st, const ChainTip* at) const {
+    MemScope mem(MemTag::Storage);
+    ScopedTimer timer(m_write_state);
+    AXLE_TRACE_SCOPE("storage.save_state");
     fs::path p = fs::path(datadir_) / "state.json";
     json j;
     j["accounts"] = json::object();
-    for (auto& [addr, a] : st.accounts) {
-        j["accounts"][addr] = {{"balance", a.balance}, {"nonce", a.nonce}};
+    if (st.accounts.tiered()) {
+        if (!st.accounts.flush()) return false;
+        j["account_store"] = true;
+    } else {
+        st.accounts.for_each([&](const std::string& addr, const AccountState& a) {
+            j["accounts"][addr] = {{"balance", a.balance}, {"nonce", a.nonce}};
+        });
     }
+    // NFTs as references into two tables, like the in-memory store: every distinct owner, symbol
+    // and uri prefix once in "nft_strings", every distinct metadata once in "nft_meta" as
+    // [name, symbol index, uri prefix index, uri suffix], and each token as [owner, meta] indices.
+    std::unordered_map<const std::string*, size_t> string_ids;
+    std::unordered_map<const void*, size_t> meta_ids;
+    j["nft_strings"] = json::array();
+    j["nft_meta"] = json::array();
     j["nfts"] = json::object();
-    for (auto& [id, pair] : st.nfts) {
-        j["nfts"][std::to_string(id)] = {
-            {"owner", pair.first},
-            {"meta", {{"name", pair.second.name}, {"symbol", pair.second.symbol}, {"uri", pair.second.uri}}}
-        };
+    auto string_id = [&](const std::string& s) {
+        auto [it, added] = string_ids.emplace(&s, string_ids.size());
+        if (added) j["nft_strings"].push_back(s);
+        return it->second;
+    };
+    for (auto& [id, e] : st.nfts) {
+        auto [it, added] = meta_ids.emplace(e.second.identity(), meta_ids.size());
+        if (added) j["nft_meta"].push_back({e.second.name(), string_id(e.second.symbol()),
+                                             string_id(e.second.uri_prefix()), e.second.uri_suffix()});
+        j["nfts"][std::to_string(id)] = {string_id(e.first.str()), it->second};
     }
     j["next_token_id"] = st.next_token_id;
     j["unclaimed_pool"] = st.unclaimed_pool;
-    std::ofstream(p) << j.dump(2);
-    return true;
+    if (at) j["tip"] = {{"height", at->height}, {"hash", at->hash}};
+    return write_file_atomic(p, j.dump(2));
+}
+
+std::shared_ptr<AccountStore> Storage::open_account_store(bool truncate, const std::string& name) const {
+    std::string err;
+    auto store = AccountStore::open((fs::path(datadir_) / name).string(), truncate, err);
+    if (!store) std::cerr << "[STATE] " << err << std::endl;
+    return store;
+}
+
+bool Storage::write_header(const HeaderRecord& h) const {
+    MemScope mem(MemTag::Storage);
+    fs::path p = fs::path(datadir_) / "headers.dat";
+    std::fstream f(p, std::ios::in | std::ios::out | std::ios::binary);
+    if (!f) f.open(p, std::ios::out | std::ios::binary); // create
+    f.seekp((std::streamoff)(h.height * sizeof(HeaderRecord)));
+    f.write(reinterpret_cast<const char*>(&h), sizeof h);
+    m_written.inc(sizeof h);
+    return (bool)f;
+}
+
+std::optional<HeaderRecord> Storage::read_header(uint64_t height) const {
+    if (height >= header_count()) return std::nullopt;
+    std::ifstream f(fs::path(datadir_) / "headers.dat", std::ios::binary);
+    f.seekg((std::streamoff)(height * sizeof(HeaderRecord)));
+    HeaderRecord h;
+    if (!f.read(reinterpret_cast<char*>(&h), sizeof h)) return std::nullopt;
+    return h;
+}
+
+std::vector<HeaderRecord> Storage::read_headers(uint64_t first, uint64_t count) const {
+    uint64_t have = header_count();
+    if (first >= have) return {};
+    std::vector<HeaderRecord> out(std::min(count, have - first));
+    std::ifstream f(fs::path(datadir_) / "headers.dat", std::ios::binary);
+    f.seekg((std::streamoff)(first * sizeof(HeaderRecord)));
+    f.read(reinterpret_cast<char*>(out.data()), (std::streamsize)(out.size() * sizeof(HeaderRecord)));
+    out.resize((size_t)f.gcount() / sizeof(HeaderRecord));
+    return out;
+}
+
+bool Storage::write_headers(const std::vector<HeaderRecord>& hs) const {
+    MemScope mem(MemTag::Storage);
+    std::ofstream f(fs::path(datadir_) / "headers.dat", std::ios::binary | std::ios::trunc);
+    f.write(reinterpret_cast<const char*>(hs.data()), (std::streamsize)(hs.size() * sizeof(HeaderRecord)));
+    m_written.inc(hs.size() * sizeof(HeaderRecord));
+    return (bool)f;
+}
+
+uint64_t Storage::header_count() const {
+    std::error_code ec;
+    auto n = fs::file_size(fs::path(datadir_) / "headers.dat", ec);
+    return ec ? 0 : n / sizeof(HeaderRecord);
 }
 
 }
@@ -0,0 +1,133 @@
+#include "trace.hpp"
+#include "mem_accounting.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace axle {
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    int64_t start_ns;
+    int64_t dur_ns;
+};
+
+// One per thread. Only the owner writes; the lock is uncontended except while dumping. The
+// ring grows as spans arrive, so a short-lived thread costs only what it recorded.
+struct TraceBuffer {
+    static constexpr size_t CAPACITY = 1 << 16;
+    std::mutex mu;
+    std::vector<TraceEvent> ring;
+    size_t next{0};
+    uint32_t tid{0};
+};
+
+struct TraceRow {
+    TraceEvent ev;
+    uint32_t tid;
+};
+
+// Buffers of live threads, and the most recent RETIRED_CAPACITY events of threads that have
+// exited (P2P serves each connection on a thread of its own, so those come and go).
+struct TraceRegistry {
+    static constexpr size_t RETIRED_CAPACITY = 1 << 16;
+    std::mutex mu;
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    std::vector<TraceRow> retired;
+    size_t retired_next{0};
+    uint32_t next_tid{1};
+};
+
+TraceRegistry& registry() {
+    static TraceRegistry r;
+    return r;
+}
+
+// Registers the thread's buffer on its first span and retires it when the thread exits.
+struct LocalBuffer {
+    std::shared_ptr<TraceBuffer> buf;
+    LocalBuffer() {
+        MemScope mem(MemTag::Other); // not the subsystem that happened to record first
+        buf = std::make_shared<TraceBuffer>();
+        auto& r = registry();
+        std::lock_guard<std::mutex> lk(r.mu);
+        buf->tid = r.next_tid++;
+        r.buffers.push_back(buf);
+    }
+    ~LocalBuffer() {
+        MemScope mem(MemTag::Other);
+        auto& r = registry();
+        std::lock_guard<std::mutex> lk(r.mu);
+        r.buffers.erase(std::find(r.buffers.begin(), r.buffers.end(), buf));
+        std::lock_guard<std::mutex> blk(buf->mu);
+        size_t n = buf->ring.size(), first = n < TraceBuffer::CAPACITY ? 0 : buf->next;
+        for (size_t i = 0; i < n; i++) {
+            TraceRow row{buf->ring[(first + i) % n], buf->tid};
+            if (r.retired.size() < TraceRegistry::RETIRED_CAPACITY) r.retired.push_back(row);
+            else r.retired[r.retired_next] = row;
+            r.retired_next = (r.retired_next + 1) % TraceRegistry::RETIRED_CAPACITY;
+        }
+    }
+};
+
+TraceBuffer& local_buffer() {
+    thread_local LocalBuffer local;
+    return *local.buf;
+}
+
+}
+
+int64_t trace_now_ns() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void trace_record(const char* name, int64_t start_ns, int64_t dur_ns) {
+    auto& b = local_buffer();
+    std::lock_guard<std::mutex> lk(b.mu);
+    if (b.ring.size() < TraceBuffer::CAPACITY) b.ring.push_back({name, start_ns, dur_ns});
+    else b.ring[b.next] = {name, start_ns, dur_ns};
+    b.next = (b.next + 1) % TraceBuffer::CAPACITY;
+}
+
+std::string trace_json(size_t* events) {
+    std::vector<TraceRow> rows;
+    {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lk(r.mu);
+        rows = r.retired;
+        for (auto& b : r.buffers) {
+            std::lock_guard<std::mutex> blk(b->mu);
+            for (auto& ev : b->ring) rows.push_back({ev, b->tid});
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [](const TraceRow& a, const TraceRow& b){ return a.ev.start_ns < b.ev.start_ns; });
+    std::ostringstream o;
+    o << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i=0;i<rows.size();i++) {
+        auto& r = rows[i];
+        if (i) o << ",";
+        o << "{\"name\":" << nlohmann::json(r.ev.name).dump() << ",\"cat\":\"axle\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r.tid
+          << ",\"ts\":" << r.ev.start_ns / 1000.0 << ",\"dur\":" << r.ev.dur_ns / 1000.0 << "}";
+    }
+    o << "]}";
+    if (events) *events = rows.size();
+    return o.str();
+}
+
+bool dump_trace(const std::string& path, size_t* events) {
+    std::ofstream f(path);
+    if (!f) return false;
+    f << trace_json(events);
+    return (bool)f;
+}
+
+}
@@ -2,14 +2,15 @@
 #include "encoding.hpp"
 #include "crypto.hpp"
 #include "base58.hpp"
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
+#include "trace.hpp"
+#include "arena.hpp"
+#include <sodium.h>
 
 namespace axle {
 
-std::string tx_preimage(const SignedTx& tx) {
-    json j;
+// Built in the thread's active arena (if any): this runs once per tx during validation.
+static arena_string preimage(const SignedTx& tx) {
+    arena_json j;
     j["type"] = (int)tx.type;
     j["from"] = tx.from;
     j["to"] = tx.to;
@@ -20,9 +21,16 @@ std::string tx_preimage(const SignedTx& tx) {
     return j.dump();
 }
 
+std::string tx_preimage(const SignedTx& tx) {
+    auto pre = preimage(tx);
+    return std::string(pre.data(), pre.size());
+}
+
 SignedTx sign_tx(const SignedTx& unsignedTx, const std::vector<uint8_t>& priv) {
+    AXLE_TRACE_SCOPE("sign_tx");
     SignedTx tx = unsignedTx;
-    auto msg = bytes(tx_preimage(tx).begin(), tx_preimage(tx).end());
+    auto pre = tx_preimage(tx);
+    auto msg = bytes(pre.begin(), pre.end());
     tx.signature = ed25519_sign(msg, priv);
     tx.pubkey.resize(crypto_sign_PUBLICKEYBYTES);
     // libsodium secret key ends with pubkey
@@ -32,9 +40,10 @@ SignedTx sign_tx(const SignedTx& unsignedTx, const std::vector<uint8_t>& priv) {
 }
 
 bool verify_tx_sig(const SignedTx& tx) {
+    AXLE_TRACE_SCOPE("verify_tx_sig");
     if (!verify_address(tx.from) || !verify_address(tx.to)) return false;
-    auto msg = bytes(tx_preimage(tx).begin(), tx_preimage(tx).end());
-    return ed25519_verify(msg, tx.signature, tx.pubkey);
+    auto pre = preimage(tx);
+    return ed25519_verify((const uint8_t*)pre.data(), pre.size(), tx.signature, tx.pubkey);
 }
 
 std::string tx_id(const SignedTx& tx) {
@@ -0,0 +1,379 @@
+#include "work_server.hpp"
+#include "block.hpp"
+#include "metrics.hpp"
+#include "miner.hpp"
+#include "trace.hpp"
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+
+using json = nlohmann::json;
+
+namespace axle {
+
+static Counter& m_jobs = metrics().counter("axle_work_jobs_total", "Mining templates built by the work server");
+static Counter& m_pushes = metrics().counter("axle_work_pushes_total", "Work messages sent to mining workers");
+static Gauge& m_workers = metrics().gauge("axle_work_workers", "Mining workers connected to the work server");
+static Counter& m_dropped = metrics().counter("axle_work_dropped_workers_total", "Workers disconnected for not reading their work");
+static Counter& submissions(const char* result) {
+    return metrics().counter("axle_work_submissions_total", "Solutions submitted by mining workers", std::string("result=\"") + result + "\"");
+}
+static Counter& m_accepted = submissions("accepted");
+static Counter& m_stale = submissions("stale");
+static Counter& m_invalid = submissions("invalid");
+
+// writes queued for one worker before it is dropped as too slow to keep up
+static constexpr size_t MAX_QUEUED = 64;
+// templates kept on the current tip; solutions to any of them are still valid blocks
+static constexpr size_t MAX_JOBS = 16;
+// longest request line a worker may send; a longer one gets it dropped
+static constexpr size_t MAX_LINE = 4096;
+
+static json header_json(const BlockHeader& h) {
+    return {{"height", h.height}, {"prev_hash", h.prev_hash}, {"merkle_root", h.merkle_root},
+            {"state_root", h.state_root}, {"timestamp", h.timestamp}, {"difficulty_bits", h.difficulty_bits}};
+}
+
+static BlockHeader header_from_json(const json& j) {
+    BlockHeader h;
+    h.height = j.at("height");
+    h.prev_hash = j.at("prev_hash");
+    h.merkle_root = j.at("merkle_root");
+    h.state_root = j.at("state_root");
+    h.timestamp = j.at("timestamp");
+    h.difficulty_bits = j.at("difficulty_bits");
+    return h;
+}
+
+// Everything below runs on the server's single io thread, except stats().
+struct WorkServer::Impl {
+    WorkServer& ws;
+    asio::io_context io;
+    asio::ip::tcp::acceptor acc{io};
+    asio::steady_timer timer{io};
+    std::set<std::shared_ptr<Session>> sessions;
+    std::map<uint64_t, Block> jobs; // by job id, all on parent `tip`
+    uint64_t job{0};
+    std::string tip;
+    uint64_t mempool_version{0};
+    uint64_t next_range{0};
+    std::atomic<uint64_t> n_jobs{0}, submitted{0}, accepted{0}, stale{0}, invalid{0}, workers{0};
+
+    explicit Impl(WorkServer& w) : ws(w) {}
+    void accept();
+    void tick();
+    void refresh(bool force);
+    void push(Session& s);
+    void handle(const std::shared_ptr<Session>& s, const std::string& line);
+    void submit(Session& s, uint64_t job_id, uint64_t nonce);
+    void drop(const std::shared_ptr<Session>& s);
+};
+
+struct WorkServer::Session : std::enable_shared_from_this<Session> {
+    Impl& impl;
+    asio::ip::tcp::socket sock;
+    asio::streambuf buf{MAX_LINE};
+    std::deque<std::string> out;
+    bool subscribed{false};
+
+    Session(Impl& i, asio::ip::tcp::socket s) : impl(i), sock(std::move(s)) {}
+
+    void read() {
+        auto self = shared_from_this();
+        asio::async_read_until(sock, buf, '\n', [self](const auto& ec, size_t) {
+            if (ec) { self->impl.drop(self); return; }
+            std::istream is(&self->buf);
+            std::string line;
+            std::getline(is, line);
+            // a bad request costs its worker the session, never the server thread
+            try {
+                self->impl.handle(self, line);
+            } catch (std::exception& e) {
+                std::cerr << "[WORK] dropping a worker: " << e.what() << std::endl;
+                self->impl.drop(self);
+                return;
+            }
+            if (self->sock.is_open()) self->read();
+        });
+    }
+    void send(std::string s) {
+        if (!sock.is_open()) return;
+        if (out.size() >= MAX_QUEUED) {
+            m_dropped.inc();
+            impl.drop(shared_from_this());
+            return;
+        }
+        out.push_back(std::move(s));
+        if (out.size() == 1) write();
+    }
+    void write() {
+        auto self = shared_from_this();
+        asio::async_write(sock, asio::buffer(out.front()), [self](const auto& ec, size_t) {
+            if (ec) { self->impl.drop(self); return; }
+            self->out.pop_front();
+            if (!self->out.empty()) self->write();
+        });
+    }
+};
+
+void WorkServer::Impl::accept() {
+    acc.async_accept([this](const auto& ec, asio::ip::tcp::socket sock) {
+        if (ec) return; // closed by stop()
+        auto s = std::make_shared<Session>(*this, std::move(sock));
+        sessions.insert(s);
+        workers = sessions.size();
+        m_workers.set((int64_t)workers);
+        s->read();
+        accept();
+    });
+}
+
+void WorkServer::Impl::drop(const std::shared_ptr<Session>& s) {
+    try { s->sock.close(); } catch (std::exception&) {}
+    sessions.erase(s);
+    workers = sessions.size();
+    m_workers.set((int64_t)workers);
+}
+
+void WorkServer::Impl::tick() {
+    refresh(false);
+    timer.expires_after(std::chrono::milliseconds(ws.refresh_ms));
+    timer.async_wait([this](const auto& ec) { if (!ec) tick(); });
+}
+
+// Builds a new template if the tip or the mempool moved (or if forced) and pushes it to everyone.
+void WorkServer::Impl::refresh(bool force) {
+    AXLE_TRACE_SCOPE("work.refresh");
+    Block b;
+    {
+        std::lock_guard<std::mutex> lk(ws.chain_.mutex());
+        bool new_tip = ws.chain_.tip_hash() != tip;
+        uint64_t version = ws.mempool_ ? ws.mempool_->version() : 0;
+        if (!new_tip && version == mempool_version && !force) return;
+        if (ws.mempool_) {
+            if (new_tip) ws.mempool_->remove_confirmed(ws.chain_.state());
+            version = ws.mempool_->version();
+        }
+        b = build_template(ws.chain_, ws.mempool_, ws.miner_address_, ws.max_block_txs);
+        if (new_tip) {
+            jobs.clear();
+            tip = ws.chain_.tip_hash();
+        }
+        mempool_version = version;
+    }
+    jobs[++job] = std::move(b);
+    while (jobs.size() > MAX_JOBS) jobs.erase(jobs.begin());
+    n_jobs++;
+    m_jobs.inc();
+    auto all = sessions; // a worker too slow to take the push is dropped from `sessions`
+    for (auto& s : all) if (s->subscribed) push(*s);
+}
+
+void WorkServer::Impl::push(Session& s) {
+    uint64_t start = next_range++ * ws.nonce_range;
+    json j = {{"type", "work"}, {"job", job}, {"header", header_json(jobs.at(job).header)},
+              {"nonce_start", start}, {"nonce_end", start + ws.nonce_range}};
+    s.send(j.dump() + "\n");
+    m_pushes.inc();
+}
+
+void WorkServer::Impl::handle(const std::shared_ptr<Session>& s, const std::string& line) {
+    json req = json::parse(line, nullptr, false);
+    bool object = !req.is_discarded() && req.is_object();
+    std::string type = object && req.contains("type") && req["type"].is_string() ? req["type"].get<std::string>() : "";
+    auto number = [&](const char* key) { return req.contains(key) && req[key].is_number_unsigned(); };
+    if (type == "subscribe") {
+        s->subscribed = true;
+        if (jobs.empty()) refresh(true);
+        else push(*s);
+    } else if (type == "get_work" && s->subscribed && !jobs.empty()) {
+        push(*s);
+    } else if (type == "submit" && number("job") && number("nonce")) {
+        submit(*s, req["job"].get<uint64_t>(), req["nonce"].get<uint64_t>());
+    } else if (type == "submit") {
+        s->send(json{{"type", "error"}, {"error", "submit needs numeric job and nonce"}}.dump() + "\n");
+    } else {
+        s->send(json{{"type", "error"}, {"error", "unknown request"}}.dump() + "\n");
+    }
+}
+
+void WorkServer::Impl::submit(Session& s, uint64_t job_id, uint64_t nonce) {
+    AXLE_TRACE_SCOPE("work.submit");
+    submitted++;
+    auto reply = [&](bool ok, const std::string& reason, std::atomic<uint64_t>& count, Counter& metric) {
+        count++;
+        metric.inc();
+        json j = {{"type", "result"}, {"job", job_id}, {"accepted", ok}};
+        if (!reason.empty()) j["reason"] = reason;
+        s.send(j.dump() + "\n");
+    };
+    auto it = jobs.find(job_id);
+    if (it == jobs.end()) {
+        if (job_id && job_id <= job) reply(false, "stale", stale, m_stale);
+        else reply(false, "unknown job", invalid, m_invalid);
+        return;
+    }
+    Block b = it->second;
+    b.header.nonce = nonce;
+    b.hash = block_hash(b.header);
+    if (!hash_meets_bits(b.hash, b.header.difficulty_bits)) { reply(false, "hash above target", invalid, m_invalid); return; }
+    bool on_tip = false, ok = false;
+    {
+        std::lock_guard<std::mutex> lk(ws.chain_.mutex());
+        on_tip = ws.chain_.tip_hash() == b.header.prev_hash;
+        if (on_tip) ok = ws.chain_.accept_block(b);
+        if (ok && ws.mempool_) ws.mempool_->remove_confirmed(ws.chain_.state());
+    }
+    if (!on_tip) { reply(false, "stale", stale, m_stale); return; }
+    if (!ok) { reply(false, "block rejected", invalid, m_invalid); return; }
+    reply(true, "", accepted, m_accepted);
+    std::cerr << "[WORK] block " << b.header.height << " accepted from a worker, hash=" << b.hash << std::endl;
+    if (ws.on_block_) ws.on_block_(b);
+    refresh(true);
+}
+
+WorkServer::WorkServer(Blockchain& chain, Mempool* mempool, std::string miner_address)
+: chain_(chain), mempool_(mempool), miner_address_(std::move(miner_address)) {}
+WorkServer::~WorkServer() { stop(); }
+
+bool WorkServer::start(const std::string& host, uint16_t port) {
+    if (running_) return false;
+    impl_ = std::make_unique<Impl>(*this);
+    try {
+        asio::ip::tcp::endpoint ep(asio::ip::make_address(host), port);
+        impl_->acc.open(ep.protocol());
+        impl_->acc.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        impl_->acc.bind(ep);
+        impl_->acc.listen();
+    } catch (std::exception& e) {
+        std::cerr << "[WORK] listen error: " << e.what() << std::endl;
+        impl_.reset();
+        return false;
+    }
+    running_ = true;
+    impl_->accept();
+    impl_->tick();
+    thread_ = std::thread([this]() {
+        try {
+            impl_->io.run();
+        } catch (std::exception& e) {
+            std::cerr << "[WORK] error: " << e.what() << std::endl;
+        }
+    });
+    return true;
+}
+
+void WorkServer::stop() {
+    if (!running_) return;
+    running_ = false;
+    impl_->io.stop();
+    if (thread_.joinable()) thread_.join();
+    final_ = stats();
+    final_.workers = 0;
+    impl_.reset();
+    m_workers.set(0);
+}
+
+WorkStats WorkServer::stats() const {
+    if (!impl_) return final_;
+    return {impl_->n_jobs, impl_->submitted, impl_->accepted, impl_->stale, impl_->invalid, impl_->workers};
+}
+
+bool run_mining_worker(const std::string& host, uint16_t port, unsigned threads,
+                       const std::atomic<bool>& stop, MinerStats& stats) {
+    asio::io_context io;
+    asio::ip::tcp::socket sock(io);
+    try {
+        sock.connect({asio::ip::make_address(host), port});
+    } catch (std::exception& e) {
+        std::cerr << "[WORK] cannot connect to " << host << ":" << port << ": " << e.what() << std::endl;
+        return false;
+    }
+    threads = std::max(1u, threads);
+    std::mutex write_mu;
+    auto send = [&](const json& j) {
+        std::lock_guard<std::mutex> lk(write_mu);
+        std::string s = j.dump() + "\n";
+        try { asio::write(sock, asio::buffer(s)); } catch (std::exception&) {}
+    };
+
+    struct Job { uint64_t id{0}; BlockHeader header; uint64_t start{0}, end{0}; };
+    std::mutex job_mu;
+    Job job;
+    std::atomic<uint64_t> gen{0};       // bumped with every work message
+    std::atomic<uint64_t> solved{0};    // gen a solution was sent for
+    std::atomic<uint64_t> requested{0}; // gen more work was asked for
+    std::atomic<bool> closed{false};
+
+    std::thread reader([&]() {
+        asio::streambuf buf;
+        try {
+            for (;;) {
+                asio::read_until(sock, buf, '\n');
+                std::istream is(&buf);
+                std::string line;
+                std::getline(is, line);
+                json m = json::parse(line, nullptr, false);
+                if (m.is_discarded() || !m.is_object()) continue;
+                auto type = m.value("type", "");
+                if (type == "work") {
+                    Job j;
+                    j.id = m.at("job");
+                    j.header = header_from_json(m.at("header"));
+                    j.start = m.at("nonce_start");
+                    j.end = m.at("nonce_end");
+                    std::lock_guard<std::mutex> lk(job_mu);
+                    job = j;
+                    gen++;
+                    stats.jobs++;
+                } else if (type == "result") {
+                    (m.value("accepted", false) ? stats.accepted : stats.rejected)++;
+                }
+            }
+        } catch (std::exception&) {}
+        closed = true;
+    });
+    send({{"type", "subscribe"}});
+
+    // Thread t hashes nonces start+t, start+t+threads, ... until the range ends, a solution is
+    // found, or new work arrives; then it waits for the next work message.
+    auto mine = [&](unsigned t) {
+        uint64_t seen = 0;
+        Job j;
+        while (!stop && !closed) {
+            {
+                std::lock_guard<std::mutex> lk(job_mu);
+                if (gen != seen) { seen = gen; j = job; }
+                else j.id = 0;
+            }
+            if (!j.id) { std::this_thread::sleep_for(std::chrono::milliseconds(1)); continue; }
+            uint64_t n = 0;
+            bool found = false;
+            for (uint64_t nonce = j.start + t; nonce < j.end && gen == seen && solved != seen && !stop; nonce += threads) {
+                j.header.nonce = nonce;
+                n++;
+                if (hash_meets_bits(block_hash(j.header), j.header.difficulty_bits)) {
+                    found = solved.exchange(seen) != seen;
+                    if (found) send({{"type", "submit"}, {"job", j.id}, {"nonce", nonce}});
+                    break;
+                }
+            }
+            stats.hashes += n;
+            if (found) stats.submitted++;
+            else if (gen == seen && solved != seen && !stop && requested.exchange(seen) != seen) send({{"type", "get_work"}});
+            j.id = 0;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t=0; t<threads; t++) pool.emplace_back(mine, t);
+    for (auto& th : pool) th.join();
+    try { sock.shutdown(asio::ip::tcp::socket::shutdown_both); } catch (std::exception&) {}
+    reader.join();
+    return true;
+}
+
+}
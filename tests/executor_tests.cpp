@@ -0,0 +1,211 @@
+// Determinism suite: the parallel executor must end in exactly the state serial apply_block does.
+#include <doctest/doctest.h>
+#include "crypto.hpp"
+#include "ledger.hpp"
+#include "tx.hpp"
+#include <random>
+
+using namespace axle;
+
+namespace {
+
+struct Fixture {
+    ChainParams params;
+    LedgerState base;
+    std::vector<KeyPair> keys;
+    std::vector<std::string> addrs;
+    std::vector<uint64_t> nonces;
+    std::string miner;
+
+    explicit Fixture(size_t n, int64_t funds = 1000 * UNIT) {
+        sodium_init_or_throw();
+        base.unclaimed_pool = params.supply_cap / 2;
+        for (size_t i=0;i<n;i++) {
+            keys.push_back(keygen());
+            addrs.push_back(address_from_pubkey(keys.back().pub));
+            base.accounts[addrs.back()] = {funds, 0};
+        }
+        nonces.assign(n, 0);
+        miner = address_from_pubkey(keygen().pub);
+    }
+
+    SignedTx tx(size_t from, TxType type, size_t to, int64_t amount = 0, uint64_t token = 0) {
+        SignedTx u;
+        u.type = type;
+        u.from = addrs[from]; u.to = addrs[to];
+        u.amount = amount; u.tokenId = token; u.nonce = nonces[from]++;
+        if (type == TxType::MINT_NFT) u.meta = {"n" + std::to_string(u.nonce), "SYM", "ipfs://x/" + addrs[from]};
+        return sign_tx(u, keys[from].priv);
+    }
+
+    Block block(std::vector<SignedTx> txs, int64_t reward = 5 * UNIT) {
+        Block b;
+        b.header.height = 1;
+        b.txs = std::move(txs);
+        b.miner_address = miner;
+        b.reward = reward;
+        return b;
+    }
+};
+
+bool same_state(const LedgerState& a, const LedgerState& b) {
+    if (a.next_token_id != b.next_token_id || a.unclaimed_pool != b.unclaimed_pool) return false;
+    if (a.accounts.size() != b.accounts.size() || a.nfts.size() != b.nfts.size()) return false;
+    bool same = true;
+    a.accounts.for_each([&](const std::string& addr, const AccountState& x) {
+        auto y = b.accounts.get(addr);
+        same = same && y && x.balance == y->balance && x.nonce == y->nonce;
+    });
+    if (!same) return false;
+    for (auto ia = a.nfts.begin(), ib = b.nfts.begin(); ia != a.nfts.end(); ++ia, ++ib) {
+        auto& [ownA, mA] = ia->second; auto& [ownB, mB] = ib->second;
+        if (ia->first != ib->first || ownA != ownB || !(mA == mB)) return false;
+    }
+    return true;
+}
+
+// Serial reference: first failing tx decides the outcome, otherwise apply_block's final state.
+ValidationResult serial(const Fixture& f, const Block& b, LedgerState& out) {
+    out = f.base;
+    for (auto& tx : b.txs) {
+        auto r = apply_tx(out, f.params, tx);
+        if (!r.ok) { r.reason = "tx invalid: " + r.reason; return r; }
+    }
+    if (b.reward < 0 || b.reward > out.unclaimed_pool) return {false, "reward exceeds pool"};
+    if (!verify_address(b.miner_address)) return {false, "bad miner address"};
+    out = f.base;
+    apply_block(out, f.params, b);
+    return {};
+}
+
+// Runs the executor at several thread counts and checks each against the serial path.
+size_t check_all_threads(const Fixture& f, const Block& b) {
+    LedgerState expect;
+    auto ser = serial(f, b, expect);
+    size_t reexec = 0;
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        StateDelta d;
+        ExecStats stats;
+        auto r = execute_block(f.base, f.params, b, d, threads, &stats);
+        CHECK(r.ok == ser.ok);
+        CHECK(r.reason == ser.reason);
+        if (r.ok && ser.ok) {
+            LedgerState got = f.base;
+            commit_delta(got, d);
+            CHECK(same_state(got, expect));
+        }
+        CHECK(stats.txs == b.txs.size());
+        reexec = stats.reexecuted;
+    }
+    return reexec;
+}
+
+}
+
+TEST_CASE("executor: disjoint transfers need no re-execution") {
+    Fixture f(256);
+    std::vector<SignedTx> txs;
+    for (size_t i=0;i<128;i++) txs.push_back(f.tx(i, TxType::TRANSFER, 128 + i, 10 * UNIT));
+    CHECK(check_all_threads(f, f.block(txs)) == 0);
+}
+
+TEST_CASE("executor: chained spends and repeated senders match serial") {
+    Fixture f(64, UNIT);
+    for (size_t i=1;i<64;i++) f.base.accounts[f.addrs[i]].balance = 0;
+    std::vector<SignedTx> txs;
+    // a -> b -> c ... where each hop spends funds received earlier in the same block
+    for (size_t i=0;i+1<64;i++) txs.push_back(f.tx(i, TxType::TRANSFER, i+1, UNIT - (int64_t)(i+1) * f.params.burn_fee));
+    for (size_t k=0;k<20;k++) txs.push_back(f.tx(63, TxType::TRANSFER, 63, 1)); // self-transfers
+    CHECK(check_all_threads(f, f.block(txs)) > 0);
+}
+
+TEST_CASE("executor: NFT mint, transfer and burn inside one block") {
+    Fixture f(16);
+    std::vector<SignedTx> txs;
+    uint64_t first = f.base.next_token_id;
+    for (size_t i=0;i<16;i++) txs.push_back(f.tx(i, TxType::MINT_NFT, i));
+    for (size_t i=0;i<16;i++) txs.push_back(f.tx(i, TxType::TRANSFER_NFT, (i+1) % 16, 0, first + i));
+    for (size_t i=0;i<8;i++) txs.push_back(f.tx((i+1) % 16, TxType::BURN_NFT, (i+1) % 16, 0, first + i));
+    CHECK(check_all_threads(f, f.block(txs)) > 0);
+}
+
+TEST_CASE("executor: invalid transactions fail with the serial reason") {
+    Fixture f(8, UNIT);
+    auto bad_nonce = f.tx(0, TxType::TRANSFER, 1, 1);
+    bad_nonce.nonce = 7;
+    bad_nonce = sign_tx(bad_nonce, f.keys[0].priv);
+    check_all_threads(f, f.block({f.tx(2, TxType::TRANSFER, 3, 1), bad_nonce}));
+    check_all_threads(f, f.block({f.tx(1, TxType::TRANSFER, 2, 2 * UNIT)}));           // insufficient
+    check_all_threads(f, f.block({f.tx(1, TxType::TRANSFER_NFT, 2, 0, 42)}));          // not owner
+    auto forged = f.tx(3, TxType::TRANSFER, 4, 1);
+    forged.amount = 2;
+    check_all_threads(f, f.block({forged}));                                            // bad signature
+    check_all_threads(f, f.block({}, f.base.unclaimed_pool + 1));                       // reward exceeds pool
+    auto nameless = f.block({f.tx(2, TxType::TRANSFER, 3, 1)});
+    nameless.miner_address = "";
+    check_all_threads(f, nameless);                                                     // bad miner address
+}
+
+TEST_CASE("executor: randomized mixed blocks match serial") {
+    std::mt19937_64 rng(7);
+    for (int round=0; round<6; round++) {
+        Fixture f(24, 20 * UNIT);
+        std::vector<SignedTx> txs;
+        std::vector<std::pair<uint64_t, size_t>> owned; // tokens minted in this block and their owners
+        uint64_t next_token = f.base.next_token_id;
+        for (int i=0;i<300;i++) {
+            size_t from = rng() % 24, to = rng() % 24;
+            int kind = rng() % 10;
+            if (kind < 7) {
+                txs.push_back(f.tx(from, TxType::TRANSFER, to, 1 + rng() % UNIT));
+            } else if (kind < 8 || owned.empty()) {
+                txs.push_back(f.tx(from, TxType::MINT_NFT, from));
+                owned.push_back({next_token++, from});
+            } else {
+                auto& [token, owner] = owned[rng() % owned.size()];
+                if (owner == SIZE_MAX) continue;
+                if (kind == 8) { txs.push_back(f.tx(owner, TxType::TRANSFER_NFT, to, 0, token)); owner = to; }
+                else { txs.push_back(f.tx(owner, TxType::BURN_NFT, owner, 0, token)); owner = SIZE_MAX; }
+            }
+        }
+        check_all_threads(f, f.block(txs));
+    }
+}
+
+TEST_CASE("compact txs round-trip and apply exactly like SignedTx") {
+    std::mt19937_64 rng(11);
+    Fixture f(12, 3 * UNIT);
+    LedgerState fat = f.base, compact = f.base;
+    std::vector<uint64_t> tokens;
+    size_t smaller = 0;
+    for (int i=0;i<200;i++) {
+        size_t from = rng() % 12, to = rng() % 12;
+        int kind = rng() % 6;
+        SignedTx tx;
+        if (kind < 3) tx = f.tx(from, TxType::TRANSFER, to, 1 + rng() % UNIT); // some run out of funds
+        else if (kind == 3 || tokens.empty()) { tx = f.tx(from, TxType::MINT_NFT, from); tokens.push_back(fat.next_token_id); }
+        else tx = f.tx(from, kind == 4 ? TxType::TRANSFER_NFT : TxType::BURN_NFT, to, 0, tokens[rng() % tokens.size()]);
+        if (rng() % 8 == 0) f.nonces[from]--; // a stale nonce now and then; the next tx reuses it
+
+        auto c = CompactTx::from_signed(tx);
+        REQUIRE(c.has_value());
+        CHECK(c->type() == tx.type);
+        auto back = c->to_signed();
+        CHECK((back.from == tx.from && back.to == tx.to && back.amount == tx.amount && back.nonce == tx.nonce &&
+               back.tokenId == tx.tokenId && back.meta.name == tx.meta.name && back.meta.uri == tx.meta.uri &&
+               back.signature == tx.signature && back.pubkey == tx.pubkey && back.id == tx.id));
+        smaller += c->memory_bytes() < memory_bytes(tx);
+
+        auto a = apply_tx(fat, f.params, tx);
+        auto b = apply_tx(compact, f.params, *c);
+        CHECK(a.ok == b.ok);
+        CHECK(a.reason == b.reason);
+    }
+    CHECK(same_state(fat, compact));
+    CHECK(smaller == 200);
+
+    // fields a type does not use cannot be represented, so such txs are refused
+    SignedTx odd = f.tx(0, TxType::TRANSFER, 1, 5);
+    odd.tokenId = 3;
+    CHECK_FALSE(CompactTx::from_signed(sign_tx(odd, f.keys[0].priv)).has_value());
+}
@@ -3,9 +3,49 @@
 #include "crypto.hpp"
 #include "base58.hpp"
 #include "tx.hpp"
+#include "blockchain.hpp"
+#include "miner.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "arena.hpp"
+#include "encoding.hpp"
+#include "block_view.hpp"
+#include "block.hpp"
+#include "p2p.hpp"
+#include "snapshot.hpp"
+#include "block_codec.hpp"
+#include "state_tree.hpp"
+#include "work_server.hpp"
+#include "rolling_bloom.hpp"
+#include "rpc.hpp"
+#include "send_batch.hpp"
+#include "reindex.hpp"
+#include "response_cache.hpp"
+#include "mem_accounting.hpp"
+#include "netsim.hpp"
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 using namespace axle;
 
+// A fresh datadir under the system temp dir, removed when the test leaves its scope (also when a REQUIRE fails).
+struct TempDir {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("axle-test-" + hex(random_bytes(4)));
+    TempDir() = default;
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+    ~TempDir() { std::error_code ec; std::filesystem::remove_all(path, ec); }
+    operator const std::filesystem::path&() const { return path; }
+    std::string string() const { return path.string(); }
+    std::filesystem::path operator/(const std::string& p) const { return path / p; }
+};
+
 TEST_CASE("keygen and address") {
     sodium_init_or_throw();
     auto kp = keygen();
@@ -25,3 +65,1540 @@ TEST_CASE("sign and verify tx") {
     auto stx = sign_tx(tx, kp.priv);
     CHECK(verify_tx_sig(stx));
 }
+
+TEST_CASE("regtest mines instantly from a funded pool") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    CHECK(chain.state().unclaimed_pool == params.supply_cap);
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    auto blk = chain.build_block(addr, {});
+    uint64_t iters = 0;
+    REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+    CHECK(iters == 1);
+    REQUIRE(chain.accept_block(blk));
+    CHECK(chain.state().accounts.at(addr).balance == blk.reward);
+    CHECK(chain.current_difficulty_bits() == 0);
+}
+
+TEST_CASE("metrics render prometheus text") {
+    MetricsRegistry reg;
+    reg.counter("t_total", "help", "k=\"a\"").inc(3);
+    auto& h = reg.histogram("t_seconds", "lat", "", {0.1, 1});
+    h.observe(0.05); h.observe(0.5); h.observe(5);
+    auto text = reg.render();
+    CHECK(text.find("# TYPE t_total counter") != std::string::npos);
+    CHECK(text.find("t_total{k=\"a\"} 3") != std::string::npos);
+    CHECK(text.find("t_seconds_bucket{le=\"1\"} 2") != std::string::npos);
+    CHECK(text.find("t_seconds_bucket{le=\"+Inf\"} 3") != std::string::npos);
+    CHECK(text.find("t_seconds_count 3") != std::string::npos);
+}
+
+TEST_CASE("metrics endpoint outlasts an idle client and stops without a scrape") {
+    MetricsServer server;
+    uint16_t port = 38000 + 8 * random_bytes(1)[0];
+    REQUIRE(server.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // sends a request line but never the blank line ending the headers
+    std::thread idle([&]{ rpc_request("127.0.0.1", port, "GET /metrics HTTP/1.0", 4000); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto reply = rpc_request("127.0.0.1", port, "GET /metrics HTTP/1.0\r\n\r", 5000);
+    idle.join();
+    REQUIRE(reply.has_value());
+    CHECK(reply->rfind("HTTP/1.0 200 OK", 0) == 0);
+    auto t0 = std::chrono::steady_clock::now();
+    server.stop();
+    CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(1));
+}
+
+TEST_CASE("trace spans export as chrome trace events") {
+    set_tracing(true);
+    { TraceSpan span("test.span"); }
+    set_tracing(false);
+    { TraceSpan span("test.disabled"); }
+    size_t n = 0;
+    auto j = nlohmann::json::parse(trace_json(&n));
+    bool found = false, disabled = false;
+    for (auto& ev : j["traceEvents"]) {
+        if (ev["name"] == "test.span") { found = true; CHECK(ev["ph"] == "X"); }
+        if (ev["name"] == "test.disabled") disabled = true;
+    }
+    CHECK(found);
+    CHECK_FALSE(disabled);
+    CHECK(n == j["traceEvents"].size());
+
+    // threads that exit hand their events over and free their buffers, which are not charged
+    // to the subsystem that recorded first
+    set_tracing(true);
+    auto p2p_before = memory_bytes(MemTag::P2P);
+    for (int i=0;i<64;i++) std::thread([]{ MemScope mem(MemTag::P2P); TraceSpan span("test.thread"); }).join();
+    set_tracing(false);
+    CHECK(memory_bytes(MemTag::P2P) - p2p_before < 4096);
+    size_t exited = 0;
+    auto after = nlohmann::json::parse(trace_json());
+    for (auto& ev : after["traceEvents"]) exited += ev["name"] == "test.thread";
+    CHECK(exited == 64);
+}
+
+TEST_CASE("rpc dump_trace only writes bare file names under DATADIR/traces") {
+    TempDir dir;
+    Storage st(dir.string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    RpcServer rpc(chain);
+    uint16_t port = 40000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto escape = rpc_request("127.0.0.1", port, R"({"method":"dump_trace","path":"../escape.json"})");
+    CHECK(nlohmann::json::parse(*escape).contains("error"));
+    CHECK_FALSE(std::filesystem::exists(dir.path.parent_path() / "escape.json"));
+    auto typed = rpc_request("127.0.0.1", port, R"({"method":"dump_trace","path":7})");
+    CHECK(nlohmann::json::parse(*typed)["error"] == "path required");
+    auto dumped = rpc_request("127.0.0.1", port, R"({"method":"dump_trace","path":"t.json"})");
+    CHECK(nlohmann::json::parse(*dumped)["path"] == (dir / "traces" / "t.json").string());
+    CHECK(std::filesystem::exists(dir / "traces" / "t.json"));
+    rpc.stop();
+}
+
+TEST_CASE("rpc server outlasts an idle client and drops an overlong request") {
+    TempDir dir;
+    Storage st(dir.string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    RpcServer rpc(chain);
+    uint16_t port = 42000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // connects and never sends its request line
+    int idle = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(::connect(idle, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto tip = rpc_request("127.0.0.1", port, R"({"method":"get_tip"})", 15000);
+    ::close(idle);
+    REQUIRE(tip.has_value());
+    CHECK(nlohmann::json::parse(*tip)["height"] == 0);
+    CHECK_FALSE(rpc_request("127.0.0.1", port, std::string(17 << 20, ' '), 15000).has_value());
+    CHECK(rpc_request("127.0.0.1", port, R"({"method":"get_tip"})").has_value());
+    rpc.stop();
+}
+
+TEST_CASE("block json round-trips through the decode arena") {
+    sodium_init_or_throw();
+    auto kp = keygen();
+    Block b;
+    b.header.height = 7;
+    b.header.prev_hash = std::string(64, 'a');
+    b.miner_address = address_from_pubkey(kp.pub);
+    b.reward = 5 * UNIT;
+    for (uint64_t i=0;i<3;i++) {
+        SignedTx tx;
+        tx.type = i == 2 ? TxType::MINT_NFT : TxType::TRANSFER;
+        tx.from = b.miner_address; tx.to = b.miner_address;
+        tx.amount = 10; tx.nonce = i; tx.tokenId = (1ULL << 40) + i;
+        tx.meta = {"name", "SYM", "ipfs://x"};
+        b.txs.push_back(sign_tx(tx, kp.priv));
+    }
+    auto js = to_json(b);
+    auto back = block_from_json(js);
+    CHECK(to_json(back) == js);
+    CHECK(back.txs[1].tokenId == (1ULL << 40) + 1);
+    CHECK(verify_tx_sig(back.txs[2]));
+
+    BlockArena arena(1024);
+    {
+        ArenaScope scope(&arena);
+        arena_json j = arena_json::parse(js);
+        CHECK(j.at("txs").size() == 3);
+    }
+    CHECK(arena.stats().allocations > 0);
+    CHECK(arena.stats().peak_bytes >= arena.stats().bytes);
+}
+
+TEST_CASE("block view reads stored bytes without decoding") {
+    sodium_init_or_throw();
+    auto kp = keygen();
+    Block b;
+    b.header.height = 42;
+    b.header.prev_hash = std::string(64, 'b');
+    b.header.timestamp = 1700000000;
+    b.header.difficulty_bits = 20;
+    b.header.nonce = 99;
+    b.miner_address = address_from_pubkey(kp.pub);
+    b.reward = 3 * UNIT;
+    b.hash = std::string(64, 'c');
+    for (uint64_t i=0;i<2;i++) {
+        SignedTx tx;
+        tx.type = i ? TxType::MINT_NFT : TxType::TRANSFER;
+        tx.from = b.miner_address; tx.to = b.miner_address;
+        tx.amount = 5; tx.nonce = i; tx.tokenId = 7;
+        tx.meta = {"quote \"x\"", "SYM", "ipfs://x"};
+        b.txs.push_back(sign_tx(tx, kp.priv));
+    }
+    auto js = to_json(b);
+    auto v = BlockView::parse(js);
+    REQUIRE(v.has_value());
+    CHECK(v->height() == 42);
+    CHECK(v->timestamp() == 1700000000);
+    CHECK(v->difficulty_bits() == 20);
+    CHECK(v->nonce() == 99);
+    CHECK(v->prev_hash() == b.header.prev_hash);
+    CHECK(v->hash() == b.hash);
+    CHECK(v->miner_address() == b.miner_address);
+    CHECK(v->reward() == b.reward);
+    REQUIRE(v->tx_count() == 2);
+    auto t = v->tx(1);
+    CHECK(t.type() == TxType::MINT_NFT);
+    CHECK(t.nonce() == 1);
+    CHECK(t.amount() == 5);
+    CHECK(t.token_id() == 7);
+    CHECK(t.id() == b.txs[1].id);
+    CHECK(t.decode().meta.name == "quote \"x\"");
+    CHECK(to_json(v->decode()) == js);
+    CHECK_FALSE(BlockView::parse(js.substr(0, js.size() / 2)).has_value());
+}
+
+TEST_CASE("columnar block codec round-trips and is read back from storage") {
+    sodium_init_or_throw();
+    auto a = keygen(), b = keygen();
+    Block blk;
+    blk.header.height = 12;
+    blk.header.prev_hash = std::string(64, 'd');
+    blk.header.merkle_root = "not-hex";
+    blk.header.timestamp = 1700000123;
+    blk.miner_address = address_from_pubkey(a.pub);
+    blk.reward = 4 * UNIT;
+    blk.hash = std::string(64, 'e');
+    for (uint64_t i=0;i<6;i++) {
+        SignedTx tx;
+        auto& kp = i % 2 ? b : a;
+        tx.type = i == 3 ? TxType::MINT_NFT : TxType::TRANSFER;
+        tx.from = address_from_pubkey(kp.pub);
+        tx.to = i == 5 ? "1NotCanonical" : blk.miner_address;
+        tx.amount = i == 4 ? -3 : (int64_t)(100 - i);
+        tx.nonce = 9 - i / 2;
+        tx.tokenId = i == 1 ? UINT64_MAX : i;
+        if (i == 3) tx.meta = {"name", "SYM", "ipfs://x"};
+        blk.txs.push_back(sign_tx(tx, kp.priv));
+    }
+    auto col = encode_block_columnar(blk);
+    CHECK(is_columnar_block(col));
+    CHECK(col.size() * 2 < to_json(blk).size());
+    auto back = decode_block_columnar(col);
+    REQUIRE(back.has_value());
+    CHECK(to_json(*back) == to_json(blk));
+    CHECK(verify_tx_sig(back->txs[3]));
+    CHECK_FALSE(decode_block_columnar(col.substr(0, col.size() - 1)).has_value());
+    CHECK_FALSE(decode_block_columnar(to_json(blk)).has_value());
+
+    TempDir dir;
+    Storage st(dir.string());
+    st.ensure_layout(chain_params_for("regtest"));
+    st.set_block_codec(BlockCodec::Columnar);
+    REQUIRE(st.write_block(blk));
+    CHECK(st.block_size(12) == col.size());
+    CHECK(st.read_block_bytes(12) == to_json(blk));
+    // the JSON is encoded once and kept, until the height is written again
+    auto& encoded = metrics().counter("axle_storage_block_json_encoded_total", "");
+    auto before = encoded.value();
+    CHECK(st.read_block_bytes(12) == to_json(blk));
+    CHECK(encoded.value() == before);
+    auto other = blk;
+    other.reward += 1;
+    REQUIRE(st.write_block(other));
+    CHECK(st.read_block_bytes(12) == to_json(other));
+    CHECK(encoded.value() == before + 1);
+    st.set_block_codec(BlockCodec::Json);
+    REQUIRE(st.write_block(blk));
+    CHECK(st.block_size(12) == to_json(blk).size());
+    CHECK(to_json(*st.read_block(12)) == to_json(blk));
+    CHECK(st.remove_block(12));
+    CHECK_FALSE(st.read_block(12).has_value());
+}
+
+TEST_CASE("state tree root is incremental and independent of write order") {
+    StateChanges all;
+    for (uint64_t i=0;i<3000;i++) all.push_back({nft_key(i), pool_value((int64_t)i, i)});
+    StateTree whole;
+    whole.apply(all);
+    auto expect = whole.root(4); // large batch: hashed on several threads
+
+    // same entries written in small batches, with some deleted and written back
+    StateTree inc;
+    for (size_t i=0;i<all.size();i+=100) {
+        inc.apply(StateChanges(all.begin()+i, all.begin()+i+100));
+        inc.root();
+    }
+    StateChanges drop;
+    for (uint64_t i=0;i<3000;i+=7) drop.push_back({nft_key(i), std::nullopt});
+    auto restore = inc.apply(drop);
+    CHECK(inc.root() != expect);
+    CHECK_FALSE(inc.get(nft_key(7)).has_value());
+    CHECK(inc.size() == 3000 - drop.size());
+    inc.apply(restore);
+    CHECK(inc.root() == expect);
+    CHECK(inc.get(nft_key(8)) == pool_value(8, 8));
+
+    // one changed entry only rehashes its path
+    inc.apply({{nft_key(5), pool_value(-1, 0)}});
+    auto changed = inc.root();
+    CHECK(changed != expect);
+    CHECK(inc.last_hashes() < 40);
+    CHECK(StateTree().root() == Hash256{});
+
+    // a file-backed tree grows past its first slots and reads back the same when reopened
+    TempDir dir;
+    std::filesystem::create_directories(dir);
+    auto path = (dir / "state_tree.dat").string();
+    std::string err;
+    {
+        StateTree file;
+        REQUIRE(file.open(path, true, err));
+        file.apply(all);
+        CHECK(file.root(4) == expect);
+        file.set_tip(7, "ab");
+    }
+    StateTree reopened;
+    REQUIRE(reopened.open(path, false, err));
+    CHECK(reopened.tip() == std::make_pair(uint64_t{7}, std::string("ab")));
+    CHECK(reopened.size() == all.size());
+    CHECK(reopened.root() == expect);
+    CHECK(reopened.last_hashes() == 0);
+    reopened.apply({{nft_key(5), pool_value(-1, 0)}});
+    CHECK_FALSE(reopened.tip().has_value()); // changed since it was stamped
+    CHECK(reopened.root() == changed);
+}
+
+TEST_CASE("blocks commit to the state root") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    for (int i=0;i<2;i++) {
+        auto blk = chain.build_block(addr, {});
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+        REQUIRE(chain.accept_block(blk));
+    }
+    SignedTx tx;
+    tx.type = TxType::MINT_NFT;
+    tx.from = addr; tx.to = addr; tx.nonce = 0;
+    tx.meta = {"n", "S", "u"};
+    auto blk = chain.build_block(addr, {sign_tx(tx, kp.priv)});
+    auto root_before = chain.state_root();
+    auto bad = blk;
+    bad.header.state_root = std::string(64, '0');
+    uint64_t iters = 0;
+    REQUIRE(mine_block(bad, chain.current_difficulty_bits(), iters));
+    CHECK_FALSE(chain.accept_block(bad));
+    CHECK(chain.state_root() == root_before);
+    REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+    REQUIRE(chain.accept_block(blk));
+
+    StateTree fresh;
+    fresh.apply(state_entries(chain.state()));
+    CHECK(hex(fresh.root()) == chain.state_root());
+    CHECK(blk.header.state_root == chain.state_root());
+    CHECK(st.read_header(chain.tip_height())->header().state_root == blk.header.state_root);
+}
+
+TEST_CASE("heavier side branch triggers a reorg through undo records") {
+    sodium_init_or_throw();
+    TempDir base;
+    auto params = chain_params_for("regtest");
+    Storage st1((base / "a").string());
+    Blockchain a(st1, params);
+    REQUIRE(a.load());
+    std::filesystem::copy(base / "a", base / "b", std::filesystem::copy_options::recursive);
+    Storage st2((base / "b").string());
+    Blockchain b(st2, params);
+    REQUIRE(b.load());
+    REQUIRE(a.tip_hash() == b.tip_hash());
+
+    // the miner address is not part of the header, so branch b is told apart by its timestamps
+    auto mine = [](Blockchain& c, const std::string& miner, std::vector<SignedTx> txs = {}, uint64_t skew = 0) {
+        auto blk = c.build_block(miner, txs);
+        blk.header.timestamp += skew;
+        uint64_t iters = 0;
+        while (!mine_block(blk, c.current_difficulty_bits(), iters)) {}
+        REQUIRE(c.accept_block(blk));
+        return blk;
+    };
+    auto ka = keygen(), kb = keygen();
+    auto addr_a = address_from_pubkey(ka.pub), addr_b = address_from_pubkey(kb.pub);
+    mine(a, addr_a);
+    SignedTx pay;
+    pay.type = TxType::TRANSFER;
+    pay.from = addr_a; pay.to = addr_b; pay.amount = 1000; pay.nonce = 0;
+    mine(a, addr_a, {sign_tx(pay, ka.priv)});
+    std::vector<Block> branch;
+    for (int i=0;i<3;i++) branch.push_back(mine(b, addr_b, {}, 100));
+
+    CHECK(a.accept_block(branch[0]));
+    CHECK(a.accept_block(branch[1]));
+    CHECK(a.tip_height() == 2);
+    CHECK(a.side_block_count() == 2);
+    CHECK_FALSE(a.accept_block(branch[1])); // already known
+
+    // a side block that no longer parses fails the reorg and keeps the old branch
+    std::filesystem::copy(base / "a", base / "c", std::filesystem::copy_options::recursive);
+    {
+        Storage st3((base / "c").string());
+        Blockchain c(st3, params);
+        REQUIRE(c.load());
+        std::ofstream(base / "c" / "blocks" / "side" / (branch[1].hash + ".json")) << "{\"truncated";
+        CHECK_FALSE(c.accept_block(branch[2]));
+        CHECK(c.tip_hash() == a.tip_hash());
+        Blockchain reloaded(st3, params);
+        REQUIRE(reloaded.load());
+        CHECK(reloaded.tip_hash() == a.tip_hash());
+        CHECK(reloaded.state_root() == a.state_root());
+    }
+
+    CHECK(a.accept_block(branch[2]));
+    CHECK(a.tip_hash() == b.tip_hash());
+    CHECK(a.tip_work() == 3);
+    CHECK(a.last_reorg().depth == 2);
+    CHECK(a.last_reorg().connected == 3);
+    CHECK(a.state().accounts.count(addr_a) == 0);
+    CHECK(a.state().accounts.at(addr_b).balance == b.state().accounts.at(addr_b).balance);
+    CHECK(a.state().unclaimed_pool == b.state().unclaimed_pool);
+    CHECK(a.side_block_count() == 2); // the old branch is kept
+    auto back = a.take_reorged_txs();
+    REQUIRE(back.size() == 1);
+    CHECK(back[0].id == sign_tx(pay, ka.priv).id);
+    CHECK(a.take_reorged_txs().empty());
+
+    // blocks must declare the difficulty their parent implies (0 on regtest)
+    auto off = b.build_block(addr_b, {});
+    off.header.difficulty_bits = 1;
+    uint64_t iters = 0;
+    while (!mine_block(off, 1, iters)) {}
+    CHECK_FALSE(a.accept_block(off));
+    auto fork = b.build_block(addr_b, {});
+    fork.header.prev_hash = branch[1].hash;
+    fork.header.height = 3;
+    fork.header.difficulty_bits = 1;
+    while (!mine_block(fork, 1, iters)) {}
+    CHECK_FALSE(a.accept_block(fork));
+    CHECK(a.side_block_count() == 2);
+
+    Blockchain reloaded(st1, params);
+    REQUIRE(reloaded.load());
+    CHECK(reloaded.tip_hash() == b.tip_hash());
+    CHECK(reloaded.tip_work() == 3);
+    CHECK(reloaded.side_block_count() == 2);
+}
+
+TEST_CASE("a node stopped between its state and tip writes rolls the state back to the tip") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    auto slurp = [&](const char* name) {
+        std::ifstream f(dir / name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(f), {});
+    };
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    std::vector<Block> blocks;
+    std::string tip_at_1, state_at_2, root_at_1;
+    {
+        Blockchain chain(st, params);
+        chain.set_state_cache(4);
+        REQUIRE(chain.load());
+        for (int i=0;i<3;i++) {
+            auto blk = chain.build_block(addr, {});
+            uint64_t iters = 0;
+            REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+            REQUIRE(chain.accept_block(blk));
+            blocks.push_back(blk);
+            if (i == 0) { tip_at_1 = slurp("tip.json"); root_at_1 = chain.state_root(); }
+            if (i == 1) state_at_2 = slurp("state.json");
+        }
+    }
+    // accounts.dat flushed at block 3, state.json written at block 2, tip.json still at block 1
+    std::ofstream(dir / "tip.json", std::ios::binary) << tip_at_1;
+    std::ofstream(dir / "state.json", std::ios::binary) << state_at_2;
+    Blockchain chain(st, params);
+    chain.set_state_cache(4);
+    REQUIRE(chain.load());
+    CHECK(chain.tip_height() == 1);
+    CHECK(chain.state_root() == root_at_1);
+    CHECK(chain.state().accounts.store()->tip() == std::make_pair(chain.tip_height(), chain.tip_hash()));
+    CHECK(chain.accept_block(blocks[1]));
+    CHECK(chain.accept_block(blocks[2]));
+    CHECK(chain.state_root() == blocks[2].header.state_root);
+}
+
+TEST_CASE("pruned node drops old bodies but keeps headers") {
+    sodium_init_or_throw();
+    CHECK(parse_prune("1000")->keep_blocks == 1000);
+    CHECK(parse_prune("550MB")->target_bytes == 550ull * 1024 * 1024);
+    CHECK_FALSE(parse_prune("lots").has_value());
+
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    chain.set_prune({10, 0}); // below the minimum, so MIN_PRUNE_KEEP applies
+    REQUIRE(chain.load());
+    auto addr = address_from_pubkey(keygen().pub);
+    for (uint64_t i=0;i<MIN_PRUNE_KEEP+12;i++) {
+        auto blk = chain.build_block(addr, {});
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+        REQUIRE(chain.accept_block(blk));
+    }
+    uint64_t tip = chain.tip_height();
+    CHECK(chain.pruned_below() == tip - MIN_PRUNE_KEEP + 1);
+    CHECK_FALSE(st.read_block_bytes(chain.pruned_below() - 1).has_value());
+    CHECK_FALSE(st.read_undo(chain.pruned_below() - 1).has_value());
+    CHECK(st.read_block_bytes(chain.pruned_below()).has_value());
+    CHECK(st.header_count() == tip + 1);
+    auto h = st.read_header(3);
+    REQUIRE(h.has_value());
+    CHECK(h->height == 3);
+    CHECK(block_hash(h->header()) == h->hash_hex());
+
+    Blockchain reloaded(st, params);
+    REQUIRE(reloaded.load());
+    CHECK(reloaded.pruned());
+    CHECK(reloaded.pruned_below() == chain.pruned_below());
+    CHECK(reloaded.tip_hash() == chain.tip_hash());
+}
+
+TEST_CASE("snapshot sync installs verified state and catches up") {
+    sodium_init_or_throw();
+    TempDir base;
+    auto params = chain_params_for("regtest");
+    Storage src_st((base / "src").string());
+    Blockchain src(src_st, params);
+    REQUIRE(src.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    auto mine = [&](std::vector<SignedTx> txs) {
+        auto blk = src.build_block(addr, txs);
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, src.current_difficulty_bits(), iters));
+        REQUIRE(src.accept_block(blk));
+    };
+    mine({});
+    for (uint64_t n=0;n<4;n++) {
+        SignedTx u;
+        u.type = n % 2 ? TxType::MINT_NFT : TxType::TRANSFER;
+        u.from = addr; u.to = n % 2 ? addr : address_from_pubkey(keygen().pub);
+        u.amount = 1000; u.nonce = n;
+        u.meta = {"snap", "SNP", "ipfs://snap"};
+        mine({sign_tx(u, kp.priv)});
+    }
+    auto m = write_snapshot(src, 256);
+    REQUIRE(m.has_value());
+    CHECK(m->height == 5);
+    CHECK(m->chunks.size() > 3);
+    mine({});
+    mine({});
+
+    uint16_t port = 29000 + random_bytes(1)[0] * 8;
+    P2PNode node(src);
+    REQUIRE(node.start_listen("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<std::pair<std::string, uint16_t>> peers = {{"127.0.0.1", port}};
+
+    Storage bad_st((base / "bad").string());
+    CHECK_FALSE(snapshot_sync(bad_st, params, peers, std::string(64, '0')).ok);
+
+    Storage dst_st((base / "dst").string());
+    auto r = snapshot_sync(dst_st, params, peers, m->hash(), 3);
+    node.stop();
+    REQUIRE(r.ok);
+    CHECK(r.height == 5);
+    CHECK(r.tip_height == src.tip_height());
+
+    Blockchain dst(dst_st, params);
+    REQUIRE(dst.load());
+    CHECK(dst.tip_hash() == src.tip_hash());
+    CHECK(dst.tip_work() == src.tip_work());
+    CHECK(dst.pruned_below() == 6);
+    CHECK(dst.state().accounts.size() == src.state().accounts.size());
+    CHECK(dst.state().nfts.size() == src.state().nfts.size());
+    CHECK(dst.state().unclaimed_pool == src.state().unclaimed_pool);
+    CHECK(dst.state().accounts.at(addr).balance == src.state().accounts.at(addr).balance);
+}
+
+TEST_CASE("work server drives several miner processes and mines pending txs") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    Mempool mempool;
+    WorkServer server(chain, &mempool, addr);
+    server.refresh_ms = 20;
+    std::atomic<int> broadcast{0};
+    server.on_block([&](const Block&){ broadcast++; });
+    uint16_t port = 29000 + random_bytes(1)[0];
+    REQUIRE(server.start("127.0.0.1", port));
+
+    // a wrong-typed submit and an overlong line cost only their own connection
+    auto bad = rpc_request("127.0.0.1", port, R"({"type":"submit","job":"x","nonce":1})", 2000);
+    REQUIRE(bad.has_value());
+    CHECK(bad->find("error") != std::string::npos);
+    CHECK_FALSE(rpc_request("127.0.0.1", port, "{\"type\":\"" + std::string(10000, 'x') + "\"}", 2000).has_value());
+    auto work = rpc_request("127.0.0.1", port, R"({"type":"subscribe"})", 2000);
+    REQUIRE(work.has_value());
+    CHECK(nlohmann::json::parse(*work)["type"] == "work");
+
+    std::atomic<bool> stop{false};
+    std::vector<std::unique_ptr<MinerStats>> stats;
+    std::vector<std::thread> workers;
+    for (int i=0;i<3;i++) {
+        stats.push_back(std::make_unique<MinerStats>());
+        workers.emplace_back([&, i](){ run_mining_worker("127.0.0.1", port, 2, stop, *stats[i]); });
+    }
+    auto wait_for = [&](auto cond) {
+        for (int i=0;i<500 && !cond();i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return cond();
+    };
+    CHECK(wait_for([&]{ std::lock_guard<std::mutex> lk(chain.mutex()); return chain.tip_height() >= 3; }));
+
+    SignedTx tx;
+    tx.type = TxType::MINT_NFT;
+    tx.from = addr; tx.to = addr;
+    tx.meta = {"n", "S", "u"};
+    {
+        std::lock_guard<std::mutex> lk(chain.mutex());
+        tx.nonce = 0;
+        CHECK(mempool.add(sign_tx(tx, kp.priv), chain.state()).ok);
+        CHECK_FALSE(mempool.add(sign_tx(tx, kp.priv), chain.state()).ok); // same nonce
+    }
+    CHECK(wait_for([&]{ std::lock_guard<std::mutex> lk(chain.mutex()); return chain.state().nfts.size() == 1; }));
+    CHECK(wait_for([&]{ return mempool.size() == 0; }));
+    stop = true;
+    for (auto& w : workers) w.join();
+    server.stop();
+
+    auto s = server.stats();
+    CHECK(s.accepted >= 3);
+    CHECK(s.accepted == (uint64_t)broadcast);
+    CHECK(s.submitted == s.accepted + s.stale + s.invalid);
+    CHECK(s.invalid == 0);
+    uint64_t accepted = 0;
+    for (auto& m : stats) accepted += m->accepted;
+    CHECK(accepted <= s.accepted); // a result can still be in flight when a worker stops
+}
+
+TEST_CASE("in-node miner follows the tip and mines pending txs") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    Mempool mempool;
+    NodeMiner miner(chain, &mempool, addr);
+    miner.tx_refresh_ms = 20;
+    std::atomic<int> broadcast{0};
+    miner.on_block([&](const Block&){ broadcast++; });
+    miner.start(3);
+    auto wait_for = [&](auto cond) {
+        for (int i=0;i<500 && !cond();i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return cond();
+    };
+    CHECK(wait_for([&]{ std::lock_guard<std::mutex> lk(chain.mutex()); return chain.tip_height() >= 3; }));
+
+    // a block from elsewhere moves the tip under the miner
+    {
+        std::lock_guard<std::mutex> lk(chain.mutex());
+        auto other = address_from_pubkey(keygen().pub);
+        auto b = chain.build_block(other, {});
+        uint64_t iters = 0;
+        while (!mine_block(b, b.header.difficulty_bits, iters)) {}
+        CHECK(chain.accept_block(b));
+    }
+    SignedTx tx;
+    tx.type = TxType::MINT_NFT;
+    tx.from = addr; tx.to = addr;
+    tx.meta = {"n", "S", "u"};
+    {
+        std::lock_guard<std::mutex> lk(chain.mutex());
+        tx.nonce = chain.state().accounts.get(addr).value_or(AccountState{}).nonce;
+        CHECK(mempool.add(sign_tx(tx, kp.priv), chain.state()).ok);
+    }
+    CHECK(wait_for([&]{ std::lock_guard<std::mutex> lk(chain.mutex()); return chain.state().nfts.size() == 1; }));
+    CHECK(wait_for([&]{ return mempool.size() == 0; }));
+    miner.stop();
+
+    auto s = miner.stats();
+    CHECK(s.accepted >= 3);
+    CHECK(s.accepted == (uint64_t)broadcast);
+    CHECK(s.found == s.accepted + s.orphaned);
+    CHECK(s.templates >= s.accepted); // the last block can land just before stop()
+    CHECK(s.switches >= 1);
+    CHECK(s.switches <= s.templates);
+    CHECK(s.switch_ms_max >= s.switch_ms_avg);
+    CHECK(s.orphaned_hashes <= s.hashes);
+}
+
+TEST_CASE("rolling bloom filter remembers recent items and forgets old ones") {
+    sodium_init_or_throw();
+    RollingBloom f(1000, 1e-4);
+    for (int i=0;i<1000;i++) f.insert("a" + std::to_string(i));
+    for (int i=0;i<1000;i++) CHECK(f.contains("a" + std::to_string(i)));
+    int fp = 0;
+    for (int i=0;i<10000;i++) fp += f.contains("b" + std::to_string(i));
+    CHECK(fp < 10);
+    for (int i=0;i<3000;i++) f.insert("c" + std::to_string(i));
+    int remembered = 0;
+    for (int i=0;i<1000;i++) remembered += f.contains("a" + std::to_string(i));
+    CHECK(remembered < 10);
+}
+
+TEST_CASE("transactions gossip across a triangle of nodes without duplicate bodies") {
+    sodium_init_or_throw();
+    struct Node {
+        TempDir dir;
+        std::unique_ptr<Storage> st;
+        std::unique_ptr<Blockchain> chain;
+        Mempool mempool;
+        std::unique_ptr<P2PNode> p2p;
+        uint16_t port;
+    };
+    auto params = chain_params_for("regtest");
+    uint16_t base = 30000 + 16 * random_bytes(1)[0];
+    std::vector<std::unique_ptr<Node>> nodes;
+    for (int i=0;i<3;i++) {
+        auto n = std::make_unique<Node>();
+        n->st = std::make_unique<Storage>(n->dir.string());
+        n->chain = std::make_unique<Blockchain>(*n->st, params);
+        REQUIRE(n->chain->load());
+        n->p2p = std::make_unique<P2PNode>(*n->chain);
+        n->p2p->set_mempool(&n->mempool);
+        n->p2p->announce_ms = 20;
+        n->port = base + i;
+        nodes.push_back(std::move(n));
+    }
+    for (int i=0;i<3;i++)
+        for (int j=0;j<3;j++) if (i != j) nodes[i]->p2p->add_peer("127.0.0.1", nodes[j]->port);
+    for (auto& n : nodes) REQUIRE(n->p2p->start_listen("127.0.0.1", n->port));
+
+    const int N = 30;
+    std::vector<std::string> ids;
+    for (int i=0;i<N;i++) {
+        auto kp = keygen();
+        SignedTx tx;
+        tx.type = TxType::MINT_NFT;
+        tx.from = tx.to = address_from_pubkey(kp.pub);
+        tx.meta = {"n", "S", "u"};
+        tx = sign_tx(tx, kp.priv);
+        std::lock_guard<std::mutex> lk(nodes[0]->chain->mutex());
+        REQUIRE(nodes[0]->mempool.add(tx, nodes[0]->chain->state()).ok);
+        nodes[0]->p2p->announce_tx(tx.id);
+        ids.push_back(tx.id);
+    }
+    for (int i=0;i<500 && (nodes[1]->mempool.size() < N || nodes[2]->mempool.size() < N);i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // let any late announcements land
+    for (auto& n : nodes) n->p2p->stop();
+
+    for (auto& id : ids) CHECK((nodes[1]->mempool.contains(id) && nodes[2]->mempool.contains(id)));
+    auto a = nodes[0]->p2p->tx_stats(), b = nodes[1]->p2p->tx_stats(), c = nodes[2]->p2p->tx_stats();
+    CHECK(a.received == 0);   // nothing is sent back to the origin
+    CHECK(b.received == N);   // every other node fetches each body exactly once
+    CHECK(c.received == N);
+    CHECK(b.accepted == N);
+    CHECK(a.announced == 2 * N);
+    CHECK(a.tx_bytes + b.tx_bytes + c.tx_bytes > 0);
+}
+
+TEST_CASE("a tx whose announcer never sends the body is fetched from another announcer") {
+    sodium_init_or_throw();
+    TempDir da, db;
+    auto params = chain_params_for("regtest");
+    Storage sa(da.string()), sb(db.string());
+    Blockchain ca(sa, params), cb(sb, params);
+    REQUIRE(ca.load());
+    REQUIRE(cb.load());
+    Mempool ma, mb;
+    P2PNode a(ca), b(cb);
+    a.set_mempool(&ma);
+    b.set_mempool(&mb);
+    a.announce_ms = b.announce_ms = 20;
+    uint16_t pa = 31000 + 16 * random_bytes(1)[0], pb = pa + 1;
+    a.add_peer("127.0.0.1", pb);
+    b.add_peer("127.0.0.1", pa);
+    REQUIRE(a.start_listen("127.0.0.1", pa));
+    REQUIRE(b.start_listen("127.0.0.1", pb));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto kp = keygen();
+    SignedTx tx;
+    tx.type = TxType::MINT_NFT;
+    tx.from = tx.to = address_from_pubkey(kp.pub);
+    tx.meta = {"n", "S", "u"};
+    tx = sign_tx(tx, kp.priv);
+    // announce it, take the get_txs, and hang up without the body
+    auto asked = p2p_request("127.0.0.1", pb, nlohmann::json{{"type","inv"},{"txids",nlohmann::json::array({tx.id})}}.dump(), 2000);
+    REQUIRE(asked.has_value());
+    CHECK(nlohmann::json::parse(*asked)["txids"].size() == 1);
+    {
+        std::lock_guard<std::mutex> lk(ca.mutex());
+        REQUIRE(ma.add(tx, ca.state()).ok);
+    }
+    a.announce_tx(tx.id);
+    for (int i=0;i<1000 && !mb.contains(tx.id);i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(mb.contains(tx.id));
+    CHECK(b.tx_stats().timeouts >= 1);
+    a.stop();
+    b.stop();
+}
+
+TEST_CASE("peer manager enforces slots, queue budgets and bans") {
+    PeerLimits lim;
+    lim.max_inbound = 2;
+    lim.max_outbound = 1;
+    lim.max_queue_bytes = 100;
+    lim.max_tracked = 4;
+    PeerManager pm(lim);
+    CHECK(pm.admit_inbound("10.0.0.1"));
+    CHECK(pm.admit_inbound("10.0.0.1"));
+    CHECK_FALSE(pm.admit_inbound("10.0.0.2")); // no free slot
+    pm.release_inbound("10.0.0.1");
+    CHECK(pm.admit_inbound("10.0.0.2"));
+    pm.release_inbound("10.0.0.1");
+    pm.release_inbound("10.0.0.2");
+    {
+        PeerLimits per_host;
+        per_host.max_inbound_per_host = 2;
+        PeerManager one(per_host);
+        CHECK(one.admit_inbound("10.0.0.1"));
+        CHECK(one.admit_inbound("10.0.0.1"));
+        CHECK_FALSE(one.admit_inbound("10.0.0.1")); // that host's share is used up
+        CHECK(one.admit_inbound("10.0.0.2"));
+        one.release_inbound("10.0.0.1");
+        CHECK(one.admit_inbound("10.0.0.1"));
+    }
+
+    CHECK(pm.add_outbound("10.0.0.9:9735"));
+    CHECK_FALSE(pm.add_outbound("10.0.0.8:9735"));
+    CHECK(pm.reserve_queue("10.0.0.9:9735", 60));
+    CHECK_FALSE(pm.reserve_queue("10.0.0.9:9735", 60)); // over budget
+    pm.release_queue("10.0.0.9:9735", 60);
+    CHECK(pm.reserve_queue("10.0.0.9:9735", 60));
+    pm.release_queue("10.0.0.9:9735", 60);
+    pm.failed("10.0.0.9:9735");
+    CHECK_FALSE(pm.reserve_queue("10.0.0.9:9735", 1)); // backing off
+
+    CHECK_FALSE(pm.misbehaving("10.0.0.1", 60, "test"));
+    CHECK(pm.misbehaving("10.0.0.1", 60, "test"));
+    CHECK(pm.banned("10.0.0.1"));
+    CHECK_FALSE(pm.admit_inbound("10.0.0.1"));
+    CHECK(pm.misbehaving("10.0.0.9:9735", 100, "test"));
+    CHECK(pm.banned("10.0.0.9"));
+    pm.unban("10.0.0.1");
+    CHECK(pm.admit_inbound("10.0.0.1"));
+    pm.release_inbound("10.0.0.1");
+
+    CHECK_FALSE(pm.misbehaving("10.0.0.2", 50, "test"));
+
+    // a stream of new source addresses only ever costs max_tracked inbound entries
+    for (int i=0;i<100;i++) {
+        auto host = "10.1.0." + std::to_string(i);
+        REQUIRE(pm.admit_inbound(host));
+        pm.release_inbound(host);
+    }
+    size_t inbound = 0, dropped = 0;
+    for (auto& s : pm.stats()) {
+        inbound += !s.outbound;
+        if (s.key == "10.0.0.9:9735") { dropped = s.dropped_msgs; CHECK(s.banned); CHECK(s.failures == 1); }
+    }
+    CHECK(inbound <= lim.max_tracked);
+    CHECK(dropped == 2);
+    // going idle and being evicted does not wipe a host's score
+    REQUIRE(pm.admit_inbound("10.0.0.2"));
+    for (auto& s : pm.stats()) if (s.key == "10.0.0.2") CHECK(s.score == 50);
+    CHECK(pm.misbehaving("10.0.0.2", 50, "test"));
+}
+
+TEST_CASE("node bans a peer that keeps sending garbage") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    P2PNode node(chain);
+    uint16_t port = 31000 + 8 * random_bytes(1)[0];
+    REQUIRE(node.start_listen("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto tip = nlohmann::json{{"type","get_block"},{"height",0}}.dump();
+    CHECK(p2p_request("127.0.0.1", port, tip, 2000).has_value());
+
+    // pushed blocks: one from ahead whose hash does not match its header, and one on our tip
+    // that fails validation, cost points; neither is accepted
+    auto push = [&](const Block& b) {
+        p2p_request("127.0.0.1", port, "{\"data\":" + to_json(b) + ",\"type\":\"block\"}", 2000);
+    };
+    auto addr = address_from_pubkey(keygen().pub);
+    auto ahead = chain.build_block(addr, {});
+    ahead.header.height = 5;
+    push(ahead);
+    CHECK(node.peers().stats().at(0).score == 10);
+    auto bad = chain.build_block(addr, {});
+    bad.header.merkle_root = std::string(64, '0');
+    bad.hash = block_hash(bad.header);
+    push(bad);
+    CHECK(node.peers().stats().at(0).score == 30);
+    CHECK(chain.tip_height() == 0);
+
+    for (int i=0;i<10;i++) p2p_request("127.0.0.1", port, "not json", 2000);
+    CHECK(node.peers().banned("127.0.0.1"));
+    CHECK_FALSE(p2p_request("127.0.0.1", port, tip, 500).has_value()); // refused while banned
+    auto stats = node.peers().stats();
+    REQUIRE(stats.size() == 1);
+    CHECK(stats[0].score >= 100);
+    CHECK(stats[0].types["get_block"].recv_msgs == 1);
+    CHECK(stats[0].types["block"].recv_msgs == 2);
+    CHECK(stats[0].types["other"].recv_msgs == 7); // banned at 100 points, then refused
+    node.peers().unban("127.0.0.1");
+    CHECK(p2p_request("127.0.0.1", port, tip, 2000).has_value());
+    node.stop();
+}
+
+TEST_CASE("send_batch signs payments in parallel and submits them to a node") {
+    sodium_init_or_throw();
+    CHECK(parse_amount("12.5") == 1250000000);
+    CHECK(parse_amount("0.00000001") == 1);
+    CHECK(parse_amount("7") == 700000000);
+    CHECK_FALSE(parse_amount("0.000000001").has_value());
+    CHECK_FALSE(parse_amount("-1").has_value());
+    CHECK_FALSE(parse_amount("0").has_value());
+    CHECK_FALSE(parse_amount("1e5").has_value());
+
+    TempDir dir;
+    std::filesystem::create_directories(dir);
+    auto to = address_from_pubkey(keygen().pub);
+    auto csv = (dir / "pay.csv").string();
+    {
+        std::ofstream f(csv);
+        f << "to,amount\n";
+        for (int i=0;i<250;i++) f << to << "," << (i + 1) << ".5\n";
+    }
+    std::string err;
+    auto payments = read_payments(csv, err);
+    REQUIRE(payments.has_value());
+    REQUIRE(payments->size() == 250);
+    CHECK((*payments)[1].amount == 250000000);
+    {
+        std::ofstream(dir / "bad.csv") << to << ",1\nnot-an-address,2\n";
+        CHECK_FALSE(read_payments((dir / "bad.csv").string(), err).has_value());
+        CHECK(err.find("line 2") != std::string::npos);
+    }
+
+    Storage st((dir / "node").string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    Mempool mempool;
+    RpcServer rpc(chain);
+    rpc.set_mempool(&mempool);
+    std::atomic<int> announced{0};
+    rpc.on_tx([&](const SignedTx&){ announced++; });
+    uint16_t port = 32000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto kp = keygen();
+    BatchOptions opt;
+    opt.port = port;
+    opt.threads = 3;
+    opt.batch_size = 40;
+    size_t progress_calls = 0;
+    opt.progress = [&](const BatchResult&){ progress_calls++; };
+    auto r = send_batch(*payments, kp.priv, 5, opt);
+    CHECK_FALSE(r.rpc_failed);
+    CHECK(r.signed_txs == 250);
+    CHECK(r.submitted == 250);
+    CHECK(r.accepted == 250);
+    CHECK(progress_calls == 7);
+    CHECK(announced == 250);
+    CHECK(mempool.size() == 250);
+    // a second run repeats the same nonces, which the node turns away row by row
+    auto again = send_batch(*payments, kp.priv, 5, opt);
+    CHECK(again.rejected == 250);
+    CHECK(again.errors.size() == 10);
+    rpc.stop();
+}
+
+TEST_CASE("memory accounting charges subsystems and budgets push back") {
+    sodium_init_or_throw();
+    REQUIRE(memory_accounting_enabled());
+    int64_t before = memory_bytes(MemTag::P2P);
+    auto* big = new std::vector<char>();
+    {
+        MemScope p2p(MemTag::P2P);
+        big->resize(1 << 20);
+        {
+            MemScope rpc(MemTag::RPC);
+            std::string s(4096, 'x');
+            CHECK(memory_bytes(MemTag::RPC) >= 4096);
+        }
+    }
+    CHECK(memory_bytes(MemTag::P2P) - before >= (1 << 20));
+    // freed on another thread, still credited back to the subsystem that allocated it
+    std::thread([&]{ big->clear(); big->shrink_to_fit(); }).join();
+    delete big;
+    CHECK(memory_bytes(MemTag::P2P) - before < 4096);
+    struct alignas(64) Line { char b[64]; };
+    {
+        MemScope st(MemTag::Storage);
+        auto line = std::make_unique<Line>();
+        CHECK(reinterpret_cast<uintptr_t>(line.get()) % 64 == 0);
+    }
+
+    std::string err;
+    CHECK_FALSE(parse_memory_budgets("mempool=1XB", err));
+    CHECK_FALSE(parse_memory_budgets("heap=1MB", err));
+    REQUIRE(parse_memory_budgets("mempool=4KB", err));
+    CHECK(memory_budget(MemTag::Mempool) == 4096);
+
+    TempDir dir;
+    Storage st(dir.string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    CHECK(memory_bytes(MemTag::State) > 0);
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    std::string refusal;
+    {
+        Mempool mempool;
+        for (uint64_t n = 0; n < 100 && refusal.empty(); n++) {
+            SignedTx tx;
+            tx.type = TxType::TRANSFER;
+            tx.from = addr; tx.to = addr; tx.amount = 1; tx.nonce = n;
+            auto vr = mempool.add(sign_tx(tx, kp.priv), chain.state());
+            if (!vr.ok) refusal = vr.reason;
+        }
+        CHECK(refusal == "mempool over memory budget");
+        CHECK(mempool.size() < 100);
+    }
+
+    RpcServer rpc(chain);
+    uint16_t port = 34000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto reply = rpc_request("127.0.0.1", port, R"({"method":"get_memory"})");
+    REQUIRE(reply.has_value());
+    auto j = nlohmann::json::parse(*reply);
+    CHECK(j["accounting"] == true);
+    CHECK(j["subsystems"]["mempool"]["budget_bytes"] == 4096);
+    CHECK(j["subsystems"]["state"]["bytes"].get<int64_t>() > 0);
+    CHECK(memory_report().find("mempool") != std::string::npos);
+    rpc.stop();
+    set_memory_budget(MemTag::Mempool, 0);
+}
+
+TEST_CASE("reindex replays stored blocks through the pipeline and stops at a bad one") {
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    auto params = chain_params_for("regtest");
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    auto to = address_from_pubkey(keygen().pub);
+    uint64_t nonce = 0;
+    for (int i=0;i<40;i++) {
+        if (i == 20) st.set_block_codec(BlockCodec::Columnar); // reindex reads both formats
+        std::vector<SignedTx> txs;
+        for (int k=0; i>0 && k<3; k++) {
+            SignedTx tx;
+            tx.type = TxType::TRANSFER;
+            tx.from = addr; tx.to = to; tx.amount = 1 + k; tx.nonce = nonce++;
+            txs.push_back(sign_tx(tx, kp.priv));
+        }
+        auto blk = chain.build_block(addr, txs);
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+        REQUIRE(chain.accept_block(blk));
+    }
+    auto root = chain.state_root();
+    auto tip_hash = chain.tip_hash();
+    auto balance = chain.state().accounts.at(to).balance;
+    std::filesystem::remove(dir / "state.json");
+
+    ReindexOptions opt;
+    opt.threads = 2;
+    opt.queue_blocks = 4;
+    auto r = reindex(st, params, opt);
+    CHECK(r.error == "");
+    REQUIRE(r.ok);
+    CHECK(r.height == 40);
+    CHECK(r.txs == 39 * 3);
+    REQUIRE(r.stages.size() == 4);
+    for (auto& s : r.stages) CHECK(s.blocks == 40);
+    Blockchain reloaded(st, params);
+    REQUIRE(reloaded.load());
+    CHECK(reloaded.tip_hash() == tip_hash);
+    CHECK(reloaded.state_root() == root);
+    CHECK(reloaded.state().accounts.at(to).balance == balance);
+
+    // a tampered body fails verification; tip.json and the state are left untouched
+    auto slurp = [&](const char* name) {
+        std::ifstream f(dir / name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(f), {});
+    };
+    auto tip_before = slurp("tip.json"), state_before = slurp("state.json");
+    auto bad = st.read_block(30);
+    REQUIRE(bad.has_value());
+    bad->txs[0].amount += 1;
+    st.write_block(*bad);
+    r = reindex(st, params, opt);
+    CHECK_FALSE(r.ok);
+    CHECK(r.error.find("block 30") == 0);
+    CHECK(r.height == 29);
+    CHECK(slurp("tip.json") == tip_before);
+    CHECK(slurp("state.json") == state_before);
+    Blockchain kept(st, params);
+    REQUIRE(kept.load());
+    CHECK(kept.tip_height() == 40);
+    CHECK(kept.tip_hash() == tip_hash);
+    CHECK(kept.state_root() == root);
+
+    // so does a block claiming a difficulty other than the chain's, even with work to match
+    bad->txs[0].amount -= 1;
+    st.write_block(*bad);
+    auto easy = st.read_block(25);
+    REQUIRE(easy.has_value());
+    uint64_t iters = 0;
+    easy->header.difficulty_bits += 1;
+    REQUIRE(mine_block(*easy, easy->header.difficulty_bits, iters));
+    st.write_block(*easy);
+    r = reindex(st, params, opt);
+    CHECK_FALSE(r.ok);
+    CHECK(r.height == 24);
+}
+
+TEST_CASE("header index answers hash, height and work lookups and survives restarts") {
+    sodium_init_or_throw();
+    TempDir dir;
+    auto params = chain_params_for("regtest");
+    auto addr = address_from_pubkey(keygen().pub);
+    std::vector<std::string> hashes;
+    uint64_t work = 0;
+    {
+        Storage st(dir.string());
+        Blockchain chain(st, params);
+        REQUIRE(chain.load());
+        hashes.push_back(chain.tip_hash());
+        for (int i=0;i<12;i++) {
+            auto blk = chain.build_block(addr, {});
+            uint64_t iters = 0;
+            REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+            REQUIRE(chain.accept_block(blk));
+            hashes.push_back(blk.hash);
+            REQUIRE_FALSE(chain.accept_block(blk)); // known: found through the index
+        }
+        work = chain.tip_work();
+        CHECK(chain.headers().size() == 13);
+        CHECK(chain.headers().work_at(12) == work);
+    }
+    Storage st(dir.string());
+    Blockchain chain(st, params);
+    REQUIRE(chain.load());
+    auto& idx = chain.headers();
+    REQUIRE(idx.size() == 13);
+    for (uint64_t h=0; h<=12; h++) {
+        CHECK(idx.height_of(hashes[h]) == h);
+        CHECK(idx.at(h)->hash_hex() == hashes[h]);
+    }
+    CHECK_FALSE(idx.height_of(std::string(64, 'a')).has_value());
+    CHECK_FALSE(idx.height_of("zz").has_value());
+    CHECK(idx.work_at(12) == work);
+    CHECK(chain.tip_work() == work);
+    CHECK(idx.memory_bytes() >= 13 * sizeof(HeaderRecord));
+
+    // a headers.dat that stops short of the tip is backfilled from the bodies
+    std::filesystem::resize_file(dir / "headers.dat", 5 * sizeof(HeaderRecord));
+    Blockchain backfilled(st, params);
+    REQUIRE(backfilled.load());
+    CHECK(backfilled.headers().work_at(12) == work);
+    // one that no longer links up is refused
+    {
+        std::fstream f(dir / "headers.dat", std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp((std::streamoff)(6 * sizeof(HeaderRecord) + offsetof(HeaderRecord, prev_hash)));
+        f.write("garbage", 7);
+    }
+    Blockchain broken(st, params);
+    CHECK_FALSE(broken.load());
+    REQUIRE(reindex(st, params).ok); // rewrites it
+    Blockchain fixed(st, params);
+    REQUIRE(fixed.load());
+    CHECK(fixed.headers().height_of(hashes[12]) == 12);
+}
+
+TEST_CASE("rpc caches serialized blocks by hash and honours if_none_match") {
+    ResponseCache lru(100);
+    lru.put("a", std::string(40, 'a'));
+    lru.put("b", std::string(40, 'b'));
+    CHECK(lru.get("a") != nullptr); // a is now the most recent
+    lru.put("c", std::string(40, 'c'));
+    CHECK(lru.get("b") == nullptr);
+    CHECK(lru.get("a") != nullptr);
+    lru.put("huge", std::string(200, 'h'));
+    CHECK(lru.get("huge") == nullptr);
+    auto ls = lru.stats();
+    CHECK(ls.entries == 2);
+    CHECK(ls.bytes == 80);
+    CHECK(ls.evictions == 1);
+
+    sodium_init_or_throw();
+    TempDir dir;
+    Storage st(dir.string());
+    st.set_block_codec(BlockCodec::Columnar); // a miss has to re-encode these as JSON
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    auto addr = address_from_pubkey(keygen().pub);
+    for (int i=0;i<3;i++) {
+        auto blk = chain.build_block(addr, {});
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, chain.current_difficulty_bits(), iters));
+        REQUIRE(chain.accept_block(blk));
+    }
+    RpcServer rpc(chain);
+    uint16_t port = 36000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto first = rpc_request("127.0.0.1", port, R"({"method":"get_block","height":2})");
+    auto second = rpc_request("127.0.0.1", port, R"({"method":"get_block","height":2})");
+    REQUIRE(first.has_value());
+    REQUIRE(second.has_value());
+    CHECK(*first == *second);
+    auto j = nlohmann::json::parse(*first);
+    auto hash = j["etag"].get<std::string>();
+    CHECK(hash == j["block"]["hash"]);
+    auto by_hash = rpc_request("127.0.0.1", port, nlohmann::json{{"method","get_block"},{"hash",hash}}.dump());
+    CHECK(by_hash == first);
+    auto s = rpc.cache().stats();
+    CHECK(s.misses == 1);
+    CHECK(s.hits == 2);
+    CHECK(s.served_bytes == 2 * (first->size() + 1));
+    auto nm = rpc_request("127.0.0.1", port, nlohmann::json{{"method","get_block"},{"height",2},{"if_none_match",hash}}.dump());
+    CHECK(nlohmann::json::parse(*nm)["not_modified"] == true);
+    auto missing = rpc_request("127.0.0.1", port, R"({"method":"get_block","height":9})");
+    CHECK(nlohmann::json::parse(*missing).contains("error"));
+    // a height that is not a non-negative integer gets an error reply, not a dropped connection
+    for (auto bad : {R"("2")", "-1", "1.5"}) {
+        for (auto method : {"get_block", "get_header"}) {
+            auto r = rpc_request("127.0.0.1", port, std::string(R"({"method":")") + method + R"(","height":)" + bad + "}", 2000);
+            REQUIRE(r.has_value());
+            CHECK(nlohmann::json::parse(*r)["error"] == "height must be a non-negative integer");
+        }
+    }
+    auto header = rpc_request("127.0.0.1", port, R"({"method":"get_header","height":2})");
+    CHECK(nlohmann::json::parse(*header)["hash"] == hash);
+
+    // a client that hangs up without a request does not take the server down
+    CHECK_FALSE(rpc_request("127.0.0.1", port, R"({"method":"get_tip"})", 0).has_value());
+    auto acct = rpc_request("127.0.0.1", port, nlohmann::json{{"method","get_account"},{"address",addr}}.dump(), 2000);
+    REQUIRE(acct.has_value());
+    auto aj = nlohmann::json::parse(*acct);
+    CHECK(aj["balance"] == chain.state().accounts.at(addr).balance);
+    CHECK(aj["nonce"] == 0);
+    auto none = rpc_request("127.0.0.1", port, R"({"method":"get_account","address":"nobody"})");
+    CHECK(nlohmann::json::parse(*none)["balance"] == 0);
+
+    rpc.stop();
+}
+
+TEST_CASE("rpc gives up cached responses rather than refuse requests over its memory budget") {
+    if (!memory_accounting_enabled()) return;
+    TempDir dir;
+    Storage st(dir.string());
+    Blockchain chain(st, chain_params_for("regtest"));
+    REQUIRE(chain.load());
+    RpcServer rpc(chain);
+    uint16_t port = 37000 + 8 * random_bytes(1)[0];
+    REQUIRE(rpc.start("127.0.0.1", port));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(rpc_request("127.0.0.1", port, R"({"method":"get_tip"})", 2000).has_value());
+    // the cache fills up past a budget set below its size, as with the default 64 MB cache
+    // and --mem-budget rpc=32MB
+    set_memory_budget(MemTag::RPC, memory_bytes(MemTag::RPC) + (2 << 20));
+    {
+        MemScope mem(MemTag::RPC);
+        for (int i=0;i<4;i++) rpc.cache().put("block:" + std::to_string(i), std::string(1 << 20, 'x'));
+    }
+    CHECK(over_memory_budget(MemTag::RPC));
+    auto tip = rpc_request("127.0.0.1", port, R"({"method":"get_tip"})", 2000);
+    set_memory_budget(MemTag::RPC, 0);
+    REQUIRE(tip.has_value());
+    CHECK(nlohmann::json::parse(*tip).contains("height"));
+    CHECK(rpc.cache().stats().bytes <= (2 << 20));
+    rpc.stop();
+}
+
+TEST_CASE("nft store shares metadata and state.json keeps it compact") {
+    auto before = nft_store_stats();
+    {
+        NFTMeta m1{"Punk #1", "PUNK", "ipfs://punks/1.json"}, m2{"Punk #2", "PUNK", "ipfs://punks/2.json"};
+        NftMetaRef a(m1), b(m1), c(m2);
+        CHECK(a == b);
+        CHECK_FALSE(a == c);
+        CHECK(a.name() == "Punk #1");
+        CHECK(c.uri() == "ipfs://punks/2.json");
+        CHECK(&a.symbol() == &c.symbol()); // one interned copy
+        CHECK(&a.uri_prefix() == &c.uri_prefix());
+        CHECK(c.uri_suffix() == "2.json");
+        CHECK(NftMetaRef(NFTMeta{"x", "", "no-slash"}).uri() == "no-slash");
+        CHECK(InternedString("owner") == InternedString(std::string("owner")));
+        CHECK(nft_store_stats().records == before.records + 2);
+
+        TempDir dir;
+        std::filesystem::create_directories(dir);
+        LedgerState st;
+        st.accounts["alice"] = {5, 1};
+        for (uint64_t id=1; id<=20; id++) st.nfts[id] = {id % 2 ? "alice" : "bob", NFTMeta{"Punk #" + std::to_string(id), "PUNK", "ipfs://punks/" + std::to_string(id) + ".json"}};
+        st.nfts[21] = {"bob", m1}; // same metadata as token 1
+        st.next_token_id = 22;
+        Storage s(dir.string());
+        REQUIRE(s.save_state(st));
+        std::ifstream f(dir / "state.json");
+        auto j = nlohmann::json::parse(f);
+        CHECK(j["nft_strings"].size() == 4); // alice, bob, PUNK, ipfs://punks/
+        CHECK(j["nft_meta"].size() == 20);
+        LedgerState back;
+        REQUIRE(s.load_state(back));
+        REQUIRE(back.nfts.size() == 21);
+        for (auto& [id, e] : st.nfts) {
+            CHECK(back.nfts.at(id) == e);
+            CHECK(nft_value(back.nfts.at(id)) == nft_value(e));
+        }
+
+        // state.json written before the store: one object per token
+        nlohmann::json old;
+        old["accounts"] = nlohmann::json::object();
+        old["nfts"]["7"] = {{"owner", "carol"}, {"meta", {{"name", "Punk #1"}, {"symbol", "PUNK"}, {"uri", "ipfs://punks/1.json"}}}};
+        old["next_token_id"] = 8;
+        std::ofstream(dir / "state.json") << old.dump();
+        REQUIRE(s.load_state(back));
+        CHECK(back.nfts.size() == 1);
+        CHECK(back.nfts.at(7).first == "carol");
+        CHECK(back.nfts.at(7).second == a);
+    }
+    // the last reference frees the record
+    CHECK(nft_store_stats().records == before.records);
+}
+
+TEST_CASE("account store grows, deletes and reopens") {
+    TempDir dir;
+    std::filesystem::create_directories(dir);
+    auto path = (dir / "accounts.dat").string();
+    std::string err;
+    {
+        auto s = AccountStore::open(path, true, err);
+        REQUIRE(s);
+        for (int i=0;i<3000;i++) REQUIRE(s->put("acct-" + std::to_string(i), {i, (uint64_t)i * 2}));
+        for (int i=0;i<3000;i+=3) REQUIRE(s->erase("acct-" + std::to_string(i)));
+        CHECK(s->size() == 2000);
+        CHECK(s->file_bytes() > AccountStore::PAGE * 17); // doubled from the initial 16 pages
+        CHECK_FALSE(s->put(std::string(AccountStore::MAX_KEY + 1, 'x'), {}));
+    }
+    auto s = AccountStore::open(path, false, err);
+    REQUIRE(s);
+    CHECK(s->size() == 2000);
+    CHECK_FALSE(s->get("acct-300").has_value());
+    REQUIRE(s->get("acct-301").has_value());
+    CHECK(s->get("acct-301")->balance == 301);
+    CHECK(s->get("acct-301")->nonce == 602);
+    size_t n = 0;
+    s->for_each([&](std::string_view, const AccountState&) { n++; });
+    CHECK(n == 2000);
+
+    // a flush that could not store every account leaves the recorded tip alone
+    AccountTable table;
+    table.attach(std::move(s), 8);
+    table.set_tip(7, std::string(64, 'a'));
+    table[""].balance = 1;
+    CHECK_FALSE(table.flush());
+    CHECK(table.store()->tip().second.empty());
+}
+
+TEST_CASE("tiered accounts give the same state as in memory") {
+    sodium_init_or_throw();
+    TempDir base;
+    auto params = chain_params_for("regtest");
+    Storage sa((base / "a").string());
+    Blockchain a(sa, params);
+    REQUIRE(a.load());
+    auto kp = keygen();
+    auto addr = address_from_pubkey(kp.pub);
+    std::vector<std::string> payees;
+    uint64_t nonce = 0;
+    for (int i=0;i<12;i++) {
+        std::vector<SignedTx> txs;
+        for (int k=0; i>0 && k<5; k++) {
+            payees.push_back(address_from_pubkey(keygen().pub));
+            SignedTx tx;
+            tx.type = TxType::TRANSFER;
+            tx.from = addr; tx.to = payees.back(); tx.amount = 10 + k; tx.nonce = nonce++;
+            txs.push_back(sign_tx(tx, kp.priv));
+        }
+        auto blk = a.build_block(addr, txs);
+        uint64_t iters = 0;
+        REQUIRE(mine_block(blk, a.current_difficulty_bits(), iters));
+        REQUIRE(a.accept_block(blk));
+    }
+    auto root = a.state_root();
+    size_t accounts = a.state().accounts.size();
+    CHECK(accounts == payees.size() + 1);
+
+    // replay a copy with only 8 accounts cached
+    std::filesystem::copy(base / "a", base / "b", std::filesystem::copy_options::recursive);
+    Storage sb((base / "b").string());
+    ReindexOptions opt;
+    opt.state_cache = 8;
+    REQUIRE(reindex(sb, params, opt).ok);
+    Blockchain b(sb, params);
+    REQUIRE(b.load());
+    REQUIRE(b.state().accounts.tiered());
+    CHECK(b.state_root() == root);
+    CHECK(b.state().accounts.size() == accounts);
+    for (auto& p : payees) CHECK(b.state().accounts.at(p).balance == a.state().accounts.at(p).balance);
+
+    // keeps working on top: the block's accounts are prefetched, then evicted again
+    SignedTx tx;
+    tx.type = TxType::TRANSFER;
+    tx.from = addr; tx.to = payees[0]; tx.amount = 1; tx.nonce = nonce++;
+    auto blk = b.build_block(addr, {sign_tx(tx, kp.priv)});
+    uint64_t iters = 0;
+    REQUIRE(mine_block(blk, b.current_difficulty_bits(), iters));
+    REQUIRE(b.accept_block(blk));
+    REQUIRE(a.accept_block(blk));
+    CHECK(b.state_root() == a.state_root());
+    auto stats = b.state().accounts.stats();
+    CHECK(stats.hits > 0);
+    CHECK(stats.prefetched > 0);
+    CHECK(stats.entries <= 8);
+    CHECK(b.state().accounts.store()->tip() == std::make_pair(b.tip_height(), b.tip_hash()));
+
+    // a miner address the store could not hold is refused before anything is written
+    auto nameless = b.build_block(std::string(AccountStore::MAX_KEY + 1, 'x'), {});
+    REQUIRE(mine_block(nameless, b.current_difficulty_bits(), iters));
+    CHECK_FALSE(b.accept_block(nameless));
+    CHECK(b.tip_hash() == blk.hash);
+
+    // a failed reindex leaves accounts.dat as it was
+    auto slurp = [&](const char* name) {
+        std::ifstream f(base / "b" / name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(f), {});
+    };
+    auto store_before = slurp("accounts.dat");
+    auto bad = sb.read_block(5);
+    REQUIRE(bad.has_value());
+    bad->txs[0].amount += 1;
+    sb.write_block(*bad);
+    CHECK_FALSE(reindex(sb, params, opt).ok);
+    CHECK(slurp("accounts.dat") == store_before);
+    CHECK_FALSE(std::filesystem::exists(base / "b" / "accounts.reindex.dat"));
+    CHECK_FALSE(std::filesystem::exists(base / "b" / "state_tree.reindex.dat"));
+    // the tree saved next to accounts.dat is reused rather than rebuilt, unless it is stamped
+    // at another block
+    auto& hashes = metrics().counter("axle_state_root_hashes_total", "");
+    auto before = hashes.value();
+    std::string err;
+    {
+        Blockchain kept(sb, params);
+        REQUIRE(kept.load());
+        CHECK(kept.state_root() == b.state_root());
+    }
+    CHECK(hashes.value() == before);
+    {
+        StateTree tree;
+        REQUIRE(tree.open((base / "b" / "state_tree.dat").string(), false, err));
+        tree.set_tip(b.tip_height() - 1, b.tip_hash());
+    }
+    {
+        Blockchain rebuilt(sb, params);
+        REQUIRE(rebuilt.load());
+        CHECK(rebuilt.state_root() == b.state_root());
+    }
+    CHECK(hashes.value() > before);
+
+    // a store written at another block is refused
+    auto store = AccountStore::open((base / "b" / "accounts.dat").string(), false, err);
+    REQUIRE(store);
+    store->set_tip(b.tip_height() - 1, b.tip_hash());
+    Blockchain behind(sb, params);
+    CHECK_FALSE(behind.load());
+
+    // an in-memory datadir moves its accounts to disk when started with a cache
+    Blockchain migrated(sa, params);
+    migrated.set_state_cache(8);
+    REQUIRE(migrated.load());
+    REQUIRE(migrated.state().accounts.tiered());
+    CHECK(migrated.state_root() == a.state_root());
+    CHECK(std::filesystem::exists(base / "a" / "accounts.dat"));
+    std::ifstream f(base / "a" / "state.json");
+    CHECK(nlohmann::json::parse(f)["accounts"].empty());
+}
+
+TEST_CASE("simulated network relays blocks, syncs a late joiner and mines a relayed tx") {
+    sodium_init_or_throw();
+    NetSimOptions o;
+    o.nodes = 4;
+    o.topology = "line";
+    o.link.latency_ms = 5;
+    NetSim sim(o);
+    std::string err;
+    REQUIRE(sim.start(err));
+    for (int i=0;i<3;i++) REQUIRE(sim.mine(0));
+    REQUIRE(sim.wait_for_height(3, 5000));
+
+    size_t late = sim.add_node({3});
+    CHECK(late == 4);
+    REQUIRE(sim.wait_for_height(3, 5000, {late}));
+    CHECK(sim.chain(late).tip_hash() == sim.chain(0).tip_hash());
+
+    // a transfer entering at the far end reaches node 0 and lands in its next block
+    SignedTx tx;
+    tx.type = TxType::TRANSFER;
+    tx.from = address_from_pubkey(sim.key(0).pub);
+    tx.to = address_from_pubkey(sim.key(3).pub);
+    tx.amount = 5;
+    tx.nonce = 0;
+    tx = sign_tx(tx, sim.key(0).priv);
+    REQUIRE(sim.submit_tx(late, tx));
+    for (int i=0;i<500 && !sim.mempool(0).contains(tx.id);i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(sim.mempool(0).contains(tx.id));
+    auto b = sim.mine(0);
+    REQUIRE(b);
+    CHECK(b->txs.size() == 1);
+    REQUIRE(sim.wait_for_height(4, 5000));
+    sim.stop();
+
+    auto p = sim.propagation();
+    CHECK(p.blocks == 4);
+    CHECK(p.missed == 0);
+    CHECK(p.arrival_ms.size() == 3 * 3 + 4); // the late joiner counts only for the block after it joined
+    CHECK(p.full_ms.size() == 4);
+    for (size_t i=0;i<sim.size();i++) CHECK(sim.chain(i).tip_height() == 4);
+    CHECK(sim.traffic(0).sent_bytes > 0);
+    CHECK(sim.node(late).block_stats().synced >= 3);
+    CHECK(sim.mempool(3).size() == 0); // confirmed txs leave every mempool
+}
@@ -0,0 +1,57 @@
+#pragma once
+// Small helpers shared by the benchmarking tools (not part of axle_lib).
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace axle::bench {
+
+using SteadyClock = std::chrono::steady_clock;
+
+inline double micros_since(SteadyClock::time_point t0) {
+    return std::chrono::duration<double, std::micro>(SteadyClock::now() - t0).count();
+}
+
+struct Summary {
+    size_t n{0};
+    double mean{0}, p50{0}, p90{0}, p95{0}, p99{0}, p999{0}, max{0};
+};
+
+inline Summary summarize(std::vector<double> v) {
+    Summary s;
+    s.n = v.size();
+    if (v.empty()) return s;
+    std::sort(v.begin(), v.end());
+    auto pct = [&](double p){ return v[std::min(v.size()-1, (size_t)(p * (v.size()-1) + 0.5))]; };
+    double sum = 0; for (auto x : v) sum += x;
+    s.mean = sum / v.size();
+    s.p50 = pct(0.50); s.p90 = pct(0.90); s.p95 = pct(0.95); s.p99 = pct(0.99); s.p999 = pct(0.999);
+    s.max = v.back();
+    return s;
+}
+
+// Resident set size in bytes (Linux /proc; 0 where unavailable).
+inline uint64_t rss_bytes() {
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) return std::stoull(line.substr(6)) * 1024;
+    }
+    return 0;
+}
+
+inline uint64_t dir_bytes(const std::filesystem::path& p) {
+    uint64_t total = 0;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(p, ec); it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (ec) break;
+        if (it->is_regular_file(ec)) total += it->file_size(ec);
+    }
+    return total;
+}
+
+}
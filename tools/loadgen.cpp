@@ -0,0 +1,334 @@
+// Synthetic transaction load generator: funds N accounts on a regtest chain, signs
+// M transfers + K NFT mints across threads, then drives them through block
+// building, mining, validation and storage and reports throughput.
+#include "bench_util.hpp"
+#include "block_codec.hpp"
+#include "compact_tx.hpp"
+#include "blockchain.hpp"
+#include "crypto.hpp"
+#include "encoding.hpp"
+#include "ledger.hpp"
+#include "mem_accounting.hpp"
+#include "miner.hpp"
+#include "storage.hpp"
+#include "tx.hpp"
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <iomanip>
+#include <random>
+#include <thread>
+
+namespace fs = std::filesystem;
+using namespace axle;
+using namespace axle::bench;
+
+struct Options {
+    std::string datadir;
+    size_t accounts{100};
+    size_t transfers{10000};
+    size_t mints{1000};
+    size_t threads{std::max(1u, std::thread::hardware_concurrency())};
+    size_t block_txs{1000};
+    unsigned exec_threads{std::max(1u, std::thread::hardware_concurrency())};
+    BlockCodec codec{BlockCodec::Json};
+    bool keep{false};
+    size_t nft_collection{20000};
+    size_t state_cache{0};
+};
+
+static void usage() {
+    std::cout << "axle_loadgen [--datadir DIR] [--accounts N] [--transfers M] [--mints K]\n"
+              << "             [--threads T] [--block-txs B] [--exec-threads E] [--block-codec json|columnar] [--keep]\n"
+              << "             [--nft-collection C] [--state-cache N]\n"
+              << "Runs on a fresh regtest datadir (a temp dir unless --datadir is given).\n";
+}
+
+static void print_summary(const char* stage, const Summary& s) {
+    std::cout << "  " << std::left << std::setw(10) << stage << std::right << std::fixed << std::setprecision(1)
+              << " n=" << s.n << " mean=" << s.mean << "us p50=" << s.p50 << "us p90=" << s.p90
+              << "us p99=" << s.p99 << "us max=" << s.max << "us\n";
+}
+
+// Builds, mines and accepts one block; records per-stage latencies.
+struct Pipeline {
+    Blockchain& chain;
+    std::vector<double> build_us, mine_us, validate_us, apply_us, store_us;
+    uint64_t reexecuted{0}, arena_allocs{0}, arena_peak{0};
+
+    bool produce(const std::string& miner, const std::vector<SignedTx>& txs) {
+        auto t0 = SteadyClock::now();
+        auto blk = chain.build_block(miner, txs);
+        build_us.push_back(micros_since(t0));
+        t0 = SteadyClock::now();
+        uint64_t iters = 0;
+        while (!mine_block(blk, chain.current_difficulty_bits(), iters)) {}
+        mine_us.push_back(micros_since(t0));
+        if (!chain.accept_block(blk)) return false;
+        auto& t = chain.last_accept_timings();
+        validate_us.push_back(t.validate_us);
+        apply_us.push_back(t.apply_us);
+        store_us.push_back(t.store_us);
+        auto& x = chain.last_exec_stats();
+        reexecuted += x.reexecuted;
+        arena_allocs += x.arena_allocations;
+        arena_peak = std::max(arena_peak, x.arena_peak_bytes);
+        return true;
+    }
+};
+
+// Average in-memory size of the load txs as SignedTx and as CompactTx, by type.
+static void report_tx_memory(const std::vector<SignedTx>& txs) {
+    size_t n[2] = {0, 0}, fat[2] = {0, 0}, compact[2] = {0, 0};
+    for (auto& tx : txs) {
+        auto c = CompactTx::from_signed(tx);
+        if (!c) continue;
+        int k = tx.type == TxType::TRANSFER ? 0 : 1;
+        n[k]++;
+        fat[k] += memory_bytes(tx);
+        compact[k] += c->memory_bytes();
+    }
+    std::cout << std::fixed << std::setprecision(1) << "Tx memory:";
+    const char* names[2] = {"transfer", "other"};
+    for (int k=0;k<2;k++) {
+        if (!n[k]) continue;
+        std::cout << " " << names[k] << " " << (double)fat[k] / n[k] << " B -> " << (double)compact[k] / n[k]
+                  << " B (" << (double)fat[k] / compact[k] << "x)";
+    }
+    std::cout << "\n";
+}
+
+// Sizes and decode speed of the load blocks in both body formats, whichever one was stored.
+static void report_codecs(const Storage& storage, uint64_t first, uint64_t last) {
+    std::vector<std::string> js, cols;
+    for (uint64_t h=first; h<=last; h++) {
+        auto b = storage.read_block(h);
+        if (!b) continue;
+        js.push_back(to_json(*b));
+        cols.push_back(encode_block_columnar(*b));
+    }
+    if (js.empty()) return;
+    uint64_t json_bytes = 0, col_bytes = 0;
+    for (auto& s : js) json_bytes += s.size();
+    for (auto& s : cols) col_bytes += s.size();
+    size_t txs = 0;
+    auto t0 = SteadyClock::now();
+    for (auto& s : js) txs += block_from_json(s).txs.size();
+    double json_secs = micros_since(t0) / 1e6;
+    t0 = SteadyClock::now();
+    for (auto& s : cols) txs += decode_block_columnar(s)->txs.size();
+    double col_secs = micros_since(t0) / 1e6;
+    txs /= 2;
+    std::cout << std::fixed << std::setprecision(1)
+              << "Codec: json " << json_bytes << " B, columnar " << col_bytes << " B ("
+              << (double)json_bytes / std::max<uint64_t>(1, col_bytes) << "x); decode json "
+              << (json_secs > 0 ? txs / json_secs : 0) << " tx/s, columnar " << (col_secs > 0 ? txs / col_secs : 0) << " tx/s\n";
+}
+
+// Mints a collection of n NFTs (one owner, one symbol, uris under one prefix) into a bare
+// LedgerState and reports mint throughput at the start and end, bytes per NFT in memory
+// against the old inline (owner, name, symbol, uri) strings, and bytes per NFT in state.json
+// against the old per-token object.
+static void report_nft_store(const std::string& dir, size_t n) {
+    if (n < 10) return;
+    ChainParams params = chain_params_for("regtest");
+    auto key = keygen();
+    std::string owner = address_from_pubkey(key.pub);
+    std::vector<SignedTx> mints(n);
+    for (size_t i=0;i<n;i++) {
+        SignedTx utx;
+        utx.type = TxType::MINT_NFT;
+        utx.from = utx.to = owner;
+        utx.nonce = i;
+        utx.meta = {"Load #" + std::to_string(i), "LOAD", "ipfs://loadgen/" + std::to_string(i) + ".json"};
+        mints[i] = sign_tx(utx, key.priv);
+    }
+    LedgerState st;
+    st.accounts[owner].balance = (int64_t)n * params.burn_fee;
+    int64_t mem0 = memory_bytes(MemTag::State);
+    std::vector<double> slice_secs;
+    {
+        MemScope scope(MemTag::State);
+        size_t slice = n / 10;
+        auto t0 = SteadyClock::now();
+        for (size_t i=0;i<n;i++) {
+            if (!apply_tx(st, params, mints[i]).ok) { std::cerr << "nft mint " << i << " rejected\n"; return; }
+            if ((i + 1) % slice == 0) { slice_secs.push_back(micros_since(t0) / 1e6); t0 = SteadyClock::now(); }
+        }
+    }
+    int64_t mem1 = memory_bytes(MemTag::State);
+    int64_t old_mem = 0;
+    {
+        MemScope scope(MemTag::State);
+        std::map<uint64_t, std::pair<std::string, NFTMeta>> old;
+        for (auto& [id, e] : st.nfts) old.emplace(id, std::make_pair(e.first.str(), e.second.meta()));
+        old_mem = memory_bytes(MemTag::State) - mem1;
+    }
+
+    fs::create_directories(dir);
+    Storage(dir).save_state(st);
+    uint64_t compact_disk = fs::file_size(fs::path(dir) / "state.json");
+    nlohmann::json j;
+    for (auto& [id, e] : st.nfts)
+        j["nfts"][std::to_string(id)] = {{"owner", e.first.str()},
+                                         {"meta", {{"name", e.second.name()}, {"symbol", e.second.symbol()}, {"uri", e.second.uri()}}}};
+    uint64_t old_disk = j.dump(2).size();
+    fs::remove_all(dir);
+
+    auto rate = [&](double secs) { return secs > 0 ? (n / 10) / secs : 0; };
+    auto store = nft_store_stats();
+    std::cout << std::fixed << std::setprecision(1) << "NFT store (" << n << " mints): "
+              << rate(slice_secs.front()) << " mints/s first 10%, " << rate(slice_secs.back()) << " mints/s last 10%\n";
+    if (memory_accounting_enabled())
+        std::cout << "  memory " << (double)old_mem / n << " B/NFT inline -> " << (double)(mem1 - mem0) / n
+                  << " B/NFT interned (" << store.strings << " strings, " << store.records << " records)\n";
+    std::cout << "  state.json " << (double)old_disk / n << " B/NFT per-token objects -> " << (double)compact_disk / n
+              << " B/NFT compact\n";
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    for (int i=1;i<argc;i++) {
+        std::string a = argv[i];
+        auto val = [&](){ return (i+1<argc)?std::string(argv[++i]):std::string(); };
+        if (a=="--datadir") o.datadir = val();
+        else if (a=="--accounts") o.accounts = std::stoull(val());
+        else if (a=="--transfers") o.transfers = std::stoull(val());
+        else if (a=="--mints") o.mints = std::stoull(val());
+        else if (a=="--threads") o.threads = std::max<size_t>(1, std::stoull(val()));
+        else if (a=="--block-txs") o.block_txs = std::max<size_t>(1, std::stoull(val()));
+        else if (a=="--exec-threads") o.exec_threads = (unsigned)std::stoul(val());
+        else if (a=="--block-codec") {
+            auto c = parse_block_codec(val());
+            if (!c) { usage(); return 1; }
+            o.codec = *c;
+        }
+        else if (a=="--keep") o.keep = true;
+        else if (a=="--nft-collection") o.nft_collection = std::stoull(val());
+        else if (a=="--state-cache") o.state_cache = std::stoull(val());
+        else { usage(); return a=="--help" ? 0 : 1; }
+    }
+    if (o.accounts < 2) { std::cerr << "--accounts must be >= 2\n"; return 1; }
+    sodium_init_or_throw();
+
+    bool temp = o.datadir.empty();
+    if (temp) o.datadir = (fs::temp_directory_path() / ("axle-loadgen-" + hex(random_bytes(4)))).string();
+    if (fs::exists(fs::path(o.datadir) / "tip.json")) { std::cerr << "datadir already holds a chain: " << o.datadir << "\n"; return 1; }
+
+    ChainParams params = chain_params_for("regtest");
+    Storage storage(o.datadir);
+    storage.set_block_codec(o.codec);
+    Blockchain chain(storage, params);
+    chain.set_exec_threads(o.exec_threads);
+    chain.set_state_cache(o.state_cache);
+    chain.load();
+    uint64_t rss0 = rss_bytes(), disk0 = dir_bytes(o.datadir);
+
+    // keys for the funder and every load account
+    auto funder = keygen();
+    std::string funder_addr = address_from_pubkey(funder.pub);
+    std::vector<KeyPair> keys(o.accounts);
+    std::vector<std::string> addrs(o.accounts);
+    for (size_t i=0;i<o.accounts;i++) { keys[i] = keygen(); addrs[i] = address_from_pubkey(keys[i].pub); }
+
+    size_t total = o.transfers + o.mints;
+    size_t per_account = (total + o.accounts - 1) / o.accounts;
+    const int64_t amount = 1;
+    int64_t fund_each = (int64_t)per_account * (amount + params.burn_fee) + params.burn_fee;
+    int64_t fund_total = fund_each * (int64_t)o.accounts + params.burn_fee * (int64_t)o.accounts;
+
+    Pipeline setup{chain};
+    while (chain.state().accounts.count(funder_addr) == 0 || chain.state().accounts.at(funder_addr).balance < fund_total) {
+        if (!setup.produce(funder_addr, {})) { std::cerr << "failed to mine funding block\n"; return 1; }
+    }
+    std::vector<SignedTx> funding;
+    for (size_t i=0;i<o.accounts;i++) {
+        SignedTx utx;
+        utx.type = TxType::TRANSFER;
+        utx.from = funder_addr; utx.to = addrs[i]; utx.amount = fund_each; utx.nonce = i;
+        funding.push_back(sign_tx(utx, funder.priv));
+    }
+    for (size_t i=0;i<funding.size();i+=o.block_txs) {
+        std::vector<SignedTx> chunk(funding.begin()+i, funding.begin()+std::min(funding.size(), i+o.block_txs));
+        if (!setup.produce(funder_addr, chunk)) { std::cerr << "funding block rejected\n"; return 1; }
+    }
+    std::cout << "Funded " << o.accounts << " accounts in " << chain.tip_height() << " blocks\n";
+
+    // Transaction g is sent by account g % N with nonce g / N, so the global order
+    // keeps every sender's nonces consecutive. Mints are spread evenly through it.
+    std::vector<uint8_t> is_mint(total, 0);
+    for (size_t k=0;k<o.mints;k++) is_mint[k * total / o.mints] = 1;
+    std::vector<SignedTx> txs(total);
+    std::vector<std::vector<double>> sign_lat(o.threads);
+    auto sign_start = SteadyClock::now();
+    std::vector<std::thread> workers;
+    for (size_t t=0;t<o.threads;t++) {
+        workers.emplace_back([&, t](){
+            std::mt19937_64 rng(t + 1);
+            for (size_t g=0; g<total; g++) {
+                size_t a = g % o.accounts;
+                if (a % o.threads != t) continue;
+                auto t0 = SteadyClock::now();
+                SignedTx utx;
+                utx.from = addrs[a];
+                utx.nonce = g / o.accounts;
+                if (is_mint[g]) {
+                    utx.type = TxType::MINT_NFT;
+                    utx.to = addrs[a];
+                    utx.meta = {"Load #" + std::to_string(g), "LOAD", "ipfs://loadgen/" + std::to_string(g)};
+                } else {
+                    utx.type = TxType::TRANSFER;
+                    utx.to = addrs[(a + 1 + rng() % (o.accounts - 1)) % o.accounts];
+                    utx.amount = amount;
+                }
+                txs[g] = sign_tx(utx, keys[a].priv);
+                sign_lat[t].push_back(micros_since(t0));
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    double sign_secs = micros_since(sign_start) / 1e6;
+    std::vector<double> sign_all;
+    for (auto& v : sign_lat) sign_all.insert(sign_all.end(), v.begin(), v.end());
+
+    Pipeline run{chain};
+    uint64_t first_height = chain.tip_height() + 1;
+    auto run_start = SteadyClock::now();
+    for (size_t i=0;i<txs.size();i+=o.block_txs) {
+        std::vector<SignedTx> chunk(txs.begin()+i, txs.begin()+std::min(txs.size(), i+o.block_txs));
+        if (!run.produce(funder_addr, chunk)) { std::cerr << "block at height " << chain.tip_height()+1 << " rejected\n"; return 1; }
+    }
+    double run_secs = micros_since(run_start) / 1e6;
+    uint64_t rss1 = rss_bytes(), disk1 = dir_bytes(o.datadir);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Signed " << total << " txs on " << o.threads << " threads in " << sign_secs << "s ("
+              << (sign_secs > 0 ? total / sign_secs : 0) << " tx/s)\n"
+              << "Processed " << total << " txs in " << (chain.tip_height() - first_height + 1) << " blocks in "
+              << run_secs << "s: " << (run_secs > 0 ? total / run_secs : 0) << " tx/s sustained\n"
+              << "Per-stage latency (per tx for sign, per block otherwise):\n";
+    print_summary("sign", summarize(sign_all));
+    print_summary("build", summarize(run.build_us));
+    print_summary("mine", summarize(run.mine_us));
+    print_summary("validate", summarize(run.validate_us));
+    print_summary("apply", summarize(run.apply_us));
+    print_summary("store", summarize(run.store_us));
+    size_t blocks = std::max<size_t>(1, run.store_us.size());
+    std::cout << "Executor: " << run.reexecuted << " txs re-executed; arena " << run.arena_allocs / blocks
+              << " allocs/block, peak " << run.arena_peak << " bytes\n";
+    if (chain.state().accounts.tiered()) {
+        auto c = chain.state().accounts.stats();
+        uint64_t lookups = std::max<uint64_t>(1, c.hits + c.misses);
+        std::cout << std::fixed << std::setprecision(1) << "State cache: " << c.entries << "/" << c.capacity << " accounts cached, "
+                  << c.stored << " stored; hit rate " << 100.0 * c.hits / lookups << "%, " << c.misses << " misses averaging "
+                  << (c.misses ? c.miss_seconds * 1e6 / c.misses : 0) << "us, " << c.evictions << " evictions\n";
+    }
+    report_codecs(storage, first_height, chain.tip_height());
+    report_tx_memory(txs);
+    report_nft_store((fs::path(o.datadir) / "nft-report").string(), o.nft_collection);
+    std::cout << "Disk: " << disk0 << " -> " << disk1 << " bytes (" << (double)(disk1 - disk0) / total << " B/tx)\n"
+              << "RSS:  " << rss0 << " -> " << rss1 << " bytes\n";
+
+    if (temp && !o.keep) fs::remove_all(o.datadir);
+    else std::cout << "Datadir kept at " << o.datadir << "\n";
+    return 0;
+}
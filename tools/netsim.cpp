@@ -0,0 +1,181 @@
+// Network simulator: runs N nodes in this process over shaped loopback links, plays a script of
+// mining, transactions and late joiners, and reports block propagation percentiles, catch-up
+// times and the P2P bytes each node sent and received.
+#include "bench_util.hpp"
+#include "netsim.hpp"
+#include "tx.hpp"
+#include <nlohmann/json.hpp>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+using namespace axle;
+using namespace axle::bench;
+using json = nlohmann::json;
+
+struct Options {
+    NetSimOptions sim;
+    size_t blocks{20};
+    int interval_ms{200};
+    size_t txs{50};          // per block
+    size_t joiners{1};
+    std::string script_path;
+    std::string json_path;
+};
+
+static void usage() {
+    std::cout << "axle_netsim [--nodes N] [--topology line|ring|star|full|random:K] [--latency-ms L] [--bandwidth-kbps B]\n"
+              << "            [--blocks B] [--interval-ms I] [--txs T] [--joiners J] [--seed S] [--script FILE] [--json PATH|-]\n"
+              << "Without --script: mines one block on node 0, then B blocks on random nodes every I ms with T\n"
+              << "transfers sent to random nodes before each, then starts J fresh nodes and times their sync.\n"
+              << "Script lines (# comments):\n"
+              << "  mine N|any        mine a block on node N\n"
+              << "  txs N|any COUNT   submit COUNT transfers from node 0's mining key to node N\n"
+              << "  sleep MS\n"
+              << "  sync [TIMEOUT_MS] wait until every node has the highest tip (default 10000)\n"
+              << "  join N[,N...]     start a fresh node linked to these and time its catch-up\n";
+}
+
+static std::string default_script(const Options& o) {
+    std::ostringstream s;
+    s << "mine 0\nsync\n";
+    for (size_t i=0; i<o.blocks; i++) s << "txs any " << o.txs << "\nsleep " << o.interval_ms << "\nmine any\n";
+    s << "sync\n";
+    for (size_t i=0; i<o.joiners; i++) s << "join any\n";
+    return s.str();
+}
+
+static json summary_json(const Summary& s) {
+    return {{"n", s.n}, {"p50", s.p50}, {"p90", s.p90}, {"p99", s.p99}, {"max", s.max}};
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    for (int i=1;i<argc;i++) {
+        std::string a = argv[i];
+        auto val = [&](){ return (i+1<argc)?std::string(argv[++i]):std::string(); };
+        if (a=="--nodes") o.sim.nodes = std::max<size_t>(1, std::stoull(val()));
+        else if (a=="--topology") o.sim.topology = val();
+        else if (a=="--latency-ms") o.sim.link.latency_ms = std::stod(val());
+        else if (a=="--bandwidth-kbps") o.sim.link.bandwidth = std::stod(val()) * 1000 / 8;
+        else if (a=="--blocks") o.blocks = std::stoull(val());
+        else if (a=="--interval-ms") o.interval_ms = std::stoi(val());
+        else if (a=="--txs") o.txs = std::stoull(val());
+        else if (a=="--joiners") o.joiners = std::stoull(val());
+        else if (a=="--seed") o.sim.seed = (uint32_t)std::stoul(val());
+        else if (a=="--script") o.script_path = val();
+        else if (a=="--json") o.json_path = val();
+        else { usage(); return a=="--help" ? 0 : 1; }
+    }
+    std::string script = default_script(o);
+    if (!o.script_path.empty()) {
+        std::ifstream f(o.script_path);
+        if (!f) { std::cerr << "cannot read " << o.script_path << "\n"; return 1; }
+        script.assign(std::istreambuf_iterator<char>(f), {});
+    }
+    sodium_init_or_throw();
+
+    NetSim sim(o.sim);
+    std::string err;
+    if (!sim.start(err)) { std::cerr << err << "\n"; return 1; }
+    std::cout << "Network: " << sim.size() << " nodes, " << o.sim.topology << ", latency " << o.sim.link.latency_ms
+              << " ms, bandwidth " << (o.sim.link.bandwidth > 0 ? std::to_string((uint64_t)(o.sim.link.bandwidth * 8 / 1000)) + " kbit/s" : "unlimited") << "\n";
+
+    std::mt19937 rng(o.sim.seed);
+    auto node_arg = [&](const std::string& s) -> size_t {
+        size_t n = s == "any" ? rng() % sim.size() : std::stoull(s);
+        if (n >= sim.size()) throw std::runtime_error("no node " + s);
+        return n;
+    };
+    const auto& sender = sim.key(0);
+    std::string sender_addr = address_from_pubkey(sender.pub);
+    uint64_t nonce = 0, txs_sent = 0, txs_refused = 0;
+    json joins = json::array();
+    std::istringstream lines(script);
+    std::string line;
+    size_t lineno = 0;
+    try {
+        while (std::getline(lines, line)) {
+            lineno++;
+            std::istringstream in(line.substr(0, line.find('#')));
+            std::string cmd;
+            if (!(in >> cmd)) continue;
+            if (cmd == "mine") {
+                std::string n; in >> n;
+                if (!sim.mine(node_arg(n))) std::cerr << "line " << lineno << ": block rejected\n";
+            } else if (cmd == "txs") {
+                std::string n; size_t count = 0; in >> n >> count;
+                size_t at = node_arg(n);
+                for (size_t i=0; i<count; i++) {
+                    SignedTx tx;
+                    tx.type = TxType::TRANSFER;
+                    tx.from = sender_addr;
+                    tx.to = address_from_pubkey(sim.key(rng() % sim.size()).pub);
+                    tx.amount = 1;
+                    tx.nonce = nonce++;
+                    (sim.submit_tx(at, sign_tx(tx, sender.priv)) ? txs_sent : txs_refused)++;
+                }
+            } else if (cmd == "sleep") {
+                int ms = 0; in >> ms;
+                std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+            } else if (cmd == "sync") {
+                int timeout = 10000; in >> timeout;
+                if (!sim.wait_for_height(sim.max_height(), timeout)) std::cerr << "line " << lineno << ": nodes did not converge\n";
+            } else if (cmd == "join") {
+                std::string list; in >> list;
+                std::vector<size_t> peers;
+                std::istringstream ps(list);
+                for (std::string p; std::getline(ps, p, ',');) peers.push_back(node_arg(p));
+                uint64_t target = sim.max_height();
+                auto t0 = SteadyClock::now();
+                size_t i = sim.add_node(peers);
+                bool ok = sim.wait_for_height(target, 60000, {i});
+                double ms = micros_since(t0) / 1e3;
+                std::cout << "Join: node " << i << (ok ? " caught up " : " did not catch up on ") << target << " blocks in "
+                          << std::fixed << std::setprecision(1) << ms << " ms\n" << std::defaultfloat;
+                joins.push_back({{"node", i}, {"blocks", target}, {"ok", ok}, {"ms", ms}});
+            } else {
+                throw std::runtime_error("unknown command " + cmd);
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "line " << lineno << ": " << e.what() << "\n";
+        return 1;
+    }
+    sim.wait_for_height(sim.max_height(), 2000); // let the last pushes land before stopping
+    sim.stop();
+
+    auto p = sim.propagation();
+    auto arrival = summarize(p.arrival_ms), full = summarize(p.full_ms);
+    std::cout << std::fixed << std::setprecision(1)
+              << "Blocks: " << p.blocks << " mined; to each node p50=" << arrival.p50 << "ms p90=" << arrival.p90
+              << "ms p99=" << arrival.p99 << "ms max=" << arrival.max << "ms; to all nodes p50=" << full.p50
+              << "ms p90=" << full.p90 << "ms max=" << full.max << "ms; " << p.missed << " arrivals missing\n"
+              << "Transactions: " << txs_sent << " submitted, " << txs_refused << " refused\n"
+              << "  node  height   sent KB   recv KB  pushed  accepted  synced\n";
+    json nodes = json::array();
+    for (size_t i=0; i<sim.size(); i++) {
+        auto t = sim.traffic(i);
+        auto b = sim.node(i).block_stats();
+        uint64_t height = sim.chain(i).tip_height();
+        std::cout << std::setw(6) << i << std::setw(8) << height << std::setw(10) << t.sent_bytes / 1e3 << std::setw(10)
+                  << t.recv_bytes / 1e3 << std::setw(8) << b.pushed << std::setw(10) << b.accepted << std::setw(8) << b.synced << "\n";
+        nodes.push_back({{"node", i}, {"height", height}, {"sent_bytes", t.sent_bytes}, {"recv_bytes", t.recv_bytes},
+                         {"blocks_pushed", b.pushed}, {"blocks_accepted", b.accepted}, {"blocks_synced", b.synced}});
+    }
+
+    if (!o.json_path.empty()) {
+        json j = {{"nodes", o.sim.nodes}, {"topology", o.sim.topology}, {"latency_ms", o.sim.link.latency_ms},
+                  {"bandwidth_bytes_per_s", o.sim.link.bandwidth}, {"blocks", p.blocks}, {"missed", p.missed},
+                  {"propagation_ms", summary_json(arrival)}, {"full_propagation_ms", summary_json(full)},
+                  {"txs_submitted", txs_sent}, {"txs_refused", txs_refused}, {"joins", joins}, {"per_node", nodes}};
+        if (o.json_path == "-") std::cout << j.dump(2) << "\n";
+        else {
+            std::ofstream f(o.json_path);
+            f << j.dump(2) << "\n";
+            if (!f) { std::cerr << "cannot write " << o.json_path << "\n"; return 1; }
+        }
+    }
+    return 0;
+}
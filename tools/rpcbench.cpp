@@ -0,0 +1,260 @@
+// RPC load generator: replays a weighted mix of get_tip, get_account, get_block and send_tx
+// against a node at an open-loop target rate over concurrent connections, and reports
+// throughput, latency percentiles and errors per method. --in-process starts a regtest node
+// with a prefilled chain in this process, so runs are comparable between builds.
+#include "bench_util.hpp"
+#include "blockchain.hpp"
+#include "crypto.hpp"
+#include "encoding.hpp"
+#include "mempool.hpp"
+#include "miner.hpp"
+#include "rpc.hpp"
+#include "storage.hpp"
+#include "tx.hpp"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace fs = std::filesystem;
+using namespace axle;
+using namespace axle::bench;
+using json = nlohmann::json;
+
+struct Options {
+    std::string rpc{"127.0.0.1:9736"};
+    bool in_process{false};
+    size_t blocks{100};       // prefilled in-process
+    size_t connections{8};
+    double rate{1000};        // requests per second
+    double duration{10};      // seconds
+    std::string mix; // default: tip=4,balance=3,block=2, plus send=1 in-process
+    int timeout_ms{5000};
+    uint32_t seed{1};
+    std::string json_path;
+};
+
+static void usage() {
+    std::cout << "axle_rpcbench [--rpc HOST:PORT] [--in-process [--blocks N]] [--connections C] [--rate R] [--duration S]\n"
+              << "              [--mix tip=W,balance=W,block=W,send=W] [--timeout-ms T] [--seed N] [--json PATH|-]\n"
+              << "Sends requests at R/s on C connections, timing each from when it was due, not when it was sent.\n"
+              << "send_tx uses a fresh key whose transfers cannot be mined; they stay in the node's mempool, so\n"
+              << "send=W is refused without --in-process.\n"
+              << "--in-process serves a regtest chain of N blocks on --rpc (default 127.0.0.1:19736) from this process.\n";
+}
+
+enum Method { TIP, BALANCE, BLOCK, SEND, METHODS };
+static const char* method_name[METHODS] = {"get_tip", "get_account", "get_block", "send_tx"};
+
+static bool parse_mix(const std::string& s, double (&w)[METHODS]) {
+    static const std::map<std::string, Method> keys = {{"tip", TIP}, {"balance", BALANCE}, {"block", BLOCK}, {"send", SEND}};
+    for (auto& x : w) x = 0;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        auto end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        auto item = s.substr(pos, end - pos);
+        auto eq = item.find('=');
+        if (eq == std::string::npos || !keys.count(item.substr(0, eq))) return false;
+        try { w[keys.at(item.substr(0, eq))] = std::stod(item.substr(eq + 1)); } catch (std::exception&) { return false; }
+        pos = end + 1;
+    }
+    double total = 0;
+    for (auto x : w) { if (x < 0) return false; total += x; }
+    return total > 0;
+}
+
+struct Result {
+    std::vector<double> latency_us[METHODS];
+    uint64_t requests[METHODS]{}, timeouts[METHODS]{}, errors[METHODS]{};
+    std::map<std::string, uint64_t> reasons; // error replies by message
+    double seconds{0};
+};
+
+// Requests i = 0, 1, ... are due at i / rate; each connection thread takes the next one, waits
+// for it to be due and sends it. When every connection is busy, later requests go out late and
+// the wait counts toward their latency.
+static Result run(const Options& o, const std::string& host, uint16_t port, const std::vector<Method>& plan,
+                  const std::vector<std::string>& requests) {
+    Result r;
+    std::mutex mu;
+    std::atomic<size_t> next{0};
+    auto t0 = SteadyClock::now() + std::chrono::milliseconds(10);
+    auto worker = [&]() {
+        Result local;
+        for (size_t i; (i = next++) < plan.size();) {
+            auto due = t0 + std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(i / o.rate));
+            std::this_thread::sleep_until(due);
+            auto m = plan[i];
+            auto reply = rpc_request(host, port, requests[i], o.timeout_ms);
+            local.latency_us[m].push_back(micros_since(due));
+            local.requests[m]++;
+            if (!reply) { local.timeouts[m]++; continue; }
+            auto j = json::parse(*reply, nullptr, false);
+            if (j.is_discarded() || !j.is_object()) { local.errors[m]++; local.reasons["unparseable reply"]++; }
+            else if (j.contains("error")) { local.errors[m]++; local.reasons[j["error"].is_string() ? j["error"].get<std::string>() : j["error"].dump()]++; }
+        }
+        std::lock_guard<std::mutex> lk(mu);
+        for (int m = 0; m < METHODS; m++) {
+            r.latency_us[m].insert(r.latency_us[m].end(), local.latency_us[m].begin(), local.latency_us[m].end());
+            r.requests[m] += local.requests[m];
+            r.timeouts[m] += local.timeouts[m];
+            r.errors[m] += local.errors[m];
+        }
+        for (auto& [k, v] : local.reasons) r.reasons[k] += v;
+    };
+    std::vector<std::thread> pool;
+    for (size_t c = 0; c < o.connections; c++) pool.emplace_back(worker);
+    for (auto& t : pool) t.join();
+    r.seconds = std::chrono::duration<double>(SteadyClock::now() - t0).count();
+    return r;
+}
+
+static json summary_json(const Summary& s) {
+    return {{"mean", s.mean}, {"p50", s.p50}, {"p95", s.p95}, {"p99", s.p99}, {"p999", s.p999}, {"max", s.max}};
+}
+
+static void print_line(const std::string& name, uint64_t n, uint64_t timeouts, uint64_t errors, const Summary& s) {
+    std::cout << "  " << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(8) << n << " req " << std::setw(6) << timeouts << " timeout " << std::setw(6) << errors << " error"
+              << std::setprecision(1) << "  p50=" << s.p50 / 1e3 << "ms p95=" << s.p95 / 1e3 << "ms p99=" << s.p99 / 1e3
+              << "ms p999=" << s.p999 / 1e3 << "ms max=" << s.max / 1e3 << "ms\n";
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    bool rpc_given = false;
+    for (int i=1;i<argc;i++) {
+        std::string a = argv[i];
+        auto val = [&](){ return (i+1<argc)?std::string(argv[++i]):std::string(); };
+        if (a=="--rpc") { o.rpc = val(); rpc_given = true; }
+        else if (a=="--in-process") o.in_process = true;
+        else if (a=="--blocks") o.blocks = std::max<size_t>(1, std::stoull(val()));
+        else if (a=="--connections") o.connections = std::max<size_t>(1, std::stoull(val()));
+        else if (a=="--rate") o.rate = std::stod(val());
+        else if (a=="--duration") o.duration = std::stod(val());
+        else if (a=="--mix") o.mix = val();
+        else if (a=="--timeout-ms") o.timeout_ms = std::stoi(val());
+        else if (a=="--seed") o.seed = (uint32_t)std::stoul(val());
+        else if (a=="--json") o.json_path = val();
+        else { usage(); return a=="--help" ? 0 : 1; }
+    }
+    if (o.mix.empty()) o.mix = o.in_process ? "tip=4,balance=3,block=2,send=1" : "tip=4,balance=3,block=2";
+    double weights[METHODS];
+    if (!parse_mix(o.mix, weights)) { std::cerr << "--mix expects e.g. tip=4,balance=3,block=2,send=1\n"; return 1; }
+    if (weights[SEND] > 0 && !o.in_process) {
+        std::cerr << "send=W needs --in-process: its transactions would sit unminable in a real node's mempool\n";
+        return 1;
+    }
+    if (o.rate <= 0 || o.duration <= 0) { std::cerr << "--rate and --duration must be positive\n"; return 1; }
+    if (o.in_process && !rpc_given) o.rpc = "127.0.0.1:19736";
+    auto colon = o.rpc.rfind(':');
+    if (colon == std::string::npos) { std::cerr << "--rpc expects HOST:PORT\n"; return 1; }
+    std::string host = o.rpc.substr(0, colon);
+    uint16_t port = (uint16_t)std::stoi(o.rpc.substr(colon + 1));
+    sodium_init_or_throw();
+
+    // in-process node: a regtest chain whose blocks pay a rotating set of addresses
+    std::mt19937_64 rng(o.seed);
+    std::vector<std::string> addrs;
+    for (int i=0;i<64;i++) addrs.push_back(address_from_pubkey(keygen().pub));
+    fs::path dir;
+    std::unique_ptr<Storage> storage;
+    std::unique_ptr<Blockchain> chain;
+    std::unique_ptr<Mempool> mempool;
+    std::unique_ptr<RpcServer> server;
+    if (o.in_process) {
+        dir = fs::temp_directory_path() / ("axle-rpcbench-" + hex(random_bytes(4)));
+        storage = std::make_unique<Storage>(dir.string());
+        chain = std::make_unique<Blockchain>(*storage, chain_params_for("regtest"));
+        chain->load();
+        for (size_t i=0;i<o.blocks;i++) {
+            auto blk = chain->build_block(addrs[i % addrs.size()], {});
+            uint64_t iters = 0;
+            while (!mine_block(blk, chain->current_difficulty_bits(), iters)) {}
+            if (!chain->accept_block(blk)) { std::cerr << "prefill block rejected\n"; return 1; }
+        }
+        mempool = std::make_unique<Mempool>();
+        server = std::make_unique<RpcServer>(*chain);
+        server->set_mempool(mempool.get());
+        server->start(host, port);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    auto tip = rpc_request(host, port, R"({"method":"get_tip"})", o.timeout_ms);
+    auto tj = tip ? json::parse(*tip, nullptr, false) : json();
+    if (!tj.is_object() || !tj.contains("height")) { std::cerr << "no node answering get_tip at " << o.rpc << "\n"; return 1; }
+    uint64_t height = tj["height"];
+    uint64_t lowest = tj.value("pruned_below", (uint64_t)0);
+
+    // the whole run, planned and serialized up front so sending costs only the round trip
+    size_t total = (size_t)(o.rate * o.duration);
+    std::discrete_distribution<int> pick(std::begin(weights), std::end(weights));
+    std::vector<Method> plan(total);
+    std::vector<std::string> requests(total);
+    auto sender = keygen();
+    auto sender_addr = address_from_pubkey(sender.pub);
+    uint64_t nonce = 0;
+    for (size_t i=0;i<total;i++) {
+        plan[i] = (Method)pick(rng);
+        json req = {{"method", method_name[plan[i]]}};
+        if (plan[i] == BALANCE) req["address"] = addrs[rng() % addrs.size()];
+        else if (plan[i] == BLOCK) req["height"] = lowest + rng() % (height - lowest + 1);
+        else if (plan[i] == SEND) {
+            SignedTx tx;
+            tx.type = TxType::TRANSFER;
+            tx.from = sender_addr; tx.to = addrs[rng() % addrs.size()]; tx.amount = 1; tx.nonce = nonce++;
+            req["tx"] = json::parse(to_json(sign_tx(tx, sender.priv)));
+        }
+        requests[i] = req.dump();
+    }
+
+    std::cout << "Target " << o.rate << " req/s for " << o.duration << " s on " << o.connections << " connections to "
+              << o.rpc << (o.in_process ? " (in-process, " + std::to_string(height) + " blocks)" : "") << "\n";
+    if (o.connections > 1)
+        std::cout << "The server handles one connection at a time: the others queue, so latency includes that wait.\n";
+    auto r = run(o, host, port, plan, requests);
+    if (server) server->stop();
+    if (o.in_process) fs::remove_all(dir);
+
+    std::vector<double> all;
+    uint64_t timeouts = 0, errors = 0;
+    json methods = json::object();
+    for (int m = 0; m < METHODS; m++) {
+        all.insert(all.end(), r.latency_us[m].begin(), r.latency_us[m].end());
+        timeouts += r.timeouts[m];
+        errors += r.errors[m];
+    }
+    auto s = summarize(all);
+    uint64_t ok = total - timeouts - errors;
+    std::cout << std::fixed << std::setprecision(0) << "Throughput: " << total / r.seconds << " req/s completed, "
+              << ok / r.seconds << " req/s ok over " << std::setprecision(2) << r.seconds << " s\n";
+    std::cout << "Latency from due time:\n";
+    for (int m = 0; m < METHODS; m++) {
+        if (!r.requests[m]) continue;
+        auto ms = summarize(r.latency_us[m]);
+        print_line(method_name[m], r.requests[m], r.timeouts[m], r.errors[m], ms);
+        methods[method_name[m]] = {{"requests", r.requests[m]}, {"timeouts", r.timeouts[m]}, {"errors", r.errors[m]},
+                                   {"latency_us", summary_json(ms)}};
+    }
+    print_line("all", total, timeouts, errors, s);
+    for (auto& [reason, n] : r.reasons) std::cout << "  error \"" << reason << "\": " << n << "\n";
+
+    if (!o.json_path.empty()) {
+        json j = {{"target_rate", o.rate}, {"duration_s", r.seconds}, {"connections", o.connections}, {"mix", o.mix},
+                  {"in_process", o.in_process}, {"requests", total}, {"ok", ok}, {"timeouts", timeouts}, {"errors", errors},
+                  {"throughput", ok / r.seconds}, {"latency_us", summary_json(s)}, {"methods", methods},
+                  {"error_reasons", r.reasons}};
+        if (o.json_path == "-") std::cout << j.dump(2) << "\n";
+        else {
+            std::ofstream f(o.json_path);
+            f << j.dump(2) << "\n";
+            if (!f) { std::cerr << "cannot write " << o.json_path << "\n"; return 1; }
+        }
+    }
+    return timeouts ? 1 : 0;
+}